@@ -0,0 +1,505 @@
+/*
+ * End-to-end load generator for the sync server. Starts the real server
+ * binary on loopback with a scratch root directory, then drives it with
+ * N client threads speaking C_OPEN/C_PUT/C_GET from comm.h.
+ *
+ * Each client owns one document of -s bytes made of 64-byte lines. An
+ * edit rewrites one random line and PUTs the whole file, followed by -g
+ * GETs of the state. With probability -x the PUT names the version before
+ * the client's last one, so the server has to three-way merge it; the
+ * merged S_STATE reply becomes the client's copy.
+ *
+ *   bench_load [-c clients] [-d seconds] [-r edits/s per client]
+ *              [-s file bytes] [-x conflict ratio] [-g gets per edit]
+ *              [-S server binary] [-t] [-- server flags...]
+ *
+ * Reports throughput, p50/p99/p999 latency for PUT and GET, and the bytes
+ * each edit moved in both directions (from TCP_INFO, so framing counts).
+ * -t adds the server's own C_STATS view of the run: lock, disk and merge
+ * latencies the client side can't see.
+ */
+
+#define _GNU_SOURCE
+#include "comm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>   // tcp_info with byte counters
+
+#ifndef RFS_SERVER_PATH
+#define RFS_SERVER_PATH "./server"
+#endif
+
+#define LINE_LEN 64
+#define MAX_SERVER_ARGS 16
+#define CONNECT_TRIES 100 // 10 ms apart
+
+struct Options {
+    int clients;
+    double seconds;
+    double rate;             // Edits per second per client, 0 = flat out
+    uint32_t file_size;
+    double conflict;         // Fraction of PUTs sent against a stale base
+    int gets;                // GETs after each edit
+    uint16_t port;
+};
+
+// Latencies of one kind of request, in nanoseconds
+struct Samples {
+    uint64_t *ns;
+    size_t n, cap;
+};
+
+struct Client {
+    pthread_t th;
+    int idx;
+    const struct Options *o;
+    struct Samples put, get;
+    uint64_t merges;         // PUTs answered with merged S_STATE
+    uint64_t errors;
+    uint64_t bytes_up, bytes_down;
+    int ok;
+};
+
+static atomic_int stop; // Set by main when the run is over
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int samples_add(struct Samples *s, uint64_t ns) {
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint64_t *p = realloc(s->ns, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        s->ns = p;
+        s->cap = cap;
+    }
+    s->ns[s->n++] = ns;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted samples, in milliseconds
+static double pct_ms(const struct Samples *s, double p) {
+    if (!s->n)
+        return 0;
+    size_t i = (size_t)(p * (double)s->n);
+    if (i >= s->n)
+        i = s->n - 1;
+    return (double)s->ns[i] / 1e6;
+}
+
+static int connect_port(uint16_t port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    for (int i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+        close(fd);
+        usleep(10000); // Server still starting
+    }
+    return -1;
+}
+
+// Ask the server for its C_STATS text before it goes away
+static char *fetch_stats(uint16_t port, uint32_t *len) {
+    int fd = connect_port(port);
+    if (fd < 0)
+        return NULL;
+    uint8_t type = 0;
+    uint8_t *text = NULL;
+    if (send_frame(fd, C_STATS, NULL, 0) != 1 ||
+        recv_message(fd, &type, NULL, &text, len) != 1 || type != S_STATS) {
+        frame_buf_free(text);
+        text = NULL;
+    }
+    close(fd);
+    return (char *)text;
+}
+
+// Let the kernel pick a free loopback port for the server
+static uint16_t free_port(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t len = sizeof(addr);
+    uint16_t port = 0;
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    if (fd >= 0)
+        close(fd);
+    return port;
+}
+
+// Next message that isn't a push for someone else's edit
+static int recv_reply(int fd, uint8_t *type, uint8_t **payload, uint32_t *plen) {
+    for (;;) {
+        *payload = NULL;
+        if (recv_message(fd, type, NULL, payload, plen) != 1) {
+            frame_buf_free(*payload);
+            return -1;
+        }
+        if (*type != S_PUSH && *type != S_PUSH_DELTA)
+            return 0;
+        frame_buf_free(*payload);
+    }
+}
+
+// Open the client's document; returns its id and current version
+static int open_doc(int fd, int idx, uint32_t *id, uint32_t *version) {
+    char name[32];
+    int n = snprintf(name, sizeof(name), "bench-%d.txt", idx);
+    if (send_frame(fd, C_OPEN, (const uint8_t *)name, (uint32_t)n) != 1)
+        return -1;
+
+    uint8_t type;
+    uint8_t *payload;
+    uint32_t plen;
+    if (recv_reply(fd, &type, &payload, &plen) != 0)
+        return -1;
+    int rc = type == S_OPENED && plen == 8 ? 0 : -1;
+    if (rc == 0) {
+        uint32_t be[2];
+        memcpy(be, payload, 8);
+        *id = ntohl(be[0]);
+        *version = ntohl(be[1]);
+    }
+    frame_buf_free(payload);
+    return rc;
+}
+
+static void fill_line(uint8_t *line, unsigned *seed) {
+    for (int i = 0; i < LINE_LEN - 1; i++)
+        line[i] = (uint8_t)('a' + rand_r(seed) % 26);
+    line[LINE_LEN - 1] = '\n';
+}
+
+// Send a C_PUT of the whole document and wait for S_OK or merged S_STATE
+static int do_put(struct Client *cl, int fd, uint32_t id, uint32_t base,
+                  uint8_t *buf, uint32_t *len, uint32_t *version) {
+    uint32_t hdr[3] = { htonl(id), htonl(base), htonl(*len) };
+    memcpy(buf, hdr, sizeof(hdr));
+
+    uint64_t t0 = now_ns();
+    uint8_t type;
+    uint8_t *payload;
+    uint32_t plen;
+    if (send_body(fd, C_PUT, buf, 12 + *len) != 1 ||
+        recv_reply(fd, &type, &payload, &plen) != 0)
+        return -1;
+    samples_add(&cl->put, now_ns() - t0);
+
+    int rc = 0;
+    if (type == S_OK && plen == 8) {
+        uint32_t be_ver;
+        memcpy(&be_ver, payload + 4, 4);
+        *version = ntohl(be_ver);
+    } else if (type == S_STATE && plen >= 12) {
+        // Merged: carry on from the server's result. Conflict markers make
+        // it grow, so past twice the file size the tail is dropped
+        uint32_t be[3];
+        memcpy(be, payload, 12);
+        uint32_t n = ntohl(be[2]);
+        if (n > plen - 12) {
+            rc = -1;
+        } else {
+            if (n > cl->o->file_size * 2u)
+                n = cl->o->file_size;
+            memcpy(buf + 12, payload + 12, n);
+            *len = n;
+            *version = ntohl(be[1]);
+            cl->merges++;
+        }
+    } else {
+        rc = -1;
+    }
+    frame_buf_free(payload);
+    return rc;
+}
+
+static int do_get(struct Client *cl, int fd, uint32_t id) {
+    uint32_t be_id = htonl(id);
+    uint64_t t0 = now_ns();
+    uint8_t type;
+    uint8_t *payload;
+    uint32_t plen;
+    if (send_frame(fd, C_GET, (uint8_t *)&be_id, 4) != 1 ||
+        recv_reply(fd, &type, &payload, &plen) != 0)
+        return -1;
+    samples_add(&cl->get, now_ns() - t0);
+    frame_buf_free(payload);
+    return type == S_STATE ? 0 : -1;
+}
+
+static void *client_main(void *arg) {
+    struct Client *cl = arg;
+    const struct Options *o = cl->o;
+    unsigned seed = (unsigned)cl->idx * 2654435761u + 1;
+
+    int fd = connect_port(o->port);
+    uint32_t id = 0, version = 0;
+    if (fd < 0 || open_doc(fd, cl->idx, &id, &version) != 0) {
+        fprintf(stderr, "bench_load: client %d could not open its document\n",
+                cl->idx);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    // 12 header bytes, then room for the document to grow through merges
+    uint32_t lines = o->file_size / LINE_LEN ? o->file_size / LINE_LEN : 1;
+    uint32_t len = lines * LINE_LEN;
+    uint8_t *buf = malloc(12 + (size_t)o->file_size * 2 + LINE_LEN);
+    if (!buf) {
+        close(fd);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < lines; i++)
+        fill_line(buf + 12 + (size_t)i * LINE_LEN, &seed);
+    if (do_put(cl, fd, id, version, buf, &len, &version) != 0)
+        cl->errors++;
+    cl->put.n = 0; // Don't count the upload that seeded the document
+
+    uint64_t interval = o->rate > 0 ? (uint64_t)(1e9 / o->rate) : 0;
+    uint64_t next = now_ns();
+    uint32_t prev_version = version;
+    while (!stop) {
+        if (interval) {
+            uint64_t t = now_ns();
+            if (t < next) {
+                struct timespec ts = { 0, (long)(next - t) };
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec = ts.tv_nsec / 1000000000L;
+                    ts.tv_nsec %= 1000000000L;
+                }
+                nanosleep(&ts, NULL);
+            }
+            next += interval;
+        }
+
+        // Rewrite one line, keeping line boundaries where merges left them
+        uint32_t nlines = len / LINE_LEN;
+        if (nlines) {
+            uint32_t line = (uint32_t)rand_r(&seed) % nlines;
+            fill_line(buf + 12 + (size_t)line * LINE_LEN, &seed);
+        }
+
+        int stale = (double)rand_r(&seed) / RAND_MAX < o->conflict &&
+                    prev_version < version;
+        uint32_t base = stale ? prev_version : version;
+        prev_version = version;
+        if (do_put(cl, fd, id, base, buf, &len, &version) != 0) {
+            cl->errors++;
+            break;
+        }
+        for (int g = 0; g < o->gets; g++) {
+            if (do_get(cl, fd, id) != 0) {
+                cl->errors++;
+                break;
+            }
+        }
+    }
+
+    struct tcp_info ti;
+    socklen_t tlen = sizeof(ti);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &tlen) == 0) {
+        cl->bytes_up = ti.tcpi_bytes_acked;
+        cl->bytes_down = ti.tcpi_bytes_received;
+    }
+    cl->ok = 1;
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int flag,
+                    struct FTW *ftw) {
+    (void)sb; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+// Merge every client's samples of one kind and sort them
+static void collect(struct Client *cls, int n, int get, struct Samples *all) {
+    for (int i = 0; i < n; i++) {
+        struct Samples *s = get ? &cls[i].get : &cls[i].put;
+        for (size_t j = 0; j < s->n; j++)
+            samples_add(all, s->ns[j]);
+    }
+    if (all->n)
+        qsort(all->ns, all->n, sizeof(*all->ns), cmp_u64);
+}
+
+static void report(const char *name, const struct Samples *s, double secs) {
+    printf("%-4s %10zu req %10.1f/s   p50 %8.3f ms   p99 %8.3f ms   "
+           "p999 %8.3f ms\n", name, s->n, (double)s->n / secs,
+           pct_ms(s, 0.50), pct_ms(s, 0.99), pct_ms(s, 0.999));
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c clients] [-d seconds] [-r edits/s] "
+                    "[-s file_bytes] [-x conflict_ratio] [-g gets_per_edit] "
+                    "[-S server] [-t] [-- server flags...]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct Options o = {
+        .clients = 8, .seconds = 10, .rate = 0,
+        .file_size = 64 * 1024, .conflict = 0, .gets = 1,
+    };
+    const char *server = RFS_SERVER_PATH;
+    int server_stats = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:r:s:x:g:S:t")) != -1) {
+        if (opt == 'c') o.clients = atoi(optarg);
+        else if (opt == 'd') o.seconds = atof(optarg);
+        else if (opt == 'r') o.rate = atof(optarg);
+        else if (opt == 's') o.file_size = (uint32_t)strtoul(optarg, NULL, 0);
+        else if (opt == 'x') o.conflict = atof(optarg);
+        else if (opt == 'g') o.gets = atoi(optarg);
+        else if (opt == 'S') server = optarg;
+        else if (opt == 't') server_stats = 1;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (o.clients < 1 || o.seconds <= 0 || o.gets < 0 ||
+        o.file_size > MAX_MSG / 4 || argc - optind > MAX_SERVER_ARGS) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char root[] = "/tmp/rfs_bench.XXXXXX";
+    o.port = free_port();
+    if (!o.port || !mkdtemp(root)) {
+        perror("bench_load");
+        return 1;
+    }
+
+    // server [flags...] port root
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%u", o.port);
+    char *sargv[MAX_SERVER_ARGS + 4];
+    int sargc = 0;
+    sargv[sargc++] = (char *)server;
+    for (int i = optind; i < argc; i++)
+        sargv[sargc++] = argv[i];
+    sargv[sargc++] = port_str;
+    sargv[sargc++] = root;
+    sargv[sargc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execv(server, sargv);
+        perror(server);
+        _exit(127);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct Client *cls = calloc((size_t)o.clients, sizeof(*cls));
+    if (!cls) {
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < o.clients; i++) {
+        cls[i].idx = i;
+        cls[i].o = &o;
+        if (pthread_create(&cls[i].th, NULL, client_main, &cls[i]) != 0) {
+            o.clients = i;
+            break;
+        }
+    }
+
+    struct timespec ts = { (time_t)o.seconds,
+                           (long)((o.seconds - (double)(time_t)o.seconds) * 1e9) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+    stop = 1;
+    for (int i = 0; i < o.clients; i++)
+        pthread_join(cls[i].th, NULL);
+    double secs = (double)(now_ns() - t0) / 1e9;
+
+    uint32_t stats_len = 0;
+    char *stats = server_stats ? fetch_stats(o.port, &stats_len) : NULL;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    struct Samples put = { 0 }, get = { 0 };
+    collect(cls, o.clients, 0, &put);
+    collect(cls, o.clients, 1, &get);
+    uint64_t merges = 0, errors = 0, up = 0, down = 0;
+    int connected = 0;
+    for (int i = 0; i < o.clients; i++) {
+        merges += cls[i].merges;
+        errors += cls[i].errors;
+        up += cls[i].bytes_up;
+        down += cls[i].bytes_down;
+        connected += cls[i].ok;
+    }
+
+    char rate[32] = "unlimited";
+    if (o.rate > 0)
+        snprintf(rate, sizeof(rate), "%.1f/s per client", o.rate);
+    printf("%d clients (%d ran), %.1f s, %u-byte files, rate %s, "
+           "conflicts %.0f%%, %d GET per edit\n",
+           o.clients, connected, secs, o.file_size, rate,
+           o.conflict * 100, o.gets);
+    report("PUT", &put, secs);
+    report("GET", &get, secs);
+    double edits = put.n ? (double)put.n : 1;
+    printf("per edit: %.0f bytes up, %.0f bytes down; %" PRIu64 " merged, "
+           "%" PRIu64 " errors\n", (double)up / edits, (double)down / edits,
+           merges, errors);
+    if (stats)
+        printf("server stats:\n%.*s", (int)stats_len, stats);
+    frame_buf_free((uint8_t *)stats);
+
+    for (int i = 0; i < o.clients; i++) {
+        free(cls[i].put.ns);
+        free(cls[i].get.ns);
+    }
+    free(cls);
+    free(put.ns);
+    free(get.ns);
+    return errors || connected < o.clients ? 1 : 0;
+}
@@ -0,0 +1,483 @@
+/*
+ * In-process microbenchmarks for the hot paths a PUT goes through:
+ * framing over a socketpair, the three-way merge, and the disk writes
+ * and reads on both ends. Each benchmark calibrates its iteration count
+ * to run for at least -t seconds and prints one JSON object per line:
+ *
+ *   {"name":"frame/send_recv/4096","iters":N,"ns_per_op":...,
+ *    "bytes_per_op":...,"allocs_per_op":...,"alloc_bytes_per_op":...,
+ *    "cycles_per_op":...,"instructions_per_op":...,
+ *    "cache_misses_per_op":...,"branch_misses_per_op":...}
+ *
+ * so runs from two commits can be diffed or fed to a script. bytes_per_op
+ * is the payload each operation handles. Allocations are counted by
+ * wrapping malloc/calloc/realloc at link time. Hardware counters come
+ * from perf_event_open and cover the benchmarking thread; they are null
+ * where the kernel doesn't allow them.
+ *
+ *   bench_micro [-t seconds] [-f name-substring]
+ */
+
+#define _GNU_SOURCE
+#include "comm.h"
+#include "doc.h"
+#include "merge.h"
+#include "rfs_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define MAX_ITERS (1u << 30)
+#define NCOUNTERS 4
+
+// Allocation counters fed by the --wrap'd allocator below
+static atomic_uint_fast64_t allocs, alloc_bytes;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, n, memory_order_relaxed);
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, n * size, memory_order_relaxed);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&alloc_bytes, n, memory_order_relaxed);
+    return __real_realloc(p, n);
+}
+
+// One benchmark: run() does 'iters' operations of 'bytes' payload each
+struct Bench {
+    const char *name;
+    uint64_t bytes;
+    int (*setup)(struct Bench *b);
+    int (*run)(struct Bench *b, uint64_t iters);
+    void (*teardown)(struct Bench *b);
+    uint32_t size;           // Input size for the setup
+    int variant;             // Benchmark specific, e.g. the conflict pattern
+    void *state;
+};
+
+// Hardware counters as one perf group, read together
+static const struct { uint32_t type; uint64_t config; const char *name; }
+counters[NCOUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles_per_op" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions_per_op" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache_misses_per_op" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses_per_op" },
+};
+
+static int perf_fd = -1;
+
+static void perf_open(void) {
+    for (int i = 0; i < NCOUNTERS; i++) {
+        struct perf_event_attr attr = {
+            .type = counters[i].type,
+            .size = sizeof(attr),
+            .config = counters[i].config,
+            .disabled = i == 0,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_GROUP,
+        };
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+                              i == 0 ? -1 : perf_fd, 0);
+        if (fd < 0) {
+            if (perf_fd >= 0)
+                close(perf_fd); // Closing the leader drops the group
+            perf_fd = -1;
+            return;
+        }
+        if (i == 0)
+            perf_fd = fd;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// --- Framing over a socketpair ---------------------------------------------
+
+struct FrameState {
+    int sv[2];
+    uint8_t *payload;
+    pthread_t reader;
+    uint64_t want;           // Frames the reader still has to take
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int body;                // Use send_body/recv_message
+    int started;             // Reader thread running
+};
+
+// Drain frames as fast as they come, like a server connection would
+static void *frame_reader(void *arg) {
+    struct FrameState *s = arg;
+    for (;;) {
+        uint8_t type;
+        uint8_t *payload = NULL;
+        uint32_t plen;
+        int r = s->body ? recv_message(s->sv[1], &type, NULL, &payload, &plen)
+                        : recv_frame(s->sv[1], &type, NULL, &payload, &plen);
+        frame_buf_free(payload);
+        if (r != 1)
+            return NULL;
+        pthread_mutex_lock(&s->mu);
+        if (s->want && --s->want == 0)
+            pthread_cond_signal(&s->cv);
+        pthread_mutex_unlock(&s->mu);
+    }
+}
+
+static int frame_setup(struct Bench *b) {
+    struct FrameState *s = calloc(1, sizeof(*s));
+    b->state = s;
+    if (!s)
+        return -1;
+    s->sv[0] = s->sv[1] = -1;
+    pthread_mutex_init(&s->mu, NULL);
+    pthread_cond_init(&s->cv, NULL);
+    s->body = b->variant;
+    s->payload = malloc(b->size);
+    if (!s->payload || socketpair(AF_UNIX, SOCK_STREAM, 0, s->sv) != 0)
+        return -1;
+    memset(s->payload, 'x', b->size);
+    s->started = pthread_create(&s->reader, NULL, frame_reader, s) == 0;
+    return s->started ? 0 : -1;
+}
+
+static int frame_run(struct Bench *b, uint64_t iters) {
+    struct FrameState *s = b->state;
+    pthread_mutex_lock(&s->mu);
+    s->want = iters;
+    pthread_mutex_unlock(&s->mu);
+
+    for (uint64_t i = 0; i < iters; i++) {
+        int r = s->body ? send_body(s->sv[0], C_PUT, s->payload, b->size)
+                        : send_frame(s->sv[0], C_PUT, s->payload, b->size);
+        if (r != 1)
+            return -1;
+    }
+
+    pthread_mutex_lock(&s->mu);
+    while (s->want)
+        pthread_cond_wait(&s->cv, &s->mu);
+    pthread_mutex_unlock(&s->mu);
+    return 0;
+}
+
+static void frame_teardown(struct Bench *b) {
+    struct FrameState *s = b->state;
+    if (!s)
+        return;
+    if (s->started) {
+        shutdown(s->sv[0], SHUT_RDWR); // The reader sees EOF and exits
+        pthread_join(s->reader, NULL);
+    }
+    if (s->sv[0] >= 0) {
+        close(s->sv[0]);
+        close(s->sv[1]);
+    }
+    free(s->payload);
+    free(s);
+}
+
+// --- Three-way merge --------------------------------------------------------
+
+enum { MERGE_DISJOINT, MERGE_OVERLAP, MERGE_SPARSE };
+
+struct MergeState {
+    uint8_t *base, *client, *server;
+};
+
+// Pseudo-random 64-byte lines
+static void fill_lines(uint8_t *p, uint32_t len, unsigned seed) {
+    for (uint32_t i = 0; i < len; i++) {
+        seed = seed * 1103515245u + 12345u;
+        p[i] = i % 64 == 63 ? '\n' : (uint8_t)('a' + (seed >> 16) % 26);
+    }
+}
+
+// Change every step'th line from 'first' on
+static void edit_lines(uint8_t *p, uint32_t len, uint32_t first, uint32_t step,
+                       uint8_t c) {
+    for (uint32_t off = first * 64; off + 64 <= len; off += step * 64)
+        p[off] = c;
+}
+
+static int merge_setup(struct Bench *b) {
+    struct MergeState *s = calloc(1, sizeof(*s));
+    b->state = s;
+    if (!s)
+        return -1;
+    s->base = malloc(b->size);
+    s->client = malloc(b->size);
+    s->server = malloc(b->size);
+    if (!s->base || !s->client || !s->server)
+        return -1;
+    fill_lines(s->base, b->size, 1);
+    memcpy(s->client, s->base, b->size);
+    memcpy(s->server, s->base, b->size);
+
+    uint32_t lines = b->size / 64;
+    if (b->variant == MERGE_DISJOINT) {
+        // Both sides edit a tenth of the lines, never the same ones
+        edit_lines(s->client, b->size, 0, 10, 'C');
+        edit_lines(s->server, b->size, 5, 10, 'S');
+    } else if (b->variant == MERGE_OVERLAP) {
+        // Same lines, different bytes: every hunk conflicts
+        edit_lines(s->client, b->size, 0, 10, 'C');
+        edit_lines(s->server, b->size, 0, 10, 'S');
+    } else {
+        // The common case: one line each, far apart
+        edit_lines(s->client, b->size, lines / 4, lines, 'C');
+        edit_lines(s->server, b->size, lines * 3 / 4, lines, 'S');
+    }
+    return 0;
+}
+
+static int merge_run(struct Bench *b, uint64_t iters) {
+    struct MergeState *s = b->state;
+    for (uint64_t i = 0; i < iters; i++) {
+        uint8_t *out = NULL;
+        uint32_t out_len = 0;
+        if (merge3(s->base, b->size, s->client, b->size, s->server, b->size,
+                   &out, &out_len) < 0)
+            return -1;
+        free(out);
+    }
+    return 0;
+}
+
+static void merge_teardown(struct Bench *b) {
+    struct MergeState *s = b->state;
+    if (!s)
+        return;
+    free(s->base);
+    free(s->client);
+    free(s->server);
+    free(s);
+}
+
+// --- Disk writes and reads -------------------------------------------------
+
+enum { DISK_WRITE_FILE, DISK_WRITE_LOCAL, DISK_PATCH_LOCAL, DISK_READ };
+
+struct DiskState {
+    char dir[32];
+    char path[64];
+    char mark[64];           // patch_local's mark, as the client keeps one
+    uint8_t *data;
+    uint32_t flip;           // Byte patch_local changes each time
+};
+
+static int disk_setup(struct Bench *b) {
+    struct DiskState *s = calloc(1, sizeof(*s));
+    b->state = s;
+    if (!s)
+        return -1;
+    strcpy(s->dir, "/tmp/rfs_micro.XXXXXX");
+    if (!mkdtemp(s->dir)) {
+        s->dir[0] = '\0';
+        return -1;
+    }
+    snprintf(s->path, sizeof(s->path), "%s/doc", s->dir);
+    snprintf(s->mark, sizeof(s->mark), "%s/mark", s->dir);
+    s->data = malloc(b->size);
+    if (!s->data)
+        return -1;
+    fill_lines(s->data, b->size, 2);
+    s->flip = b->size / 2;
+    return atomic_write_local(s->path, s->data, b->size);
+}
+
+static int disk_run(struct Bench *b, uint64_t iters) {
+    struct DiskState *s = b->state;
+    for (uint64_t i = 0; i < iters; i++) {
+        int rc;
+        if (b->variant == DISK_WRITE_FILE) {
+            rc = atomic_write_file(s->path, s->data, b->size, NULL);
+        } else if (b->variant == DISK_WRITE_LOCAL) {
+            rc = atomic_write_local(s->path, s->data, b->size);
+        } else if (b->variant == DISK_PATCH_LOCAL) {
+            s->data[s->flip] ^= 1; // A one-byte edit in the middle
+            rc = patch_local(s->path, s->data, b->size, s->mark);
+        } else {
+            uint8_t *buf = NULL;
+            uint32_t len = 0;
+            rc = read_file_into_buf(s->path, &buf, &len);
+            free(buf);
+        }
+        if (rc != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int flag,
+                    struct FTW *ftw) {
+    (void)sb; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+static void disk_teardown(struct Bench *b) {
+    struct DiskState *s = b->state;
+    if (!s)
+        return;
+    if (s->dir[0])
+        nftw(s->dir, rm_entry, 8, FTW_DEPTH | FTW_PHYS);
+    free(s->data);
+    free(s);
+}
+
+// --- Harness ----------------------------------------------------------------
+
+#define FRAME(n, sz, body) \
+    { n, sz, frame_setup, frame_run, frame_teardown, sz, body, NULL }
+#define MERGE(n, sz, v) \
+    { n, sz, merge_setup, merge_run, merge_teardown, sz, v, NULL }
+#define DISK(n, sz, v) \
+    { n, sz, disk_setup, disk_run, disk_teardown, sz, v, NULL }
+
+static struct Bench benches[] = {
+    FRAME("frame/send_recv/64", 64, 0),
+    FRAME("frame/send_recv/4096", 4096, 0),
+    FRAME("frame/send_recv/65536", 65536, 0),
+    FRAME("frame/send_recv/1048576", 1048576, 0),
+    FRAME("frame/body/4194304", 4194304, 1),
+    MERGE("merge/sparse/4096", 4096, MERGE_SPARSE),
+    MERGE("merge/sparse/65536", 65536, MERGE_SPARSE),
+    MERGE("merge/sparse/1048576", 1048576, MERGE_SPARSE),
+    MERGE("merge/disjoint/65536", 65536, MERGE_DISJOINT),
+    MERGE("merge/overlap/65536", 65536, MERGE_OVERLAP),
+    DISK("disk/atomic_write_file/4096", 4096, DISK_WRITE_FILE),
+    DISK("disk/atomic_write_file/1048576", 1048576, DISK_WRITE_FILE),
+    DISK("disk/atomic_write_local/4096", 4096, DISK_WRITE_LOCAL),
+    DISK("disk/atomic_write_local/1048576", 1048576, DISK_WRITE_LOCAL),
+    DISK("disk/patch_local/1048576", 1048576, DISK_PATCH_LOCAL),
+    DISK("disk/read_file_into_buf/4096", 4096, DISK_READ),
+    DISK("disk/read_file_into_buf/1048576", 1048576, DISK_READ),
+};
+
+// Time 'iters' operations with allocation and hardware counters around them
+static int measure(struct Bench *b, uint64_t iters, uint64_t *ns,
+                   uint64_t *nallocs, uint64_t *nbytes, uint64_t hw[NCOUNTERS],
+                   int *have_hw) {
+    uint64_t a0 = atomic_load(&allocs), b0 = atomic_load(&alloc_bytes);
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    uint64_t t0 = now_ns();
+    int rc = b->run(b, iters);
+    *ns = now_ns() - t0;
+    *have_hw = 0;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        uint64_t vals[1 + NCOUNTERS];
+        if (read(perf_fd, vals, sizeof(vals)) == (ssize_t)sizeof(vals) &&
+            vals[0] == NCOUNTERS) {
+            memcpy(hw, vals + 1, sizeof(uint64_t) * NCOUNTERS);
+            *have_hw = 1;
+        }
+    }
+    *nallocs = atomic_load(&allocs) - a0;
+    *nbytes = atomic_load(&alloc_bytes) - b0;
+    return rc;
+}
+
+static int run_bench(struct Bench *b, double min_secs) {
+    if (b->setup(b) != 0) {
+        fprintf(stderr, "bench_micro: %s: setup failed\n", b->name);
+        b->teardown(b);
+        return -1;
+    }
+
+    // Warm up, then grow the count until one run lasts min_secs
+    uint64_t iters = 1, ns, nallocs, nbytes, hw[NCOUNTERS];
+    int have_hw;
+    int rc = measure(b, 1, &ns, &nallocs, &nbytes, hw, &have_hw);
+    while (rc == 0) {
+        rc = measure(b, iters, &ns, &nallocs, &nbytes, hw, &have_hw);
+        if (rc != 0 || (double)ns >= min_secs * 1e9 || iters >= MAX_ITERS)
+            break;
+        uint64_t next = iters * 100;
+        if (ns)
+            next = (uint64_t)((double)iters * min_secs * 1.2e9 / (double)ns);
+        if (next > iters * 100)
+            next = iters * 100;
+        iters = next > iters ? next : iters * 2;
+    }
+    b->teardown(b);
+    if (rc != 0) {
+        fprintf(stderr, "bench_micro: %s: failed\n", b->name);
+        return -1;
+    }
+
+    double n = (double)iters;
+    printf("{\"name\":\"%s\",\"iters\":%" PRIu64 ",\"ns_per_op\":%.1f,"
+           "\"bytes_per_op\":%" PRIu64 ",\"allocs_per_op\":%.3f,"
+           "\"alloc_bytes_per_op\":%.1f", b->name, iters, (double)ns / n,
+           b->bytes, (double)nallocs / n, (double)nbytes / n);
+    for (int i = 0; i < NCOUNTERS; i++) {
+        if (have_hw)
+            printf(",\"%s\":%.1f", counters[i].name, (double)hw[i] / n);
+        else
+            printf(",\"%s\":null", counters[i].name);
+    }
+    printf("}\n");
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    double min_secs = 0.5;
+    const char *filter = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+        if (opt == 't') {
+            min_secs = atof(optarg);
+        } else if (opt == 'f') {
+            filter = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-t seconds] [-f name-substring]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    perf_open();
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (filter && !strstr(benches[i].name, filter))
+            continue;
+        if (run_bench(&benches[i], min_secs) != 0)
+            failed = 1;
+    }
+    return failed;
+}
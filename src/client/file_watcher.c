@@ -2,6 +2,7 @@
 #include "socket_client.h"
 #include "rfs_file.h"
 #include "args.h"
+#include "sync_state.h"
 
 #include <arpa/inet.h>
 #include <sys/inotify.h>
@@ -20,17 +21,37 @@
 #include <stdatomic.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
 
 #define EVENT_SIZE  (sizeof(struct inotify_event))
 #define BUF_LEN     (1024 * (EVENT_SIZE + 16))
 
+// A save shows up as a burst of events. Sync once, when the burst is over
+#define DEBOUNCE_MS 50        // Quiet time after a save before syncing
+#define DEBOUNCE_MAX_WAITS 10 // Windows a burst may last; bounds sync delay
+
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | \
+                    IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR)
+
 // file watcher variables
-int fd, wd;
+int fd;
+
+// Watched directories by watch descriptor, relative to the root ("" is it)
+static char** watch_dirs;
+static int watch_cap;
+
+// Files changed in the current burst
+static struct SyncFile** changed;
+static size_t nchanged, changed_cap;
 
 // path variables
-char file_path[50];
-char folder_path[50];
+char folder_path[PATH_MAX];
+char patch_mark[PATH_MAX];
 const char* home;
+long debounce_ms = DEBOUNCE_MS;
 
 // Ctrl + C handling variables
 volatile sig_atomic_t stop_flag = 0;
@@ -43,19 +64,187 @@ void handle_sigint(int sig) {
     printf("\nCtrl+C detected\n");
 }
 
-void init_file_path(void) {
+void init_file_path(const char* dir) {
+    if (dir) {
+        snprintf(folder_path, sizeof(folder_path), "%s", dir);
+        return;
+    }
     home = getenv("HOME");
     if (!home) {
         fprintf(stderr, "Could not get HOME environment variable\n");
         exit(EXIT_FAILURE);
     }
-    snprintf(file_path, sizeof(file_path), "%s/rfs/main.py", home);
     snprintf(folder_path, sizeof(folder_path), "%s/rfs", home);
 }
 
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// "dir/name", or just name at the root. 0 if it doesn't fit
+static int join_rel(char* out, const char* dir, const char* name) {
+    int n = dir[0] ? snprintf(out, PATH_MAX, "%s/%s", dir, name)
+                   : snprintf(out, PATH_MAX, "%s", name);
+    return n > 0 && n < PATH_MAX;
+}
+
+// Note a file for the sync at the end of this burst
+static void mark_changed(struct args* a, const char* rel) {
+    pthread_mutex_lock(&a->mu);
+    struct SyncFile* f = sync_file_get(&a->files, rel);
+    pthread_mutex_unlock(&a->mu);
+    if (!f || f->watch_pending)
+        return;
+
+    if (nchanged == changed_cap) {
+        size_t cap = changed_cap ? changed_cap * 2 : 64;
+        struct SyncFile** c = realloc(changed, cap * sizeof(*c));
+        if (!c)
+            return;
+        changed = c;
+        changed_cap = cap;
+    }
+    f->watch_pending = 1;
+    changed[nchanged++] = f;
+}
+
+// Queue the burst's files for the socket thread and wake it once
+static void flush_changed(struct args* a) {
+    if (!nchanged)
+        return;
+    pthread_mutex_lock(&a->mu);
+    for (size_t i = 0; i < nchanged; i++) {
+        changed[i]->watch_pending = 0;
+        sync_queue(&a->files, changed[i], SYNC_PUSH);
+    }
+    pthread_mutex_unlock(&a->mu);
+    printf("%zu file%s changed\n", nchanged, nchanged == 1 ? "" : "s");
+    nchanged = 0;
+
+    // Send message to pipe
+    char* msg = "modify";
+    write(a->pipefd[1], msg, strlen(msg) + 1);
+}
+
+// Watch directory 'rel' and everything below it, and mark every file in
+// it changed: files created before the watch was in place raised no event
+static void watch_tree(struct args* a, const char* rel) {
+    char path[PATH_MAX];
+    if (!join_rel(path, folder_path, rel))
+        return;
+    if (!rel[0])
+        snprintf(path, sizeof(path), "%s", folder_path);
+
+    int wd = inotify_add_watch(fd, path, WATCH_MASK);
+    if (wd < 0) {
+        fprintf(stderr, "Cannot watch '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    if (wd >= watch_cap) {
+        int cap = watch_cap ? watch_cap : 64;
+        while (cap <= wd)
+            cap *= 2;
+        char** dirs = realloc(watch_dirs, (size_t)cap * sizeof(*dirs));
+        if (!dirs)
+            return;
+        memset(dirs + watch_cap, 0, (size_t)(cap - watch_cap) * sizeof(*dirs));
+        watch_dirs = dirs;
+        watch_cap = cap;
+    }
+    free(watch_dirs[wd]); // Watching the same directory again
+    watch_dirs[wd] = strdup(rel);
+
+    DIR* dir = opendir(path);
+    if (!dir)
+        return;
+    struct dirent* e;
+    while ((e = readdir(dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        int is_dir = e->d_type == DT_DIR, is_reg = e->d_type == DT_REG;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            is_dir = S_ISDIR(st.st_mode);
+            is_reg = S_ISREG(st.st_mode);
+        }
+
+        char child[PATH_MAX];
+        if ((!is_dir && !is_reg) || sync_ignored(e->d_name, is_dir) ||
+            !join_rel(child, rel, e->d_name))
+            continue;
+        if (is_dir)
+            watch_tree(a, child);
+        else
+            mark_changed(a, child);
+    }
+    closedir(dir);
+}
+
+// A directory moved away: stop watching it and everything below it
+static void unwatch_tree(const char* rel) {
+    size_t n = strlen(rel);
+    for (int wd = 0; wd < watch_cap; wd++) {
+        char* d = watch_dirs[wd];
+        if (d && strncmp(d, rel, n) == 0 && (d[n] == '\0' || d[n] == '/')) {
+            inotify_rm_watch(fd, wd);
+            free(d);
+            watch_dirs[wd] = NULL;
+        }
+    }
+}
+
+// Act on one event. Returns how long to wait for the burst to end before
+// syncing, or -1 for events that change nothing we send
+static int64_t handle_event(struct args* a, const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        watch_tree(a, ""); // Lost events: look at everything
+        return debounce_ms;
+    }
+    if (event->mask & IN_IGNORED) { // Directory deleted or unwatched
+        if (event->wd < watch_cap) {
+            free(watch_dirs[event->wd]);
+            watch_dirs[event->wd] = NULL;
+        }
+        return -1;
+    }
+
+    const char* dir = event->wd >= 0 && event->wd < watch_cap
+        ? watch_dirs[event->wd] : NULL;
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+    char rel[PATH_MAX];
+    if (!dir || !event->len || sync_ignored(event->name, is_dir) ||
+        !join_rel(rel, dir, event->name))
+        return -1;
+
+    if (event->mask & IN_MOVED_FROM) {
+        if (is_dir)
+            unwatch_tree(rel);
+        return -1; // Moved away; nothing to send
+    }
+    if (is_dir) {
+        watch_tree(a, rel);
+        return debounce_ms;
+    }
+    mark_changed(a, rel);
+    return event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)
+        ? debounce_ms
+        : debounce_ms * DEBOUNCE_MAX_WAITS;
+}
+
+// Watch the whole tree under the root. Changed files are collected per
+// burst and handed to the socket thread as one "modify" on the pipe, so
+// a checkout touching hundreds of files becomes one pipelined sync. A
+// save is complete on close-after-write or rename-into-place, and the
+// sync waits for the debounce window to pass without another one. A file
+// that was written but not closed is still being written, so wait for the
+// close, up to DEBOUNCE_MAX_WAITS windows after the burst started
 void* start_file_watcher(void* arg) {
     struct args *a = (struct args *)arg;
-    char buffer[BUF_LEN];
+    char buffer[BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
 
     // Initialize inotify and catch err
     fd = inotify_init();
@@ -66,24 +255,33 @@ void* start_file_watcher(void* arg) {
 
     printf("inotify initialized!\n");
 
-    // Add a watch to the directory and catch err
-    wd = inotify_add_watch(fd, folder_path, IN_CREATE | IN_MODIFY | IN_DELETE);
-    if (wd == -1) {
+    // Watch the tree; what is already there gets synced right away
+    watch_tree(a, "");
+    if (watch_cap == 0) {
         fprintf(stderr, "Cannot watch '%s'\n", folder_path);
         close(fd);
         exit(EXIT_FAILURE);
     }
     printf("Watching directory: %s\n\n", folder_path);
-
+    flush_changed(a);
 
     struct pollfd pfd = {
         .fd = fd,
         .events = POLLIN
     };
 
+    int pending = 0;          // Events seen, sync not yet signalled
+    int64_t first = 0;        // When the pending burst started
+    int64_t deadline = 0;     // When to signal it
+
     // Event loop
     while (!stop_flag) {
-        int ret = poll(&pfd, 1, 500); // timeout every 500ms so loop can check stop_flag
+        int timeout = 500; // timeout every 500ms so loop can check stop_flag
+        if (pending) {
+            int64_t left = deadline - now_ms();
+            timeout = left < 0 ? 0 : left < timeout ? (int)left : timeout;
+        }
+        int ret = poll(&pfd, 1, timeout);
 
         if (ret < 0) {
             if (errno == EINTR) continue;
@@ -91,67 +289,89 @@ void* start_file_watcher(void* arg) {
             break;
         }
 
-        if (ret == 0) continue; // timeout -> check stop_flag again
-
-        if (pfd.revents & POLLIN) {
-            int length = read(fd, buffer, BUF_LEN);
+        if (ret > 0 && (pfd.revents & POLLIN)) {
+            ssize_t length = read(fd, buffer, BUF_LEN);
             if (length < 0) {
                 if (errno == EINTR) continue;
                 perror("read");
                 break;
             }
 
-            int i = 0;
+            ssize_t i = 0;
             while (i < length) {
                 struct inotify_event *event = (struct inotify_event *)&buffer[i];
-
-                if (event->len) {
-                    if (strcmp(event->name, "main.py") == 0) {
-                        if (event->mask & IN_CREATE) 
-                            printf("File created: %s\n", event->name);
-                        else if (event->mask & IN_MODIFY) 
-                            printf("File modified: %s\n", event->name);
-                        else if (event->mask & IN_DELETE) 
-                            printf("File deleted: %s\n", event->name);
-
-                        pthread_mutex_lock(&a->mu);
-                        if (a->suppress_next) {
-                            a->suppress_next = 0;
-                        }
-                        pthread_mutex_unlock(&a->mu);
-
-                        // Send message to pipe
-                        char* msg = "modify";
-                        write(a->pipefd[1], msg, strlen(msg) + 1);
-                    }
+                i += (ssize_t)(EVENT_SIZE + event->len);
+
+                int64_t wait = handle_event(a, event);
+                if (wait < 0)
+                    continue;
+                int64_t now = now_ms();
+                if (!pending) {
+                    pending = 1;
+                    first = now;
                 }
-                // Call sync callback
-                /*if (on_change && (event->mask & (IN_CREATE | IN_MODIFY)))
-                    on_change(event->name);
-                */
-                i += EVENT_SIZE + event->len;
+                deadline = now + wait;
+                if (deadline > first + debounce_ms * DEBOUNCE_MAX_WAITS)
+                    deadline = first + debounce_ms * DEBOUNCE_MAX_WAITS;
             }
         }
+
+        if (pending && now_ms() >= deadline) {
+            pending = 0;
+            flush_changed(a);
+        }
     }
+    return NULL;
 }
 
 void close_file_watcher(){
     // Cleanup
-    inotify_rm_watch(fd, wd);
     close(fd);
+    for (int wd = 0; wd < watch_cap; wd++)
+        free(watch_dirs[wd]);
+    free(watch_dirs);
+    free(changed);
     printf("File watcher cleaned\n");
 }
 
-int main(void){
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-c] [-d debounce_ms] [directory]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv){
+    int opt, collab = 0;
+    while ((opt = getopt(argc, argv, "cd:")) != -1) {
+        if (opt == 'c')
+            collab = 1;
+        else if (opt == 'd')
+            debounce_ms = atol(optarg);
+        else
+            usage(argv[0]);
+    }
+    if (debounce_ms < 0 || debounce_ms > 60000)
+        usage(argv[0]);
+
+    // Optional directory to sync instead of ~/rfs
+    int rest = argc - optind;
+    if (rest > 1 || (rest == 1 && argv[optind][0] == '\0'))
+        usage(argv[0]);
+
     // Handle Ctrl + C
     signal(SIGINT, handle_sigint);
 
-    init_file_path();
-    // Check if RFS file exists, if not create it
+    init_file_path(rest == 1 ? argv[optind] : NULL);
+    // Create the synced folder if it isn't there yet
     create_rfs_folder(folder_path);
-    int rfs_is_folder = check_rfs_file_exists(file_path);
-    if(!rfs_is_folder){
-        create_rfs_file(file_path);
+    if (rest == 0) {
+        // ~/rfs always has the shared main.py, as it did before trees
+        char file_path[PATH_MAX];
+        if (!join_rel(file_path, folder_path, "main.py")) {
+            fprintf(stderr, "Path too long: %s\n", folder_path);
+            exit(EXIT_FAILURE);
+        }
+        if (!check_rfs_file_exists(file_path))
+            create_rfs_file(file_path);
     }
 
     // Thread 1: File Watcher
@@ -161,15 +381,30 @@ int main(void){
 
     // args pointer will be used to communicate between the two threads
     arguments = malloc(sizeof(struct args));
-    if (!arguments) {
+    if (!arguments || sync_table_init(&arguments->files, folder_path) != 0) {
         perror("malloc failed");
         exit(EXIT_FAILURE);
     }
-    arguments->new_message    = 0;
-    arguments->message        = NULL;
-    arguments->file_path      = file_path;
-    arguments->last_version   = 0;
-    arguments->suppress_next  = 0;
+    // Bases from the last run, so a restart only syncs what changed
+    int needed = snprintf(patch_mark, sizeof(patch_mark), "%s/%s",
+                          folder_path, SYNC_PATCH_MARK);
+    if (needed < 0 || (size_t)needed >= sizeof(patch_mark)) {
+        fprintf(stderr, "Path too long: %s\n", folder_path);
+        exit(EXIT_FAILURE);
+    }
+    int known = sync_state_load(&arguments->files);
+    if (known > 0)
+        printf("Restored sync state of %d file%s\n", known, known == 1 ? "" : "s");
+    arguments->root           = folder_path;
+    arguments->patch_mark     = patch_mark;
+    arguments->server_fd      = -1;
+    arguments->compress       = 0;
+    arguments->tags           = 0;
+    arguments->last_tag       = 0;
+    arguments->reconcile      = 1; // Catch up with the server on connecting
+    arguments->retry_ms       = 0;
+    arguments->retry_at       = 0;
+    arguments->collab         = collab;
     arguments->stop_flag_addr = &stop_flag;
     pthread_mutex_init(&arguments->mu, NULL);
 
@@ -190,7 +425,8 @@ int main(void){
     printf("Safe clean up...\n");
     close_file_watcher();
     pthread_mutex_destroy(&arguments->mu);
+    sync_table_free(&arguments->files);
     free(arguments);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 
 #include "rfs_file.h"
+#include "merge.h"
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -10,6 +11,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <libgen.h>
+
+#define PATCH_BLOCK 4096      // Compare and rewrite in page-sized blocks
+#define PATCH_MAX_RANGES 16   // More separate edits than this: one span
 
 int check_rfs_file_exists(char* file_path) {
     struct stat sb;
@@ -85,35 +90,20 @@ void create_rfs_file(char* file_path){
     }
 }
 
-// Read the entire file at `path` into a heap buffer
-int read_file_into_buf(const char *path, uint8_t **data_out, uint32_t *len_out) {
-    int fd = open(path, O_RDONLY | O_CLOEXEC);
-    if (fd < 0) {
-        // If file is missing, treat as empty file
-        if (errno == ENOENT) {
-            *data_out = NULL;
-            *len_out  = 0;
-            return 0;
-        }
-        return -1;
-    }
-
-    // Get file size
-    struct stat sb;
-    if (fstat(fd, &sb) != 0) {
-        close(fd);
+// Read the st_size bytes of an open file into a heap buffer
+static int read_fd(int fd, off_t size, uint8_t **data_out, uint32_t *len_out) {
+    size_t n = (size_t)size;
+    uint8_t *buf = NULL;
+    if (n > UINT32_MAX) {
+        // Lengths on the wire are 32-bit
+        errno = EFBIG;
         return -1;
     }
-
-    size_t n = (size_t)sb.st_size;
-    uint8_t *buf = NULL;
     if (n) {
         // Allocate a buffer of size n
         buf = (uint8_t *)malloc(n);
-        if (!buf) {
-            close(fd);
+        if (!buf)
             return -1;
-        }
         // Read until we've received n bytes or EOF
         size_t got = 0;
         while (got < n) {
@@ -123,19 +113,59 @@ int read_file_into_buf(const char *path, uint8_t **data_out, uint32_t *len_out)
                 if (errno == EINTR) continue; // Interrupted; retry
                 // Real error: clean up and abort
                 free(buf);
-                close(fd);
                 return -1;
             }
             got += (size_t)r;
         }
+        n = got; // Shrank while we read
     }
-    close(fd);
 
     *data_out = buf;
     *len_out  = (uint32_t)n;
     return 0;
 }
 
+// Read the entire file at `path` into a heap buffer
+int read_file_into_buf(const char *path, uint8_t **data_out, uint32_t *len_out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // If file is missing, treat as empty file
+        if (errno == ENOENT) {
+            *data_out = NULL;
+            *len_out  = 0;
+            return 0;
+        }
+        return -1;
+    }
+
+    // Get file size
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int rc = read_fd(fd, sb.st_size, data_out, len_out);
+    close(fd);
+    return rc;
+}
+
+// mkdir -p for every directory above path, for files first seen on the
+// server whose directories we don't have yet
+static int make_parent_dirs(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
 // Atomically write new content to `path` using a temp file + rename
 // This is used by the client when applying a new version pulled from the server
 int atomic_write_local(const char *path, const uint8_t *data, uint32_t len) {
@@ -150,6 +180,8 @@ int atomic_write_local(const char *path, const uint8_t *data, uint32_t len) {
 
     // Open the temporary file
     int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT && make_parent_dirs(path) == 0)
+        fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
     if (fd < 0) 
         return -1;
 
@@ -166,4 +198,183 @@ int atomic_write_local(const char *path, const uint8_t *data, uint32_t len) {
     if (rename(tmp, path) != 0) 
         return -1;
     return 0;
-}
\ No newline at end of file
+}
+
+// pwrite all of [off, off + n) from data
+static int write_range(int fd, const uint8_t *data, size_t off, size_t n) {
+    while (n) {
+        ssize_t w = pwrite(fd, data + off, n, (off_t)off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Find the blocks of an equal-length file that changed, merging edits one
+// block apart. Too many ranges become one span so editors see a handful of
+// writes, not hundreds. Returns the bytes to write
+static size_t plan_blocks(const uint8_t *old, const uint8_t *data,
+                          size_t from, size_t to,
+                          size_t *starts, size_t *ends, size_t *n) {
+    *n = 0;
+    for (size_t b = from / PATCH_BLOCK * PATCH_BLOCK; b < to; b += PATCH_BLOCK) {
+        size_t s = b < from ? from : b;
+        size_t e = b + PATCH_BLOCK < to ? b + PATCH_BLOCK : to;
+        if (memcmp(old + s, data + s, e - s) == 0)
+            continue;
+        if (*n && s <= ends[*n - 1] + PATCH_BLOCK) {
+            ends[*n - 1] = e;
+        } else if (*n == PATCH_MAX_RANGES) {
+            starts[0] = from;
+            ends[0] = to;
+            *n = 1;
+            return to - from;
+        } else {
+            starts[*n] = s;
+            ends[(*n)++] = e;
+        }
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < *n; i++)
+        total += ends[i] - starts[i];
+    return total;
+}
+
+static int sync_dir_of(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    int dfd = open(dirname(tmp), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
+        return -1;
+    int rc = fsync(dfd);
+    close(dfd);
+    return rc;
+}
+
+// Record in `mark` that `path` is about to be written in place. Left
+// behind by a crash midway, it tells the next start which file is torn,
+// so it is on disk, along with its directory entry if new, before the
+// first byte of the patch is
+static int set_mark(const char *mark, const char *path) {
+    int fd = open(mark, O_TRUNC | O_WRONLY | O_CLOEXEC);
+    int created = fd < 0 && errno == ENOENT;
+    if (created)
+        fd = open(mark, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT && make_parent_dirs(mark) == 0)
+        fd = open(mark, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    size_t n = strlen(path);
+    int rc = write(fd, path, n) == (ssize_t)n && fsync(fd) == 0 ? 0 : -1;
+    if (close(fd) != 0)
+        rc = -1;
+    if (rc == 0 && created && sync_dir_of(mark) != 0)
+        rc = -1;
+    return rc;
+}
+
+// Bring the file at `path` to data by writing only the bytes that differ
+// from what it holds now, keeping its inode so editors see a small change.
+// Unchanged content writes nothing. An insert or delete shifts everything
+// after it, so that tail is rewritten and the file truncated.
+// Edits that would rewrite most of the file, or a file we can't read, go
+// through atomic_write_local instead. A crash mid-patch would leave a file
+// that looks edited, so `mark`, if given, names the file while it is being
+// patched and is removed once the patch is complete; sync_state_load puts
+// a file still named there back to its base
+int patch_local(const char *path, const uint8_t *data, uint32_t len,
+                const char *mark) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return atomic_write_local(path, data, len);
+
+    struct stat sb;
+    uint8_t *old = NULL;
+    uint32_t old_len = 0;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+        read_fd(fd, sb.st_size, &old, &old_len) != 0) {
+        close(fd);
+        return atomic_write_local(path, data, len);
+    }
+
+    // Changed span: everything between the common prefix and suffix
+    size_t common = old_len < len ? old_len : len;
+    size_t pre = 0;
+    while (pre < common && old[pre] == data[pre])
+        pre++;
+    size_t suf = 0;
+    while (suf < common - pre && old[old_len - 1 - suf] == data[len - 1 - suf])
+        suf++;
+
+    // Same length patches blocks in place; otherwise the tail after pre moves
+    size_t starts[PATCH_MAX_RANGES], ends[PATCH_MAX_RANGES];
+    size_t n = 1;
+    starts[0] = pre;
+    ends[0] = len;
+    size_t cost = old_len == len
+        ? plan_blocks(old, data, pre, len - suf, starts, ends, &n)
+        : len - pre;
+    free(old);
+    if ((cost > len / 2 && cost > PATCH_BLOCK) ||
+        (cost && mark && set_mark(mark, path) != 0)) {
+        close(fd);
+        return atomic_write_local(path, data, len);
+    }
+
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; i++)
+        rc = write_range(fd, data, starts[i], ends[i] - starts[i]);
+    if (rc == 0 && len < old_len && ftruncate(fd, (off_t)len) != 0)
+        rc = -1;
+    // The mark may only go once the patch itself can't
+    if (rc == 0 && cost && mark && fdatasync(fd) != 0)
+        rc = -1;
+    if (close(fd) != 0)
+        rc = -1;
+    if (rc == 0 && cost && mark)
+        unlink(mark); // A failed patch keeps it, to be undone at the next start
+    return rc;
+}
+
+static int same_bytes(const uint8_t *a, uint32_t a_len,
+                      const uint8_t *b, uint32_t b_len) {
+    return a_len == b_len && (a_len == 0 || memcmp(a, b, a_len) == 0);
+}
+
+// Bring the file at `path` to remote, a version from the server, keeping
+// whatever was saved to it since base, the version it was last in step
+// with. A file that still holds base or already holds remote, or that is
+// gone, just takes remote. Otherwise the saved edits and the server's are
+// merged line by line, as the server merges a stale PUT, so the save is
+// not lost. The merge replaces the file whole: a torn patch is put back
+// to the base, which would lose the save after all. Returns 1 if the file
+// now holds more than remote and has to go up, 0 if it holds remote, -1
+// on error. `mark` is for patch_local
+int merge_local(const char *path, const uint8_t *base, uint32_t base_len,
+                const uint8_t *remote, uint32_t remote_len, const char *mark) {
+    uint8_t *local = NULL;
+    uint32_t local_len = 0;
+    if (access(path, F_OK) != 0 ||
+        read_file_into_buf(path, &local, &local_len) != 0 ||
+        same_bytes(local, local_len, base, base_len) ||
+        same_bytes(local, local_len, remote, remote_len)) {
+        free(local);
+        return patch_local(path, remote, remote_len, mark);
+    }
+
+    uint8_t *merged = NULL;
+    uint32_t merged_len = 0;
+    int conflicts = merge3(base, base_len, local, local_len, remote, remote_len,
+                           &merged, &merged_len);
+    free(local);
+    if (conflicts < 0)
+        return -1;
+    int rc = atomic_write_local(path, merged, merged_len);
+    free(merged);
+    return rc == 0 ? 1 : -1;
+}
@@ -1,8 +1,15 @@
 #define _GNU_SOURCE
 #include "socket_client.h"
-#include "file_watcher.h"
+#include "args.h"
 #include "rfs_file.h"
 #include "comm.h"
+#include "crdt.h"
+#include "delta.h"
+#include "hash.h"
+#include "lz.h"
+#include "merge.h"
+#include "merkle.h"
+#include "sync_state.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +21,8 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -22,6 +31,8 @@
 
 #define SERVER_HOST "raspberrypi.local" 
 #define SERVER_PORT_STR "9000"
+#define RECONNECT_MIN_MS 250     // First retry after losing the server
+#define RECONNECT_MAX_MS 30000   // Backoff doubles up to this
 
 static int connect_to_server(void) {
     struct addrinfo hints, *res = NULL, *rp = NULL;
@@ -70,28 +81,178 @@ static int connect_to_server(void) {
     return fd; // -1
 }
 
-// Connect to server
-// Send C_GET + Receives S_STATE (version + bytes)
-static void pull_from_server(struct args* a) {
-    int fd = connect_to_server();
-    if (fd < 0) return;
-
-    // Send C_GET
-    if (send_frame(fd, C_GET, NULL, 0) != 1) {
-        close(fd);
-        return;
-    }
+// Offer compression and tagged requests on a fresh connection; the reply
+// says what we got
+static int say_hello(struct args* a, int fd) {
+    uint32_t be_features = htonl(FEATURE_LZ | FEATURE_TAGS);
+    if (send_frame(fd, C_HELLO, (uint8_t*)&be_features, 4) != 1)
+        return -1;
 
-    // Receive S_STATE
     uint8_t  type;
     uint8_t* payload = NULL;
     uint32_t plen = 0;
+    if (recv_frame(fd, &type, NULL, &payload, &plen) != 1 ||
+        type != S_HELLO || plen != 4) {
+        frame_buf_free(payload);
+        return -1;
+    }
+
+    memcpy(&be_features, payload, 4);
+    a->compress = (ntohl(be_features) & FEATURE_LZ) != 0;
+    a->tags = (ntohl(be_features) & FEATURE_TAGS) != 0;
+    frame_buf_free(payload);
+    return 0;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    int r = recv_frame(fd, &type, &payload, &plen);
-    close(fd);
+// Wait twice as long after each failed attempt, plus up to a quarter
+// more so clients that lost the same server don't all return at once
+static void back_off(struct args* a) {
+    if (a->retry_ms == 0)
+        printf("[client] offline, queueing edits until the server is back\n");
+    a->retry_ms = a->retry_ms ? a->retry_ms * 2 : RECONNECT_MIN_MS;
+    if (a->retry_ms > RECONNECT_MAX_MS)
+        a->retry_ms = RECONNECT_MAX_MS;
+    int64_t now = now_ms();
+    uint32_t jitter = (uint32_t)(now ^ getpid()) % ((uint32_t)a->retry_ms / 4 + 1);
+    a->retry_at = now + a->retry_ms + jitter;
+}
+
+// Open the persistent connection if needed and subscribe to every
+// document on it. The first round on it reconciles our tree with the
+// server's; files get their doc_ids from that or from C_OPEN
+// While backing off this fails without trying, so saves just queue
+// Only the socket thread touches a->server_fd, so no locking
+static int ensure_connected(struct args* a) {
+    if (a->server_fd >= 0)
+        return a->server_fd;
+    if (a->retry_ms && now_ms() < a->retry_at)
+        return -1;
+
+    int fd = connect_to_server();
+    if (fd >= 0 && (say_hello(a, fd) != 0 ||
+                    send_frame(fd, C_SUBSCRIBE_ALL, NULL, 0) != 1)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        back_off(a);
+        return -1;
+    }
 
-    if (r <= 0 || type != S_STATE || plen < 12) {
-        free(payload);
+    a->server_fd = fd;
+    a->retry_ms = 0;
+    a->reconcile = 1;
+    printf("[client] connected\n");
+    return fd;
+}
+
+// Forget f's replica and the ops it hadn't sent. Its base still holds
+// what the server acknowledged, so the next join merges the edits again
+static void leave_collab(struct SyncFile* f) {
+    if (f->crdt) {
+        crdt_free(f->crdt);
+        free(f->crdt);
+        f->crdt = NULL;
+    }
+    free(f->inbox);
+    free(f->outbox);
+    f->inbox = f->outbox = NULL;
+    f->inbox_len = f->outbox_len = f->inbox_version = 0;
+    f->joining = f->sending = 0;
+}
+
+// Every doc_id died with the connection. The next one reconciles trees
+// instead of reopening every file, so only what changed meanwhile syncs
+// Replicas die with it too; files join again the next time they sync
+static void drop_connection(struct args* a) {
+    if (a->server_fd < 0)
+        return;
+    close(a->server_fd);
+    a->server_fd = -1;
+    a->reconcile = 1;
+
+    pthread_mutex_lock(&a->mu);
+    sync_forget_ids(&a->files);
+    for (struct SyncFile* f = a->files.all; f; f = f->all)
+        leave_collab(f);
+    pthread_mutex_unlock(&a->mu);
+    printf("[client] disconnected from server\n");
+}
+
+// Check the doc_id every server payload starts with and step past it
+// Returns 0 for frames about some other document
+static int strip_doc_id(const struct SyncFile* f, const uint8_t** payload,
+                        uint32_t* plen) {
+    if (*plen < 4)
+        return 0;
+    uint32_t be_id;
+    memcpy(&be_id, *payload, 4);
+    if (!f->opened || ntohl(be_id) != f->doc_id)
+        return 0;
+    *payload += 4;
+    *plen -= 4;
+    return 1;
+}
+
+// The file a server payload is about, or NULL
+static struct SyncFile* file_of(struct args* a, const uint8_t* payload,
+                                uint32_t plen) {
+    if (plen < 4)
+        return NULL;
+    uint32_t be_id;
+    memcpy(&be_id, payload, 4);
+    pthread_mutex_lock(&a->mu);
+    struct SyncFile* f = sync_file_by_id(&a->files, ntohl(be_id));
+    pthread_mutex_unlock(&a->mu);
+    return f;
+}
+
+// Remember the server's bytes at last_version as the base for the next delta
+// Takes ownership of data. Caller holds a->mu
+static void set_base_locked(struct SyncFile* f, uint8_t* data, uint32_t len) {
+    free(f->base);
+    f->base = data;
+    f->base_len = len;
+    f->base_hash = hash64(data, len);
+    f->has_base = 1;
+}
+
+// Write a version of f the server has into the file. Saves made since
+// mine, what the server already has from us, aren't acknowledged yet,
+// and a push or pull can land before they go up: during the watcher's
+// debounce, in a round's pull pass, or after an outage. They are merged
+// in rather than overwritten, and the result is queued to go up. Without
+// a base there is nothing to merge against, and the server's bytes win
+// Caller holds a->mu
+static int land_locked(struct args* a, struct SyncFile* f, uint32_t ver,
+                       const uint8_t* data, uint32_t n,
+                       const uint8_t* mine, uint32_t mine_len) {
+    int rc = mine ? merge_local(f->path, mine, mine_len, data, n, a->patch_mark)
+                  : patch_local(f->path, data, n, a->patch_mark);
+    if (rc == 1) {
+        sync_queue(&a->files, f, SYNC_PUSH);
+        printf("[client] merged local edits to %s into version %" PRIu32 "\n",
+               f->name, ver);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+// Apply an S_STATE/S_PUSH payload (doc_id + version + len + bytes) to the
+// local file. Pushes can overtake each other, so they only ever move the
+// version forward. sent is what a PUT this state answers carried, which
+// the server merged, or NULL to merge saves against our base
+static void apply_state(struct args* a, struct SyncFile* f,
+                        const uint8_t* payload, uint32_t plen, int only_newer,
+                        const uint8_t* sent, uint32_t sent_len) {
+    pthread_mutex_lock(&a->mu);
+    if (!strip_doc_id(f, &payload, &plen) || plen < 8) {
+        pthread_mutex_unlock(&a->mu);
         return;
     }
 
@@ -105,131 +266,1245 @@ static void pull_from_server(struct args* a) {
     uint32_t n = ntohl(be_n);
 
     if (8 + n != plen) {
-        // Malformed frame
-        free(payload);
-        return;
+        pthread_mutex_unlock(&a->mu);
+        return; // Malformed frame
     }
 
     const uint8_t* data = payload + 8; // content starts after version + len
 
-    // Compare with local version and if changed, apply
+    // Compare with local version and if changed, apply. A reply we asked
+    // for also counts when the version matches but the bytes don't, as
+    // after a restart of a server without -j, and for a file we only know
+    // from the server's listing. A new local file is left to be pushed
+    int apply;
+    if (only_newer)
+        apply = ver > f->last_version;
+    else if (f->has_base)
+        apply = ver != f->last_version || hash64(data, n) != f->base_hash;
+    else
+        apply = ver != f->last_version || access(f->path, F_OK) != 0;
+    const uint8_t* mine = sent;
+    uint32_t mine_len = sent_len;
+    if (!sent && (f->has_base || f->base)) {
+        mine = f->base_len ? f->base : (const uint8_t*)""; // Empty is a base too
+        mine_len = f->base_len;
+    }
+    if (apply && land_locked(a, f, ver, data, n, mine, mine_len) == 0) {
+        f->last_version = ver;
+        printf("[client] pulled %s version %" PRIu32 ", %u bytes\n",
+               f->name, ver, n);
+    }
+
+    if (ver == f->last_version) {
+        uint8_t* cpy = n ? malloc(n) : NULL;
+        if (!n || cpy) {
+            if (n) memcpy(cpy, data, n);
+            set_base_locked(f, cpy, n);
+        }
+    }
+
+    pthread_mutex_unlock(&a->mu);
+}
+
+// Apply an S_DELTA/S_PUSH_DELTA payload (doc_id, from, to, then len + delta
+// per step) on top of our base. Returns 0 if it doesn't start at our
+// version, in which case the caller has to ask for the state another way
+static int apply_delta_chain(struct args* a, struct SyncFile* f,
+                             const uint8_t* payload, uint32_t plen,
+                             int only_newer) {
+    pthread_mutex_lock(&a->mu);
+    if (!strip_doc_id(f, &payload, &plen) || plen < 8) {
+        pthread_mutex_unlock(&a->mu);
+        return 0;
+    }
+
+    uint32_t be_from, be_to;
+    memcpy(&be_from, payload, 4);
+    memcpy(&be_to, payload + 4, 4);
+    uint32_t from = ntohl(be_from), to = ntohl(be_to);
+
+    if (only_newer && to <= f->last_version) {
+        pthread_mutex_unlock(&a->mu);
+        return 1; // Old news
+    }
+    if (!f->has_base || from != f->last_version) {
+        pthread_mutex_unlock(&a->mu);
+        return 0;
+    }
+
+    // Walk the steps; cur stays NULL until the first one lands
+    uint8_t* cur = NULL;
+    uint32_t cur_len = 0;
+    uint32_t off = 8;
+    for (uint32_t v = from; v < to; v++) {
+        uint32_t be_n;
+        if (plen - off < 4) goto bad;
+        memcpy(&be_n, payload + off, 4);
+        uint32_t n = ntohl(be_n);
+        off += 4;
+        if (n > plen - off) goto bad;
+
+        uint8_t* next = NULL;
+        uint32_t next_len = 0;
+        int rc = delta_apply(cur ? cur : f->base, cur ? cur_len : f->base_len,
+                             payload + off, n, &next, &next_len);
+        free(cur);
+        cur = NULL;
+        if (rc != 0) goto bad;
+        cur = next;
+        cur_len = next_len;
+        off += n;
+    }
+    if (off != plen) goto bad;
+
+    if (to != from) {
+        const uint8_t* mine = f->base_len ? f->base : (const uint8_t*)"";
+        if (land_locked(a, f, to, cur, cur_len, mine, f->base_len) != 0)
+            goto bad;
+        f->last_version = to;
+        set_base_locked(f, cur, cur_len);
+        printf("[client] pulled %s version %" PRIu32 ", %u bytes "
+               "(%u on the wire)\n", f->name, to, cur_len, plen + 4);
+    }
+
+    pthread_mutex_unlock(&a->mu);
+    return 1;
+
+bad:
+    free(cur);
+    pthread_mutex_unlock(&a->mu);
+    return 0;
+}
+
+// --- Collaborative editing --------------------------------------------------
+//
+// With -c, a file joins the document's CRDT the first time it syncs on a
+// connection. Saves then become ops on our replica: the span between the
+// common prefix and suffix of the replica's text and the file. Ops from
+// other replicas merge into ours in any order, and the text is patched
+// into the file. No version ever conflicts, so nothing is merged by lines
+
+static int ops_append(uint8_t** buf, uint32_t* len, const uint8_t* ops,
+                      uint32_t n) {
+    if (n == 0)
+        return 0;
+    if (n > UINT32_MAX - *len)
+        return -1;
+    uint8_t* b = realloc(*buf, (size_t)*len + n);
+    if (!b)
+        return -1;
+    memcpy(b + *len, ops, n);
+    *buf = b;
+    *len += n;
+    return 0;
+}
+
+// Whether the file holds what the replica does, so nothing saved still
+// has to become ops. A file that is gone holds nothing worth keeping
+static int local_matches(const struct SyncFile* f) {
+    uint8_t *local = NULL, *text = NULL;
+    uint32_t local_len = 0, text_len = 0;
+    int same = read_file_into_buf(f->path, &local, &local_len) != 0 ||
+               (crdt_text(f->crdt, &text, &text_len) == 0 &&
+                text_len == local_len && memcmp(text, local, text_len) == 0);
+    free(local);
+    free(text);
+    return same;
+}
+
+// Turn what was saved since the replica last matched the file into ops
+// waiting in the outbox. A file that is gone has nothing to add
+static int capture_local(struct SyncFile* f) {
+    uint8_t* local = NULL;
+    uint32_t local_len = 0;
+    if (read_file_into_buf(f->path, &local, &local_len) != 0) {
+        free(local);
+        return 0;
+    }
+    uint8_t* ops = NULL;
+    uint32_t ops_len = 0;
+    int rc = crdt_diff(f->crdt, f->site, local, local_len, &ops, &ops_len);
+    if (rc == 0)
+        rc = ops_append(&f->outbox, &f->outbox_len, ops, ops_len);
+    free(ops);
+    free(local);
+    return rc;
+}
+
+// Apply the held ops and patch the replica's text into the file. It is
+// the server's content too once none of our ops are unacknowledged, so
+// then it becomes the base
+static int take_inbox(struct args* a, struct SyncFile* f) {
+    if (!f->inbox_len)
+        return 0;
+    int rc = crdt_apply(f->crdt, f->inbox, f->inbox_len);
+    free(f->inbox);
+    f->inbox = NULL;
+    f->inbox_len = 0;
+    uint8_t* text = NULL;
+    uint32_t len = 0;
+    if (rc != 0 || crdt_text(f->crdt, &text, &len) != 0)
+        return -1;
+
+    // With ops still unacknowledged the file holds more than its base, so
+    // it is replaced whole; sync_state_load undoes a torn patch to the base
     pthread_mutex_lock(&a->mu);
+    rc = f->outbox_len || f->sending
+        ? atomic_write_local(f->path, text, len)
+        : patch_local(f->path, text, len, a->patch_mark);
+    if (rc == 0 && !f->outbox_len && !f->sending) {
+        set_base_locked(f, text, len);
+        if (f->inbox_version > f->last_version)
+            f->last_version = f->inbox_version;
+        text = NULL;
+    }
+    pthread_mutex_unlock(&a->mu);
+    free(text);
+    return rc;
+}
 
-    if (ver != a->last_version) {
-        a->suppress_next = 1;
+// S_CRDT_OPS: ops from another replica. They are held while the file is
+// joining, and while it differs from the replica: a save, or one being
+// written, whose watcher event is on its way. send_ops turns that save
+// into ops before these go in, so they merge rather than overwrite it.
+// A replica that fails us is left; the file joins again, merging from
+// its base
+static void apply_remote_ops(struct args* a, struct SyncFile* f,
+                             const uint8_t* payload, uint32_t plen) {
+    pthread_mutex_lock(&a->mu);
+    int ours = strip_doc_id(f, &payload, &plen);
+    pthread_mutex_unlock(&a->mu);
+    if (!ours || plen < 8)
+        return;
+    uint32_t be[2];
+    memcpy(be, payload, 8);
+    uint32_t ver = ntohl(be[0]), n = ntohl(be[1]);
+    if (8 + n != plen || (!f->joining && !f->crdt))
+        return; // Not collaborating on it any more
 
-        if (atomic_write_local(a->file_path, data, n) == 0) {
-            a->last_version = ver;
-            printf("[client] pulled version %" PRIu32 ", %u bytes\n", ver, n);
+    int rc = ops_append(&f->inbox, &f->inbox_len, payload + 8, n);
+    if (ver > f->inbox_version)
+        f->inbox_version = ver;
+    if (rc == 0 && f->crdt && local_matches(f))
+        rc = take_inbox(a, f);
+    if (rc != 0) {
+        pthread_mutex_lock(&a->mu);
+        leave_collab(f);
+        sync_queue(&a->files, f, SYNC_PUSH);
+        pthread_mutex_unlock(&a->mu);
+    }
+}
+
+// A pushed delta we can't apply means we missed a version; the next
+// round catches the file up from its own version. A doc_id we don't know
+// yet is a file that changed since we connected, maybe a new one; the
+// next round reconciles to find out which. Files we collaborate on go by
+// the ops alone
+static void apply_push(struct args* a, uint8_t type, const uint8_t* payload,
+                       uint32_t plen) {
+    struct SyncFile* f = file_of(a, payload, plen);
+    if (!f) {
+        a->reconcile = 1;
+        return;
+    }
+    if (type == S_CRDT_OPS) {
+        apply_remote_ops(a, f, payload, plen);
+    } else if (f->crdt || f->joining) {
+        return;
+    } else if (type == S_PUSH) {
+        apply_state(a, f, payload, plen, 1, NULL, 0);
+    } else if (!apply_delta_chain(a, f, payload, plen, 1)) {
+        pthread_mutex_lock(&a->mu);
+        sync_queue(&a->files, f, SYNC_PULL);
+        pthread_mutex_unlock(&a->mu);
+    }
+}
+
+// Read frames until the reply to one of our requests arrives
+// The server may interleave pushes for other clients' edits; apply those
+static int recv_reply(struct args* a, uint8_t* type, uint32_t* tag,
+                      uint8_t** payload, uint32_t* plen) {
+    for (;;) {
+        *payload = NULL;
+        int r = recv_message(a->server_fd, type, tag, payload, plen);
+        if (r <= 0) {
+            frame_buf_free(*payload);
+            drop_connection(a);
+            return -1;
         }
+        if (*type == S_PUSH || *type == S_PUSH_DELTA || *type == S_CRDT_OPS)
+            apply_push(a, *type, *payload, *plen);
+        else
+            return 1;
+        frame_buf_free(*payload);
+    }
+}
+
+// S_NOT_MODIFIED: what we hashed is the head, so just take its version
+// Without a base, the local file we hashed becomes it
+static void apply_not_modified(struct args* a, struct SyncFile* f,
+                               const uint8_t* payload, uint32_t plen,
+                               uint8_t* local, uint32_t local_len) {
+    pthread_mutex_lock(&a->mu);
+    if (!strip_doc_id(f, &payload, &plen) || plen != 4) {
+        pthread_mutex_unlock(&a->mu);
+        free(local);
+        return;
+    }
+
+    uint32_t be_ver;
+    memcpy(&be_ver, payload, 4);
+    uint32_t ver = ntohl(be_ver);
+
+    if (ver >= f->last_version || !f->has_base) { // A push may have overtaken it
+        if (!f->has_base && local) {
+            set_base_locked(f, local, local_len);
+            local = NULL;
+        }
+        f->last_version = ver;
+    }
+    pthread_mutex_unlock(&a->mu);
+    free(local);
+}
+
+// --- Pipelined sync rounds --------------------------------------------------
+//
+// A round sends every request it can before reading replies, so a batch
+// of files costs a few round trips rather than a few per file. Requests
+// carry tags when the server agreed to them, and replies are matched by
+// tag, so it may answer in any order; otherwise it answers in order and
+// replies are matched by position.
+// In-flight requests are capped in number and bytes: a blocking server
+// thread stops reading while it writes a reply, so we must not be stuck
+// writing a large request at the same time
+
+#define PIPELINE_MAX 64              // Requests in flight
+#define PIPELINE_BYTES (256u << 10)  // Request bytes in flight, past the first
+
+// A request whose reply hasn't arrived yet
+struct Pending {
+    struct SyncFile* f;
+    uint8_t type;            // What we sent
+    uint8_t* data;           // C_PUT*: the content; C_GET: local copy hashed;
+                             // C_TREE: the directory's path
+    uint32_t len;
+    uint32_t base_ver;       // C_PUT*: version the content is based on
+    struct MerkleNode* dir;  // C_TREE: our copy of the directory, or NULL
+    size_t wire;             // Request bytes
+    uint32_t tag;            // 0 on an untagged connection
+};
+
+// Directories reconcile still has to ask about
+struct TreeWalk {
+    char** paths;
+    struct MerkleNode** dirs;
+    size_t n, cap;
+};
+
+struct Pipeline {
+    struct Pending q[PIPELINE_MAX];
+    int head, n;
+    size_t bytes;
+    struct TreeWalk* walk;   // Reconciling: where S_TREE adds subdirectories
+};
+
+static void pipeline_add(struct Pipeline* pl, struct Pending p) {
+    pl->q[(pl->head + pl->n++) % PIPELINE_MAX] = p;
+    pl->bytes += p.wire;
+}
+
+// Tag for the next request, or 0 if the server doesn't take tags
+static uint32_t next_tag(struct args* a) {
+    if (!a->tags)
+        return 0;
+    if (++a->last_tag == 0)
+        a->last_tag = 1;
+    return a->last_tag;
+}
+
+static int send_request(struct args* a, uint8_t type, uint32_t tag,
+                        const void* payload, uint32_t plen) {
+    struct iovec iov = { (void*)payload, plen };
+    return send_framev(a->server_fd, type, tag, &iov, 1);
+}
+
+// Forget what was in flight; the connection is gone
+static void pipeline_abort(struct Pipeline* pl) {
+    for (; pl->n; pl->n--, pl->head = (pl->head + 1) % PIPELINE_MAX)
+        free(pl->q[pl->head].data);
+    pl->bytes = 0;
+}
+
+// Send doc_id + base version + optional length + body as one
+// C_PUT/C_PUT_DELTA, gathered straight from the caller's buffer
+static int send_put(struct args* a, struct SyncFile* f, uint8_t type,
+                    uint32_t tag, uint32_t base_ver,
+                    const uint8_t* body, uint32_t len) {
+    uint32_t hdr_len = type == C_PUT ? 12 : 8; // C_PUT also carries a length
+    uint32_t hdr[3] = { htonl(f->doc_id), htonl(base_ver), htonl(len) };
+    struct iovec iov[2] = {
+        { hdr, hdr_len },
+        { (void*)body, len },
+    };
+
+    // Compressing needs the payload in one piece; skip it if that fails
+    int iovcnt = 2;
+    uint8_t *raw = NULL, *z = NULL;
+    uint32_t zlen = 0;
+    if (a->compress && len >= LZ_MIN_INPUT &&
+        (raw = frame_buf_alloc(hdr_len + len))) {
+        memcpy(raw, hdr, hdr_len);
+        memcpy(raw + hdr_len, body, len);
+        if (lz_pack(raw, hdr_len + len, &z, &zlen) == 0) {
+            iov[0] = (struct iovec){ z, zlen };
+            iovcnt = 1;
+            type |= FRAME_COMPRESSED;
+        }
+        frame_buf_free(raw);
+    }
+
+    int ok = send_bodyv(a->server_fd, type, tag, iov, iovcnt);
+    free(z);
+    if (ok != 1)
+        drop_connection(a);
+    return ok;
+}
+
+// S_OPENED: the file has a doc_id on this connection now, and
+// C_SUBSCRIBE_ALL already covers it. Have a file we never synced pulled
+// first
+static int finish_open(struct args* a, struct Pending* p, uint8_t type,
+                       const uint8_t* payload, uint32_t plen) {
+    if (type != S_OPENED || plen != 8) {
+        fprintf(stderr, "[client] server refused to open %s\n", p->f->name);
+        return -1;
+    }
+    uint32_t be_id;
+    memcpy(&be_id, payload, 4);
+
+    pthread_mutex_lock(&a->mu);
+    int rc = sync_file_set_id(&a->files, p->f, ntohl(be_id));
+    if (!p->f->has_base)
+        p->f->todo |= SYNC_PULL;
+    pthread_mutex_unlock(&a->mu);
+    return rc == 0 ? 1 : -1;
+}
+
+// S_DELTA, S_STATE or S_NOT_MODIFIED for a pull
+static int finish_pull(struct args* a, struct Pending* p, uint8_t type,
+                       const uint8_t* payload, uint32_t plen) {
+    if (type == S_NOT_MODIFIED) {
+        apply_not_modified(a, p->f, payload, plen, p->data, p->len);
+        p->data = NULL;
+    } else if (type == S_STATE) {
+        apply_state(a, p->f, payload, plen, 0, NULL, 0);
+    } else if (type == S_DELTA) {
+        if (!apply_delta_chain(a, p->f, payload, plen, 0)) {
+            // Our base no longer lines up; take the full state. Its bytes
+            // stay, as the ancestor to merge saves made since against
+            pthread_mutex_lock(&a->mu);
+            p->f->has_base = 0;
+            sync_queue(&a->files, p->f, SYNC_PULL);
+            pthread_mutex_unlock(&a->mu);
+        }
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+// S_OK(new_version) makes what we sent the base, S_NACK means the delta
+// base went stale so the content goes again in full, and S_STATE carries
+// the merged result if our base was stale
+static int finish_push(struct args* a, struct Pipeline* pl, struct Pending* p,
+                       uint8_t type, const uint8_t* payload, uint32_t plen) {
+    struct SyncFile* f = p->f;
+    if (type == S_OK && plen == 8) {
+        uint32_t be_new;
+        memcpy(&be_new, payload + 4, 4);
+        uint32_t new_ver = ntohl(be_new);
+
+        pthread_mutex_lock(&a->mu);
+        f->last_version = new_ver;
+        set_base_locked(f, p->data, p->len); // Server now holds exactly our bytes
+        p->data = NULL;
+        pthread_mutex_unlock(&a->mu);
+
+        printf("[client] pushed %s version %" PRIu32 ", %u bytes "
+               "(%zu on the wire)\n", f->name, new_ver, p->len, p->wire);
+    } else if (type == S_NACK && p->type == C_PUT_DELTA) {
+        uint32_t tag = next_tag(a);
+        if (send_put(a, f, C_PUT, tag, p->base_ver, p->data, p->len) != 1)
+            return -1;
+        struct Pending full = *p;
+        full.type = C_PUT;
+        full.tag = tag;
+        full.wire = p->len;
+        p->data = NULL;
+        pipeline_add(pl, full);
+    } else if (type == S_STATE) {
+        printf("[client] push of %s conflicted, applying merged result\n",
+               f->name);
+        apply_state(a, f, payload, plen, 0,
+                    p->data ? p->data : (const uint8_t*)"", p->len);
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+static int finish_tree(struct args* a, struct Pipeline* pl, struct Pending* p,
+                       uint8_t type, const uint8_t* payload, uint32_t plen);
+static int finish_join(struct args* a, struct Pending* p, uint8_t type,
+                       const uint8_t* payload, uint32_t plen);
+static int finish_ops(struct args* a, struct Pending* p, uint8_t type,
+                      const uint8_t* payload, uint32_t plen);
+
+// Take the next reply: to the request with its tag, or without tags, to
+// the oldest request in flight
+static int complete_one(struct args* a, struct Pipeline* pl) {
+    uint8_t  type;
+    uint32_t tag = 0;
+    uint8_t* payload = NULL;
+    uint32_t plen = 0;
+    if (recv_reply(a, &type, &tag, &payload, &plen) != 1) {
+        pipeline_abort(pl);
+        return -1;
+    }
+
+    // Swap the tagged request to the head; the rest keep no order
+    int i = 0;
+    while (i < pl->n && pl->q[(pl->head + i) % PIPELINE_MAX].tag != tag)
+        i++;
+    if (i == pl->n) {
+        frame_buf_free(payload);
+        pipeline_abort(pl);
+        drop_connection(a); // A reply to nothing we asked
+        return -1;
+    }
+    struct Pending p = pl->q[(pl->head + i) % PIPELINE_MAX];
+    pl->q[(pl->head + i) % PIPELINE_MAX] = pl->q[pl->head];
+    pl->head = (pl->head + 1) % PIPELINE_MAX;
+    pl->n--;
+    pl->bytes -= p.wire;
+
+    int ok;
+    if (p.type == C_OPEN)
+        ok = finish_open(a, &p, type, payload, plen);
+    else if (p.type == C_PUT || p.type == C_PUT_DELTA)
+        ok = finish_push(a, pl, &p, type, payload, plen);
+    else if (p.type == C_TREE)
+        ok = finish_tree(a, pl, &p, type, payload, plen);
+    else if (p.type == C_CRDT_JOIN)
+        ok = finish_join(a, &p, type, payload, plen);
+    else if (p.type == C_CRDT_OPS)
+        ok = finish_ops(a, &p, type, payload, plen);
+    else
+        ok = finish_pull(a, &p, type, payload, plen);
+    frame_buf_free(payload);
+    free(p.data);
+
+    if (ok != 1) {
+        pipeline_abort(pl);
+        drop_connection(a); // Out of step with the server
     }
+    return ok;
+}
+
+// Wait until a request of 'wire' bytes may go out
+static int pipeline_room(struct args* a, struct Pipeline* pl, size_t wire) {
+    while (pl->n == PIPELINE_MAX ||
+           (pl->n && pl->bytes + wire > PIPELINE_BYTES))
+        if (complete_one(a, pl) != 1)
+            return -1;
+    return 1;
+}
+
+static int pipeline_drain(struct args* a, struct Pipeline* pl) {
+    while (pl->n)
+        if (complete_one(a, pl) != 1)
+            return -1;
+    return 1;
+}
 
+// C_OPEN by name; finish_open subscribes once the id is back
+static int send_open(struct args* a, struct Pipeline* pl, struct SyncFile* f) {
+    uint32_t len = (uint32_t)strlen(f->name);
+    if (pipeline_room(a, pl, len) != 1)
+        return -1;
+    uint32_t tag = next_tag(a);
+    if (send_request(a, C_OPEN, tag, f->name, len) != 1) {
+        drop_connection(a);
+        return -1;
+    }
+    pipeline_add(pl, (struct Pending){
+        .f = f, .type = C_OPEN, .wire = len, .tag = tag,
+    });
+    return 1;
+}
+
+// Ask for the head of f
+// With a base, send C_GET_SINCE(last_version, hash of base) and receive
+// S_DELTA, or S_STATE if our version aged out. Without one, C_GET with the
+// hash of the local file, if any -> S_STATE. Either way a matching hash
+// gets S_NOT_MODIFIED, so nothing we already have is downloaded again
+static int send_pull(struct args* a, struct Pipeline* pl, struct SyncFile* f) {
+    pthread_mutex_lock(&a->mu);
+    int has_base = f->has_base;
+    uint32_t last_version = f->last_version;
+    uint64_t hash = f->base_hash;
     pthread_mutex_unlock(&a->mu);
-    free(payload);
+
+    // No base yet: the file on disk may well be what the server has
+    uint8_t* local = NULL;
+    uint32_t local_len = 0;
+    if (!has_base && read_file_into_buf(f->path, &local, &local_len) == 0)
+        hash = hash64(local, local_len);
+
+    uint32_t req[4] = {
+        htonl(f->doc_id), htonl(last_version),
+        htonl((uint32_t)(hash >> 32)), htonl((uint32_t)hash),
+    };
+    uint8_t type = C_GET_SINCE;
+    uint32_t len = 16;
+    if (!has_base) {
+        type = C_GET;
+        req[1] = req[2];
+        req[2] = req[3];
+        len = local ? 12 : 4;
+    }
+
+    if (pipeline_room(a, pl, len) != 1) {
+        free(local);
+        return -1;
+    }
+    uint32_t tag = next_tag(a);
+    if (send_request(a, type, tag, req, len) != 1) {
+        free(local);
+        drop_connection(a);
+        return -1;
+    }
+    pipeline_add(pl, (struct Pending){
+        .f = f, .type = type, .data = local, .len = local_len, .wire = len,
+        .tag = tag,
+    });
+    return 1;
 }
 
-// Read entire local file into memory
-// Send C_PUT -> Receive S_ON(new_version) and update last_version
-static void push_to_server(struct args* a) {
+// Send C_PUT_DELTA against the last synced version when that is smaller,
+// else C_PUT. Files that hold exactly what the server has (saves that
+// changed nothing, and our own patches of pulled versions, which fire the
+// watcher too) send nothing
+static int send_push(struct args* a, struct Pipeline* pl, struct SyncFile* f) {
     uint8_t* data = NULL;
     uint32_t len = 0;
     // Read the current local file into memory
-    if (read_file_into_buf(a->file_path, &data, &len) != 0) {
+    if (read_file_into_buf(f->path, &data, &len) != 0) {
         free(data);
-        return;
+        return 1; // Gone again; nothing to push
+    }
+    if (len > MAX_BODY - 12) {
+        fprintf(stderr, "[client] %s is too large to sync\n", f->path);
+        free(data);
+        return 1;
     }
 
+    uint64_t hash = hash64(data, len);
     pthread_mutex_lock(&a->mu);
-    if (a->suppress_next) {
-        // Ignore
-        a->suppress_next = 0;
+    if (f->has_base && len == f->base_len && hash == f->base_hash) {
         pthread_mutex_unlock(&a->mu);
         free(data);
-        return;
+        return 1;
     }
 
-    uint32_t base_ver = a->last_version;
+    uint32_t base_ver = f->last_version;
+
+    // Block-match against what the server had at base_ver
+    uint8_t* delta = NULL;
+    uint32_t delta_len = 0;
+    if (f->has_base &&
+        delta_encode(f->base, f->base_len, data, len, &delta, &delta_len) == 0 &&
+        delta_len >= len) {
+        free(delta); // No savings, e.g. a rewritten file
+        delta = NULL;
+    }
     pthread_mutex_unlock(&a->mu);
 
-    // Open TCP connection
-    int fd = connect_to_server();
-    if (fd < 0) {
+    uint8_t type = delta ? C_PUT_DELTA : C_PUT;
+    size_t wire = delta ? delta_len : len;
+    uint32_t tag = 0;
+    int ok = pipeline_room(a, pl, wire);
+    if (ok == 1) {
+        tag = next_tag(a);
+        ok = delta ? send_put(a, f, type, tag, base_ver, delta, delta_len)
+                   : send_put(a, f, type, tag, base_ver, data, len);
+    }
+    free(delta);
+    if (ok != 1) {
         free(data);
-        return;
+        return -1;
     }
+    pipeline_add(pl, (struct Pending){
+        .f = f, .type = type, .data = data, .len = len,
+        .base_ver = base_ver, .wire = wire, .tag = tag,
+    });
+    return 1;
+}
 
-    uint8_t* buf = malloc(8 + len);
-    if (!buf) {
-        free(data);
-        close(fd); 
-        return; 
+// C_CRDT_JOIN for a file we collaborate on; pushed ops wait until the
+// replica is here
+static int send_join(struct args* a, struct Pipeline* pl, struct SyncFile* f) {
+    if (pipeline_room(a, pl, 4) != 1)
+        return -1;
+    uint32_t be_id = htonl(f->doc_id);
+    uint32_t tag = next_tag(a);
+    if (send_request(a, C_CRDT_JOIN, tag, &be_id, 4) != 1) {
+        drop_connection(a);
+        return -1;
     }
+    f->joining = 1;
+    pipeline_add(pl, (struct Pending){
+        .f = f, .type = C_CRDT_JOIN, .wire = 4, .tag = tag,
+    });
+    return 1;
+}
 
-    uint32_t be_base = htonl(base_ver);
-    uint32_t be_n = htonl(len);
+// S_CRDT_STATE: our replica and site. Ops pushed meanwhile go on top; any
+// the state already holds are repeats. Edits made since the base merge
+// with the state as the server merges a stale PUT, and go up as our first
+// ops. A file never synced before keeps its bytes
+static int finish_join(struct args* a, struct Pending* p, uint8_t type,
+                       const uint8_t* payload, uint32_t plen) {
+    struct SyncFile* f = p->f;
+    pthread_mutex_lock(&a->mu);
+    int ours = strip_doc_id(f, &payload, &plen);
+    pthread_mutex_unlock(&a->mu);
+    if (type != S_CRDT_STATE || !ours || plen < 12)
+        return -1;
+    uint32_t be[3];
+    memcpy(be, payload, 12);
+    uint32_t ver = ntohl(be[0]), n = ntohl(be[1]);
+    if (8 + n != plen)
+        return -1;
+    if (!f->joining)
+        return 1; // Left while joining; the file is queued to join again
 
-    memcpy(buf, &be_base, 4);
-    memcpy(buf + 4, &be_n, 4);
-    memcpy(buf + 8, data, len);
+    f->joining = 0;
+    f->crdt = malloc(sizeof(*f->crdt));
+    if (!f->crdt || crdt_decode(f->crdt, payload + 12, n - 4) != 0) {
+        free(f->crdt);
+        f->crdt = NULL;
+        return -1;
+    }
+    f->site = ntohl(be[2]);
+    int rc = f->inbox_len ? crdt_apply(f->crdt, f->inbox, f->inbox_len) : 0;
+    free(f->inbox);
+    f->inbox = NULL;
+    f->inbox_len = f->inbox_version = 0;
 
-    // Send frame
-    if (send_frame(fd, C_PUT, buf, 8 + len) != 1) {
-        free(data);
-        free(buf);
-        close(fd); 
-        return;
+    uint8_t *text = NULL, *local = NULL, *merged = NULL;
+    uint32_t text_len = 0, local_len = 0, merged_len = 0;
+    if (rc != 0 || crdt_text(f->crdt, &text, &text_len) != 0)
+        return -1;
+    int have_local = read_file_into_buf(f->path, &local, &local_len) == 0;
+
+    pthread_mutex_lock(&a->mu);
+    const uint8_t* want = text;
+    uint32_t want_len = text_len;
+    if (have_local && !f->has_base) {
+        want = local;
+        want_len = local_len;
+    } else if (have_local && hash64(local, local_len) != f->base_hash) {
+        if (merge3(f->base, f->base_len, local, local_len, text, text_len,
+                   &merged, &merged_len) < 0)
+            rc = -1;
+        want = merged;
+        want_len = merged_len;
     }
-    free(buf);
+    if (rc == 0)
+        rc = want == merged ? atomic_write_local(f->path, want, want_len)
+                            : patch_local(f->path, want, want_len, a->patch_mark);
+    if (rc == 0) {
+        f->last_version = ver;
+        printf("[client] joined %s version %" PRIu32 "\n", f->name, ver);
+    }
+    pthread_mutex_unlock(&a->mu);
 
-    // Read S_OK or error from server 
-    uint8_t type; 
-    uint8_t* payload = NULL; 
-    uint32_t plen = 0;
+    // What we keep beyond the state goes up as ops
+    uint8_t* ops = NULL;
+    uint32_t ops_len = 0;
+    if (rc == 0 && want != text &&
+        (rc = crdt_diff(f->crdt, f->site, want, want_len, &ops, &ops_len)) == 0)
+        rc = ops_append(&f->outbox, &f->outbox_len, ops, ops_len);
+    free(ops);
+    free(local);
+    free(merged);
+
+    pthread_mutex_lock(&a->mu);
+    if (rc == 0)
+        set_base_locked(f, text, text_len);
+    else
+        free(text);
+    if (f->outbox_len)
+        f->todo |= SYNC_PUSH;
+    pthread_mutex_unlock(&a->mu);
+    return rc == 0 ? 1 : -1;
+}
 
-    int r = recv_frame(fd, &type, &payload, &plen);
-    close(fd);
+// Diff the saved file into the replica, merge the ops held back for it,
+// and send every op not sent yet
+static int send_ops(struct args* a, struct Pipeline* pl, struct SyncFile* f) {
+    if (capture_local(f) != 0 || take_inbox(a, f) != 0) {
+        pthread_mutex_lock(&a->mu);
+        leave_collab(f);
+        sync_queue(&a->files, f, SYNC_PUSH);
+        pthread_mutex_unlock(&a->mu);
+        return 1;
+    }
+    if (!f->outbox_len)
+        return 1; // A save that changed nothing, or our own patch
 
-    if (r <= 0) {
-        free(data);
-        free(payload);
+    // Waiting may apply pushed ops, which can add to the outbox
+    if (pipeline_room(a, pl, 4 + (size_t)f->outbox_len) != 1)
+        return -1;
+    uint32_t be_id = htonl(f->doc_id);
+    struct iovec iov[2] = {
+        { &be_id, 4 },
+        { f->outbox, f->outbox_len },
+    };
+    uint32_t tag = next_tag(a);
+    if (send_bodyv(a->server_fd, C_CRDT_OPS, tag, iov, 2) != 1) {
+        drop_connection(a);
+        return -1;
+    }
+    pipeline_add(pl, (struct Pending){
+        .f = f, .type = C_CRDT_OPS, .data = f->outbox, .len = f->outbox_len,
+        .wire = 4 + (size_t)f->outbox_len, .tag = tag,
+    });
+    f->outbox = NULL;
+    f->outbox_len = 0;
+    f->sending = 1;
+    return 1;
+}
+
+// S_OK for our ops. With nothing else to send, the server holds what our
+// replica does
+static int finish_ops(struct args* a, struct Pending* p, uint8_t type,
+                      const uint8_t* payload, uint32_t plen) {
+    struct SyncFile* f = p->f;
+    if (type != S_OK || plen != 8)
+        return -1;
+    uint32_t be_ver;
+    memcpy(&be_ver, payload + 4, 4);
+    uint32_t ver = ntohl(be_ver);
+
+    f->sending = 0;
+    uint8_t* text = NULL;
+    uint32_t len = 0;
+    if (f->crdt && !f->outbox_len && crdt_text(f->crdt, &text, &len) != 0)
+        return -1;
+    pthread_mutex_lock(&a->mu);
+    if (ver > f->last_version)
+        f->last_version = ver;
+    if (text)
+        set_base_locked(f, text, len);
+    pthread_mutex_unlock(&a->mu);
+
+    printf("[client] pushed %s version %" PRIu32 ", %u bytes of ops\n",
+           f->name, ver, p->len);
+    return 1;
+}
+
+// Whether the file on disk holds exactly its base. At a warm start every
+// file is queued, and reconciling gave doc_ids only to those that changed
+// on the server; the rest only need opening if they changed here
+static int local_is_base(struct args* a, struct SyncFile* f) {
+    pthread_mutex_lock(&a->mu);
+    int has_base = f->has_base;
+    uint32_t base_len = f->base_len;
+    uint64_t base_hash = f->base_hash;
+    pthread_mutex_unlock(&a->mu);
+
+    struct stat st;
+    if (!has_base || stat(f->path, &st) != 0 || st.st_size != (off_t)base_len)
+        return 0;
+    uint8_t* local = NULL;
+    uint32_t len = 0;
+    int same = read_file_into_buf(f->path, &local, &len) == 0 &&
+               len == base_len && hash64(local, len) == base_hash;
+    free(local);
+    return same;
+}
+
+// One round over the queued files, in pipelined passes: open what this
+// connection hasn't seen, join the documents we collaborate on, pull what
+// may be behind, then push local changes against the bases the pulls left
+// Joined files skip the pull, the ops keep them current
+static int sync_batch(struct args* a, struct SyncFile** files, size_t n) {
+    struct Pipeline pl = { 0 };
+    int ok = 1;
+
+    for (size_t i = 0; i < n && ok == 1; i++) {
+        pthread_mutex_lock(&a->mu);
+        int opened = files[i]->opened;
+        pthread_mutex_unlock(&a->mu);
+        if (opened)
+            continue;
+        if (files[i]->todo == SYNC_PUSH && local_is_base(a, files[i]))
+            files[i]->todo = 0;
+        else
+            ok = send_open(a, &pl, files[i]);
+    }
+    if (ok == 1)
+        ok = pipeline_drain(a, &pl);
+
+    for (size_t i = 0; i < n && ok == 1 && a->collab; i++)
+        if (files[i]->opened && !files[i]->crdt && !files[i]->joining)
+            ok = send_join(a, &pl, files[i]);
+    if (ok == 1)
+        ok = pipeline_drain(a, &pl);
+
+    for (size_t i = 0; i < n && ok == 1; i++)
+        if ((files[i]->todo & SYNC_PULL) && !files[i]->crdt)
+            ok = send_pull(a, &pl, files[i]);
+    if (ok == 1)
+        ok = pipeline_drain(a, &pl);
+
+    for (size_t i = 0; i < n && ok == 1; i++)
+        if (files[i]->todo & SYNC_PUSH)
+            ok = files[i]->crdt ? send_ops(a, &pl, files[i])
+                                : send_push(a, &pl, files[i]);
+    if (ok == 1)
+        ok = pipeline_drain(a, &pl);
+
+    pipeline_abort(&pl); // Only non-empty after an error
+    return ok;
+}
+
+// --- Reconciliation --------------------------------------------------------
+//
+// On a new connection, compare a Merkle tree of our bases with the
+// server's head tree one directory level at a time, descending only where
+// the hashes differ. Files that differ are queued for a pull, files the
+// server lacks for a push, and files we have never seen are added and
+// pulled. An unchanged tree costs one C_TREE and an 8-byte S_TREE; a
+// changed file costs one listing per directory above it
+
+static uint64_t get_u64(const uint8_t* p) {
+    uint32_t be[2];
+    memcpy(be, p, 8);
+    return (uint64_t)ntohl(be[0]) << 32 | ntohl(be[1]);
+}
+
+// Queue a directory to ask about. Takes path, even on failure
+static int walk_add(struct TreeWalk* w, char* path, struct MerkleNode* dir) {
+    if (w->n == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 16;
+        char** paths = realloc(w->paths, cap * sizeof(*paths));
+        if (paths)
+            w->paths = paths;
+        struct MerkleNode** dirs = paths ? realloc(w->dirs, cap * sizeof(*dirs))
+                                         : NULL;
+        if (!dirs) {
+            free(path);
+            return -1;
+        }
+        w->dirs = dirs;
+        w->cap = cap;
+    }
+    w->paths[w->n] = path;
+    w->dirs[w->n++] = dir;
+    return 0;
+}
+
+// Every file we hold a base for, hashed the way the server hashes its
+// heads. Built afresh each time: it is only needed on reconnect, and the
+// base hashes it reads are all in memory
+static struct MerkleNode* build_local_tree(struct args* a) {
+    struct MerkleNode* root = merkle_new();
+    if (!root)
+        return NULL;
+    pthread_mutex_lock(&a->mu);
+    for (struct SyncFile* f = a->files.all; f; f = f->all) {
+        if (!f->has_base)
+            continue;
+        struct MerkleNode* leaf = merkle_add(root, f->name, strlen(f->name),
+                                             f->base_hash);
+        if (leaf)
+            leaf->data = f;
+    }
+    pthread_mutex_unlock(&a->mu);
+    return root;
+}
+
+// C_TREE for one directory, with our hash of it. Takes path, which rides
+// along in the Pending until the reply
+static int send_tree(struct args* a, struct Pipeline* pl, char* path,
+                     struct MerkleNode* dir) {
+    uint32_t len = (uint32_t)strlen(path);
+    uint64_t hash = dir ? dir->hash : 0;
+    uint8_t* req = malloc(8 + len);
+    if (!req || pipeline_room(a, pl, 8 + len) != 1) {
+        free(req);
+        free(path);
+        return -1;
+    }
+    uint32_t hw[2] = { htonl((uint32_t)(hash >> 32)), htonl((uint32_t)hash) };
+    memcpy(req, hw, 8);
+    memcpy(req + 8, path, len);
+    uint32_t tag = next_tag(a);
+    int ok = send_request(a, C_TREE, tag, req, 8 + len);
+    free(req);
+    if (ok != 1) {
+        free(path);
+        drop_connection(a);
+        return -1;
+    }
+    pipeline_add(pl, (struct Pending){
+        .type = C_TREE, .data = (uint8_t*)path, .len = len, .dir = dir,
+        .wire = 8 + len, .tag = tag,
+    });
+    return 1;
+}
+
+// A file the server listed, which our tree doesn't match. Its doc_id comes
+// with the listing, so no C_OPEN. A base that matches after all just
+// takes the version; a local copy we never synced that matches becomes
+// the base without a download. Anything else gets pulled, and what was
+// saved here since the base, restored from the last run at a warm start,
+// is merged into the pulled version rather than overwritten by it
+static int adopt_listed(struct args* a, const char* name, uint32_t id,
+                        uint64_t hash, uint32_t version) {
+    pthread_mutex_lock(&a->mu);
+    struct SyncFile* f = sync_file_get(&a->files, name);
+    if (!f || sync_file_set_id(&a->files, f, id) != 0) {
+        pthread_mutex_unlock(&a->mu);
+        return -1;
+    }
+    int has_base = f->has_base;
+    if (has_base && f->base_hash == hash) {
+        if (version > f->last_version)
+            f->last_version = version;
+        pthread_mutex_unlock(&a->mu);
+        return 0;
+    }
+    pthread_mutex_unlock(&a->mu);
+
+    uint8_t* local = NULL;
+    uint32_t local_len = 0;
+    int same = !has_base &&
+               read_file_into_buf(f->path, &local, &local_len) == 0 &&
+               hash64(local, local_len) == hash;
+
+    pthread_mutex_lock(&a->mu);
+    if (same && !f->has_base) {
+        set_base_locked(f, local, local_len);
+        f->last_version = version;
+        local = NULL;
+    } else if (!same) {
+        sync_queue(&a->files, f, SYNC_PULL);
+    }
+    pthread_mutex_unlock(&a->mu);
+    free(local);
+    return 0;
+}
+
+// Files under n that the server doesn't have at all, say after it lost
+// its root. Our bases mean nothing to it, so they go up as new files
+static void push_unlisted(struct args* a, struct MerkleNode* n) {
+    if (n->is_dir) {
+        for (struct MerkleNode* c = n->children; c; c = c->sibling)
+            push_unlisted(a, c);
         return;
     }
+    struct SyncFile* f = n->data;
+    pthread_mutex_lock(&a->mu);
+    f->has_base = 0;
+    f->last_version = 0;
+    sync_queue(&a->files, f, SYNC_PUSH);
+    pthread_mutex_unlock(&a->mu);
+}
 
-    if (type == S_OK && plen == 8) { 
-        // S_OK returns new version
-        uint32_t be_new;
-        memcpy(&be_new, payload, 8);
-        uint32_t new_ver = ntohl(be_new);
+// S_TREE for p->data: the server's hash of the directory and, if it isn't
+// ours, its children. Subdirectories that differ go on the walk. Our
+// children get version 1 when listed, so what is left over is unlisted
+static int finish_tree(struct args* a, struct Pipeline* pl, struct Pending* p,
+                       uint8_t type, const uint8_t* payload, uint32_t plen) {
+    if (type != S_TREE || plen < 8 || !pl->walk)
+        return -1;
+    const char* path = (const char*)p->data;
+    struct MerkleNode* mine = p->dir;
+    if (get_u64(payload) == (mine ? mine->hash : 0))
+        return 1;
 
+    uint32_t off = 8;
+    while (off < plen) {
+        if (plen - off < 19)
+            return -1;
+        int is_dir = payload[off];
+        uint64_t hash = get_u64(payload + off + 1);
+        uint32_t be[2];
+        uint16_t be_nl;
+        memcpy(be, payload + off + 9, 8);
+        memcpy(&be_nl, payload + off + 17, 2);
+        uint16_t nl = ntohs(be_nl);
+        off += 19;
+        if (nl > plen - off)
+            return -1;
+        const char* name = (const char*)payload + off;
+        off += nl;
+
+        // Names come from the server; keep them inside our root
+        if (nl == 0 || memchr(name, '/', nl) || memchr(name, '\0', nl) ||
+            (nl == 1 && name[0] == '.') ||
+            (nl == 2 && name[0] == '.' && name[1] == '.'))
+            continue;
+
+        struct MerkleNode* ours = mine ? merkle_child(mine, name, nl) : NULL;
+        if (ours)
+            ours->version = 1;
+
+        char* child = NULL;
+        if (asprintf(&child, "%s%s%.*s", path, *path ? "/" : "",
+                     (int)nl, name) < 0)
+            return -1;
+        if (sync_ignored(child + strlen(child) - nl, is_dir) ||
+            (is_dir && ours && ours->is_dir && ours->hash == hash)) {
+            free(child);
+        } else if (is_dir) {
+            if (walk_add(pl->walk, child,
+                         ours && ours->is_dir ? ours : NULL) != 0)
+                return -1;
+        } else {
+            int rc = adopt_listed(a, child, ntohl(be[0]), hash, ntohl(be[1]));
+            free(child);
+            if (rc != 0)
+                return -1;
+        }
+    }
+
+    if (mine)
+        for (struct MerkleNode* c = mine->children; c; c = c->sibling)
+            if (!c->version)
+                push_unlisted(a, c);
+    return 1;
+}
+
+// Walk both trees breadth first, pipelining the C_TREEs of each level
+static int reconcile(struct args* a) {
+    a->reconcile = 0;
+    struct MerkleNode* mine = build_local_tree(a);
+    struct TreeWalk walk = { 0 };
+    struct Pipeline pl = { .walk = &walk };
+    int ok = -1;
+    if (mine) {
+        char* root = strdup("");
+        ok = root && walk_add(&walk, root, mine) == 0 ? 1 : -1;
+    }
+
+    size_t next = 0;
+    while (ok == 1 && (next < walk.n || pl.n)) {
+        if (next < walk.n) {
+            char* path = walk.paths[next];
+            walk.paths[next] = NULL; // The Pending owns it now
+            ok = send_tree(a, &pl, path, walk.dirs[next++]);
+        } else {
+            ok = complete_one(a, &pl);
+        }
+    }
+
+    pipeline_abort(&pl); // Only non-empty after an error
+    for (size_t i = next; i < walk.n; i++)
+        free(walk.paths[i]);
+    free(walk.paths);
+    free(walk.dirs);
+    merkle_free(mine);
+    if (ok != 1)
+        a->reconcile = 1;
+    return ok;
+}
+
+// Sync everything queued, including whatever the rounds themselves queue
+// (missed versions, bases that went stale), until the queue is empty. A
+// new connection reconciles first, which queues whatever changed while
+// we were away. Without a connection the files stay queued for the next
+// attempt. A file is queued once however often it was saved, and pushes
+// diff it against the last acknowledged base, so an outage costs one
+// upload per file edited, not one per save. A file that also changed on
+// the server is pulled first, and the pull merges the saves into the new
+// version against that base, so the upload carries both
+static void sync_round(struct args* a) {
+    while (!*(a->stop_flag_addr)) {
         pthread_mutex_lock(&a->mu);
-        a->last_version = new_ver;
+        int queued = a->files.queue != NULL;
         pthread_mutex_unlock(&a->mu);
+        if (!queued && !a->reconcile)
+            return;
+        if (ensure_connected(a) < 0 || (a->reconcile && reconcile(a) != 1))
+            return;
 
-        printf("[client] pushed version %" PRIu32 ", %u bytes\n", new_ver, len);
-    } else {
-        printf("[client] push rejected due to conflict\n");
+        size_t n = 0;
+        pthread_mutex_lock(&a->mu);
+        struct SyncFile** files = sync_take_queue(&a->files, &n);
+        pthread_mutex_unlock(&a->mu);
+        if (!files)
+            return;
+
+        int ok = sync_batch(a, files, n);
+        if (ok != 1 && a->server_fd < 0) {
+            // The next connection reconciles; what we took must still go
+            pthread_mutex_lock(&a->mu);
+            for (size_t i = 0; i < n; i++)
+                sync_queue(&a->files, files[i], files[i]->todo);
+            pthread_mutex_unlock(&a->mu);
+            free(files);
+            return;
+        }
+        free(files);
     }
+}
+
+// Handle a frame the server sent without being asked
+static void handle_push(struct args* a) {
+    uint8_t  type;
+    uint8_t* payload = NULL;
+    uint32_t plen = 0;
+
+    int r = recv_message(a->server_fd, &type, NULL, &payload, &plen);
+    if (r <= 0) {
+        frame_buf_free(payload);
+        drop_connection(a);
+        return;
+    }
+
+    if (type == S_PUSH || type == S_PUSH_DELTA || type == S_CRDT_OPS)
+        apply_push(a, type, payload, plen);
+    frame_buf_free(payload);
+    sync_round(a); // Catch up if the push showed we missed a version
+}
 
-    free(payload);  
-    free(data); 
+// Record the bases this round moved, for the next start
+static void save_state(struct args* a) {
+    pthread_mutex_lock(&a->mu);
+    if (sync_state_save(&a->files) != 0)
+        fprintf(stderr, "[client] could not save sync state under %s/%s\n",
+                a->root, SYNC_STATE_DIR);
+    pthread_mutex_unlock(&a->mu);
 }
 
-// If file_watcher signaled new_message, call push_to_server
-// Always call pull_from_server to pick up remote changes + Sleep briefly 
+// Wait on both the file watcher pipe and the server connection
+// When the watcher has queued changed files, sync them as one round
+// Remote edits arrive as S_PUSH frames on the open connection
 void* socket_client(void* arg) {
     struct args* a = arg;
 
-    // poll to refresh if nothing received from read
-    struct pollfd pfd = { 
-        .fd = a->pipefd[0],  
-        .events = POLLIN
-    };
-
-    // Initial pull to sync local file with local change
-    pull_from_server(a);
-
     while(!*(a->stop_flag_addr)) {  
-        int ret = poll(&pfd, 1, 100); // timeout every 500ms so loop can check stop_flag
+        // poll ignores negative fds, so this also works while disconnected
+        struct pollfd pfds[2] = {
+            { .fd = a->pipefd[0], .events = POLLIN },
+            { .fd = a->server_fd, .events = POLLIN },
+        };
+        int ret = poll(pfds, 2, 100); // timeout every 100ms so loop can check stop_flag
 
         if (ret < 0) {
             if (errno == EINTR) continue;
@@ -237,24 +1512,36 @@ void* socket_client(void* arg) {
             break;
         }
 
-        if (ret == 0) 
-            continue; // timeout -> check stop_flag again
+        if (ret == 0) {
+            // timeout -> check stop_flag again, and retry a lost connection
+            // once the backoff allows
+            if (a->server_fd < 0 && now_ms() >= a->retry_at) {
+                sync_round(a);
+                save_state(a);
+            }
+            continue;
+        }
+
+        if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            handle_push(a);
+            save_state(a);
+        }
 
-        if (pfd.revents & POLLIN) {
+        if (pfds[0].revents & POLLIN) {
+            // The watcher already debounced and queued; one round takes it all
             char buf[100];
-            read(a->pipefd[0], buf, sizeof(buf));
+            ssize_t n = read(a->pipefd[0], buf, sizeof(buf));
 
-            if (buf[0] == 'X') {
+            if (n > 0 && memchr(buf, 'X', (size_t)n)) {
                 printf("Reader thread exiting...\n");
                 break; 
             }
 
-            push_to_server(a);  
-            pull_from_server(a); 
-
-            usleep(100000); // 100ms delay
+            sync_round(a);
+            save_state(a);
         }
     }
 
+    drop_connection(a);
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,172 @@
+/*
+ * The client's table of synced files. The watcher thread adds files and
+ * queues the ones that changed; the socket thread takes the whole queue
+ * and syncs it as one pipelined batch. Files are never removed, so a
+ * SyncFile pointer stays valid for the life of the client.
+ */
+
+#define _GNU_SOURCE
+#include "sync_files.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNC_BUCKETS_MIN 64
+
+static uint32_t name_hash(const char *p) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int sync_table_init(struct SyncTable *t, const char *root) {
+    memset(t, 0, sizeof(*t));
+    t->root = root;
+    t->nbuckets = SYNC_BUCKETS_MIN;
+    t->buckets = calloc(t->nbuckets, sizeof(*t->buckets));
+    t->queue_tail = &t->queue;
+    return t->buckets ? 0 : -1;
+}
+
+void sync_table_free(struct SyncTable *t) {
+    while (t->all) {
+        struct SyncFile *f = t->all;
+        t->all = f->all;
+        free(f->name);
+        free(f->path);
+        free(f->base);
+        free(f);
+    }
+    free(t->buckets);
+    free(t->by_id);
+    memset(t, 0, sizeof(*t));
+}
+
+// Double the hash map once it averages one file per bucket
+static int grow_buckets(struct SyncTable *t) {
+    uint32_t nb = t->nbuckets * 2;
+    struct SyncFile **b = calloc(nb, sizeof(*b));
+    if (!b)
+        return -1;
+    for (struct SyncFile *f = t->all; f; f = f->all) {
+        uint32_t h = name_hash(f->name) & (nb - 1);
+        f->next = b[h];
+        b[h] = f;
+    }
+    free(t->buckets);
+    t->buckets = b;
+    t->nbuckets = nb;
+    return 0;
+}
+
+// Find a file by its name under the root, adding it on first sight
+struct SyncFile *sync_file_get(struct SyncTable *t, const char *name) {
+    uint32_t h = name_hash(name);
+    for (struct SyncFile *f = t->buckets[h & (t->nbuckets - 1)]; f; f = f->next)
+        if (strcmp(f->name, name) == 0)
+            return f;
+
+    if (t->count >= t->nbuckets && grow_buckets(t) != 0)
+        return NULL;
+
+    struct SyncFile *f = calloc(1, sizeof(*f));
+    if (!f || !(f->name = strdup(name)) ||
+        asprintf(&f->path, "%s/%s", t->root, name) < 0) {
+        if (f)
+            free(f->name);
+        free(f);
+        return NULL;
+    }
+
+    h &= t->nbuckets - 1;
+    f->next = t->buckets[h];
+    t->buckets[h] = f;
+    f->all = t->all;
+    t->all = f;
+    t->count++;
+    return f;
+}
+
+struct SyncFile *sync_file_by_id(struct SyncTable *t, uint32_t id) {
+    return id < t->id_cap ? t->by_id[id] : NULL;
+}
+
+// Record the doc_id the server gave f on this connection
+int sync_file_set_id(struct SyncTable *t, struct SyncFile *f, uint32_t id) {
+    if (id >= t->id_cap) {
+        uint32_t cap = t->id_cap ? t->id_cap : 64;
+        while (cap <= id)
+            cap *= 2;
+        struct SyncFile **ids = realloc(t->by_id, cap * sizeof(*ids));
+        if (!ids)
+            return -1;
+        memset(ids + t->id_cap, 0, (cap - t->id_cap) * sizeof(*ids));
+        t->by_id = ids;
+        t->id_cap = cap;
+    }
+    t->by_id[id] = f;
+    f->doc_id = id;
+    f->opened = 1;
+    return 0;
+}
+
+// The connection is gone, and with it every doc_id
+void sync_forget_ids(struct SyncTable *t) {
+    for (struct SyncFile *f = t->all; f; f = f->all)
+        f->opened = 0;
+    if (t->by_id)
+        memset(t->by_id, 0, t->id_cap * sizeof(*t->by_id));
+}
+
+// Ask the next sync round for 'want'; a queued file just collects more
+void sync_queue(struct SyncTable *t, struct SyncFile *f, int want) {
+    if (!f->want) {
+        f->qnext = NULL;
+        *t->queue_tail = f;
+        t->queue_tail = &f->qnext;
+    }
+    f->want |= want;
+}
+
+// Hand the queued files to the caller as a malloc'd array, with each
+// file's 'want' moved to 'todo'. Files queued again meanwhile start a new
+// queue. NULL with *n_out 0 if there is nothing to do
+struct SyncFile **sync_take_queue(struct SyncTable *t, size_t *n_out) {
+    size_t n = 0;
+    for (struct SyncFile *f = t->queue; f; f = f->qnext)
+        n++;
+    *n_out = 0;
+    struct SyncFile **files = n ? malloc(n * sizeof(*files)) : NULL;
+    if (!files)
+        return NULL; // Stays queued for the next try
+
+    for (struct SyncFile *f = t->queue; f; f = f->qnext) {
+        f->todo = f->want;
+        f->want = 0;
+        files[(*n_out)++] = f;
+    }
+    t->queue = NULL;
+    t->queue_tail = &t->queue;
+    return files;
+}
+
+// Names not to sync: ones the server refuses (.tmp and .journal are its
+// own), our atomic_write_local temporaries, editor scratch files, version
+// control metadata and our own sync state
+int sync_ignored(const char *name, int is_dir) {
+    if (is_dir)
+        return strcmp(name, ".git") == 0 || strcmp(name, SYNC_STATE_DIR) == 0;
+
+    size_t len = strlen(name);
+    const char *suffixes[] = { ".tmp", ".journal", ".swp", ".swx", "~" };
+    for (size_t k = 0; k < sizeof(suffixes) / sizeof(*suffixes); k++) {
+        size_t sl = strlen(suffixes[k]);
+        if (len >= sl && strcmp(name + len - sl, suffixes[k]) == 0)
+            return 1;
+    }
+    return 0;
+}
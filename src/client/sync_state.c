@@ -0,0 +1,183 @@
+/*
+ * What the client knows about each file, kept across restarts: the last
+ * version it synced and the server's bytes at that version (the base).
+ * Each file has a record at <root>/.rfs_sync/<name>, so a sync rewrites
+ * only the records of files whose base moved. A warm start then matches
+ * the server's tree with one C_TREE, and edits made while the client was
+ * off go up as deltas against the real base instead of as new files. If
+ * the server moved meanwhile, the base is the ancestor they merge against.
+ *
+ * Record: [u32 magic][u32 last_version][u64 hash64 of base][base bytes]
+ */
+
+#define _GNU_SOURCE
+#include "sync_state.h"
+#include "hash.h"
+#include "rfs_file.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#define STATE_MAGIC 0x52465331u // "RFS1"
+#define STATE_HDR 16
+
+static int record_path(char *out, const struct SyncTable *t, const char *name) {
+    int n = snprintf(out, PATH_MAX, "%s/%s/%s", t->root, SYNC_STATE_DIR, name);
+    return n > 0 && n < PATH_MAX ? 0 : -1;
+}
+
+// Take one record as f's base, unless it is damaged
+static void load_record(struct SyncTable *t, const char *path,
+                        const char *name) {
+    uint8_t *buf = NULL;
+    uint32_t len = 0;
+    if (read_file_into_buf(path, &buf, &len) != 0 || len < STATE_HDR) {
+        free(buf);
+        return;
+    }
+    uint32_t be[4];
+    memcpy(be, buf, STATE_HDR);
+    uint64_t hash = (uint64_t)ntohl(be[2]) << 32 | ntohl(be[3]);
+    uint32_t base_len = len - STATE_HDR;
+    struct SyncFile *f = NULL;
+    if (ntohl(be[0]) == STATE_MAGIC &&
+        hash64(buf + STATE_HDR, base_len) == hash)
+        f = sync_file_get(t, name);
+    if (!f) {
+        free(buf);
+        return;
+    }
+
+    // The base keeps the whole buffer, header and all
+    memmove(buf, buf + STATE_HDR, base_len);
+    free(f->base);
+    f->base = buf;
+    f->base_len = base_len;
+    f->base_hash = hash;
+    f->has_base = 1;
+    f->last_version = ntohl(be[1]);
+    f->saved = 1;
+    f->saved_version = f->last_version;
+    f->saved_hash = hash;
+}
+
+static void load_dir(struct SyncTable *t, const char *rel, int depth) {
+    char path[PATH_MAX];
+    if (record_path(path, t, rel) != 0 || depth > 64)
+        return;
+    DIR *dir = opendir(path);
+    if (!dir)
+        return;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        char child[PATH_MAX], child_path[PATH_MAX];
+        int n = rel[0] ? snprintf(child, sizeof(child), "%s/%s", rel, e->d_name)
+                       : snprintf(child, sizeof(child), "%s", e->d_name);
+        struct stat st;
+        if (n <= 0 || n >= (int)sizeof(child) ||
+            record_path(child_path, t, child) != 0 ||
+            lstat(child_path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode) && !sync_ignored(e->d_name, 1))
+            load_dir(t, child, depth + 1);
+        else if (S_ISREG(st.st_mode) && !sync_ignored(e->d_name, 0))
+            load_record(t, child_path, child);
+    }
+    closedir(dir);
+}
+
+// The last run died patching a file in place (patch_local), so it is
+// torn. It held its base before the patch began, so put that back; the
+// next sync brings the version the patch was writing. A file we have no
+// base for is left to that sync, which replaces it from the server
+static void undo_patch(struct SyncTable *t) {
+    char mark[PATH_MAX];
+    int n = snprintf(mark, sizeof(mark), "%s/%s", t->root, SYNC_PATCH_MARK);
+    uint8_t *path = NULL;
+    uint32_t len = 0;
+    if (n <= 0 || n >= (int)sizeof(mark) ||
+        read_file_into_buf(mark, &path, &len) != 0 || len == 0) {
+        free(path);
+        return;
+    }
+
+    int rc = 0;
+    for (struct SyncFile *f = t->all; f; f = f->all) {
+        if (!f->has_base || strlen(f->path) != len ||
+            memcmp(f->path, path, len) != 0)
+            continue;
+        rc = atomic_write_local(f->path, f->base, f->base_len);
+        if (rc == 0)
+            printf("Restored %s, torn by an interrupted update\n", f->name);
+    }
+    free(path);
+    if (rc == 0)
+        unlink(mark);
+}
+
+// Bring back the bases of the last run, and undo a patch it didn't finish.
+// Returns how many files have a base
+int sync_state_load(struct SyncTable *t) {
+    load_dir(t, "", 0);
+    undo_patch(t);
+    int n = 0;
+    for (struct SyncFile *f = t->all; f; f = f->all)
+        n += f->has_base;
+    return n;
+}
+
+static int save_record(const struct SyncTable *t, struct SyncFile *f) {
+    char path[PATH_MAX];
+    if (record_path(path, t, f->name) != 0)
+        return -1;
+    if (!f->has_base) {
+        if (unlink(path) != 0 && errno != ENOENT)
+            return -1;
+        f->saved = 0;
+        return 0;
+    }
+
+    uint8_t *buf = malloc(STATE_HDR + (size_t)f->base_len);
+    if (!buf)
+        return -1;
+    uint32_t be[4] = {
+        htonl(STATE_MAGIC), htonl(f->last_version),
+        htonl((uint32_t)(f->base_hash >> 32)), htonl((uint32_t)f->base_hash),
+    };
+    memcpy(buf, be, STATE_HDR);
+    if (f->base_len)
+        memcpy(buf + STATE_HDR, f->base, f->base_len);
+    int rc = atomic_write_local(path, buf, STATE_HDR + f->base_len);
+    free(buf);
+    if (rc != 0)
+        return -1;
+    f->saved = 1;
+    f->saved_version = f->last_version;
+    f->saved_hash = f->base_hash;
+    return 0;
+}
+
+// Write the records of files whose version or base changed since they
+// were last saved, and drop those of files that lost their base.
+// Returns -1 if any of them failed; those are tried again next time
+int sync_state_save(struct SyncTable *t) {
+    int rc = 0;
+    for (struct SyncFile *f = t->all; f; f = f->all) {
+        int same = f->has_base
+            ? f->saved && f->saved_version == f->last_version &&
+              f->saved_hash == f->base_hash
+            : !f->saved;
+        if (!same && save_record(t, f) != 0)
+            rc = -1;
+    }
+    return rc;
+}
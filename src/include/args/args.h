@@ -1,18 +1,26 @@
 #ifndef ARGS_H
 #define ARGS_H
 
+#include "sync_files.h"
+
 #include <stdint.h>
 #include <pthread.h>
 #include <signal.h>
 
 struct args {
-    int new_message;
     int pipefd[2];
-    char *message;
-    char *file_path;
-    uint32_t last_version;
-    int suppress_next;
-    pthread_mutex_t mu;
+    const char *root;       // Synced directory, ~/rfs by default
+    const char *patch_mark; // <root>/SYNC_PATCH_MARK, for patch_local
+    int server_fd;          // Persistent connection, -1 while disconnected
+    int compress;           // Server agreed to FEATURE_LZ on server_fd
+    int tags;               // Server agreed to FEATURE_TAGS on server_fd
+    uint32_t last_tag;      // Socket thread only: tag of the last request
+    int reconcile;          // Socket thread only: compare trees next round
+    int retry_ms;           // Socket thread only: reconnect backoff, 0 if online
+    int64_t retry_at;       // Socket thread only: no reconnect before this (ms)
+    int collab;             // -c: edit files collaboratively through CRDTs
+    struct SyncTable files; // Every file under root, and the sync queue
+    pthread_mutex_t mu;     // Guards files and everything in them
     volatile sig_atomic_t* stop_flag_addr;
 };
 
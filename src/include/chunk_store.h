@@ -0,0 +1,39 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stdint.h>
+
+// Content-defined chunk sizes. Cuts fall where the content says, so they
+// don't shift when bytes before them are inserted or removed
+#define CDC_MIN 1024u
+#define CDC_AVG 4096u
+#define CDC_MAX 32768u
+
+// A run of bytes, stored once however many versions and documents hold it
+struct Chunk {
+    uint64_t hash;           // hash64 of data
+    uint32_t len;
+    uint32_t refs;           // Guarded by its store stripe's lock
+    struct Chunk *next;      // Store slot chain
+    uint8_t data[];
+};
+
+// A content as the chunks it is made of, in order. Each entry holds one
+// reference to its chunk
+struct ChunkList {
+    struct Chunk **chunks;
+    uint32_t n;
+    uint32_t len;            // Bytes in all of them
+};
+
+uint32_t chunk_cut(const uint8_t *data, uint32_t len);
+
+int  chunk_split(const uint8_t *data, uint32_t len, struct ChunkList *out,
+                 uint32_t *fresh_out);
+int  chunk_resplit(const struct ChunkList *prev, uint32_t head, uint32_t tail,
+                   const uint8_t *data, uint32_t len, struct ChunkList *out,
+                   uint32_t *fresh_out);
+int  chunk_list_join(const struct ChunkList *l, uint8_t **out, uint32_t *len_out);
+void chunk_list_free(struct ChunkList *l);
+
+#endif
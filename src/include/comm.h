@@ -3,20 +3,138 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
-#define MAX_MSG (8u * 1024u * 1024u) // 8 MB
+#define MAX_MSG (8u * 1024u * 1024u) // 8 MB per frame
+#define CHUNK_SIZE (1u * 1024u * 1024u) // Bodies above this go as F_CHUNKs
+#define MAX_BODY (256u << 20) // Largest message, chunked or not
+#define BODY_INFLIGHT_MAX (1024u << 20) // Bodies being received, all together
+#define FRAME_IOV_MAX 8 // Payload pieces per send_framev/send_bodyv
+#define FRAME_COMPRESSED 0x80 // Type flag: payload is lz.h packed
+#define FRAME_TAGGED 0x40 // Header flag: a u32 request tag follows the type
+#define FRAME_HDR_MAX 9   // length + type + tag
 
+// C_HELLO/S_HELLO feature bits
+#define FEATURE_LZ 0x1 // Peer may send FRAME_COMPRESSED messages
+#define FEATURE_TAGS 0x2 // Requests carry tags; replies echo them, in any order
+
+// Every payload except C_OPEN, C_HELLO, C_STATS, C_TREE and C_SUBSCRIBE_ALL
+// starts with the u32 doc_id from S_OPENED
 enum MsgType {
-    C_GET   = 0x01,  // Poll current state
+    C_GET   = 0x01,  // Poll current state, optionally u64 hash64 of ours
     C_PUT   = 0x02,  // Submit new state based on base_version
+    C_SUBSCRIBE = 0x03,  // Keep connection open and push new versions to it
+    C_PUT_DELTA = 0x04,  // base_version + delta.h delta against that version
+    C_GET_SINCE = 0x05,  // Client's version, optionally u64 hash64 of its
+                         // content; answered by S_DELTA, S_STATE or
+                         // S_NOT_MODIFIED
+    C_OPEN  = 0x06,  // Document name relative to the server root
+    C_HELLO = 0x07,  // u32 features the client wants; answered by S_HELLO
+    C_STATS = 0x08,  // No payload; answered by S_STATS
+    C_TREE  = 0x09,  // u64 hash of our copy of a directory, then its path
+                     // ("" for the root); answered by S_TREE
+    C_SUBSCRIBE_ALL = 0x0A,  // No payload; C_SUBSCRIBE to every document
+    C_CRDT_JOIN = 0x0B,  // Edit collaboratively; answered by S_CRDT_STATE,
+                         // then every edit comes as S_CRDT_OPS
+    C_CRDT_OPS = 0x0C,  // crdt.h ops made on our replica; answered by S_OK
     S_STATE = 0x11,  // Current version and bytes
     S_OK    = 0x12,  // PUT accepted new version included
+    S_PUSH  = 0x13,  // Unsolicited S_STATE broadcast after another client's PUT
+    S_NACK  = 0x14,  // Delta base has aged out; resend as a full C_PUT
+    S_DELTA = 0x15,  // from, to, then (len + delta) per version in between
+    S_PUSH_DELTA = 0x16,  // Unsolicited one-step S_DELTA after a PUT
+    S_OPENED = 0x17,  // doc_id and current version of the opened document
+    S_HELLO = 0x18,  // u32 features both sides will use on this connection
+    S_NOT_MODIFIED = 0x19,  // Head version; the client's hash matched it
+    S_STATS = 0x1A,  // Server statistics as text, one "name value" per line
+    S_TREE  = 0x1B,  // u64 directory hash, then unless ours matched, per
+                     // child: u8 is_dir, u64 hash, u32 doc_id, u32 version,
+                     // u16 name length, name
+    S_CRDT_STATE = 0x1C,  // doc_id, version, length, then u32 site for our
+                          // ops and the crdt.h replica
+    S_CRDT_OPS = 0x1D,  // doc_id, version, length, then the crdt.h ops
+                        // that made the version
+    F_BEGIN = 0x20,  // Chunked body follows: its type + u32 total length
+    F_CHUNK = 0x21,  // Next bytes of the body, at most CHUNK_SIZE
+    F_END   = 0x22,  // Body complete; handled as one frame of its type
 };
 
 int read_full(int fd, void *buf, size_t n);
 int write_full(int fd, const void *buf, size_t n);
 
+// Received payloads live in frame buffers from a per-thread pool, so a PUT
+// storm keeps reusing the same warm buffers instead of faulting in fresh
+// pages. Everything recv_frame, recv_message, frame_parser_feed and
+// body_feed hand out must go back through frame_buf_free, from any thread
+// However many threads there are, their caches stay under FRAME_POOL_TOTAL
+#define FRAME_POOL_MIN 4096u          // Smallest pooled buffer
+#define FRAME_POOL_KEEP_MIN (1u << 20) // Bytes a thread keeps cached...
+#define FRAME_POOL_KEEP (16u << 20)   // ...or an event loop, see frame_pool_keep
+#define FRAME_POOL_TOTAL (64u << 20)  // Bytes all threads keep together
+
+uint8_t *frame_buf_alloc(uint32_t n);
+void frame_buf_free(uint8_t *p);
+void frame_pool_keep(size_t bytes);
+
+// A tag is any nonzero u32 the requester picks; 0 means untagged, and
+// untagged frames use the plain 5-byte header. Receivers get the tag
+// apart from the type, which never has FRAME_TAGGED set
+int frame_header(uint8_t hdr[FRAME_HDR_MAX], uint8_t type, uint32_t tag,
+                 uint32_t plen);
 int send_frame(int fd, uint8_t type, const uint8_t *payload, uint32_t plen);
-int recv_frame(int fd, uint8_t *type_out, uint8_t **payload_out, uint32_t *plen_out);
+int send_framev(int fd, uint8_t type, uint32_t tag,
+                const struct iovec *iov, int iovcnt);
+int recv_frame(int fd, uint8_t *type_out, uint32_t *tag_out,
+               uint8_t **payload_out, uint32_t *plen_out);
+
+// Whole messages of any size: large payloads travel as F_BEGIN, F_CHUNK...,
+// F_END and are reassembled on the other side. Only F_BEGIN carries the tag
+int send_body(int fd, uint8_t type, const uint8_t *payload, uint32_t plen);
+int send_bodyv(int fd, uint8_t type, uint32_t tag,
+               const struct iovec *iov, int iovcnt);
+int send_body_file(int sock, uint8_t type, uint32_t tag,
+                   const uint8_t *payload, uint32_t plen,
+                   int file_fd, uint32_t file_from);
+int recv_message(int fd, uint8_t *type_out, uint32_t *tag_out,
+                 uint8_t **payload_out, uint32_t *plen_out);
+int body_begin_frame(uint8_t out[FRAME_HDR_MAX + 5], uint8_t type,
+                     uint32_t tag, uint32_t plen);
+
+// Collects a chunked body as its frames arrive. Bodies don't interleave
+// with other frames, so one per connection is enough. The buffer grows
+// with the chunks actually received, not with the announced total, and
+// all assemblers together stay under BODY_INFLIGHT_MAX. Compressed
+// messages come out inflated
+struct BodyAssembler {
+    uint8_t  type;       // Type the body will be delivered as
+    uint32_t tag;        // ...and its tag, from F_BEGIN
+    int      active;     // Between F_BEGIN and F_END
+    uint8_t *buf;
+    uint32_t cap;        // Bytes buf holds, charged to BODY_INFLIGHT_MAX
+    uint32_t len;        // Announced total
+    uint32_t got;
+};
+
+void body_init(struct BodyAssembler *b);
+void body_free(struct BodyAssembler *b);
+int  body_feed(struct BodyAssembler *b, uint8_t *type, uint32_t *tag,
+               uint8_t **payload, uint32_t *plen);
+
+// Incremental frame decoder for non-blocking sockets
+// Bytes can arrive in any split; state carries over between feeds
+struct FrameParser {
+    uint8_t  hdr[FRAME_HDR_MAX]; // length + type + tag if FRAME_TAGGED
+    uint32_t hdr_got;    // Header bytes seen so far
+    uint32_t hdr_len;    // 5 until the type says a tag follows
+    uint8_t *payload;    // Allocated once the header is complete
+    uint32_t plen;       // Expected payload length
+    uint32_t got;        // Payload bytes seen so far
+};
+
+void frame_parser_init(struct FrameParser *fp);
+void frame_parser_free(struct FrameParser *fp);
+int  frame_parser_feed(struct FrameParser *fp, const uint8_t *buf, size_t n,
+                       size_t *used_out, uint8_t *type_out, uint32_t *tag_out,
+                       uint8_t **payload_out, uint32_t *plen_out);
 
 #endif
\ No newline at end of file
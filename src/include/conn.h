@@ -0,0 +1,127 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include "comm.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_PENDING_OUT (64u * 1024u * 1024u) // Drop readers this far behind
+#define MAX_PENDING_BODIES 16                 // ...or this many bodies behind
+
+// Bytes queued for a non-blocking socket that the kernel hasn't taken yet
+struct OutBuf {
+    uint8_t *data;
+    size_t off;   // First unsent byte
+    size_t len;   // End of queued bytes
+    size_t cap;
+};
+
+// How conn_send_body keeps a caller's buffer alive until it is sent
+struct BodyOwner {
+    void (*hold)(void *ptr);     // Take one more reference
+    void (*release)(void *ptr);  // Drop one
+    void *ptr;
+    int file_fd;                 // Payload from file_from on is also this
+    uint32_t file_from;          // file's contents, or file_fd is -1
+    // Optional cached FRAME_COMPRESSED form of the payload, NULL if none
+    const uint8_t *(*packed)(void *ptr, uint32_t *len);
+};
+
+// A large payload streamed from its owner's buffer as F_BEGIN, F_CHUNKs
+// and F_END, so replies queued on a slow socket never copy whole documents
+struct OutBody {
+    struct OutBody *next;
+    uint64_t at;             // Position in the out stream where it goes
+    uint8_t type;
+    const uint8_t *data;
+    uint32_t len;
+    uint32_t off;            // Body bytes sent
+    uint32_t chunk_left;     // Bytes left in the current F_CHUNK
+    uint8_t hdr[FRAME_HDR_MAX + 5]; // Frame header being sent
+    uint8_t hdr_off, hdr_len;
+    int ended;               // F_END header started
+    struct BodyOwner owner;
+};
+
+struct SubList;
+struct Deferred;
+
+// One connected client. A client thread or reactor reads from fd, but
+// broadcasts from other threads also write to it, so writes go through wmu
+struct Conn {
+    int fd;
+    atomic_int refs;         // Owner's, plus one per broadcast sending to it
+    pthread_mutex_t wmu;     // Serializes whole frames written to fd
+    atomic_int compress;     // Peer negotiated FEATURE_LZ
+    uint32_t tag;            // Tag of the request being answered; owner only
+
+    // Replies held back until the journal has the versions they announce;
+    // server.c sends them once nothing more is waiting to be read
+    struct Deferred *deferred;
+    size_t ndeferred;
+
+    // Documents this client subscribed to; only its owner touches these
+    struct SubList **subs;
+    size_t nsubs, subs_cap;
+
+    // Reactor mode only. epfd < 0 means a blocking, thread-per-client socket
+    int epfd;                // Epoll set of the owning reactor
+    int want_out;            // EPOLLOUT armed because out isn't empty
+    int dead;                // Write failed or peer fell too far behind
+    int held;                // Parked on its reactor for deferred replies
+    int closing;             // Closed, kept only until they are sent
+    int paused;              // Not reading requests until they are sent
+    uint8_t *in;             // Bytes read before the pause, not parsed yet
+    size_t in_len;
+    struct FrameParser parser;
+    struct BodyAssembler body; // Chunked request being received
+    struct OutBuf out;
+    uint64_t out_sent;       // Bytes of out sent so far, ever
+    struct OutBody *bodies;  // Queued after out bytes at their 'at'
+    struct OutBody **bodies_tail;
+    size_t nbodies;
+};
+
+// Connections subscribed to one document. mu is never held while writing
+struct SubList {
+    struct Conn **conns;
+    size_t n, cap;
+    pthread_mutex_t mu;
+};
+
+// Takes ownership of payload, a frame buffer, so it can keep it
+typedef int (*frame_handler)(struct Conn *c, uint8_t type, uint32_t tag,
+                             uint8_t *payload, uint32_t plen);
+typedef int (*conn_handler)(struct Conn *c);
+
+struct Conn *conn_new(int fd, int epfd);
+void conn_hold(struct Conn *c);
+void conn_put(struct Conn *c);
+
+// conn_send* are untagged, for pushes; conn_reply* answer the request
+// c->tag names, and only its owner may call them
+int conn_send(struct Conn *c, uint8_t type,
+              const uint8_t *payload, uint32_t plen);
+int conn_send_body(struct Conn *c, uint8_t type, const uint8_t *payload,
+                   uint32_t plen, const struct BodyOwner *owner);
+int conn_reply(struct Conn *c, uint8_t type,
+               const uint8_t *payload, uint32_t plen);
+int conn_reply_body(struct Conn *c, uint8_t type, const uint8_t *payload,
+                    uint32_t plen, const struct BodyOwner *owner);
+int conn_flush(struct Conn *c);
+int conn_pause(struct Conn *c, int paused);
+
+int  registry_add(struct Conn *c);
+void registry_remove(struct Conn *c);
+
+void sublist_init(struct SubList *l);
+int  sublist_add(struct SubList *l, struct Conn *c);
+void sublist_broadcast(struct SubList *const *lists, size_t nlists,
+                       const struct Conn *skip, uint8_t type,
+                       const uint8_t *payload, uint32_t plen,
+                       const struct BodyOwner *owner);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CRDT_H
+#define CRDT_H
+
+#include <stdint.h>
+
+#define CRDT_SERVER_SITE 1   // Edits the server makes for plain C_PUTs
+#define CRDT_FIRST_SITE 2    // First site handed to a collaborating client
+
+// Ops, back to back in C_CRDT_OPS/S_CRDT_OPS. Ids are (site, clock); a
+// run of n inserted bytes takes clocks clock..clock + n - 1
+#define CRDT_INSERT 1        // site, clock, origin site, origin clock, n, bytes
+#define CRDT_DELETE 2        // site, clock, n: the bytes with those ids
+#define CRDT_PENDING_MAX (1u << 20) // Bytes of ops kept waiting, see crdt_apply
+
+// A run of bytes one site inserted with consecutive clocks, in document
+// order. Deleted runs stay as tombstones so later ops can still name them
+struct CrdtBlock {
+    uint32_t site;
+    uint32_t clock;          // Id of the first byte; byte i has clock + i
+    uint32_t len;
+    uint32_t off;            // Bytes at text + off, unless deleted
+    uint32_t deleted;
+};
+
+// A replicated byte sequence (RGA). Every replica that applies the same
+// ops, in any order, ends with the same text: an op naming ids not seen
+// yet waits in pending until they arrive
+struct Crdt {
+    struct CrdtBlock *blocks;
+    uint32_t n, cap;
+    uint8_t *text;           // Append-only arena of inserted bytes
+    uint32_t text_len, text_cap;
+    uint32_t clock;          // Highest clock seen, for new ids (Lamport)
+    uint32_t visible;        // Bytes not deleted
+    uint8_t *pending;        // Encoded ops that name unknown ids
+    uint32_t pending_len, pending_cap;
+};
+
+int crdt_init(struct Crdt *c, uint32_t site, const uint8_t *data, uint32_t len);
+void crdt_free(struct Crdt *c);
+
+int crdt_apply(struct Crdt *c, const uint8_t *ops, uint32_t len);
+int crdt_diff(struct Crdt *c, uint32_t site, const uint8_t *data, uint32_t len,
+              uint8_t **ops_out, uint32_t *ops_len);
+int crdt_text(const struct Crdt *c, uint8_t **out, uint32_t *len_out);
+
+int crdt_encode(const struct Crdt *c, uint8_t **out, uint32_t *len_out);
+int crdt_decode(struct Crdt *c, const uint8_t *p, uint32_t len);
+
+#endif
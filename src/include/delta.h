@@ -0,0 +1,27 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+// Binary delta between two versions of a file, rsync style
+// Layout: u32 target_len, then ops until the end of the buffer:
+//   DELTA_COPY   u32 base_offset, u32 len   -> bytes taken from the base
+//   DELTA_INSERT u32 len, len bytes         -> literal bytes
+// All integers are in network order
+enum DeltaOp {
+    DELTA_COPY   = 'C',
+    DELTA_INSERT = 'I',
+};
+
+int delta_encode(const uint8_t *base, uint32_t base_len,
+                 const uint8_t *target, uint32_t target_len,
+                 uint8_t **delta_out, uint32_t *delta_len_out);
+
+int delta_apply(const uint8_t *base, uint32_t base_len,
+                const uint8_t *delta, uint32_t delta_len,
+                uint8_t **out, uint32_t *out_len);
+
+void delta_unchanged(const uint8_t *delta, uint32_t delta_len,
+                     uint32_t base_len, uint32_t *head, uint32_t *tail);
+
+#endif
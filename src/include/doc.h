@@ -0,0 +1,83 @@
+#ifndef DOC_H
+#define DOC_H
+
+#include "conn.h"
+#include "history.h"
+#include "journal.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DOC_NAME_MAX 1024
+
+struct MerkleNode;
+struct Crdt;
+
+// One published version of a document. Never modified once published, so
+// readers can send it without any lock. It already holds the S_STATE
+// payload: doc_id, version, length, content
+struct Snapshot {
+    atomic_uint refs;
+    int fd;                  // The version's file, kept for sendfile, or -1
+    uint32_t version;
+    uint32_t len;            // Content bytes, at payload + 12
+    uint32_t plen;           // Whole payload
+    uint64_t hash;           // hash64 of the content, for conditional GETs
+
+    // Compressed payload, built by the first peer that negotiated FEATURE_LZ
+    pthread_mutex_t zmu;
+    int zstate;              // 0 not tried, 1 in z, -1 not worth it
+    uint8_t *z;
+    uint32_t zlen;
+
+    uint8_t *payload;        // A frame buffer, often the PUT that made it
+};
+
+// One synced file. Everything but id/name/path/subs/snap is guarded by mu,
+// so edits to different documents never wait on each other
+struct Doc {
+    uint32_t id;             // Index in the table, sent on the wire
+    char name[DOC_NAME_MAX + 1]; // Path relative to the server root
+    char path[PATH_MAX];     // On-disk file path
+    const uint8_t *content;  // Head bytes, inside snap
+    uint32_t content_len;    // Bytes in content
+    uint32_t version;        // Version starting at 0
+
+    // Head version for readers. Writers swap it under snap_lock, which is
+    // only ever held for a pointer copy and a refcount bump
+    struct Snapshot *snap;
+    pthread_spinlock_t snap_lock;
+
+    struct History hist;     // Recent versions for C_GET_SINCE
+    int journaled;           // -j given: log versions instead of rewriting path
+    struct Journal journal;
+    pthread_mutex_t mu;      // Ensure thread safety
+    struct SubList subs;     // Connections to push new versions to
+    struct Crdt *crdt;       // Replica once someone collaborates, under mu
+    struct SubList crdt_subs; // Collaborators, pushed ops instead
+    struct MerkleNode *leaf; // Our place in the table's tree, under its lock
+    struct Doc *next;        // Hash chain
+};
+
+int doc_table_init(const char *root, int journaled, enum JournalSync sync);
+struct Doc *doc_open(const char *name, size_t len);
+struct Doc *doc_get(uint32_t id);
+uint8_t *doc_tree_list(const char *path, size_t len, uint64_t their_hash,
+                       uint32_t *plen_out);
+
+struct Snapshot *snapshot_new(uint32_t id, uint32_t version,
+                              const uint8_t *data, uint32_t len);
+struct Snapshot *snapshot_adopt(uint32_t id, uint32_t version,
+                                uint8_t *buf, uint32_t len);
+void snapshot_put(struct Snapshot *s);
+struct BodyOwner snapshot_owner(struct Snapshot *s);
+struct Snapshot *doc_snapshot(struct Doc *d);
+void doc_publish_locked(struct Doc *d, struct Snapshot *s);
+
+int atomic_write_file(const char *path, const uint8_t *data, size_t len,
+                      int *keep_fd);
+
+#endif
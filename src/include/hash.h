@@ -0,0 +1,10 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Fast 64-bit content hash (XXH64, seed 0), so both ends agree on it
+uint64_t hash64(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "chunk_store.h"
+
+#include <stdint.h>
+
+#define HIST_MAX_VERSIONS 256                   // Versions kept per document
+#define HIST_MAX_BYTES    (16u * 1024u * 1024u) // Total bytes they may add
+
+// Recent versions of a document: each as the list of chunk_store chunks it
+// is made of, plus the forward delta from the one before for S_DELTA
+// A version is charged its delta, its chunk list (8 bytes per CDC_AVG of
+// content) and the chunks no older version had, so a small edit costs
+// little however big the document. The anchor is free. A version that
+// alone costs more than HIST_MAX_BYTES, such as a rewrite of a document
+// past 16 MB, evicts every older one, and documents of some hundreds of
+// MB keep only a few versions for their chunk lists
+// Not thread safe; the owner's lock covers it
+struct History {
+    uint32_t oldest;         // Version the anchor holds
+    struct ChunkList anchor;
+    int anchorless;          // history_clear: oldest's bytes aren't kept
+
+    struct HistDelta {
+        uint8_t *delta;      // delta.h encoding from version - 1
+        uint32_t len;
+        struct ChunkList chunks; // The version itself
+        uint32_t cost;       // Delta, chunk list and chunks it added
+    } ring[HIST_MAX_VERSIONS];
+    uint32_t start;          // Ring index of version oldest + 1
+    uint32_t count;          // Versions after the anchor; head is oldest + count
+    uint64_t bytes;          // Sum of costs
+};
+
+int  history_init(struct History *h, uint32_t version,
+                  const uint8_t *content, uint32_t len);
+void history_free(struct History *h);
+void history_clear(struct History *h, uint32_t version);
+
+int history_append(struct History *h, uint8_t *delta, uint32_t len,
+                   const uint8_t *content, uint32_t content_len);
+
+int history_chain(const struct History *h, uint32_t from, uint32_t max_bytes,
+                  uint32_t headroom, uint8_t **out, uint32_t *out_len);
+
+int history_content_at(const struct History *h, uint32_t version,
+                       uint8_t **out, uint32_t *out_len);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define JOURNAL_COMPACT_MIN (16u * 1024u * 1024u) // Never compact below this
+
+// When an appended record counts as durable
+enum JournalSync {
+    JOURNAL_SYNC_NONE,    // Leave it to the page cache
+    JOURNAL_SYNC_BATCH,   // Group commit: waiters share one fdatasync
+    JOURNAL_SYNC_ALWAYS,  // fdatasync every record before returning
+};
+
+// Record kinds. A journal always starts with a snapshot
+enum JournalKind {
+    J_SNAPSHOT = 'S',     // Full content of a version
+    J_DELTA    = 'D',     // delta.h delta from version - 1
+};
+
+// Append-only log of accepted versions: <doc path>.journal
+struct Journal {
+    char path[PATH_MAX];
+    int fd;
+    enum JournalSync sync;
+    uint64_t size;        // Bytes in the file
+    uint64_t appended;    // Sequence number of the last record written
+    uint64_t synced;      // Everything up to here is on disk
+    int syncing;          // A group commit leader is in fdatasync
+    int failed;           // A sync failed; nothing is durable anymore
+    int queued;           // On the flusher's list; see journal_poll
+    int compacting;       // journal_compact_later is under way
+    struct Journal *next_queued;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+};
+
+int journal_open(struct Journal *j, const char *doc_path, enum JournalSync sync,
+                 uint32_t *version_out, uint8_t **content_out,
+                 uint32_t *len_out);
+
+int journal_append(struct Journal *j, uint8_t kind, uint32_t version,
+                   const uint8_t *data, uint32_t len, uint64_t *seq_out);
+int journal_wait(struct Journal *j, uint64_t seq);
+int journal_poll(struct Journal *j, uint64_t seq);
+void journal_set_wake(void (*wake)(void));
+
+int journal_compact(struct Journal *j, uint32_t version,
+                    const uint8_t *content, uint32_t len);
+int journal_compact_later(struct Journal *j, uint32_t version,
+                          const uint8_t *content, uint32_t len,
+                          void (*done)(void *arg, int rc), void *arg);
+int journal_should_compact(struct Journal *j, uint32_t content_len);
+void journal_close(struct Journal *j);
+
+#endif
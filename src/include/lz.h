@@ -0,0 +1,16 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+// Fast LZ77 compression for frame payloads, LZ4 block format
+// Packed layout: u32 raw_len (network order), then one LZ4 block
+#define LZ_MIN_INPUT 512 // Smaller payloads aren't worth a pass
+
+int lz_pack(const uint8_t *src, uint32_t len,
+            uint8_t **out, uint32_t *out_len);
+int lz_packed_len(const uint8_t *src, uint32_t len, uint32_t max_raw,
+                  uint32_t *raw_len);
+int lz_unpack(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t raw_len);
+
+#endif
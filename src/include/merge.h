@@ -0,0 +1,26 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdint.h>
+
+// Conflict markers, shared with the whole-file fallback in the server
+#define MERGE_PRE  "<-- client\n"
+#define MERGE_MID  "========\n"
+#define MERGE_POST "--> server\n"
+
+// Bytes [a_from, a_to) of one text that another replaced with its
+// [b_from, b_to), whole lines at a time
+struct MergeEdit {
+    uint32_t a_from, a_to;
+    uint32_t b_from, b_to;
+};
+
+int merge3(const uint8_t *base, uint32_t base_len,
+           const uint8_t *client, uint32_t client_len,
+           const uint8_t *server, uint32_t server_len,
+           uint8_t **out, uint32_t *out_len);
+int merge_diff(const uint8_t *a, uint32_t a_len,
+               const uint8_t *b, uint32_t b_len,
+               struct MergeEdit **edits_out, uint32_t *n_out);
+
+#endif
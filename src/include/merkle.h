@@ -0,0 +1,40 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A directory tree of content hashes. A directory's hash is the sum of
+// merkle_entry() over its children, so two trees agree on a directory
+// exactly when they agree on everything under it, and changing one file
+// only touches the sums on its path to the root
+struct MerkleNode {
+    char *name;              // One path component; "" for the root
+    int is_dir;
+    uint64_t hash;           // Files: hash64 of the content
+    uint32_t doc_id;         // Files: whatever the owner keeps there
+    uint32_t version;
+    void *data;
+
+    struct MerkleNode *parent;
+    struct MerkleNode *sibling;  // Children of one directory, newest first
+    struct MerkleNode *children;
+    struct MerkleNode **slots;   // Directories: children by name
+    struct MerkleNode *next;     // Slot chain
+    uint32_t nslots, nchildren;
+};
+
+uint64_t merkle_entry(const char *name, size_t len, int is_dir, uint64_t hash);
+
+struct MerkleNode *merkle_new(void);
+void merkle_free(struct MerkleNode *root);
+
+struct MerkleNode *merkle_child(const struct MerkleNode *dir,
+                                const char *name, size_t len);
+struct MerkleNode *merkle_find(struct MerkleNode *root,
+                               const char *path, size_t len);
+struct MerkleNode *merkle_add(struct MerkleNode *root, const char *path,
+                              size_t len, uint64_t hash);
+void merkle_set(struct MerkleNode *leaf, uint64_t hash);
+
+#endif
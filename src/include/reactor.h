@@ -0,0 +1,18 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "conn.h"
+
+// Serve clients with nreactors event loops, each owning an epoll set
+// lfds holds either one listener shared by all reactors, or one listener
+// per reactor (SO_REUSEPORT). Every complete frame goes to on_frame, and
+// on_drained runs once the frames one wakeup read have all been handled,
+// and must not block: a conn it leaves replies deferred on is called again
+// after each reactor_wake, until they are all sent. on_frame may
+// conn_pause its conn; no more of its frames are handled until then. Only
+// returns on setup failure
+int reactor_serve(const int *lfds, int nlfds, int nreactors,
+                  frame_handler on_frame, conn_handler on_drained);
+void reactor_wake(void);
+
+#endif
@@ -9,5 +9,9 @@ void create_rfs_file(char* file_path);
 
 int  read_file_into_buf(const char *path, uint8_t **data_out, uint32_t *len_out);
 int  atomic_write_local(const char *path, const uint8_t *data, uint32_t len);
+int  patch_local(const char *path, const uint8_t *data, uint32_t len,
+                 const char *mark);
+int  merge_local(const char *path, const uint8_t *base, uint32_t base_len,
+                 const uint8_t *remote, uint32_t remote_len, const char *mark);
 
 #endif
@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Events counted by the thread that saw them
+enum StatCounter {
+    STAT_OPEN,
+    STAT_GET,
+    STAT_GET_SINCE,
+    STAT_PUT,
+    STAT_PUT_DELTA,
+    STAT_SUBSCRIBE,
+    STAT_TREE,               // Directory listings for reconciliation
+    STAT_CRDT_OPS,           // Collaborative edits
+    STAT_NOT_MODIFIED,       // Conditional GETs answered without content
+    STAT_NACK,               // Stale C_PUT_DELTA bases
+    STAT_DEFERRED,           // Tagged PUT acks held for a shared journal sync
+    STAT_MERGE,              // PUTs against a stale base
+    STAT_CONFLICT,           // Merges that needed conflict markers
+    STAT_ERROR,              // Requests that closed their connection
+    STAT_BYTES_IN,           // Request payload bytes
+    STAT_NCOUNTERS
+};
+
+// Levels that go up and down
+enum StatGauge {
+    STAT_CONNS,              // Open client connections
+    STAT_CLIENT_THREADS,     // -m threads client threads alive
+    STAT_CHUNKS,             // Distinct history chunks stored
+    STAT_CHUNK_BYTES,        // Bytes in them
+    STAT_NGAUGES
+};
+
+// Latencies in ns
+enum StatHist {
+    HIST_LOCK_WAIT,          // Waiting for a document's mu
+    HIST_LOCK_HOLD,          // Holding it
+    HIST_DISK_WRITE,         // atomic_write_file
+    HIST_JOURNAL_WAIT,       // Waiting for a journal append to be durable
+    HIST_MERGE,
+    HIST_GET,                // Whole request, reply included
+    HIST_GET_SINCE,
+    HIST_PUT,
+    HIST_PUT_DELTA,
+    STAT_NHISTS
+};
+
+void stats_init(void);
+
+// Recording is per thread and lock free, cheap enough for every request
+uint64_t stats_now(void);    // CLOCK_MONOTONIC ns
+void stats_count(enum StatCounter c, uint64_t n);
+void stats_gauge(enum StatGauge g, int delta);
+void stats_record(enum StatHist h, uint64_t ns);
+void stats_since(enum StatHist h, uint64_t start); // stats_now() - start
+
+// All threads merged, as the text S_STATS carries
+char *stats_format(uint32_t *len_out);
+int stats_dump_every(unsigned secs);
+
+#endif
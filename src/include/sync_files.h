@@ -0,0 +1,79 @@
+#ifndef SYNC_FILES_H
+#define SYNC_FILES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// What a queued file needs from the next sync round
+#define SYNC_PUSH 0x1        // Local bytes may have changed
+#define SYNC_PULL 0x2        // Server may have versions we missed
+
+#define SYNC_STATE_DIR ".rfs_sync" // sync_state.h records, never synced
+// Names the file being patched in place; sync_ignored, so never a record
+#define SYNC_PATCH_MARK SYNC_STATE_DIR "/patch.journal"
+
+struct Crdt;
+
+// One synced file: <root>/<name> here, <name> on the server
+struct SyncFile {
+    char *name;              // Path relative to the root
+    char *path;              // Local path
+    uint32_t doc_id;         // From S_OPENED or S_TREE, valid while opened
+    int opened;              // doc_id known on the current connection
+    uint32_t last_version;
+    uint8_t *base;           // Server content at last_version, for deltas
+    uint32_t base_len;
+    uint64_t base_hash;      // hash64 of base, for conditional GETs
+    int has_base;
+    int saved;               // sync_state.h has a record of this file,
+    uint32_t saved_version;  // at this version and base
+    uint64_t saved_hash;
+
+    // Collaborative mode, socket thread only. The base then only moves to
+    // what the server has acknowledged, so a lost connection loses no ops
+    struct Crdt *crdt;       // Replica, once joined on this connection
+    uint32_t site;           // Ours in it
+    int joining;             // C_CRDT_JOIN in flight
+    int sending;             // C_CRDT_OPS in flight
+    uint8_t *inbox;          // Pushed ops held back: while joining, or
+    uint32_t inbox_len;      // until a save on its way has become ops
+    uint32_t inbox_version;
+    uint8_t *outbox;         // Ops made on the replica, not sent yet
+    uint32_t outbox_len;
+
+    int want;                // SYNC_PUSH | SYNC_PULL, while queued
+    int todo;                // Socket thread only: want, once taken
+    int watch_pending;       // Watcher thread only: changed in this burst
+    struct SyncFile *next;   // Name hash chain
+    struct SyncFile *all;    // Every file, in creation order
+    struct SyncFile *qnext;  // Sync queue
+};
+
+// Every file under the root the client has seen, by name and by doc_id,
+// plus the queue of files waiting for the socket thread. Not thread safe;
+// callers lock around it
+struct SyncTable {
+    const char *root;
+    struct SyncFile **buckets;
+    uint32_t nbuckets;
+    uint32_t count;
+    struct SyncFile *all;
+    struct SyncFile **by_id; // Indexed by doc_id on the current connection
+    uint32_t id_cap;
+    struct SyncFile *queue, **queue_tail;
+};
+
+int sync_table_init(struct SyncTable *t, const char *root);
+void sync_table_free(struct SyncTable *t);
+
+struct SyncFile *sync_file_get(struct SyncTable *t, const char *name);
+struct SyncFile *sync_file_by_id(struct SyncTable *t, uint32_t id);
+int sync_file_set_id(struct SyncTable *t, struct SyncFile *f, uint32_t id);
+void sync_forget_ids(struct SyncTable *t);
+
+void sync_queue(struct SyncTable *t, struct SyncFile *f, int want);
+struct SyncFile **sync_take_queue(struct SyncTable *t, size_t *n_out);
+
+int sync_ignored(const char *name, int is_dir);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef SYNC_STATE_H
+#define SYNC_STATE_H
+
+#include "sync_files.h"
+
+int sync_state_load(struct SyncTable *t);
+int sync_state_save(struct SyncTable *t);
+
+#endif
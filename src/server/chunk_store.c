@@ -0,0 +1,287 @@
+/*
+ * Content-addressed store of variable-size chunks, shared by every
+ * document's history. Contents are cut where a rolling gear hash of the
+ * bytes just read hits a mask (FastCDC), so an edit only moves the cuts
+ * next to it: versions of a file, and files copied from one another, come
+ * out as mostly the same chunks, and each distinct chunk is kept once.
+ * Chunks are found by hash64 and confirmed byte for byte, so two contents
+ * that collide on the hash are still kept apart. The store is split into
+ * stripes by hash, each with its own lock, so documents committing at
+ * once rarely wait on each other here.
+ */
+
+#define _GNU_SOURCE
+#include "chunk_store.h"
+#include "hash.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define STORE_SLOTS_MIN 16 // Per stripe
+#define STORE_STRIPES 64 // Picked by the top bits of the hash, slots by the low
+
+// Normalized chunking: before CDC_AVG a cut needs two more zero bits than
+// log2(CDC_AVG), after it two fewer, which keeps sizes close to CDC_AVG.
+// Bit k of the gear hash depends on the last k + 1 bytes, so the masks
+// take the top bits
+#define MASK_HARD (~0ull << (64 - 14))
+#define MASK_EASY (~0ull << (64 - 10))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static struct Store {
+    struct Chunk **slots;
+    size_t nslots, n;
+    pthread_mutex_t mu;
+} stores[STORE_STRIPES];
+static pthread_once_t stores_once = PTHREAD_ONCE_INIT;
+
+// Fixed pseudo-random values per byte (splitmix64), so cuts never move
+// between runs
+static void gear_init(void) {
+    uint64_t x = 0;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static void stores_init(void) {
+    for (int i = 0; i < STORE_STRIPES; i++)
+        pthread_mutex_init(&stores[i].mu, NULL);
+}
+
+static struct Store *stripe(uint64_t hash) {
+    return &stores[hash >> 58];
+}
+
+// Length of the first chunk of data. No cut comes before CDC_MIN, so
+// those bytes aren't even hashed
+uint32_t chunk_cut(const uint8_t *data, uint32_t len) {
+    pthread_once(&gear_once, gear_init);
+    if (len <= CDC_MIN)
+        return len;
+    uint32_t end = len < CDC_MAX ? len : CDC_MAX;
+    uint32_t mid = end < CDC_AVG ? end : CDC_AVG;
+
+    uint64_t fp = 0;
+    uint32_t i = CDC_MIN;
+    for (; i < mid; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & MASK_HARD))
+            return i + 1;
+    }
+    for (; i < end; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & MASK_EASY))
+            return i + 1;
+    }
+    return end;
+}
+
+// Double a stripe's slots once it averages one chunk per slot
+static int grow_locked(struct Store *st) {
+    size_t ns = st->nslots ? st->nslots * 2 : STORE_SLOTS_MIN;
+    struct Chunk **s = calloc(ns, sizeof(*s));
+    if (!s)
+        return -1;
+    for (size_t i = 0; i < st->nslots; i++) {
+        while (st->slots[i]) {
+            struct Chunk *c = st->slots[i];
+            st->slots[i] = c->next;
+            c->next = s[c->hash & (ns - 1)];
+            s[c->hash & (ns - 1)] = c;
+        }
+    }
+    free(st->slots);
+    st->slots = s;
+    st->nslots = ns;
+    return 0;
+}
+
+// A reference to the stored chunk holding these bytes, added if new
+static struct Chunk *intern_locked(struct Store *st, const uint8_t *data,
+                                   uint32_t len, uint64_t hash,
+                                   uint32_t *fresh) {
+    if (st->n >= st->nslots && grow_locked(st) != 0 && !st->nslots)
+        return NULL;
+    struct Chunk **slot = &st->slots[hash & (st->nslots - 1)];
+    for (struct Chunk *c = *slot; c; c = c->next) {
+        if (c->hash == hash && c->len == len && memcmp(c->data, data, len) == 0) {
+            c->refs++;
+            return c;
+        }
+    }
+
+    struct Chunk *c = malloc(sizeof(*c) + len);
+    if (!c)
+        return NULL;
+    c->hash = hash;
+    c->len = len;
+    c->refs = 1;
+    memcpy(c->data, data, len);
+    c->next = *slot;
+    *slot = c;
+    st->n++;
+    *fresh += len;
+    stats_gauge(STAT_CHUNKS, 1);
+    stats_gauge(STAT_CHUNK_BYTES, (int)len);
+    return c;
+}
+
+static void release_locked(struct Store *st, struct Chunk *c) {
+    if (--c->refs)
+        return;
+    struct Chunk **p = &st->slots[c->hash & (st->nslots - 1)];
+    while (*p != c)
+        p = &(*p)->next;
+    *p = c->next;
+    st->n--;
+    stats_gauge(STAT_CHUNKS, -1);
+    stats_gauge(STAT_CHUNK_BYTES, -(int)c->len);
+    free(c);
+}
+
+// Another reference to a chunk some list already holds
+static void chunk_ref(struct Chunk *c) {
+    struct Store *st = stripe(c->hash);
+    pthread_mutex_lock(&st->mu);
+    c->refs++;
+    pthread_mutex_unlock(&st->mu);
+}
+
+// Cut data into chunks and take a reference to each, storing the ones the
+// store didn't have. *fresh_out gets the bytes that took, the memory this
+// content costs beyond what was already held
+int chunk_split(const uint8_t *data, uint32_t len, struct ChunkList *out,
+                uint32_t *fresh_out) {
+    static const struct ChunkList none;
+    return chunk_resplit(&none, 0, 0, data, len, out, fresh_out);
+}
+
+// chunk_split for data that is an edit of prev's content sharing its first
+// head and last tail bytes. Only the edited region is cut and hashed: a
+// cut depends on nothing but the bytes since its chunk began, so prev's
+// chunks inside the head come out the same (bar its last, cut by the end
+// of the content), and once a cut in the tail lands on one of prev's, so
+// does everything after it. The result is what chunk_split would give
+int chunk_resplit(const struct ChunkList *prev, uint32_t head, uint32_t tail,
+                  const uint8_t *data, uint32_t len, struct ChunkList *out,
+                  uint32_t *fresh_out) {
+    memset(out, 0, sizeof(*out));
+    *fresh_out = 0;
+    if (head > len) head = len;
+    if (head > prev->len) head = prev->len;
+    if (tail > len - head) tail = len - head;
+    if (tail > prev->len - head) tail = prev->len - head;
+
+    uint32_t lead = 0, off = 0;
+    while (lead + 1 < prev->n && off + prev->chunks[lead]->len <= head)
+        off += prev->chunks[lead++]->len;
+
+    // Cut and hash outside the locks; only the lookups need them
+    uint32_t cap = 0, ncut = 0;
+    uint64_t *hashes = NULL;
+    uint32_t *lens = NULL;
+    uint32_t rest = lead, prev_off = off;
+    for (uint32_t at = off; ; ) {
+        if (at >= len - tail) {
+            // Where this cut falls in prev, if prev has a cut there too
+            uint32_t was = at - (len - prev->len);
+            while (rest < prev->n && prev_off < was)
+                prev_off += prev->chunks[rest++]->len;
+            if (prev_off == was)
+                break;
+        }
+        if (ncut == cap) {
+            cap = cap ? cap * 2 : (len - at) / CDC_AVG + 4;
+            uint64_t *h = realloc(hashes, cap * sizeof(*h));
+            if (h)
+                hashes = h;
+            uint32_t *l = h ? realloc(lens, cap * sizeof(*l)) : NULL;
+            if (!l) {
+                free(hashes);
+                free(lens);
+                return -1;
+            }
+            lens = l;
+        }
+        uint32_t n = chunk_cut(data + at, len - at);
+        hashes[ncut] = hash64(data + at, n);
+        lens[ncut++] = n;
+        at += n;
+    }
+
+    uint32_t nchunks = lead + ncut + (prev->n - rest);
+    if (nchunks && !(out->chunks = malloc(nchunks * sizeof(*out->chunks)))) {
+        free(hashes);
+        free(lens);
+        return -1;
+    }
+    for (uint32_t i = 0; i < lead; i++) {
+        chunk_ref(prev->chunks[i]);
+        out->chunks[out->n++] = prev->chunks[i];
+    }
+    out->len = off;
+
+    int ok = 0;
+    pthread_once(&stores_once, stores_init);
+    for (uint32_t i = 0; i < ncut; off += lens[i++]) {
+        struct Store *st = stripe(hashes[i]);
+        pthread_mutex_lock(&st->mu);
+        struct Chunk *c = intern_locked(st, data + off, lens[i], hashes[i],
+                                        fresh_out);
+        pthread_mutex_unlock(&st->mu);
+        if (!c) {
+            ok = -1;
+            break;
+        }
+        out->chunks[out->n++] = c;
+        out->len += lens[i];
+    }
+    free(hashes);
+    free(lens);
+    if (ok != 0) {
+        chunk_list_free(out);
+        return ok;
+    }
+
+    for (uint32_t i = rest; i < prev->n; i++) {
+        chunk_ref(prev->chunks[i]);
+        out->chunks[out->n++] = prev->chunks[i];
+        out->len += prev->chunks[i]->len;
+    }
+    return 0;
+}
+
+// The content back in one buffer
+int chunk_list_join(const struct ChunkList *l, uint8_t **out, uint32_t *len_out) {
+    uint8_t *buf = NULL;
+    if (l->len && !(buf = malloc(l->len)))
+        return -1;
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < l->n; i++) {
+        memcpy(buf + off, l->chunks[i]->data, l->chunks[i]->len);
+        off += l->chunks[i]->len;
+    }
+    *out = buf;
+    *len_out = l->len;
+    return 0;
+}
+
+// Drop the list's references; chunks nobody holds anymore are freed
+void chunk_list_free(struct ChunkList *l) {
+    for (uint32_t i = 0; i < l->n; i++) {
+        struct Store *st = stripe(l->chunks[i]->hash);
+        pthread_mutex_lock(&st->mu);
+        release_locked(st, l->chunks[i]);
+        pthread_mutex_unlock(&st->mu);
+    }
+    free(l->chunks);
+    memset(l, 0, sizeof(*l));
+}
@@ -1,12 +1,129 @@
 #define _GNU_SOURCE
 #include "comm.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h> 
 #include <errno.h>  
+#include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h> 
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+// Frame buffers: power-of-two classes from FRAME_POOL_MIN up to MAX_MSG,
+// anything larger goes straight to malloc. A header in front of each says
+// which class it came from and links it into a free list while cached
+#define POOL_CLASSES 12      // 4 KB << 11 = 8 MB = MAX_MSG
+#define POOL_DIRECT 0xFFFFu  // Class of unpooled buffers
+
+struct FrameBuf {
+    uint32_t cls;
+    uint32_t pad;
+    struct FrameBuf *next;   // Free list link
+};                           // 16 bytes keeps payloads 16-aligned
+
+struct FramePool {
+    struct FrameBuf *free[POOL_CLASSES];
+    size_t cached;           // Bytes on the free lists
+    size_t keep;             // Most it may hold
+};
+
+static __thread struct FramePool *pool;
+static atomic_size_t pool_total; // Bytes cached by every thread together
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static size_t class_size(uint32_t cls) {
+    return (size_t)FRAME_POOL_MIN << cls;
+}
+
+// Release a thread's cache when the thread exits
+static void pool_destroy(void *arg) {
+    struct FramePool *p = arg;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        while (p->free[i]) {
+            struct FrameBuf *b = p->free[i];
+            p->free[i] = b->next;
+            free(b);
+        }
+    }
+    atomic_fetch_sub_explicit(&pool_total, p->cached, memory_order_relaxed);
+    free(p);
+}
+
+static void pool_key_init(void) {
+    pthread_key_create(&pool_key, pool_destroy);
+}
+
+static struct FramePool *thread_pool(void) {
+    if (!pool) {
+        pthread_once(&pool_once, pool_key_init);
+        pool = calloc(1, sizeof(*pool));
+        if (pool) {
+            pool->keep = FRAME_POOL_KEEP_MIN;
+            pthread_setspecific(pool_key, pool);
+        }
+    }
+    return pool;
+}
+
+// Let this thread cache up to 'bytes'. For event loops, whose few threads
+// see every client's frames; a thread per client keeps the default
+void frame_pool_keep(size_t bytes) {
+    struct FramePool *p = thread_pool();
+    if (p)
+        p->keep = bytes;
+}
+
+// A buffer of at least n bytes, reused from this thread's cache if it can
+uint8_t *frame_buf_alloc(uint32_t n) {
+    uint32_t cls = 0;
+    while (cls < POOL_CLASSES && class_size(cls) < n)
+        cls++;
+
+    struct FrameBuf *b = NULL;
+    struct FramePool *p = cls < POOL_CLASSES ? thread_pool() : NULL;
+    if (p && p->free[cls]) {
+        b = p->free[cls];
+        p->free[cls] = b->next;
+        p->cached -= class_size(cls);
+        atomic_fetch_sub_explicit(&pool_total, class_size(cls),
+                                  memory_order_relaxed);
+    } else {
+        size_t size = cls < POOL_CLASSES ? class_size(cls) : n;
+        b = malloc(sizeof(*b) + size);
+        if (!b)
+            return NULL;
+        b->cls = cls < POOL_CLASSES ? cls : POOL_DIRECT;
+    }
+    return (uint8_t *)(b + 1);
+}
+
+// Return a buffer to this thread's cache, or to malloc once that, or all
+// the caches together, are full
+void frame_buf_free(uint8_t *ptr) {
+    if (!ptr)
+        return;
+    struct FrameBuf *b = (struct FrameBuf *)ptr - 1;
+    struct FramePool *p = b->cls != POOL_DIRECT ? thread_pool() : NULL;
+    size_t size = p ? class_size(b->cls) : 0;
+    if (!p || p->cached + size > p->keep) {
+        free(b);
+        return;
+    }
+    if (atomic_fetch_add_explicit(&pool_total, size, memory_order_relaxed) +
+        size > FRAME_POOL_TOTAL) {
+        atomic_fetch_sub_explicit(&pool_total, size, memory_order_relaxed);
+        free(b);
+        return;
+    }
+    b->next = p->free[b->cls];
+    p->free[b->cls] = b;
+    p->cached += size;
+}
 
 // read_full/write_full implement exactly n bytes of reading/writing
     // Necessary because read()/write() may do partial transfers
@@ -39,21 +156,91 @@ int write_full(int fd, const void *buf, size_t n) {
     return 1; // success
 }
 
-// read_full / write_full loop until theyve read exactly n bytes
-int send_frame(int fd, uint8_t type, const uint8_t *payload, uint32_t plen) {
-    uint32_t len = 1u + plen; 
-    uint32_t be_len = htonl(len);
-    uint8_t hdr[5];
-    memcpy(hdr, &be_len, 4); // copy length 
+// Send every byte described by iov to a socket, resuming after partial
+// sends. Modifies iov in place
+static int sendv_full(int fd, struct iovec *iov, int iovcnt, int flags) {
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)iovcnt };
+        ssize_t w = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if (w < 0) {
+            if (errno == EINTR) continue; // try again
+            return -1; // error
+        }
+        size_t left = (size_t)w;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 1; // success
+}
 
-    hdr[4] = type;
-    if (write_full(fd, hdr, 5) != 1) return -1; // write header
-    if (plen && write_full(fd, payload, plen) != 1) return -1;
+// Send file bytes [off, off + n) to a socket without copying them through
+// user space. The file must not shrink meanwhile
+static int sendfile_full(int sock, int file_fd, off_t off, size_t n) {
+    while (n) {
+        ssize_t w = sendfile(sock, file_fd, &off, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (w == 0)
+            return -1; // file is shorter than promised
+        n -= (size_t)w;
+    }
     return 1;
 }
 
-// Receive a full frame. Caller frees *payload_out if plen_out > 0
-int recv_frame(int fd, uint8_t *type_out, uint8_t **payload_out, uint32_t *plen_out) {
+// Frame header: length (type, tag and payload), type, and the tag if
+// there is one. Returns its size, 5 or 9 bytes
+int frame_header(uint8_t hdr[FRAME_HDR_MAX], uint8_t type, uint32_t tag,
+                 uint32_t plen) {
+    uint32_t be_len = htonl(1u + (tag ? 4u : 0u) + plen);
+    memcpy(hdr, &be_len, 4); // copy length 
+    hdr[4] = type;
+    if (!tag)
+        return 5;
+    uint32_t be_tag = htonl(tag);
+    hdr[4] |= FRAME_TAGGED;
+    memcpy(hdr + 5, &be_tag, 4);
+    return 9;
+}
+
+// Send one frame whose payload is gathered from iov, header included, in
+// a single sendmsg where the socket allows
+int send_framev(int fd, uint8_t type, uint32_t tag,
+                const struct iovec *iov, int iovcnt) {
+    if (iovcnt > FRAME_IOV_MAX)
+        return -1;
+
+    uint64_t plen = 0;
+    struct iovec all[1 + FRAME_IOV_MAX];
+    for (int i = 0; i < iovcnt; i++) {
+        plen += iov[i].iov_len;
+        all[1 + i] = iov[i];
+    }
+    if (plen > MAX_MSG - (tag ? 5u : 1u))
+        return -1;
+
+    uint8_t hdr[FRAME_HDR_MAX];
+    all[0] = (struct iovec){ hdr, (size_t)frame_header(hdr, type, tag, (uint32_t)plen) };
+    return sendv_full(fd, all, 1 + iovcnt, 0);
+}
+
+int send_frame(int fd, uint8_t type, const uint8_t *payload, uint32_t plen) {
+    struct iovec iov = { (void *)payload, plen };
+    return send_framev(fd, type, 0, &iov, 1);
+}
+
+// Receive a full frame. Caller frame_buf_frees *payload_out. *tag_out,
+// if asked for, is 0 for an untagged frame
+int recv_frame(int fd, uint8_t *type_out, uint32_t *tag_out,
+               uint8_t **payload_out, uint32_t *plen_out) {
     uint32_t be_len;
     int r = read_full(fd, &be_len, 4); 
     if (r <= 0) return r; 
@@ -64,20 +251,375 @@ int recv_frame(int fd, uint8_t *type_out, uint8_t **payload_out, uint32_t *plen_
     r = read_full(fd, &type, 1); // Read 1-byte type
     if (r <= 0) return r;
 
+    uint32_t tag = 0, be_tag;
+    if (type & FRAME_TAGGED) {
+        if (len < 5) return -1;
+        r = read_full(fd, &be_tag, 4);
+        if (r <= 0) return r;
+        tag = ntohl(be_tag);
+        type &= (uint8_t)~FRAME_TAGGED;
+        len -= 4;
+    }
+
     uint32_t plen = len - 1; // Payload length
     uint8_t *buf = NULL;
     if (plen) {
-        buf = (uint8_t *)malloc(plen); 
+        buf = frame_buf_alloc(plen);
         if (!buf) return -1;
         r = read_full(fd, buf, plen); 
         if (r <= 0) {
-            free(buf);
+            frame_buf_free(buf);
             return r;
         }
     }
 
     *type_out = type;
+    if (tag_out)
+        *tag_out = tag;
     *payload_out = buf;
     *plen_out = plen;
     return 1;
-}
\ No newline at end of file
+}
+
+// Header frame of a chunked body: F_BEGIN with the body's tag, type and
+// length. Returns the frame's size on the wire
+int body_begin_frame(uint8_t out[FRAME_HDR_MAX + 5], uint8_t type,
+                     uint32_t tag, uint32_t plen) {
+    int n = frame_header(out, F_BEGIN, tag, 5);
+    uint32_t be_total = htonl(plen);
+    out[n] = type;
+    memcpy(out + n + 1, &be_total, 4);
+    return n + 5;
+}
+
+// Send a payload of any size gathered from iov. Small ones are a single
+// frame; larger ones are split so neither side ever needs a frame bigger
+// than CHUNK_SIZE. Each chunk, header and all, is one sendmsg
+int send_bodyv(int fd, uint8_t type, uint32_t tag,
+               const struct iovec *iov, int iovcnt) {
+    if (iovcnt > FRAME_IOV_MAX)
+        return -1;
+
+    uint64_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    if (total <= CHUNK_SIZE)
+        return send_framev(fd, type, tag, iov, iovcnt);
+    if (total > MAX_BODY)
+        return -1;
+
+    uint8_t begin[FRAME_HDR_MAX + 5], chunk[FRAME_HDR_MAX], end[FRAME_HDR_MAX];
+    int begin_len = body_begin_frame(begin, type, tag, (uint32_t)total);
+    int end_len = frame_header(end, F_END, 0, 0);
+
+    int seg = 0;       // Source segment and offset within it
+    size_t seg_off = 0;
+    for (uint64_t off = 0; off < total; ) {
+        uint32_t n = total - off < CHUNK_SIZE ? (uint32_t)(total - off) : CHUNK_SIZE;
+        int chunk_len = frame_header(chunk, F_CHUNK, 0, n);
+
+        struct iovec out[3 + FRAME_IOV_MAX];
+        int cnt = 0;
+        if (off == 0)
+            out[cnt++] = (struct iovec){ begin, (size_t)begin_len };
+        out[cnt++] = (struct iovec){ chunk, (size_t)chunk_len };
+        for (uint32_t want = n; want; ) {
+            size_t take = iov[seg].iov_len - seg_off;
+            if (take > want) take = want;
+            if (take)
+                out[cnt++] = (struct iovec){
+                    (uint8_t *)iov[seg].iov_base + seg_off, take };
+            seg_off += take;
+            want -= (uint32_t)take;
+            if (seg_off == iov[seg].iov_len) {
+                seg++;
+                seg_off = 0;
+            }
+        }
+        off += n;
+        if (off == total)
+            out[cnt++] = (struct iovec){ end, (size_t)end_len };
+        if (sendv_full(fd, out, cnt, 0) != 1)
+            return -1;
+    }
+    return 1;
+}
+
+int send_body(int fd, uint8_t type, const uint8_t *payload, uint32_t plen) {
+    struct iovec iov = { (void *)payload, plen };
+    return send_bodyv(fd, type, 0, &iov, 1);
+}
+
+// Send payload[from, from + n) after the header 'hdr'. Bytes at and past
+// file_from go out of file_fd with sendfile; the rest from memory
+static int send_span(int sock, const uint8_t *hdr, size_t hlen,
+                     const uint8_t *payload, uint32_t from, uint32_t n,
+                     int file_fd, uint32_t file_from) {
+    uint32_t end = from + n;
+    uint32_t mem_end = end < file_from ? end : file_from;
+    if (mem_end < from)
+        mem_end = from;
+
+    struct iovec iov[2] = {
+        { (void *)hdr, hlen },
+        { (void *)(payload + from), mem_end - from },
+    };
+    int more = mem_end < end; // file bytes follow, don't push a short segment
+    if (sendv_full(sock, iov, 2, more ? MSG_MORE : 0) != 1)
+        return -1;
+    if (!more)
+        return 1;
+    return sendfile_full(sock, file_fd, (off_t)(mem_end - file_from),
+                         end - mem_end);
+}
+
+// send_body for a payload whose bytes from file_from on are also the
+// contents of file_fd, which must stay unchanged until this returns
+// Those bytes go socket to page cache with sendfile, never through a buffer
+int send_body_file(int sock, uint8_t type, uint32_t tag,
+                   const uint8_t *payload, uint32_t plen,
+                   int file_fd, uint32_t file_from) {
+    if (file_fd < 0) {
+        struct iovec iov = { (void *)payload, plen };
+        return send_bodyv(sock, type, tag, &iov, 1);
+    }
+    if (plen > MAX_BODY)
+        return -1;
+
+    uint8_t hdr[FRAME_HDR_MAX];
+    if (plen <= CHUNK_SIZE) {
+        int hlen = frame_header(hdr, type, tag, plen);
+        return send_span(sock, hdr, (size_t)hlen, payload, 0, plen,
+                         file_fd, file_from);
+    }
+
+    uint8_t begin[FRAME_HDR_MAX + 5];
+    struct iovec iov = { begin, (size_t)body_begin_frame(begin, type, tag, plen) };
+    if (sendv_full(sock, &iov, 1, MSG_MORE) != 1)
+        return -1;
+    for (uint32_t off = 0; off < plen; ) {
+        uint32_t n = plen - off < CHUNK_SIZE ? plen - off : CHUNK_SIZE;
+        int hlen = frame_header(hdr, F_CHUNK, 0, n);
+        if (send_span(sock, hdr, (size_t)hlen, payload, off, n,
+                      file_fd, file_from) != 1)
+            return -1;
+        off += n;
+    }
+    return send_frame(sock, F_END, NULL, 0);
+}
+
+static atomic_size_t body_total; // Sum of every assembler's cap
+
+void body_init(struct BodyAssembler *b) {
+    memset(b, 0, sizeof(*b));
+}
+
+void body_free(struct BodyAssembler *b) {
+    atomic_fetch_sub_explicit(&body_total, b->cap, memory_order_relaxed);
+    frame_buf_free(b->buf);
+    body_init(b);
+}
+
+// Make room for n more bytes: double up to the announced total, as long as
+// all bodies together stay under BODY_INFLIGHT_MAX
+static int body_reserve(struct BodyAssembler *b, uint32_t n) {
+    if (b->got + n <= b->cap)
+        return 0;
+    uint32_t cap = b->cap ? b->cap : CHUNK_SIZE;
+    while (cap < b->got + n)
+        cap *= 2;
+    if (cap > b->len)
+        cap = b->len;
+
+    size_t grow = cap - b->cap;
+    if (atomic_fetch_add_explicit(&body_total, grow, memory_order_relaxed) +
+        grow > BODY_INFLIGHT_MAX) {
+        atomic_fetch_sub_explicit(&body_total, grow, memory_order_relaxed);
+        return -1;
+    }
+    uint8_t *buf = frame_buf_alloc(cap);
+    if (!buf) {
+        atomic_fetch_sub_explicit(&body_total, grow, memory_order_relaxed);
+        return -1;
+    }
+    if (b->got) memcpy(buf, b->buf, b->got);
+    frame_buf_free(b->buf);
+    b->buf = buf;
+    b->cap = cap;
+    return 0;
+}
+
+// Replace a FRAME_COMPRESSED message with its raw payload
+static int inflate_message(uint8_t *type, uint8_t **payload, uint32_t *plen) {
+    if (!(*type & FRAME_COMPRESSED))
+        return 1;
+
+    uint32_t raw_len = 0;
+    uint8_t *raw = NULL;
+    int rc = lz_packed_len(*payload, *plen, MAX_BODY, &raw_len);
+    if (rc == 0 && !(raw = frame_buf_alloc(raw_len)))
+        rc = -1;
+    if (rc == 0)
+        rc = lz_unpack(*payload, *plen, raw, raw_len);
+    frame_buf_free(*payload);
+    *payload = NULL;
+    if (rc != 0) {
+        frame_buf_free(raw);
+        return -1;
+    }
+    *type &= (uint8_t)~FRAME_COMPRESSED;
+    *payload = raw;
+    *plen = raw_len;
+    return 1;
+}
+
+// Run one received frame through the assembler; takes ownership of
+// *payload. Returns 1 when (*type, *tag, *payload, *plen) hold a message
+// to handle, 0 when the frame was absorbed into a body, -1 on a bad
+// sequence
+int body_feed(struct BodyAssembler *b, uint8_t *type, uint32_t *tag,
+              uint8_t **payload, uint32_t *plen) {
+    uint8_t t = *type;
+    if (t != F_BEGIN && t != F_CHUNK && t != F_END) {
+        if (b->active)
+            goto bad; // Nothing may interrupt a body
+        return inflate_message(type, payload, plen);
+    }
+
+    if (t == F_BEGIN) {
+        if (b->active || *plen != 5)
+            goto bad;
+        uint32_t be_total;
+        memcpy(&be_total, *payload + 1, 4);
+        uint32_t total = ntohl(be_total);
+        if (total <= CHUNK_SIZE || total > MAX_BODY)
+            goto bad;
+        b->type = (*payload)[0];
+        b->tag = *tag;
+        b->len = total;
+        b->got = 0;
+        b->active = 1;
+    } else if (t == F_CHUNK) {
+        if (!b->active || *plen > CHUNK_SIZE || *plen > b->len - b->got ||
+            body_reserve(b, *plen) != 0)
+            goto bad;
+        if (*plen) memcpy(b->buf + b->got, *payload, *plen);
+        b->got += *plen;
+    } else {
+        if (!b->active || b->got != b->len || *plen != 0)
+            goto bad;
+        frame_buf_free(*payload);
+        *type = b->type;
+        *tag = b->tag;
+        *payload = b->buf;
+        *plen = b->len;
+        b->buf = NULL;
+        body_free(b); // The message is the caller's now, not in flight
+        return inflate_message(type, payload, plen);
+    }
+    frame_buf_free(*payload);
+    *payload = NULL;
+    return 0;
+
+bad:
+    frame_buf_free(*payload);
+    *payload = NULL;
+    body_free(b);
+    return -1;
+}
+
+// Blocking receive of one whole message, chunked or not
+int recv_message(int fd, uint8_t *type_out, uint32_t *tag_out,
+                 uint8_t **payload_out, uint32_t *plen_out) {
+    struct BodyAssembler b;
+    body_init(&b);
+    uint32_t tag = 0;
+    for (;;) {
+        *payload_out = NULL;
+        int r = recv_frame(fd, type_out, &tag, payload_out, plen_out);
+        if (r <= 0) {
+            body_free(&b);
+            return r;
+        }
+        r = body_feed(&b, type_out, &tag, payload_out, plen_out);
+        if (r != 0) {
+            if (tag_out)
+                *tag_out = tag;
+            return r;
+        }
+    }
+}
+
+void frame_parser_init(struct FrameParser *fp) {
+    memset(fp, 0, sizeof(*fp));
+    fp->hdr_len = 5;
+}
+
+void frame_parser_free(struct FrameParser *fp) {
+    frame_buf_free(fp->payload);
+    frame_parser_init(fp);
+}
+
+// Consume up to n bytes from buf. *used_out says how many were taken
+// Returns 1 when a frame completed (caller owns *payload_out), 0 when more
+// bytes are needed, -1 on a malformed length
+int frame_parser_feed(struct FrameParser *fp, const uint8_t *buf, size_t n,
+                      size_t *used_out, uint8_t *type_out, uint32_t *tag_out,
+                      uint8_t **payload_out, uint32_t *plen_out) {
+    size_t used = 0;
+
+    // Header first; it may itself be split across reads, and only its
+    // type says whether a tag follows
+    while (fp->hdr_got < fp->hdr_len) {
+        size_t take = fp->hdr_len - fp->hdr_got;
+        if (take > n - used) take = n - used;
+        memcpy(fp->hdr + fp->hdr_got, buf + used, take);
+        fp->hdr_got += (uint32_t)take;
+        used += take;
+        if (fp->hdr_got < fp->hdr_len) {
+            *used_out = used;
+            return 0;
+        }
+        if (fp->hdr_len == 5 && (fp->hdr[4] & FRAME_TAGGED)) {
+            fp->hdr_len = FRAME_HDR_MAX;
+            continue;
+        }
+
+        uint32_t be_len;
+        memcpy(&be_len, fp->hdr, 4);
+        uint32_t len = ntohl(be_len);
+        if (len < fp->hdr_len - 4 || len > MAX_MSG) {
+            *used_out = used;
+            return -1;
+        }
+        fp->plen = len - (fp->hdr_len - 4);
+        fp->got = 0;
+        if (fp->plen) {
+            fp->payload = frame_buf_alloc(fp->plen);
+            if (!fp->payload) {
+                *used_out = used;
+                return -1;
+            }
+        }
+    }
+
+    size_t take = fp->plen - fp->got;
+    if (take > n - used) take = n - used;
+    if (take) memcpy(fp->payload + fp->got, buf + used, take);
+    fp->got += (uint32_t)take;
+    used += take;
+    *used_out = used;
+    if (fp->got < fp->plen)
+        return 0;
+
+    // Frame complete: hand the payload over and start the next header
+    uint32_t be_tag = 0;
+    if (fp->hdr_len == FRAME_HDR_MAX)
+        memcpy(&be_tag, fp->hdr + 5, 4);
+    *type_out = fp->hdr[4] & (uint8_t)~FRAME_TAGGED;
+    *tag_out = ntohl(be_tag);
+    *payload_out = fp->payload;
+    *plen_out = fp->plen;
+    frame_parser_init(fp);
+    return 1;
+}
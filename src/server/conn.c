@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include "conn.h"
+#include "lz.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Every live connection
+static struct Registry {
+    struct Conn **conns;
+    size_t n, cap;
+    pthread_mutex_t mu;
+} reg = { .mu = PTHREAD_MUTEX_INITIALIZER };
+
+struct Conn *conn_new(int fd, int epfd) {
+    struct Conn *c = calloc(1, sizeof(*c));
+    if (!c)
+        return NULL;
+    c->fd = fd;
+    c->epfd = epfd;
+    pthread_mutex_init(&c->wmu, NULL);
+    frame_parser_init(&c->parser);
+    body_init(&c->body);
+    c->bodies_tail = &c->bodies;
+    atomic_init(&c->refs, 1);
+    stats_gauge(STAT_CONNS, 1);
+    return c;
+}
+
+void conn_hold(struct Conn *c) {
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+}
+
+// Drop a reference. The last one closes fd and frees c; the owner drops
+// its own once c is out of the registry
+void conn_put(struct Conn *c) {
+    if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    close(c->fd);
+    frame_parser_free(&c->parser);
+    body_free(&c->body);
+    while (c->bodies) {
+        struct OutBody *b = c->bodies;
+        c->bodies = b->next;
+        b->owner.release(b->owner.ptr);
+        free(b);
+    }
+    free(c->out.data);
+    free(c->in);
+    free(c->subs);
+    free(c->deferred);
+    pthread_mutex_destroy(&c->wmu);
+    free(c);
+    stats_gauge(STAT_CONNS, -1);
+}
+
+// Append bytes to the pending queue, compacting or growing it as needed
+static int outbuf_append(struct OutBuf *o, const void *data, size_t n) {
+    if (o->off == o->len) {
+        o->off = o->len = 0;
+    }
+    if (o->len + n > o->cap && o->off) {
+        memmove(o->data, o->data + o->off, o->len - o->off);
+        o->len -= o->off;
+        o->off = 0;
+    }
+    if (o->len + n > o->cap) {
+        size_t cap = o->cap ? o->cap : 4096;
+        while (cap < o->len + n) cap *= 2;
+        uint8_t *p = realloc(o->data, cap);
+        if (!p)
+            return -1;
+        o->data = p;
+        o->cap = cap;
+    }
+    memcpy(o->data + o->len, data, n);
+    o->len += n;
+    return 0;
+}
+
+// Set the frame header b sends next: 'type' carrying n body bytes
+static void body_next_header(struct OutBody *b, uint8_t type, uint32_t n) {
+    b->hdr_len = (uint8_t)frame_header(b->hdr, type, 0, n);
+    b->hdr_off = 0;
+    b->chunk_left = n;
+}
+
+// Send as much of a queued body as the socket takes. Each header goes out
+// with the chunk bytes behind it; bytes the owner also has in a file go
+// with sendfile. Returns 1 when it is all out, 0 if the socket would
+// block, -1 on error
+static int body_flush(struct Conn *c, struct OutBody *b) {
+    for (;;) {
+        if (b->hdr_off == b->hdr_len && !b->chunk_left) {
+            if (b->off < b->len) {
+                uint32_t left = b->len - b->off;
+                body_next_header(b, F_CHUNK, left < CHUNK_SIZE ? left : CHUNK_SIZE);
+            } else if (!b->ended) {
+                body_next_header(b, F_END, 0);
+                b->ended = 1;
+            } else {
+                return 1;
+            }
+        }
+
+        // Chunk bytes that must come from memory: all of them, or those
+        // before the file copy starts
+        uint32_t mem = b->chunk_left;
+        int fd = b->owner.file_fd;
+        if (fd >= 0)
+            mem = b->off >= b->owner.file_from ? 0
+                : b->owner.file_from - b->off < mem ? b->owner.file_from - b->off
+                : mem;
+
+        ssize_t w;
+        size_t hdr_left = b->hdr_len - b->hdr_off;
+        if (hdr_left || mem) {
+            struct iovec iov[2] = {
+                { b->hdr + b->hdr_off, hdr_left },
+                { (void *)(b->data + b->off), mem },
+            };
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+            w = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (b->ended ? 0 : MSG_MORE));
+        } else {
+            off_t foff = (off_t)(b->off - b->owner.file_from);
+            w = sendfile(c->fd, fd, &foff, b->chunk_left);
+            if (w == 0)
+                return -1; // file is shorter than promised
+        }
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0; // EWOULDBLOCK on Linux too
+            return -1;
+        }
+
+        size_t got = (size_t)w;
+        size_t h = got < hdr_left ? got : hdr_left;
+        b->hdr_off = (uint8_t)(b->hdr_off + h);
+        b->off += (uint32_t)(got - h);
+        b->chunk_left -= (uint32_t)(got - h);
+    }
+}
+
+// Ask epoll for what c waits on: requests unless paused, and EPOLLOUT
+// while something is queued. Caller holds wmu
+static int arm_locked(struct Conn *c, int want_out) {
+    struct epoll_event ev = {
+        .events = (c->paused ? 0 : EPOLLIN) | (want_out ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+        return -1;
+    c->want_out = want_out;
+    return 1;
+}
+
+// Write queued bytes and bodies, in order, until the socket would block
+// Caller holds wmu
+static int flush_locked(struct Conn *c) {
+    struct OutBuf *o = &c->out;
+    for (;;) {
+        // Plain bytes up to where the next body goes
+        struct OutBody *b = c->bodies;
+        size_t n = o->len - o->off;
+        if (b && b->at - c->out_sent < n)
+            n = (size_t)(b->at - c->out_sent);
+        if (n) {
+            ssize_t w = send(c->fd, o->data + o->off, n, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) break;
+                return -1;
+            }
+            o->off += (size_t)w;
+            c->out_sent += (uint64_t)w;
+            continue;
+        }
+        if (!b)
+            break;
+
+        int r = body_flush(c, b);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        c->bodies = b->next;
+        if (!c->bodies)
+            c->bodies_tail = &c->bodies;
+        c->nbodies--;
+        b->owner.release(b->owner.ptr);
+        free(b);
+    }
+
+    // Only ask for EPOLLOUT while something is actually waiting
+    int want = o->off < o->len || c->bodies;
+    if (want != c->want_out)
+        return arm_locked(c, want);
+    return 1;
+}
+
+// Mark a connection as failed and wake its owner so it gets closed
+static void kill_locked(struct Conn *c) {
+    c->dead = 1;
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+// Write one frame to a connection without interleaving with other writers
+// Blocking sockets write through; reactor sockets queue what doesn't fit
+static int send_raw(struct Conn *c, uint8_t type, uint32_t tag,
+                    const uint8_t *payload, uint32_t plen) {
+    pthread_mutex_lock(&c->wmu);
+    if (c->epfd < 0) {
+        struct iovec iov = { (void *)payload, plen };
+        int ok = send_framev(c->fd, type, tag, &iov, 1);
+        pthread_mutex_unlock(&c->wmu);
+        return ok;
+    }
+
+    if (c->dead) {
+        pthread_mutex_unlock(&c->wmu);
+        return -1;
+    }
+
+    uint8_t hdr[FRAME_HDR_MAX];
+    size_t hlen = (size_t)frame_header(hdr, type, tag, plen);
+
+    // Nothing queued: hand header and payload to the kernel in one call and
+    // copy only what it doesn't take
+    size_t sent = 0;
+    if (c->out.off == c->out.len && !c->bodies) {
+        struct iovec iov[2] = {
+            { hdr, hlen },
+            { (void *)payload, plen },
+        };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+        ssize_t w;
+        do {
+            w = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        } while (w < 0 && errno == EINTR);
+        if (w < 0 && errno != EAGAIN) {
+            kill_locked(c);
+            pthread_mutex_unlock(&c->wmu);
+            return -1;
+        }
+        if (w > 0) {
+            sent = (size_t)w;
+            c->out_sent += sent;
+        }
+    }
+    size_t hsent = sent < hlen ? sent : hlen;
+    size_t psent = sent - hsent;
+    if (sent == hlen + plen) {
+        pthread_mutex_unlock(&c->wmu);
+        return 1;
+    }
+
+    int ok = 1;
+    if (c->out.len - c->out.off + hlen + plen > MAX_PENDING_OUT ||
+        (hsent < hlen &&
+         outbuf_append(&c->out, hdr + hsent, hlen - hsent) != 0) ||
+        (plen > psent && outbuf_append(&c->out, payload + psent, plen - psent) != 0) ||
+        flush_locked(c) != 1) {
+        kill_locked(c);
+        ok = -1;
+    }
+    pthread_mutex_unlock(&c->wmu);
+    return ok;
+}
+
+// Compress when the peer asked for it, outside wmu so other writers don't
+// wait on it. plen must fit in one frame; see send_message_body for larger
+static int send_message(struct Conn *c, uint8_t type, uint32_t tag,
+                        const uint8_t *payload, uint32_t plen) {
+    uint8_t *z;
+    uint32_t zlen;
+    if (plen >= LZ_MIN_INPUT && type < F_BEGIN &&
+        atomic_load_explicit(&c->compress, memory_order_relaxed) &&
+        lz_pack(payload, plen, &z, &zlen) == 0) {
+        int ok = send_raw(c, type | FRAME_COMPRESSED, tag, z, zlen);
+        free(z);
+        return ok;
+    }
+    return send_raw(c, type, tag, payload, plen);
+}
+
+// Bodies above CHUNK_SIZE go out chunked; a reactor socket that can't take
+// one right away keeps a reference and streams it from the buffer later
+static int send_body_raw(struct Conn *c, uint8_t type, uint32_t tag,
+                         const uint8_t *payload, uint32_t plen,
+                         const struct BodyOwner *owner) {
+    if (plen <= CHUNK_SIZE)
+        return send_raw(c, type, tag, payload, plen);
+
+    pthread_mutex_lock(&c->wmu);
+    if (c->epfd < 0) {
+        int ok = send_body_file(c->fd, type, tag, payload, plen,
+                                owner->file_fd, owner->file_from);
+        pthread_mutex_unlock(&c->wmu);
+        return ok;
+    }
+
+    struct OutBody *b = NULL;
+    if (c->dead || plen > MAX_BODY || c->nbodies >= MAX_PENDING_BODIES ||
+        !(b = calloc(1, sizeof(*b)))) {
+        kill_locked(c);
+        pthread_mutex_unlock(&c->wmu);
+        return -1;
+    }
+
+    b->at = c->out_sent + (c->out.len - c->out.off);
+    b->type = type;
+    b->data = payload;
+    b->len = plen;
+    b->hdr_len = (uint8_t)body_begin_frame(b->hdr, type, tag, plen);
+    b->owner = *owner;
+    owner->hold(owner->ptr);
+    *c->bodies_tail = b;
+    c->bodies_tail = &b->next;
+    c->nbodies++;
+
+    int ok = flush_locked(c);
+    if (ok != 1)
+        kill_locked(c);
+    pthread_mutex_unlock(&c->wmu);
+    return ok;
+}
+
+// Send a payload of any size that lives in a refcounted buffer, using the
+// owner's compressed copy for peers that negotiated it
+static int send_message_body(struct Conn *c, uint8_t type, uint32_t tag,
+                             const uint8_t *payload, uint32_t plen,
+                             const struct BodyOwner *owner) {
+    if (!atomic_load_explicit(&c->compress, memory_order_relaxed))
+        return send_body_raw(c, type, tag, payload, plen, owner);
+    if (!owner->packed)
+        return plen <= CHUNK_SIZE
+            ? send_message(c, type, tag, payload, plen)
+            : send_body_raw(c, type, tag, payload, plen, owner);
+
+    uint32_t zlen;
+    const uint8_t *z = owner->packed(owner->ptr, &zlen);
+    if (!z)
+        return send_body_raw(c, type, tag, payload, plen, owner);
+    struct BodyOwner zo = *owner;
+    zo.file_fd = -1; // The file holds the raw bytes
+    return send_body_raw(c, type | FRAME_COMPRESSED, tag, z, zlen, &zo);
+}
+
+int conn_send(struct Conn *c, uint8_t type,
+              const uint8_t *payload, uint32_t plen) {
+    return send_message(c, type, 0, payload, plen);
+}
+
+int conn_send_body(struct Conn *c, uint8_t type, const uint8_t *payload,
+                   uint32_t plen, const struct BodyOwner *owner) {
+    return send_message_body(c, type, 0, payload, plen, owner);
+}
+
+int conn_reply(struct Conn *c, uint8_t type,
+               const uint8_t *payload, uint32_t plen) {
+    return send_message(c, type, c->tag, payload, plen);
+}
+
+int conn_reply_body(struct Conn *c, uint8_t type, const uint8_t *payload,
+                    uint32_t plen, const struct BodyOwner *owner) {
+    return send_message_body(c, type, c->tag, payload, plen, owner);
+}
+
+// Called by the owning reactor on EPOLLOUT
+int conn_flush(struct Conn *c) {
+    pthread_mutex_lock(&c->wmu);
+    int ok = c->dead ? -1 : flush_locked(c);
+    if (ok != 1)
+        kill_locked(c);
+    pthread_mutex_unlock(&c->wmu);
+    return ok;
+}
+
+// Stop or resume reading c's requests; replies and pushes still go out
+// Reactor mode, owner only
+int conn_pause(struct Conn *c, int paused) {
+    pthread_mutex_lock(&c->wmu);
+    c->paused = paused;
+    int ok = c->dead ? -1 : arm_locked(c, c->want_out);
+    pthread_mutex_unlock(&c->wmu);
+    return ok;
+}
+
+int registry_add(struct Conn *c) {
+    pthread_mutex_lock(&reg.mu);
+    if (reg.n == reg.cap) {
+        size_t cap = reg.cap ? reg.cap * 2 : 16;
+        struct Conn **conns = realloc(reg.conns, cap * sizeof(*conns));
+        if (!conns) {
+            pthread_mutex_unlock(&reg.mu);
+            return -1;
+        }
+        reg.conns = conns;
+        reg.cap = cap;
+    }
+    reg.conns[reg.n++] = c;
+    pthread_mutex_unlock(&reg.mu);
+    return 0;
+}
+
+static void sublist_remove(struct SubList *l, const struct Conn *c) {
+    pthread_mutex_lock(&l->mu);
+    for (size_t i = 0; i < l->n; i++) {
+        if (l->conns[i] == c) {
+            l->conns[i] = l->conns[--l->n]; // order doesn't matter
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l->mu);
+}
+
+// Also drops c from every document it subscribed to, so no broadcaster
+// can reach it once this returns
+void registry_remove(struct Conn *c) {
+    for (size_t i = 0; i < c->nsubs; i++)
+        sublist_remove(c->subs[i], c);
+    c->nsubs = 0;
+
+    pthread_mutex_lock(&reg.mu);
+    for (size_t i = 0; i < reg.n; i++) {
+        if (reg.conns[i] == c) {
+            reg.conns[i] = reg.conns[--reg.n]; // order doesn't matter
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reg.mu);
+}
+
+void sublist_init(struct SubList *l) {
+    memset(l, 0, sizeof(*l));
+    pthread_mutex_init(&l->mu, NULL);
+}
+
+// Subscribe c to a document. Called by c's owner; subscribing twice is a no-op
+int sublist_add(struct SubList *l, struct Conn *c) {
+    for (size_t i = 0; i < c->nsubs; i++)
+        if (c->subs[i] == l)
+            return 0;
+
+    if (c->nsubs == c->subs_cap) {
+        size_t cap = c->subs_cap ? c->subs_cap * 2 : 4;
+        struct SubList **subs = realloc(c->subs, cap * sizeof(*subs));
+        if (!subs)
+            return -1;
+        c->subs = subs;
+        c->subs_cap = cap;
+    }
+
+    pthread_mutex_lock(&l->mu);
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        struct Conn **conns = realloc(l->conns, cap * sizeof(*conns));
+        if (!conns) {
+            pthread_mutex_unlock(&l->mu);
+            return -1;
+        }
+        l->conns = conns;
+        l->cap = cap;
+    }
+    l->conns[l->n++] = c;
+    pthread_mutex_unlock(&l->mu);
+
+    c->subs[c->nsubs++] = l;
+    return 0;
+}
+
+static int conn_cmp(const void *a, const void *b) {
+    const struct Conn *x = *(struct Conn *const *)a;
+    const struct Conn *y = *(struct Conn *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Send a frame once to every conn on any of the lists except 'skip' (the
+// client whose PUT produced it, which already got its answer). The lists
+// are only locked to take a reference to each conn, so a slow subscriber
+// never holds up the others or anyone subscribing. With an owner the
+// payload may be a large body; see conn_send_body
+void sublist_broadcast(struct SubList *const *lists, size_t nlists,
+                       const struct Conn *skip, uint8_t type,
+                       const uint8_t *payload, uint32_t plen,
+                       const struct BodyOwner *owner) {
+    struct Conn *few[64];
+    struct Conn **to = few;
+    size_t n = 0, cap = sizeof(few) / sizeof(few[0]);
+
+    for (size_t k = 0; k < nlists; k++) {
+        struct SubList *l = lists[k];
+        pthread_mutex_lock(&l->mu);
+        for (size_t i = 0; i < l->n; i++) {
+            struct Conn *c = l->conns[i];
+            if (c == skip)
+                continue;
+            if (n == cap) {
+                struct Conn **more = malloc(cap * 2 * sizeof(*more));
+                if (!more) {
+                    shutdown(c->fd, SHUT_RDWR); // Resyncs when it reconnects
+                    continue;
+                }
+                memcpy(more, to, n * sizeof(*more));
+                if (to != few)
+                    free(to);
+                to = more;
+                cap *= 2;
+            }
+            conn_hold(c);
+            to[n++] = c;
+        }
+        pthread_mutex_unlock(&l->mu);
+    }
+
+    // A conn on several lists hears it once
+    if (nlists > 1)
+        qsort(to, n, sizeof(*to), conn_cmp);
+    for (size_t i = 0; i < n; i++) {
+        struct Conn *c = to[i];
+        if (i && c == to[i - 1]) {
+            conn_put(c);
+            continue;
+        }
+        int ok = owner ? conn_send_body(c, type, payload, plen, owner)
+                       : conn_send(c, type, payload, plen);
+        if (ok != 1) {
+            // Slow or dead subscriber: wake its owner so it cleans up
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        conn_put(c);
+    }
+    if (to != few)
+        free(to);
+}
@@ -0,0 +1,484 @@
+/*
+ * Sequence CRDT for collaborative editing, RGA style, over bytes.
+ *
+ * Every inserted byte has a unique id (site, clock), where clocks are
+ * Lamport timestamps: a new insert gets a clock above every clock its site
+ * has seen. An insert names the byte to its left (its origin) and lands
+ * right after it, past any bytes there with greater ids; those were
+ * inserted concurrently at the same spot, or after seeing this one. So
+ * every replica orders concurrent inserts the same way without asking
+ * anyone. Deletes only mark bytes, so ops naming them still resolve, and
+ * ops that arrive before the bytes they name wait until those do.
+ *
+ * The sequence is an array of runs rather than a list of bytes: typing
+ * makes one run per burst, and a whole run is skipped or matched in one
+ * comparison because the ids inside it only grow.
+ *
+ * Nothing here sees keystrokes. Ops come from diffing a saved file
+ * against the replica's text, line by line as merge.h does.
+ */
+
+#define _GNU_SOURCE
+#include "crdt.h"
+#include "merge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define CRDT_NONE UINT32_MAX
+
+static void put32(uint8_t *p, uint32_t v) {
+    uint32_t be = htonl(v);
+    memcpy(p, &be, 4);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t be;
+    memcpy(&be, p, 4);
+    return ntohl(be);
+}
+
+// Id order: clock first, site breaks ties
+static int id_after(uint32_t s1, uint32_t c1, uint32_t s2, uint32_t c2) {
+    return c1 > c2 || (c1 == c2 && s1 > s2);
+}
+
+static int reserve_blocks(struct Crdt *c, uint32_t extra) {
+    if (c->n + extra <= c->cap)
+        return 0;
+    uint32_t cap = c->cap ? c->cap : 16;
+    while (cap < c->n + extra)
+        cap *= 2;
+    struct CrdtBlock *b = realloc(c->blocks, cap * sizeof(*b));
+    if (!b)
+        return -1;
+    c->blocks = b;
+    c->cap = cap;
+    return 0;
+}
+
+static int insert_block(struct Crdt *c, uint32_t i, struct CrdtBlock b) {
+    if (reserve_blocks(c, 1) != 0)
+        return -1;
+    memmove(c->blocks + i + 1, c->blocks + i, (c->n - i) * sizeof(b));
+    c->blocks[i] = b;
+    c->n++;
+    return 0;
+}
+
+// Cut block i so its first k bytes stay in it and the rest follow as i + 1
+static int split(struct Crdt *c, uint32_t i, uint32_t k) {
+    struct CrdtBlock tail = c->blocks[i];
+    tail.clock += k;
+    tail.off += k;
+    tail.len -= k;
+    if (insert_block(c, i + 1, tail) != 0)
+        return -1;
+    c->blocks[i].len = k;
+    return 0;
+}
+
+// Fold block i into i - 1 when it simply continues it
+static void try_merge(struct Crdt *c, uint32_t i) {
+    if (i == 0 || i >= c->n)
+        return;
+    struct CrdtBlock *a = &c->blocks[i - 1], *b = &c->blocks[i];
+    if (a->site != b->site || a->clock + a->len != b->clock ||
+        a->deleted != b->deleted || (!a->deleted && a->off + a->len != b->off))
+        return;
+    a->len += b->len;
+    memmove(b, b + 1, (c->n - i - 1) * sizeof(*b));
+    c->n--;
+}
+
+// Block holding id (site, clock) and the byte's offset in it
+static uint32_t find_id(const struct Crdt *c, uint32_t site, uint32_t clock,
+                        uint32_t *k_out) {
+    for (uint32_t i = 0; i < c->n; i++) {
+        const struct CrdtBlock *b = &c->blocks[i];
+        if (b->site == site && clock >= b->clock && clock - b->clock < b->len) {
+            *k_out = clock - b->clock;
+            return i;
+        }
+    }
+    return CRDT_NONE;
+}
+
+static int append_text(struct Crdt *c, const uint8_t *data, uint32_t len,
+                       uint32_t *off_out) {
+    if (len > UINT32_MAX - c->text_len)
+        return -1;
+    if (c->text_len + len > c->text_cap) {
+        uint32_t cap = c->text_cap ? c->text_cap : 256;
+        while (cap < c->text_len + len)
+            cap = cap > UINT32_MAX / 2 ? UINT32_MAX : cap * 2;
+        uint8_t *t = realloc(c->text, cap);
+        if (!t)
+            return -1;
+        c->text = t;
+        c->text_cap = cap;
+    }
+    memcpy(c->text + c->text_len, data, len);
+    *off_out = c->text_len;
+    c->text_len += len;
+    return 0;
+}
+
+// 0 once applied (repeats change nothing), 1 if the origin hasn't
+// arrived yet, -1 if out of memory
+static int integrate_insert(struct Crdt *c, uint32_t site, uint32_t clock,
+                            uint32_t osite, uint32_t oclock,
+                            const uint8_t *data, uint32_t len) {
+    uint32_t k;
+    if (len == 0 || site == 0 || clock == 0 || clock > UINT32_MAX - len ||
+        find_id(c, site, clock, &k) != CRDT_NONE)
+        return 0;
+
+    uint32_t i = 0;          // Origin (0, 0) is the start of the document
+    if (osite || oclock) {
+        uint32_t o = find_id(c, osite, oclock, &k);
+        if (o == CRDT_NONE)
+            return 1;
+        if (k + 1 < c->blocks[o].len && split(c, o, k + 1) != 0)
+            return -1;
+        i = o + 1;
+    }
+    while (i < c->n &&
+           id_after(c->blocks[i].site, c->blocks[i].clock, site, clock))
+        i++;
+
+    uint32_t off;
+    if (append_text(c, data, len, &off) != 0 ||
+        insert_block(c, i, (struct CrdtBlock){ site, clock, len, off, 0 }) != 0)
+        return -1;
+    try_merge(c, i);
+    c->visible += len;
+    if (clock + len - 1 > c->clock)
+        c->clock = clock + len - 1;
+    return 0;
+}
+
+// Whether every id from (site, clock) on for len bytes has arrived
+static int all_known(const struct Crdt *c, uint32_t site, uint32_t clock,
+                     uint32_t len) {
+    while (len) {
+        uint32_t k;
+        uint32_t i = find_id(c, site, clock, &k);
+        if (i == CRDT_NONE)
+            return 0;
+        uint32_t take = c->blocks[i].len - k;
+        if (take >= len)
+            return 1;
+        clock += take;
+        len -= take;
+    }
+    return 1;
+}
+
+// Same results as integrate_insert
+static int integrate_delete(struct Crdt *c, uint32_t site, uint32_t clock,
+                            uint32_t len) {
+    if (clock > UINT32_MAX - len)
+        return 0;
+    if (!all_known(c, site, clock, len))
+        return 1;
+    while (len) {
+        uint32_t k;
+        uint32_t i = find_id(c, site, clock, &k);
+        if (k && split(c, i++, k) != 0)
+            return -1;
+        uint32_t take = len < c->blocks[i].len ? len : c->blocks[i].len;
+        if (take < c->blocks[i].len && split(c, i, take) != 0)
+            return -1;
+        if (!c->blocks[i].deleted) {
+            c->blocks[i].deleted = 1;
+            c->visible -= take;
+        }
+        try_merge(c, i + 1);
+        try_merge(c, i);
+        clock += take;
+        len -= take;
+    }
+    return 0;
+}
+
+// Start a replica holding data, as inserted by 'site' at the start
+int crdt_init(struct Crdt *c, uint32_t site, const uint8_t *data, uint32_t len) {
+    memset(c, 0, sizeof(*c));
+    return integrate_insert(c, site, 1, 0, 0, data, len);
+}
+
+void crdt_free(struct Crdt *c) {
+    free(c->blocks);
+    free(c->text);
+    free(c->pending);
+    memset(c, 0, sizeof(*c));
+}
+
+// Check a run of encoded ops is well formed before touching the replica
+static int ops_valid(const uint8_t *ops, uint32_t len) {
+    uint32_t off = 0;
+    while (off < len) {
+        if (ops[off] == CRDT_INSERT && len - off >= 21 &&
+            get32(ops + off + 17) <= len - off - 21)
+            off += 21 + get32(ops + off + 17);
+        else if (ops[off] == CRDT_DELETE && len - off >= 13)
+            off += 13;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+static int defer_op(struct Crdt *c, const uint8_t *op, uint32_t len) {
+    if (len > CRDT_PENDING_MAX - c->pending_len)
+        return -1;
+    if (c->pending_len + len > c->pending_cap) {
+        uint32_t cap = c->pending_cap ? c->pending_cap : 256;
+        while (cap < c->pending_len + len)
+            cap *= 2;
+        uint8_t *p = realloc(c->pending, cap);
+        if (!p)
+            return -1;
+        c->pending = p;
+        c->pending_cap = cap;
+    }
+    memcpy(c->pending + c->pending_len, op, len);
+    c->pending_len += len;
+    return 0;
+}
+
+// Apply well-formed ops, deferring those that aren't ready. *progress is
+// set if any of them was
+static int apply_ops(struct Crdt *c, const uint8_t *ops, uint32_t len,
+                     int *progress) {
+    uint32_t off = 0;
+    while (off < len) {
+        const uint8_t *p = ops + off + 1;
+        uint32_t op_len = ops[off] == CRDT_INSERT ? 21 + get32(p + 16) : 13;
+        int rc = ops[off] == CRDT_INSERT
+            ? integrate_insert(c, get32(p), get32(p + 4), get32(p + 8),
+                               get32(p + 12), p + 20, get32(p + 16))
+            : integrate_delete(c, get32(p), get32(p + 4), get32(p + 8));
+        if (rc < 0 || (rc == 1 && defer_op(c, ops + off, op_len) != 0))
+            return -1;
+        if (rc == 0)
+            *progress = 1;
+        off += op_len;
+    }
+    return 0;
+}
+
+// Apply a run of encoded ops, then whatever they let through of the ops
+// still waiting. -1 if they are malformed, with nothing applied, if memory
+// ran out partway or if more than CRDT_PENDING_MAX bytes would wait
+int crdt_apply(struct Crdt *c, const uint8_t *ops, uint32_t len) {
+    if (!ops_valid(ops, len))
+        return -1;
+    int progress = 0;
+    if (apply_ops(c, ops, len, &progress) != 0)
+        return -1;
+    while (progress && c->pending_len) {
+        uint8_t *waiting = c->pending;
+        uint32_t waiting_len = c->pending_len;
+        c->pending = NULL;
+        c->pending_len = c->pending_cap = 0;
+        progress = 0;
+        int rc = apply_ops(c, waiting, waiting_len, &progress);
+        free(waiting);
+        if (rc != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// The visible bytes, in a malloc'd buffer (never NULL on success)
+int crdt_text(const struct Crdt *c, uint8_t **out, uint32_t *len_out) {
+    uint8_t *buf = malloc(c->visible ? c->visible : 1);
+    if (!buf)
+        return -1;
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < c->n; i++) {
+        const struct CrdtBlock *b = &c->blocks[i];
+        if (!b->deleted) {
+            memcpy(buf + off, c->text + b->off, b->len);
+            off += b->len;
+        }
+    }
+    *out = buf;
+    *len_out = off;
+    return 0;
+}
+
+static void put_delete(uint8_t *op, uint32_t site, uint32_t clock,
+                       uint32_t len) {
+    op[0] = CRDT_DELETE;
+    put32(op + 1, site);
+    put32(op + 5, clock);
+    put32(op + 9, len);
+}
+
+// Ops that turn the visible text into data, made by 'site' and already
+// applied here. Lines that didn't change keep their ids: each changed run
+// of lines, trimmed to the bytes that differ, becomes one delete per
+// block it covers and one insert. An edit that swept over unchanged text
+// would delete it and insert a copy, and a concurrent edit in there would
+// then land next to the copy. *ops_out is NULL when the text already is
+// data
+int crdt_diff(struct Crdt *c, uint32_t site, const uint8_t *data, uint32_t len,
+              uint8_t **ops_out, uint32_t *ops_len) {
+    *ops_out = NULL;
+    *ops_len = 0;
+    uint8_t *old;
+    uint32_t old_len;
+    if (crdt_text(c, &old, &old_len) != 0)
+        return -1;
+    struct MergeEdit *e = NULL;
+    uint32_t ne = 0;
+    if (merge_diff(old, old_len, data, len, &e, &ne) != 0) {
+        free(old);
+        return -1;
+    }
+
+    // Hunks are whole lines; most edits change a few bytes of one
+    size_t cap = ((size_t)c->n + ne) * 13;
+    for (uint32_t k = 0; k < ne; k++) {
+        struct MergeEdit *h = &e[k];
+        while (h->a_from < h->a_to && h->b_from < h->b_to &&
+               old[h->a_from] == data[h->b_from]) {
+            h->a_from++;
+            h->b_from++;
+        }
+        while (h->a_from < h->a_to && h->b_from < h->b_to &&
+               old[h->a_to - 1] == data[h->b_to - 1]) {
+            h->a_to--;
+            h->b_to--;
+        }
+        cap += 21 + (size_t)(h->b_to - h->b_from);
+    }
+    free(old);
+    uint8_t *ops = ne && cap <= UINT32_MAX ? malloc(cap) : NULL;
+    if (!ops) {
+        free(e);
+        return ne ? -1 : 0;
+    }
+
+    // One pass over the blocks: edits come in text order, and a block
+    // reaching past an edit is kept for the next one
+    uint32_t n = 0, bi = 0, pos = 0;
+    uint32_t clock = c->clock + 1;
+    for (uint32_t k = 0; k < ne; k++) {
+        uint32_t from = e[k].a_from, to = e[k].a_to;
+        uint32_t ins = e[k].b_to - e[k].b_from;
+        uint32_t osite = 0, oclock = 0; // The byte left of the edit
+        for (; bi < c->n; bi++) {
+            const struct CrdtBlock *b = &c->blocks[bi];
+            if (b->deleted)
+                continue;
+            uint32_t end = pos + b->len;
+            if (from > pos && from <= end) {
+                osite = b->site;
+                oclock = b->clock + (from - pos) - 1;
+            }
+            uint32_t df = from > pos ? from : pos;
+            uint32_t dt = to < end ? to : end;
+            if (df < dt) {
+                put_delete(ops + n, b->site, b->clock + (df - pos), dt - df);
+                n += 13;
+            }
+            if (end > to)
+                break;
+            pos = end;
+        }
+
+        if (ins) {
+            if (clock > UINT32_MAX - ins) {
+                free(ops);
+                free(e);
+                return -1;
+            }
+            ops[n] = CRDT_INSERT;
+            put32(ops + n + 1, site);
+            put32(ops + n + 5, clock);
+            put32(ops + n + 9, osite);
+            put32(ops + n + 13, oclock);
+            put32(ops + n + 17, ins);
+            memcpy(ops + n + 21, data + e[k].b_from, ins);
+            n += 21 + ins;
+            clock += ins;
+        }
+    }
+    free(e);
+
+    if (n == 0 || crdt_apply(c, ops, n) != 0) {
+        free(ops);
+        return n == 0 ? 0 : -1;
+    }
+    *ops_out = ops;
+    *ops_len = n;
+    return 0;
+}
+
+// Whole replica for a joining client:
+//   [u32 clock][u32 nblocks], then per block
+//   [u32 site][u32 clock][u32 len][u8 deleted][len bytes unless deleted]
+int crdt_encode(const struct Crdt *c, uint8_t **out, uint32_t *len_out) {
+    size_t need = 8 + (size_t)c->n * 13 + c->visible;
+    uint8_t *buf = need <= UINT32_MAX ? malloc(need) : NULL;
+    if (!buf)
+        return -1;
+    put32(buf, c->clock);
+    put32(buf + 4, c->n);
+    size_t off = 8;
+    for (uint32_t i = 0; i < c->n; i++) {
+        const struct CrdtBlock *b = &c->blocks[i];
+        put32(buf + off, b->site);
+        put32(buf + off + 4, b->clock);
+        put32(buf + off + 8, b->len);
+        buf[off + 12] = (uint8_t)b->deleted;
+        off += 13;
+        if (!b->deleted) {
+            memcpy(buf + off, c->text + b->off, b->len);
+            off += b->len;
+        }
+    }
+    *out = buf;
+    *len_out = (uint32_t)off;
+    return 0;
+}
+
+int crdt_decode(struct Crdt *c, const uint8_t *p, uint32_t len) {
+    memset(c, 0, sizeof(*c));
+    if (len < 8)
+        return -1;
+    c->clock = get32(p);
+    uint32_t nb = get32(p + 4);
+    if (nb > (len - 8) / 13 || reserve_blocks(c, nb) != 0)
+        goto bad;
+
+    uint32_t off = 8;
+    for (uint32_t i = 0; i < nb; i++) {
+        if (len - off < 13)
+            goto bad;
+        struct CrdtBlock b = {
+            get32(p + off), get32(p + off + 4), get32(p + off + 8), 0,
+            p[off + 12] != 0,
+        };
+        off += 13;
+        if (!b.deleted) {
+            if (b.len > len - off || append_text(c, p + off, b.len, &b.off) != 0)
+                goto bad;
+            off += b.len;
+            c->visible += b.len;
+        }
+        c->blocks[c->n++] = b;
+    }
+    if (off != len)
+        goto bad;
+    return 0;
+
+bad:
+    crdt_free(c);
+    return -1;
+}
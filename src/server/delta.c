@@ -0,0 +1,279 @@
+/*
+ * rsync-style delta encoding. The base is split into fixed blocks indexed
+ * by a rolling weak checksum; the target is scanned one byte at a time and
+ * every checksum hit is confirmed before it becomes a COPY. Unlike rsync,
+ * the encoder always has both versions in memory, so candidates are
+ * confirmed with memcmp instead of a strong hash, and matches are extended
+ * byte by byte past block edges to keep literal runs as short as possible.
+ */
+
+#define _GNU_SOURCE
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define DELTA_MIN_BLOCK 64u
+#define DELTA_MAX_BLOCK 8192u
+
+// Growable output buffer for encoded ops
+struct DeltaBuf {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+static int buf_put(struct DeltaBuf *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n) cap *= 2;
+        uint8_t *d = realloc(b->data, cap);
+        if (!d)
+            return -1;
+        b->data = d;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+static int buf_put_u32(struct DeltaBuf *b, uint32_t v) {
+    uint32_t be = htonl(v);
+    return buf_put(b, &be, 4);
+}
+
+static int emit_insert(struct DeltaBuf *b, const uint8_t *p, uint32_t n) {
+    if (!n)
+        return 0;
+    uint8_t op = DELTA_INSERT;
+    if (buf_put(b, &op, 1) || buf_put_u32(b, n) || buf_put(b, p, n))
+        return -1;
+    return 0;
+}
+
+static int emit_copy(struct DeltaBuf *b, uint32_t off, uint32_t n) {
+    uint8_t op = DELTA_COPY;
+    if (buf_put(b, &op, 1) || buf_put_u32(b, off) || buf_put_u32(b, n))
+        return -1;
+    return 0;
+}
+
+// Roughly sqrt(len), the classic rsync trade-off between index size
+// and how much of a changed block has to be resent
+static uint32_t pick_block_size(uint32_t base_len) {
+    uint32_t bs = DELTA_MIN_BLOCK;
+    while (bs < DELTA_MAX_BLOCK && (uint64_t)bs * bs < base_len) bs *= 2;
+    return bs;
+}
+
+// rsync weak checksum: a = sum of bytes, b = sum of running a
+static uint32_t weak_sum(const uint8_t *p, uint32_t n, uint32_t *a_out,
+                         uint32_t *b_out) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        a += p[i];
+        b += (n - i) * p[i];
+    }
+    *a_out = a & 0xffff;
+    *b_out = b & 0xffff;
+    return *a_out | (*b_out << 16);
+}
+
+int delta_encode(const uint8_t *base, uint32_t base_len,
+                 const uint8_t *target, uint32_t target_len,
+                 uint8_t **delta_out, uint32_t *delta_len_out) {
+    struct DeltaBuf out = {0};
+    if (buf_put_u32(&out, target_len) != 0)
+        return -1;
+
+    uint32_t bs = pick_block_size(base_len);
+    uint32_t nblocks = base_len / bs;
+
+    // Chained hash index of every full base block by weak checksum
+    uint32_t nbuckets = 1;
+    while (nbuckets < nblocks * 2) nbuckets *= 2;
+    int32_t *heads = malloc(nbuckets * sizeof(*heads));
+    int32_t *next = malloc((nblocks ? nblocks : 1) * sizeof(*next));
+    uint32_t *sums = malloc((nblocks ? nblocks : 1) * sizeof(*sums));
+    if (!heads || !next || !sums) {
+        free(heads); free(next); free(sums); free(out.data);
+        return -1;
+    }
+    memset(heads, 0xff, nbuckets * sizeof(*heads)); // all -1
+    for (uint32_t j = 0; j < nblocks; j++) {
+        uint32_t a, b;
+        sums[j] = weak_sum(base + (size_t)j * bs, bs, &a, &b);
+        uint32_t h = sums[j] & (nbuckets - 1);
+        next[j] = heads[h];
+        heads[h] = (int32_t)j;
+    }
+
+    int rc = 0;
+    uint32_t lit = 0; // Start of pending literal bytes
+    uint32_t i = 0;
+    uint32_t a = 0, b = 0, sum = 0;
+    int have_sum = 0;
+
+    while (nblocks && i + bs <= target_len) {
+        if (!have_sum) {
+            sum = weak_sum(target + i, bs, &a, &b);
+            have_sum = 1;
+        }
+
+        int32_t hit = -1;
+        for (int32_t j = heads[sum & (nbuckets - 1)]; j >= 0; j = next[j]) {
+            if (sums[j] == sum &&
+                memcmp(base + (size_t)j * bs, target + i, bs) == 0) {
+                hit = j;
+                break;
+            }
+        }
+
+        if (hit < 0) {
+            // Roll the window one byte forward
+            if (i + bs < target_len) {
+                uint8_t out_b = target[i], in_b = target[i + bs];
+                a = (a - out_b + in_b) & 0xffff;
+                b = (b - bs * out_b + a) & 0xffff;
+                sum = a | (b << 16);
+            } else {
+                have_sum = 0;
+            }
+            i++;
+            continue;
+        }
+
+        // Grow the match backwards into the literal and forwards past the block
+        uint32_t boff = (uint32_t)hit * bs, toff = i;
+        while (toff > lit && boff > 0 && base[boff - 1] == target[toff - 1]) {
+            boff--;
+            toff--;
+        }
+        uint32_t end = i + bs, bend = (uint32_t)hit * bs + bs;
+        while (end < target_len && bend < base_len &&
+               base[bend] == target[end]) {
+            end++;
+            bend++;
+        }
+
+        if (emit_insert(&out, target + lit, toff - lit) != 0 ||
+            emit_copy(&out, boff, end - toff) != 0) {
+            rc = -1;
+            break;
+        }
+        i = lit = end;
+        have_sum = 0;
+    }
+
+    if (rc == 0 && emit_insert(&out, target + lit, target_len - lit) != 0)
+        rc = -1;
+
+    free(heads);
+    free(next);
+    free(sums);
+    if (rc != 0 || out.len > UINT32_MAX) {
+        free(out.data);
+        return -1;
+    }
+    *delta_out = out.data;
+    *delta_len_out = (uint32_t)out.len;
+    return 0;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    uint32_t be;
+    memcpy(&be, p, 4);
+    return ntohl(be);
+}
+
+// Rebuild the target from base + delta. Every op is bounds checked since
+// the delta comes off the network
+int delta_apply(const uint8_t *base, uint32_t base_len,
+                const uint8_t *delta, uint32_t delta_len,
+                uint8_t **out, uint32_t *out_len) {
+    if (delta_len < 4)
+        return -1;
+    uint32_t target_len = get_u32(delta);
+
+    uint8_t *buf = NULL;
+    if (target_len) {
+        buf = malloc(target_len);
+        if (!buf)
+            return -1;
+    }
+
+    uint32_t pos = 4, w = 0;
+    while (pos < delta_len) {
+        uint8_t op = delta[pos++];
+        if (op == DELTA_COPY && delta_len - pos >= 8) {
+            uint32_t off = get_u32(delta + pos);
+            uint32_t n = get_u32(delta + pos + 4);
+            pos += 8;
+            if (off > base_len || n > base_len - off || n > target_len - w)
+                goto bad;
+            if (n) memcpy(buf + w, base + off, n);
+            w += n;
+        } else if (op == DELTA_INSERT && delta_len - pos >= 4) {
+            uint32_t n = get_u32(delta + pos);
+            pos += 4;
+            if (n > delta_len - pos || n > target_len - w)
+                goto bad;
+            if (n) memcpy(buf + w, delta + pos, n);
+            pos += n;
+            w += n;
+        } else {
+            goto bad;
+        }
+    }
+    if (w != target_len)
+        goto bad;
+
+    *out = buf;
+    *out_len = target_len;
+    return 0;
+
+bad:
+    free(buf);
+    return -1;
+}
+
+// How much of the target the delta leaves as it was: *head bytes at the
+// start copied from the start of the base, *tail at the end from its end.
+// Trusts the delta to apply, so only call it with one that did
+void delta_unchanged(const uint8_t *delta, uint32_t delta_len,
+                     uint32_t base_len, uint32_t *head, uint32_t *tail) {
+    *head = *tail = 0;
+    if (delta_len < 4)
+        return;
+    uint32_t target_len = get_u32(delta);
+
+    uint32_t pos = 4, w = 0, run = 0;
+    int at_head = 1, at_tail = 0;
+    while (pos < delta_len) {
+        uint8_t op = delta[pos++];
+        uint32_t off = 0, n;
+        if (op == DELTA_COPY && delta_len - pos >= 8) {
+            off = get_u32(delta + pos);
+            n = get_u32(delta + pos + 4);
+            pos += 8;
+        } else if (op == DELTA_INSERT && delta_len - pos >= 4) {
+            n = get_u32(delta + pos);
+            pos += 4 + n;
+        } else {
+            return;
+        }
+        if (op == DELTA_COPY && at_head && off == w)
+            *head += n;
+        else
+            at_head = 0;
+        // The tail is the last run of copies that each sit as far from the
+        // base's end as they do from the target's
+        int aligned = op == DELTA_COPY &&
+                      (uint64_t)off + target_len == (uint64_t)w + base_len;
+        run = !aligned ? 0 : at_tail ? run + n : n;
+        at_tail = aligned;
+        w += n;
+    }
+    *tail = at_tail ? run : 0;
+}
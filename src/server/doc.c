@@ -0,0 +1,577 @@
+/*
+ * Document table: every file the server hosts, found by name when a client
+ * opens it and by id on every request after that. Documents already under
+ * the root are loaded at startup, new ones on first open, and all stay
+ * resident until the server exits.
+ *
+ * A merkle.h tree mirrors the table, so a reconnecting client can compare
+ * directory hashes and only list the subtrees that changed.
+ */
+
+#define _GNU_SOURCE
+#include "doc.h"
+#include "hash.h"
+#include "lz.h"
+#include "merkle.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#define LOAD_STRIPES 16 // Loads of names in different stripes run at once
+
+static struct DocTable {
+    char root[PATH_MAX];     // Directory holding every document
+    int journaled;
+    enum JournalSync sync;
+    pthread_rwlock_t lock;   // Writers only when adding a loaded document
+    pthread_mutex_t load_mu[LOAD_STRIPES]; // By name hash: one loader a name
+    struct Doc **by_id;
+    uint32_t n, cap;
+    struct Doc **buckets;    // Chained hash map by name
+    uint32_t nbuckets;       // Power of two
+    struct MerkleNode *tree; // Every document's head hash, by path
+    pthread_mutex_t tree_mu; // Taken after t.lock or a d->mu, never before
+} t = { .lock = PTHREAD_RWLOCK_INITIALIZER,
+        .tree_mu = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t name_hash(const char *p, size_t n) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < n; i++) {
+        h ^= (uint8_t)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Names are relative paths under the root. Reject anything that could
+// escape it or collide with the server's own .tmp/.journal files
+static int name_valid(const char *name, size_t len) {
+    if (len == 0 || len > DOC_NAME_MAX || name[0] == '/')
+        return 0;
+    if (memchr(name, '\0', len))
+        return 0;
+
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && name[i] != '/')
+            continue;
+        size_t n = i - start;
+        if (n == 0 || (n == 1 && name[start] == '.') ||
+            (n == 2 && name[start] == '.' && name[start + 1] == '.'))
+            return 0;
+        start = i + 1;
+    }
+
+    const char *reserved[] = { ".tmp", ".journal" };
+    for (size_t k = 0; k < 2; k++) {
+        size_t rl = strlen(reserved[k]);
+        if (len >= rl && memcmp(name + len - rl, reserved[k], rl) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+// mkdir -p for every directory above path
+static int make_parent_dirs(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
+// Replace file at 'path' with 'data' of length n atomically
+// Writes to a temp file and renames it into place. With keep_fd, the
+// file stays open there: later renames never change what it reads
+static int write_and_rename(const char *path, const uint8_t *data, size_t len,
+                            int *keep_fd) {
+    char tmp[PATH_MAX]; // Temporary file path
+    int needed = snprintf(tmp, sizeof(tmp), "%s.tmp", path); // e.g., "file.txt.tmp"
+    if (needed < 0 || (size_t)needed >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    int fd = open(tmp, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) 
+        return -1; 
+    
+    if (len && write_full(fd, data, len) != 1) {
+        close(fd);
+        return -1;
+    }
+    if (!keep_fd && close(fd) != 0) 
+        return -1;
+    
+    if (rename(tmp, path) != 0) {
+        if (keep_fd)
+            close(fd);
+        return -1; 
+    }
+    if (keep_fd)
+        *keep_fd = fd;
+    return 0;
+}   
+
+int atomic_write_file(const char *path, const uint8_t *data, size_t len,
+                      int *keep_fd) {
+    uint64_t start = stats_now();
+    int rc = write_and_rename(path, data, len, keep_fd);
+    stats_since(HIST_DISK_WRITE, start);
+    return rc;
+}
+
+// Load initial state from disk -> See struct Doc
+// If file does not exist, initialize empty state with version 0
+static int load_initial(struct Doc *d, uint8_t **content, uint32_t *len_out) {
+    int fd = open(d->path, O_RDONLY | O_CLOEXEC); 
+    if (fd < 0) {
+        if (errno == ENOENT) { 
+            *content = NULL; 
+            *len_out = 0;
+            d->version = 0; 
+            return 0;
+        }
+        return -1; 
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t len = (size_t)st.st_size; // File size in bytes
+    uint8_t *buf = NULL;
+    if (len > UINT32_MAX) {
+        close(fd);
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (len) {
+        buf = malloc(len); // Allocate buffer
+        if (!buf) {
+            close(fd);
+            return -1;
+        }
+        if (read_full(fd, buf, len) != 1) { // Read full file
+            free(buf);
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+    *content = buf; 
+    *len_out = (uint32_t)len;   
+    d->version = 0; 
+    return 0; 
+}
+
+// Pick up where the last run stopped. In journal mode that is the
+// journal's latest version; a first run seeds the journal from the file
+static int load_state(struct Doc *d, uint8_t **content, uint32_t *len) {
+    d->journaled = t.journaled;
+    if (!d->journaled)
+        return load_initial(d, content, len);
+
+    int rc = journal_open(&d->journal, d->path, t.sync,
+                          &d->version, content, len);
+    if (rc != 1)
+        return rc;
+
+    if (load_initial(d, content, len) != 0)
+        return -1;
+    return journal_compact(&d->journal, d->version, *content, *len);
+}
+
+// Wrap a version's bytes in a snapshot with one reference for the caller
+struct Snapshot *snapshot_new(uint32_t id, uint32_t version,
+                              const uint8_t *data, uint32_t len) {
+    if (len > MAX_BODY - 12)
+        return NULL; // Too big to send
+    uint8_t *buf = frame_buf_alloc(12 + len);
+    if (!buf)
+        return NULL;
+    if (len) memcpy(buf + 12, data, len);
+    return snapshot_adopt(id, version, buf, len);
+}
+
+// Same, but the content already sits at buf + 12 in a frame buffer, as in
+// a received C_PUT, so publishing it copies nothing. Takes ownership of
+// buf, even on failure
+struct Snapshot *snapshot_adopt(uint32_t id, uint32_t version,
+                                uint8_t *buf, uint32_t len) {
+    struct Snapshot *s = len <= MAX_BODY - 12 ? malloc(sizeof(*s)) : NULL;
+    if (!s) {
+        frame_buf_free(buf);
+        return NULL;
+    }
+    s->payload = buf;
+    atomic_init(&s->refs, 1);
+    pthread_mutex_init(&s->zmu, NULL);
+    s->zstate = 0;
+    s->z = NULL;
+    s->zlen = 0;
+    s->fd = -1;
+    s->version = version;
+    s->len = len;
+    s->plen = 12 + len;
+
+    uint32_t hdr[3] = { htonl(id), htonl(version), htonl(len) };
+    memcpy(s->payload, hdr, sizeof(hdr));
+    s->hash = hash64(s->payload + 12, len);
+    return s;
+}
+
+void snapshot_put(struct Snapshot *s) {
+    if (s && atomic_fetch_sub_explicit(&s->refs, 1, memory_order_acq_rel) == 1) {
+        if (s->fd >= 0)
+            close(s->fd);
+        pthread_mutex_destroy(&s->zmu);
+        free(s->z);
+        frame_buf_free(s->payload);
+        free(s);
+    }
+}
+
+static void snapshot_hold(void *p) {
+    struct Snapshot *s = p;
+    atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+}
+
+static void snapshot_release(void *p) {
+    snapshot_put(p);
+}
+
+// Compress the payload once and share it among all compressing peers
+// NULL when it doesn't shrink enough to be worth it
+static const uint8_t *snapshot_packed(void *p, uint32_t *len) {
+    struct Snapshot *s = p;
+    pthread_mutex_lock(&s->zmu);
+    if (s->zstate == 0)
+        s->zstate = lz_pack(s->payload, s->plen, &s->z, &s->zlen) == 0 ? 1 : -1;
+    const uint8_t *z = s->zstate == 1 ? s->z : NULL;
+    *len = s->zlen;
+    pthread_mutex_unlock(&s->zmu);
+    return z;
+}
+
+// Lets a connection keep the snapshot alive while it streams from it,
+// sending the content out of the on-disk copy when there is one
+struct BodyOwner snapshot_owner(struct Snapshot *s) {
+    return (struct BodyOwner){ snapshot_hold, snapshot_release, s, s->fd, 12,
+                               snapshot_packed };
+}
+
+// Take a reference to the head version. Doesn't touch d->mu, so readers
+// never wait for a writer's merge or disk write
+struct Snapshot *doc_snapshot(struct Doc *d) {
+    pthread_spin_lock(&d->snap_lock);
+    struct Snapshot *s = d->snap;
+    atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+    pthread_spin_unlock(&d->snap_lock);
+    return s;
+}
+
+// Make s the head version, taking over the caller's reference. Caller
+// holds d->mu; readers still holding the old snapshot keep it alive
+void doc_publish_locked(struct Doc *d, struct Snapshot *s) {
+    d->content = s->payload + 12;
+    d->content_len = s->len;
+    d->version = s->version;
+
+    pthread_spin_lock(&d->snap_lock);
+    struct Snapshot *old = d->snap;
+    d->snap = s;
+    pthread_spin_unlock(&d->snap_lock);
+    snapshot_put(old);
+
+    if (d->leaf) {
+        pthread_mutex_lock(&t.tree_mu);
+        d->leaf->version = s->version;
+        merkle_set(d->leaf, s->hash);
+        pthread_mutex_unlock(&t.tree_mu);
+    }
+}
+
+static int load_dir(const char *rel);
+
+int doc_table_init(const char *root, int journaled, enum JournalSync sync) {
+    int needed = snprintf(t.root, sizeof(t.root), "%s", root);
+    if (needed < 0 || (size_t)needed >= sizeof(t.root)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(t.root, 0755) != 0 && errno != EEXIST)
+        return -1;
+
+    t.journaled = journaled;
+    t.sync = sync;
+    for (int i = 0; i < LOAD_STRIPES; i++)
+        pthread_mutex_init(&t.load_mu[i], NULL);
+    t.nbuckets = 64;
+    t.buckets = calloc(t.nbuckets, sizeof(*t.buckets));
+    t.tree = merkle_new();
+    if (!t.buckets || !t.tree)
+        return -1;
+    return load_dir("");
+}
+
+// Caller holds t.lock
+static struct Doc *lookup_locked(const char *name, size_t len) {
+    uint32_t h = name_hash(name, len) & (t.nbuckets - 1);
+    for (struct Doc *d = t.buckets[h]; d; d = d->next)
+        if (strlen(d->name) == len && memcmp(d->name, name, len) == 0)
+            return d;
+    return NULL;
+}
+
+// Double the hash map once it averages one document per bucket
+static int grow_buckets_locked(void) {
+    uint32_t nb = t.nbuckets * 2;
+    struct Doc **b = calloc(nb, sizeof(*b));
+    if (!b)
+        return -1;
+    for (uint32_t i = 0; i < t.n; i++) {
+        struct Doc *d = t.by_id[i];
+        uint32_t h = name_hash(d->name, strlen(d->name)) & (nb - 1);
+        d->next = b[h];
+        b[h] = d;
+    }
+    free(t.buckets);
+    t.buckets = b;
+    t.nbuckets = nb;
+    return 0;
+}
+
+// Free what doc_load built, for a document that never made it into the table
+static void doc_unload(struct Doc *d, struct Snapshot *snap) {
+    snapshot_put(snap);
+    history_free(&d->hist);
+    journal_close(&d->journal);
+    free(d);
+}
+
+// Read a document from disk into a fresh Doc, or start it empty. Runs
+// without t.lock, so nobody looking up other documents waits on the disk
+// *snap_out is its head, with the id left for doc_open to fill in
+static struct Doc *doc_load(const char *name, size_t len,
+                            struct Snapshot **snap_out) {
+    struct Doc *d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+    memcpy(d->name, name, len);
+    d->journal.fd = -1;
+    uint8_t *content = NULL;
+    uint32_t content_len = 0;
+    struct Snapshot *snap = NULL;
+    int needed = snprintf(d->path, sizeof(d->path), "%s/%s", t.root, d->name);
+    if (needed < 0 || (size_t)needed >= sizeof(d->path) - 16 || // room for suffixes
+        make_parent_dirs(d->path) != 0 ||
+        load_state(d, &content, &content_len) != 0 ||
+        !(snap = snapshot_new(0, d->version, content, content_len)) ||
+        history_init(&d->hist, d->version, content, content_len) != 0) {
+        perror(d->name);
+        free(content);
+        doc_unload(d, snap);
+        return NULL;
+    }
+    free(content);
+    pthread_spin_init(&d->snap_lock, PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&d->mu, NULL);
+    sublist_init(&d->subs);
+    sublist_init(&d->crdt_subs);
+    *snap_out = snap;
+    return d;
+}
+
+// Find a document by name, loading it (or starting it empty) on first use
+struct Doc *doc_open(const char *name, size_t len) {
+    if (!name_valid(name, len))
+        return NULL;
+
+    pthread_rwlock_rdlock(&t.lock);
+    struct Doc *d = lookup_locked(name, len);
+    pthread_rwlock_unlock(&t.lock);
+    if (d)
+        return d;
+
+    // Only one loader per name, so a journal is never opened, or seeded,
+    // twice. The first may have finished while this one waited
+    pthread_mutex_t *load_mu =
+        &t.load_mu[name_hash(name, len) % LOAD_STRIPES];
+    pthread_mutex_lock(load_mu);
+    pthread_rwlock_rdlock(&t.lock);
+    d = lookup_locked(name, len);
+    pthread_rwlock_unlock(&t.lock);
+    if (d) {
+        pthread_mutex_unlock(load_mu);
+        return d;
+    }
+
+    struct Snapshot *snap = NULL;
+    d = doc_load(name, len, &snap);
+    if (!d) {
+        pthread_mutex_unlock(load_mu);
+        return NULL;
+    }
+
+    // Adding it is all the write lock covers. Every insert holds the
+    // name's load_mu, so no other can have added it meanwhile
+    pthread_rwlock_wrlock(&t.lock);
+    if (t.n == t.cap) {
+        uint32_t cap = t.cap ? t.cap * 2 : 64;
+        struct Doc **ids = realloc(t.by_id, cap * sizeof(*ids));
+        if (!ids)
+            goto fail;
+        t.by_id = ids;
+        t.cap = cap;
+    }
+    if (t.n >= t.nbuckets && grow_buckets_locked() != 0)
+        goto fail;
+
+    d->id = t.n;
+    uint32_t be_id = htonl(d->id);
+    memcpy(snap->payload, &be_id, 4);
+    doc_publish_locked(d, snap); // not shared yet, no lock needed
+    t.by_id[t.n++] = d;
+    uint32_t h = name_hash(name, len) & (t.nbuckets - 1);
+    d->next = t.buckets[h];
+    t.buckets[h] = d;
+
+    // Still under t.lock, so no publish can run before the leaf exists.
+    // Without one the document just stays out of tree listings
+    pthread_mutex_lock(&t.tree_mu);
+    d->leaf = merkle_add(t.tree, d->name, len, snap->hash);
+    if (d->leaf) {
+        d->leaf->doc_id = d->id;
+        d->leaf->version = d->version;
+    }
+    pthread_mutex_unlock(&t.tree_mu);
+    pthread_rwlock_unlock(&t.lock);
+    pthread_mutex_unlock(load_mu);
+
+    printf("Opened %s (id=%u, version=%u)\n", d->name, d->id, d->version);
+    return d;
+
+fail:
+    pthread_rwlock_unlock(&t.lock);
+    pthread_mutex_unlock(load_mu);
+    doc_unload(d, snap);
+    return NULL;
+}
+
+struct Doc *doc_get(uint32_t id) {
+    pthread_rwlock_rdlock(&t.lock);
+    struct Doc *d = id < t.n ? t.by_id[id] : NULL;
+    pthread_rwlock_unlock(&t.lock);
+    return d;
+}
+
+// Open every document under <root>/<rel>, so tree listings cover files no
+// client has asked for yet. Journal mode keeps <name>.journal and maybe
+// <name>; both stand for <name>
+static int load_dir(const char *rel) {
+    char dir_path[PATH_MAX];
+    int needed = snprintf(dir_path, sizeof(dir_path), "%s/%s", t.root, rel);
+    if (needed < 0 || (size_t)needed >= sizeof(dir_path))
+        return 0; // Too deep to ever open anyway
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return -1;
+
+    struct dirent *e;
+    while ((e = readdir(dir))) {
+        if (e->d_name[0] == '.' &&
+            (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2])))
+            continue;
+        char name[DOC_NAME_MAX + 16];
+        needed = snprintf(name, sizeof(name), "%s%s%s", rel, *rel ? "/" : "",
+                          e->d_name);
+        if (needed < 0 || (size_t)needed >= sizeof(name))
+            continue;
+
+        struct stat st;
+        char path[PATH_MAX];
+        needed = snprintf(path, sizeof(path), "%s/%s", t.root, name);
+        if (needed < 0 || (size_t)needed >= sizeof(path) || lstat(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            load_dir(name);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+            continue;
+
+        size_t len = strlen(name), jl = strlen(".journal");
+        if (t.journaled && len > jl && strcmp(name + len - jl, ".journal") == 0)
+            len -= jl;
+        if (name_valid(name, len))
+            doc_open(name, len);
+    }
+    closedir(dir);
+    return 0;
+}
+
+// The S_TREE payload for the directory at path: its hash, then unless the
+// caller's hash already matches it, one entry per child:
+//   [u8 is_dir][u64 hash][u32 doc_id][u32 version][u16 name_len][name]
+// A path that isn't a directory here has hash 0 and no entries. Returns
+// a frame buffer, or NULL if out of memory or too big for one frame
+uint8_t *doc_tree_list(const char *path, size_t len, uint64_t their_hash,
+                       uint32_t *plen_out) {
+    pthread_mutex_lock(&t.tree_mu);
+    struct MerkleNode *dir = merkle_find(t.tree, path, len);
+    if (dir && !dir->is_dir)
+        dir = NULL;
+
+    uint64_t hash = dir ? dir->hash : 0;
+    size_t need = 8;
+    if (dir && hash != their_hash)
+        for (struct MerkleNode *c = dir->children; c; c = c->sibling)
+            need += 19 + strlen(c->name);
+
+    uint8_t *out = need <= MAX_MSG ? frame_buf_alloc((uint32_t)need) : NULL;
+    if (!out) {
+        pthread_mutex_unlock(&t.tree_mu);
+        return NULL;
+    }
+
+    uint32_t hw[2] = { htonl((uint32_t)(hash >> 32)), htonl((uint32_t)hash) };
+    memcpy(out, hw, 8);
+    size_t off = 8;
+    if (dir && hash != their_hash) {
+        for (struct MerkleNode *c = dir->children; c; c = c->sibling) {
+            uint16_t nl = (uint16_t)strlen(c->name);
+            uint32_t w[4] = {
+                htonl((uint32_t)(c->hash >> 32)), htonl((uint32_t)c->hash),
+                htonl(c->doc_id), htonl(c->version),
+            };
+            uint16_t be_nl = htons(nl);
+            out[off++] = (uint8_t)c->is_dir;
+            memcpy(out + off, w, 16);
+            memcpy(out + off + 16, &be_nl, 2);
+            memcpy(out + off + 18, c->name, nl);
+            off += 18 + nl;
+        }
+    }
+    pthread_mutex_unlock(&t.tree_mu);
+    *plen_out = (uint32_t)off;
+    return out;
+}
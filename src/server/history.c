@@ -0,0 +1,162 @@
+/*
+ * Bounded version history. Every version is kept as its list of
+ * content-defined chunks, so rebuilding an old version for a merge is a
+ * copy of its chunks, and versions that share most of their bytes share
+ * most of their chunks in the store. The forward delta from the previous
+ * version is kept alongside for serving "what changed since version v".
+ * When the ring or its byte budget fills, the oldest quarter is dropped.
+ */
+
+#define _GNU_SOURCE
+#include "history.h"
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+int history_init(struct History *h, uint32_t version,
+                 const uint8_t *content, uint32_t len) {
+    memset(h, 0, sizeof(*h));
+    h->oldest = version;
+    uint32_t fresh;
+    return chunk_split(content, len, &h->anchor, &fresh);
+}
+
+void history_free(struct History *h) {
+    for (uint32_t i = 0; i < h->count; i++) {
+        struct HistDelta *d = &h->ring[(h->start + i) % HIST_MAX_VERSIONS];
+        free(d->delta);
+        chunk_list_free(&d->chunks);
+    }
+    chunk_list_free(&h->anchor);
+    memset(h, 0, sizeof(*h));
+}
+
+// An empty history with its head at version, for when history_init can't
+// store the content: nothing is served from it until later versions come
+// and the first of them ages into the anchor
+void history_clear(struct History *h, uint32_t version) {
+    memset(h, 0, sizeof(*h));
+    h->oldest = version;
+    h->anchorless = 1;
+}
+
+// Drop the n oldest versions; the next one becomes the anchor
+static void history_evict(struct History *h, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        struct HistDelta *d = &h->ring[h->start];
+        chunk_list_free(&h->anchor);
+        h->anchor = d->chunks;
+        h->anchorless = 0;
+        memset(&d->chunks, 0, sizeof(d->chunks));
+
+        h->bytes -= d->cost;
+        free(d->delta);
+        d->delta = NULL;
+        h->start = (h->start + 1) % HIST_MAX_VERSIONS;
+        h->count--;
+        h->oldest++;
+    }
+}
+
+// Record the next version: its content and the delta that produced it.
+// Takes ownership of delta
+int history_append(struct History *h, uint8_t *delta, uint32_t len,
+                   const uint8_t *content, uint32_t content_len) {
+    // Commits run under the document lock, so only what the delta touched
+    // is cut again; the rest is the head's chunks
+    static const struct ChunkList none;
+    const struct ChunkList *prev = &none;
+    if (h->count)
+        prev = &h->ring[(h->start + h->count - 1) % HIST_MAX_VERSIONS].chunks;
+    else if (!h->anchorless)
+        prev = &h->anchor;
+    uint32_t head = 0, tail = 0;
+    if (prev->n)
+        delta_unchanged(delta, len, prev->len, &head, &tail);
+
+    struct ChunkList chunks;
+    uint32_t fresh;
+    if (chunk_resplit(prev, head, tail, content, content_len, &chunks,
+                      &fresh) != 0) {
+        free(delta);
+        return -1;
+    }
+    // Charged with the chunks it brought in; ones it shares with older
+    // versions are already paid for
+    uint64_t cost = (uint64_t)len + fresh + chunks.n * sizeof(*chunks.chunks);
+    if (cost > UINT32_MAX)
+        cost = UINT32_MAX;
+
+    if (h->count == HIST_MAX_VERSIONS || h->bytes + cost > HIST_MAX_BYTES) {
+        uint32_t n = h->count / 4 + 1;
+        if (n > h->count) n = h->count;
+        history_evict(h, n);
+        // A single version bigger than the budget keeps the ring empty
+        if (h->bytes + cost > HIST_MAX_BYTES)
+            history_evict(h, h->count);
+    }
+
+    struct HistDelta *d = &h->ring[(h->start + h->count) % HIST_MAX_VERSIONS];
+    d->delta = delta;
+    d->len = len;
+    d->chunks = chunks;
+    d->cost = (uint32_t)cost;
+    h->count++;
+    h->bytes += cost;
+    return 0;
+}
+
+// Pack the deltas taking 'from' to the head as an S_DELTA payload:
+//   u32 from, u32 to, then per step u32 len + delta
+// Returns 1 when 'from' aged out or the chain exceeds max_bytes, so the
+// caller should send the full state instead. The first 'headroom' bytes
+// of *out are left for the caller's own header
+int history_chain(const struct History *h, uint32_t from, uint32_t max_bytes,
+                  uint32_t headroom, uint8_t **out, uint32_t *out_len) {
+    uint32_t head = h->oldest + h->count;
+    if (from < h->oldest || from > head)
+        return 1;
+
+    uint64_t total = headroom + 8;
+    for (uint32_t v = from; v < head; v++)
+        total += 4 + h->ring[(h->start + (v - h->oldest)) % HIST_MAX_VERSIONS].len;
+    if (total > max_bytes || total > UINT32_MAX)
+        return 1;
+
+    uint8_t *buf = malloc(total);
+    if (!buf)
+        return -1;
+
+    uint32_t be_from = htonl(from), be_to = htonl(head);
+    memcpy(buf + headroom, &be_from, 4);
+    memcpy(buf + headroom + 4, &be_to, 4);
+    size_t off = headroom + 8;
+    for (uint32_t v = from; v < head; v++) {
+        const struct HistDelta *d =
+            &h->ring[(h->start + (v - h->oldest)) % HIST_MAX_VERSIONS];
+        uint32_t be_len = htonl(d->len);
+        memcpy(buf + off, &be_len, 4);
+        memcpy(buf + off + 4, d->delta, d->len);
+        off += 4 + d->len;
+    }
+
+    *out = buf;
+    *out_len = (uint32_t)total;
+    return 0;
+}
+
+// Copy out the bytes of an older version from its chunks
+// Returns 1 if the version is no longer retained
+int history_content_at(const struct History *h, uint32_t version,
+                       uint8_t **out, uint32_t *out_len) {
+    if (version < h->oldest || version > h->oldest + h->count ||
+        (version == h->oldest && h->anchorless))
+        return 1;
+    if (version == h->oldest)
+        return chunk_list_join(&h->anchor, out, out_len);
+    const struct HistDelta *d =
+        &h->ring[(h->start + (version - h->oldest - 1)) % HIST_MAX_VERSIONS];
+    return chunk_list_join(&d->chunks, out, out_len);
+}
@@ -0,0 +1,498 @@
+/*
+ * Write-ahead journal for the server's document. Each accepted version is
+ * appended as a small record (usually a delta) instead of rewriting the
+ * whole file, and durability is bought per policy: never, with one shared
+ * fdatasync for every PUT that arrived while the previous one ran (group
+ * commit), or on every record. Event loops that must not wait on the disk
+ * hand the group commit to a flusher thread, which wakes them when it's
+ * done. When the log grows well past the document, that thread also
+ * compacts it into a fresh journal holding a single snapshot.
+ *
+ * Record: u8 kind, u32 version, u32 len, u32 crc32(body), body
+ * Recovery replays records until the first torn or corrupt one and
+ * truncates the tail there.
+ */
+
+#define _GNU_SOURCE
+#include "journal.h"
+#include "comm.h"
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#define REC_HDR 13
+
+// A journal_compact_later request
+struct CompactJob {
+    struct Journal *j;
+    uint32_t version;
+    const uint8_t *content;
+    uint32_t len;
+    uint64_t from;        // Journal size just after version's record
+    void (*done)(void *arg, int rc);
+    void *arg;
+    struct CompactJob *next;
+};
+
+// Journals with records a poller wants synced, and compactions, for the
+// flusher thread
+static struct Flusher {
+    struct Journal *head;
+    struct CompactJob *jobs;
+    void (*wake)(void);   // Called after every sync the flusher runs
+    int started;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} flusher = { .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+static pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t *p, uint32_t n) {
+    pthread_once(&crc_once, crc_init);
+    uint32_t c = 0xFFFFFFFFu;
+    for (uint32_t i = 0; i < n; i++)
+        c = crc_table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void pack_hdr(uint8_t hdr[REC_HDR], uint8_t kind, uint32_t version,
+                     const uint8_t *data, uint32_t len) {
+    uint32_t be_ver = htonl(version), be_len = htonl(len);
+    uint32_t be_crc = htonl(crc32(data, len));
+    hdr[0] = kind;
+    memcpy(hdr + 1, &be_ver, 4);
+    memcpy(hdr + 5, &be_len, 4);
+    memcpy(hdr + 9, &be_crc, 4);
+}
+
+// Make a rename durable by syncing the directory that holds it
+static int sync_dir_of(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    int dfd = open(dirname(tmp), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
+        return -1;
+    int rc = fsync(dfd);
+    close(dfd);
+    return rc;
+}
+
+// Replay every intact record. Returns the offset after the last good one
+static int64_t replay(int fd, uint32_t *version, uint8_t **content,
+                      uint32_t *len, int *have_snapshot) {
+    int64_t good = 0;
+    for (;;) {
+        uint8_t hdr[REC_HDR];
+        if (read_full(fd, hdr, REC_HDR) != 1)
+            return good;
+
+        uint32_t be_ver, be_len, be_crc;
+        memcpy(&be_ver, hdr + 1, 4);
+        memcpy(&be_len, hdr + 5, 4);
+        memcpy(&be_crc, hdr + 9, 4);
+        uint32_t ver = ntohl(be_ver), n = ntohl(be_len);
+
+        uint8_t *body = n ? malloc(n) : NULL;
+        if (n && (!body || read_full(fd, body, n) != 1)) {
+            free(body);
+            return good;
+        }
+        if (crc32(body, n) != ntohl(be_crc)) {
+            free(body);
+            return good;
+        }
+
+        if (hdr[0] == J_SNAPSHOT) {
+            free(*content);
+            *content = body;
+            *len = n;
+            *version = ver;
+            *have_snapshot = 1;
+        } else if (hdr[0] == J_DELTA && *have_snapshot && ver == *version + 1) {
+            uint8_t *next = NULL;
+            uint32_t next_len = 0;
+            int rc = delta_apply(*content, *len, body, n, &next, &next_len);
+            free(body);
+            if (rc != 0)
+                return good;
+            free(*content);
+            *content = next;
+            *len = next_len;
+            *version = ver;
+        } else {
+            free(body);
+            return good;
+        }
+        good += REC_HDR + (int64_t)n;
+    }
+}
+
+// Open <doc_path>.journal and recover the latest version from it
+// Returns 1 if there is no journal yet: the caller loads the document some
+// other way and starts one with journal_compact
+int journal_open(struct Journal *j, const char *doc_path, enum JournalSync sync,
+                 uint32_t *version_out, uint8_t **content_out,
+                 uint32_t *len_out) {
+    memset(j, 0, sizeof(*j));
+    j->fd = -1;
+    j->sync = sync;
+    pthread_mutex_init(&j->mu, NULL);
+    pthread_cond_init(&j->cv, NULL);
+
+    int needed = snprintf(j->path, sizeof(j->path), "%s.journal", doc_path);
+    if (needed < 0 || (size_t)needed >= sizeof(j->path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = open(j->path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 1 : -1;
+
+    uint32_t version = 0, len = 0;
+    uint8_t *content = NULL;
+    int have_snapshot = 0;
+    int64_t good = replay(fd, &version, &content, &len, &have_snapshot);
+    if (!have_snapshot) {
+        free(content);
+        close(fd);
+        return 1; // Nothing usable; start over from the document file
+    }
+
+    // Drop a torn tail so new records follow the last good one
+    if (ftruncate(fd, good) != 0 || lseek(fd, good, SEEK_SET) != good) {
+        free(content);
+        close(fd);
+        return -1;
+    }
+
+    j->fd = fd;
+    j->size = (uint64_t)good;
+    *version_out = version;
+    *content_out = content;
+    *len_out = len;
+    return 0;
+}
+
+// Write one record. With JOURNAL_SYNC_ALWAYS it is durable on return;
+// otherwise pass *seq_out to journal_wait once the caller's locks are gone
+int journal_append(struct Journal *j, uint8_t kind, uint32_t version,
+                   const uint8_t *data, uint32_t len, uint64_t *seq_out) {
+    uint8_t hdr[REC_HDR];
+    pack_hdr(hdr, kind, version, data, len);
+
+    pthread_mutex_lock(&j->mu);
+    if (j->failed ||
+        write_full(j->fd, hdr, REC_HDR) != 1 ||
+        (len && write_full(j->fd, data, len) != 1)) {
+        j->failed = 1;
+        pthread_mutex_unlock(&j->mu);
+        return -1;
+    }
+    j->size += REC_HDR + (uint64_t)len;
+    *seq_out = ++j->appended;
+
+    if (j->sync == JOURNAL_SYNC_ALWAYS) {
+        if (fdatasync(j->fd) != 0)
+            j->failed = 1;
+        j->synced = j->appended;
+    }
+    int ok = j->failed ? -1 : 0;
+    pthread_mutex_unlock(&j->mu);
+    return ok;
+}
+
+// Block until record seq is durable. The first waiter becomes the leader
+// and syncs everything appended so far; the rest ride along on that sync
+int journal_wait(struct Journal *j, uint64_t seq) {
+    if (j->sync != JOURNAL_SYNC_BATCH)
+        return 0;
+
+    pthread_mutex_lock(&j->mu);
+    while (j->synced < seq && !j->failed) {
+        if (j->syncing) {
+            pthread_cond_wait(&j->cv, &j->mu);
+            continue;
+        }
+
+        j->syncing = 1;
+        uint64_t target = j->appended;
+        int fd = j->fd;
+        pthread_mutex_unlock(&j->mu);
+
+        int rc = fdatasync(fd);
+
+        pthread_mutex_lock(&j->mu);
+        j->syncing = 0;
+        if (rc != 0)
+            j->failed = 1;
+        else if (target > j->synced)
+            j->synced = target;
+        pthread_cond_broadcast(&j->cv);
+    }
+    int ok = j->failed ? -1 : 0;
+    pthread_mutex_unlock(&j->mu);
+    return ok;
+}
+
+static void compact_job(struct CompactJob *job);
+
+// Compact, and sync everything queued, one journal at a time. A journal
+// is taken off the list before its sync, so records appended meanwhile
+// queue it again
+static void *flusher_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&flusher.mu);
+        while (!flusher.head && !flusher.jobs)
+            pthread_cond_wait(&flusher.cv, &flusher.mu);
+        struct CompactJob *job = flusher.jobs;
+        struct Journal *j = NULL;
+        if (job) {
+            flusher.jobs = job->next;
+        } else {
+            j = flusher.head;
+            flusher.head = j->next_queued;
+            j->queued = 0;
+        }
+        void (*wake)(void) = flusher.wake;
+        pthread_mutex_unlock(&flusher.mu);
+
+        if (job) {
+            compact_job(job);
+            continue;
+        }
+        pthread_mutex_lock(&j->mu);
+        uint64_t target = j->appended;
+        pthread_mutex_unlock(&j->mu);
+        journal_wait(j, target);
+        if (wake)
+            wake();
+    }
+    return NULL;
+}
+
+static void flusher_start(void) {
+    pthread_t th;
+    if (pthread_create(&th, NULL, flusher_thread, NULL) == 0) {
+        pthread_detach(th);
+        flusher.started = 1;
+    }
+}
+
+// Run after each sync journal_poll asked for; pollers check again then
+void journal_set_wake(void (*wake)(void)) {
+    pthread_mutex_lock(&flusher.mu);
+    flusher.wake = wake;
+    pthread_mutex_unlock(&flusher.mu);
+}
+
+// journal_wait for callers that can't block: 1 once record seq is durable,
+// -1 if it never will be, 0 while the flusher thread syncs it
+int journal_poll(struct Journal *j, uint64_t seq) {
+    if (j->sync != JOURNAL_SYNC_BATCH)
+        return 1;
+
+    pthread_mutex_lock(&j->mu);
+    int state = j->failed ? -1 : j->synced >= seq ? 1 : 0;
+    pthread_mutex_unlock(&j->mu);
+    if (state != 0)
+        return state;
+
+    pthread_once(&flusher_once, flusher_start);
+    if (!flusher.started)
+        return journal_wait(j, seq) == 0 ? 1 : -1; // No thread: sync here
+
+    pthread_mutex_lock(&flusher.mu);
+    if (!j->queued) {
+        j->queued = 1;
+        j->next_queued = flusher.head;
+        flusher.head = j;
+        pthread_cond_signal(&flusher.cv);
+    }
+    pthread_mutex_unlock(&flusher.mu);
+    return 0;
+}
+
+int journal_should_compact(struct Journal *j, uint32_t content_len) {
+    pthread_mutex_lock(&j->mu);
+    int should = !j->compacting && j->size > JOURNAL_COMPACT_MIN &&
+                 j->size > 4 * (uint64_t)content_len;
+    pthread_mutex_unlock(&j->mu);
+    return should;
+}
+
+// Write a journal holding only a snapshot of version to path, synced
+// Returns its fd, positioned after the record
+static int write_snapshot(const char *path, uint32_t version,
+                          const uint8_t *content, uint32_t len) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    uint8_t hdr[REC_HDR];
+    pack_hdr(hdr, J_SNAPSHOT, version, content, len);
+    if (write_full(fd, hdr, REC_HDR) != 1 ||
+        (len && write_full(fd, content, len) != 1) || fdatasync(fd) != 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+// Append src's bytes [off, off + n) to fd
+static int copy_tail(int src, uint64_t off, uint64_t n, int fd) {
+    uint8_t buf[64 * 1024];
+    while (n) {
+        size_t want = n < sizeof(buf) ? (size_t)n : sizeof(buf);
+        ssize_t r = pread(src, buf, want, (off_t)off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0 || write_full(fd, buf, (size_t)r) != 1)
+            return -1;
+        off += (uint64_t)r;
+        n -= (uint64_t)r;
+    }
+    return 0;
+}
+
+// Replace the journal with a single snapshot of the given version
+// The new file is synced and renamed into place, so a crash leaves either
+// the old journal or the new one. For a journal nobody appends to yet
+int journal_compact(struct Journal *j, uint32_t version,
+                    const uint8_t *content, uint32_t len) {
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+
+    int fd = write_snapshot(tmp, version, content, len);
+    if (fd < 0)
+        return -1;
+    if (rename(tmp, j->path) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    sync_dir_of(j->path);
+
+    if (j->fd >= 0)
+        close(j->fd);
+    j->fd = fd;
+    j->size = REC_HDR + (uint64_t)len;
+    return 0;
+}
+
+// journal_compact while appends carry on. The snapshot is written without
+// holding mu; then, with appends held off, the records made meanwhile are
+// copied after it and the new file takes their place. Until it's renamed
+// in, the compaction is the sync leader, so nothing appended to it counts
+// as durable before it is the journal
+static int compact_live(struct Journal *j, uint32_t version,
+                        const uint8_t *content, uint32_t len, uint64_t from) {
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->path);
+
+    int fd = write_snapshot(tmp, version, content, len);
+    if (fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&j->mu);
+    while (j->syncing)
+        pthread_cond_wait(&j->cv, &j->mu);
+    uint64_t tail = j->size - from;
+    if (j->failed || copy_tail(j->fd, from, tail, fd) != 0) {
+        pthread_mutex_unlock(&j->mu);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    int old = j->fd;
+    uint64_t target = j->appended;
+    j->fd = fd;
+    j->size = REC_HDR + (uint64_t)len + tail;
+    j->syncing = 1;
+    pthread_mutex_unlock(&j->mu);
+
+    int rc = fdatasync(fd) == 0 && rename(tmp, j->path) == 0 &&
+             sync_dir_of(j->path) == 0 ? 0 : -1;
+    close(old);
+
+    pthread_mutex_lock(&j->mu);
+    j->syncing = 0;
+    if (rc != 0)
+        j->failed = 1; // Records since the swap aren't in the journal
+    else if (target > j->synced)
+        j->synced = target;
+    pthread_cond_broadcast(&j->cv);
+    pthread_mutex_unlock(&j->mu);
+    return rc;
+}
+
+static void compact_job(struct CompactJob *job) {
+    struct Journal *j = job->j;
+    int rc = compact_live(j, job->version, job->content, job->len, job->from);
+    pthread_mutex_lock(&j->mu);
+    j->compacting = 0;
+    pthread_mutex_unlock(&j->mu);
+    job->done(job->arg, rc);
+    free(job);
+}
+
+// Compact on the flusher thread, from the snapshot of version, which must
+// be the last record appended. content stays the caller's until
+// done(arg, rc) runs there. Returns -1, and never calls done, if a
+// compaction is already under way or this one can't be queued
+int journal_compact_later(struct Journal *j, uint32_t version,
+                          const uint8_t *content, uint32_t len,
+                          void (*done)(void *arg, int rc), void *arg) {
+    struct CompactJob *job = malloc(sizeof(*job));
+    if (!job)
+        return -1;
+    pthread_mutex_lock(&j->mu);
+    if (j->compacting || j->failed) {
+        pthread_mutex_unlock(&j->mu);
+        free(job);
+        return -1;
+    }
+    j->compacting = 1;
+    *job = (struct CompactJob){ j, version, content, len, j->size, done, arg,
+                                NULL };
+    pthread_mutex_unlock(&j->mu);
+
+    pthread_once(&flusher_once, flusher_start);
+    if (!flusher.started) {
+        compact_job(job); // No thread: compact here
+        return 0;
+    }
+    pthread_mutex_lock(&flusher.mu);
+    job->next = flusher.jobs;
+    flusher.jobs = job;
+    pthread_cond_signal(&flusher.cv);
+    pthread_mutex_unlock(&flusher.mu);
+    return 0;
+}
+
+void journal_close(struct Journal *j) {
+    if (j->fd >= 0)
+        close(j->fd);
+    j->fd = -1;
+}
@@ -0,0 +1,218 @@
+/*
+ * LZ4-compatible block compressor. Greedy single-probe matching over a
+ * 64 KB window: every 4-byte sequence hashes into a table of its last
+ * position, and a hit that really matches is extended as far as it goes.
+ * Misses speed the scan up, so incompressible input costs little.
+ *
+ * Block format, per sequence:
+ *   token          literal length (high nibble), match length - 4 (low)
+ *   [255...]       length extensions when a nibble is 15
+ *   literals
+ *   u16 offset     little endian, back from the current position
+ *   [255...]       match length extension
+ * The last sequence has literals only and the last 5 bytes are literals.
+ */
+
+#define _GNU_SOURCE
+#include "lz.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535u
+#define LZ_LAST_LITERALS 5   // Block must end in literals
+#define LZ_MATCH_LIMIT 12    // No match may start in the last 12 bytes
+#define LZ_SKIP_TRIGGER 6    // Misses before the scan starts skipping
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Worst case output for len input bytes
+static size_t lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static uint8_t *put_length(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15)
+        op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (!match_len)
+        return op; // Last sequence
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - LZ_MIN_MATCH;
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (ml >= 15)
+        op = put_length(op, ml - 15);
+    return op;
+}
+
+// Compress src into dst, which holds lz_bound(len). Returns bytes written
+static size_t compress_block(const uint8_t *src, size_t len, uint8_t *dst,
+                             uint32_t *table) {
+    uint8_t *op = dst;
+    size_t anchor = 0;
+
+    if (len > LZ_MATCH_LIMIT) {
+        size_t limit = len - LZ_MATCH_LIMIT;
+        size_t i = 1;
+        unsigned misses = 1u << LZ_SKIP_TRIGGER;
+        while (i < limit) {
+            uint32_t seq = read32(src + i);
+            uint32_t h = lz_hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)i;
+
+            if (ref >= i || i - ref > LZ_MAX_OFFSET || read32(src + ref) != seq) {
+                i += misses++ >> LZ_SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1u << LZ_SKIP_TRIGGER;
+
+            // Grow the match backwards over pending literals, then forwards
+            while (i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+                i--;
+                ref--;
+            }
+            size_t m = LZ_MIN_MATCH;
+            size_t max = len - LZ_LAST_LITERALS - i;
+            while (m < max && src[ref + m] == src[i + m])
+                m++;
+
+            op = put_sequence(op, src + anchor, i - anchor, i - ref, m);
+            i += m;
+            anchor = i;
+        }
+    }
+    return (size_t)(put_sequence(op, src + anchor, len - anchor, 0, 0) - dst);
+}
+
+// Compress a payload. Returns 1 when it doesn't shrink enough to be worth
+// the receiver's time, in which case the raw payload should go instead
+int lz_pack(const uint8_t *src, uint32_t len,
+            uint8_t **out, uint32_t *out_len) {
+    if (len < LZ_MIN_INPUT)
+        return 1;
+
+    uint32_t *table = calloc(1u << LZ_HASH_BITS, sizeof(*table));
+    uint8_t *buf = malloc(4 + lz_bound(len));
+    if (!table || !buf) {
+        free(table);
+        free(buf);
+        return -1;
+    }
+
+    uint32_t be_len = htonl(len);
+    memcpy(buf, &be_len, 4);
+    size_t n = 4 + compress_block(src, len, buf + 4, table);
+    free(table);
+
+    if (n > len - len / 8) { // Save at least an eighth
+        free(buf);
+        return 1;
+    }
+    *out = buf;
+    *out_len = (uint32_t)n;
+    return 0;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *n) {
+    uint8_t b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Size of the raw payload a packed one claims, if it is at most max_raw
+// and plausible, so the caller can allocate the output
+int lz_packed_len(const uint8_t *src, uint32_t len, uint32_t max_raw,
+                  uint32_t *raw_len) {
+    if (len < 4)
+        return -1;
+    uint32_t be_raw;
+    memcpy(&be_raw, src, 4);
+    uint32_t raw = ntohl(be_raw);
+    // A block can't expand more than 255:1; don't allocate on its word
+    if (raw > max_raw || raw / 255 > len)
+        return -1;
+    *raw_len = raw;
+    return 0;
+}
+
+// Inflate a packed payload into dst, which holds lz_packed_len's raw_len
+// Anything malformed or pointing outside the output is rejected
+int lz_unpack(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t raw_len) {
+    if (len < 4)
+        return -1;
+    const uint8_t *ip = src + 4, *end = src + len;
+    uint8_t *op = dst, *oend = dst + raw_len;
+    for (;;) {
+        if (ip >= end)
+            goto bad;
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, end, &lit) != 0)
+            goto bad;
+        if (lit > (size_t)(end - ip) || lit > (size_t)(oend - op))
+            goto bad;
+        if (lit) memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == end)
+            break; // Last sequence has no match
+
+        if (end - ip < 2)
+            goto bad;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            goto bad;
+
+        size_t m = token & 15;
+        if (m == 15 && get_length(&ip, end, &m) != 0)
+            goto bad;
+        m += LZ_MIN_MATCH;
+        if (m > (size_t)(oend - op))
+            goto bad;
+
+        // Overlapping copies repeat the last 'offset' bytes
+        const uint8_t *ref = op - offset;
+        if (offset >= m) {
+            memcpy(op, ref, m);
+            op += m;
+        } else {
+            while (m--) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+
+bad:
+    return -1;
+}
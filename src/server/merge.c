@@ -0,0 +1,442 @@
+/*
+ * Three-way line merge (diff3 style). Lines of all three versions are
+ * hashed and interned to integer ids, each side is diffed against the
+ * common ancestor with Myers' O(ND) algorithm (linear-space bisection),
+ * and the resulting hunks are merged in base order. Only hunks where both
+ * sides changed overlapping base lines differently get conflict markers.
+ */
+
+#define _GNU_SOURCE
+#include "merge.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// One text split into lines; every line keeps its trailing '\n'
+struct Lines {
+    const uint8_t *text;
+    uint32_t n;
+    uint32_t *off;           // n + 1 offsets, off[n] == text length
+    uint32_t *id;            // Interned line ids
+};
+
+// Interning table shared by the three texts so equal lines get equal ids
+struct Intern {
+    uint32_t mask;
+    struct Slot {
+        uint64_t hash;
+        const uint8_t *p;
+        uint32_t len;
+        uint32_t id;         // 0 means empty slot
+    } *slots;
+    uint32_t next_id;
+};
+
+static uint64_t fnv1a(const uint8_t *p, uint32_t n) {
+    uint64_t h = 1469598103934665603ull;
+    for (uint32_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint32_t intern(struct Intern *t, const uint8_t *p, uint32_t len) {
+    uint64_t h = fnv1a(p, len);
+    for (uint32_t i = (uint32_t)h & t->mask;; i = (i + 1) & t->mask) {
+        struct Slot *s = &t->slots[i];
+        if (!s->id) {
+            s->hash = h;
+            s->p = p;
+            s->len = len;
+            s->id = ++t->next_id;
+            return s->id;
+        }
+        if (s->hash == h && s->len == len && memcmp(s->p, p, len) == 0)
+            return s->id;
+    }
+}
+
+static uint32_t count_lines(const uint8_t *p, uint32_t len) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < len; i++)
+        if (p[i] == '\n') n++;
+    return n + (len && p[len - 1] != '\n');
+}
+
+// Room for 'lines' distinct lines at most half full
+static int intern_init(struct Intern *t, uint32_t lines) {
+    uint32_t nslots = 16;
+    while (nslots < lines * 2) nslots *= 2;
+    t->mask = nslots - 1;
+    t->slots = calloc(nslots, sizeof(*t->slots));
+    return t->slots ? 0 : -1;
+}
+
+static int split_lines(struct Lines *l, struct Intern *t,
+                       const uint8_t *p, uint32_t len) {
+    l->text = p;
+    l->n = count_lines(p, len);
+    l->off = malloc(((size_t)l->n + 1) * sizeof(*l->off));
+    l->id = malloc(((size_t)l->n + 1) * sizeof(*l->id));
+    if (!l->off || !l->id)
+        return -1;
+
+    uint32_t k = 0, start = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (p[i] == '\n' || i + 1 == len) {
+            l->off[k] = start;
+            l->id[k] = intern(t, p + start, i + 1 - start);
+            k++;
+            start = i + 1;
+        }
+    }
+    l->off[l->n] = len;
+    return 0;
+}
+
+static void free_lines(struct Lines *l) {
+    free(l->off);
+    free(l->id);
+}
+
+// Myers diff of a[alo, ahi) against b[blo, bhi). Writes a2b[i] = matching
+// index in b for every matched line of a; unmatched entries stay -1
+struct Diff {
+    const uint32_t *a, *b;
+    int32_t *a2b;
+};
+
+static int diff_range(struct Diff *d, int32_t alo, int32_t ahi,
+                      int32_t blo, int32_t bhi);
+
+// Find a point on an optimal path (the middle snake) and split there
+static int diff_bisect(struct Diff *d, int32_t alo, int32_t ahi,
+                       int32_t blo, int32_t bhi) {
+    const uint32_t *a = d->a + alo, *b = d->b + blo;
+    int32_t n = ahi - alo, m = bhi - blo;
+    int32_t max_d = (n + m + 1) / 2;
+    int32_t voff = max_d, vlen = 2 * max_d + 2;
+
+    int32_t *v1 = malloc(2 * (size_t)vlen * sizeof(*v1));
+    if (!v1)
+        return -1;
+    int32_t *v2 = v1 + vlen;
+    for (int32_t i = 0; i < vlen; i++) v1[i] = v2[i] = -1;
+    v1[voff + 1] = 0;
+    v2[voff + 1] = 0;
+
+    int32_t delta = n - m;
+    int front = (delta & 1) != 0; // Odd delta: overlap is found going forward
+    int32_t k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+
+    for (int32_t step = 0; step < max_d; step++) {
+        for (int32_t k1 = -step + k1start; k1 <= step - k1end; k1 += 2) {
+            int32_t k1o = voff + k1;
+            int32_t x1 = (k1 == -step || (k1 != step && v1[k1o - 1] < v1[k1o + 1]))
+                       ? v1[k1o + 1] : v1[k1o - 1] + 1;
+            int32_t y1 = x1 - k1;
+            while (x1 < n && y1 < m && a[x1] == b[y1]) { x1++; y1++; }
+            v1[k1o] = x1;
+            if (x1 > n) {
+                k1end += 2;  // Ran off the right edge
+            } else if (y1 > m) {
+                k1start += 2; // Ran off the bottom edge
+            } else if (front) {
+                int32_t k2o = voff + delta - k1;
+                if (k2o >= 0 && k2o < vlen && v2[k2o] != -1 &&
+                    x1 >= n - v2[k2o]) {
+                    free(v1);
+                    return diff_range(d, alo, alo + x1, blo, blo + y1) ||
+                           diff_range(d, alo + x1, ahi, blo + y1, bhi);
+                }
+            }
+        }
+
+        for (int32_t k2 = -step + k2start; k2 <= step - k2end; k2 += 2) {
+            int32_t k2o = voff + k2;
+            int32_t x2 = (k2 == -step || (k2 != step && v2[k2o - 1] < v2[k2o + 1]))
+                       ? v2[k2o + 1] : v2[k2o - 1] + 1;
+            int32_t y2 = x2 - k2;
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+                x2++;
+                y2++;
+            }
+            v2[k2o] = x2;
+            if (x2 > n) {
+                k2end += 2;
+            } else if (y2 > m) {
+                k2start += 2;
+            } else if (!front) {
+                int32_t k1o = voff + delta - k2;
+                if (k1o >= 0 && k1o < vlen && v1[k1o] != -1) {
+                    int32_t x1 = v1[k1o];
+                    int32_t y1 = voff + x1 - k1o;
+                    if (x1 >= n - x2) {
+                        free(v1);
+                        return diff_range(d, alo, alo + x1, blo, blo + y1) ||
+                               diff_range(d, alo + x1, ahi, blo + y1, bhi);
+                    }
+                }
+            }
+        }
+    }
+
+    free(v1);
+    return 0; // Nothing in common
+}
+
+static int diff_range(struct Diff *d, int32_t alo, int32_t ahi,
+                      int32_t blo, int32_t bhi) {
+    // Common prefix and suffix are matched without any search
+    while (alo < ahi && blo < bhi && d->a[alo] == d->b[blo])
+        d->a2b[alo++] = blo++;
+    while (alo < ahi && blo < bhi && d->a[ahi - 1] == d->b[bhi - 1])
+        d->a2b[--ahi] = --bhi;
+
+    if (alo == ahi || blo == bhi)
+        return 0;
+    return diff_bisect(d, alo, ahi, blo, bhi);
+}
+
+// A run of base lines [s, e) that one side replaced with its lines [t, u)
+struct Hunk {
+    uint32_t s, e, t, u;
+    int side;                // 0 client, 1 server
+};
+
+// Diff base against x and append x's hunks
+static int collect_hunks(const struct Lines *base, const struct Lines *x,
+                         int side, struct Hunk **hunks, uint32_t *nh,
+                         uint32_t *cap) {
+    int32_t *a2b = malloc(((size_t)base->n + 1) * sizeof(*a2b));
+    if (!a2b)
+        return -1;
+    for (uint32_t i = 0; i < base->n; i++) a2b[i] = -1;
+
+    struct Diff d = { base->id, x->id, a2b };
+    if (diff_range(&d, 0, (int32_t)base->n, 0, (int32_t)x->n) != 0) {
+        free(a2b);
+        return -1;
+    }
+
+    uint32_t i = 0, j = 0;
+    while (i < base->n || j < x->n) {
+        if (i < base->n && a2b[i] == (int32_t)j) {
+            i++;
+            j++;
+            continue;
+        }
+        struct Hunk h = { .s = i, .t = j, .side = side };
+        while (i < base->n && a2b[i] < 0) i++;
+        h.e = i;
+        h.u = i < base->n ? (uint32_t)a2b[i] : x->n;
+        j = h.u;
+
+        if (*nh == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            struct Hunk *p = realloc(*hunks, *cap * sizeof(*p));
+            if (!p) {
+                free(a2b);
+                return -1;
+            }
+            *hunks = p;
+        }
+        (*hunks)[(*nh)++] = h;
+    }
+
+    free(a2b);
+    return 0;
+}
+
+static int cmp_hunk(const void *pa, const void *pb) {
+    const struct Hunk *a = pa, *b = pb;
+    if (a->s != b->s) return a->s < b->s ? -1 : 1;
+    return a->side - b->side;
+}
+
+// Growable output buffer
+struct Out {
+    uint8_t *data;
+    size_t len, cap;
+};
+
+static int out_put(struct Out *o, const void *p, size_t n) {
+    if (o->len + n > o->cap) {
+        size_t cap = o->cap ? o->cap : 4096;
+        while (cap < o->len + n) cap *= 2;
+        uint8_t *d = realloc(o->data, cap);
+        if (!d)
+            return -1;
+        o->data = d;
+        o->cap = cap;
+    }
+    if (n) memcpy(o->data + o->len, p, n);
+    o->len += n;
+    return 0;
+}
+
+static int out_lines(struct Out *o, const struct Lines *l,
+                     uint32_t from, uint32_t to) {
+    return out_put(o, l->text + l->off[from], l->off[to] - l->off[from]);
+}
+
+// Lines [from, to) of l followed by a newline if the last one lacks it,
+// so a conflict marker always starts on its own line
+static int out_side(struct Out *o, const struct Lines *l,
+                    uint32_t from, uint32_t to) {
+    if (out_lines(o, l, from, to) != 0)
+        return -1;
+    if (to > from && l->text[l->off[to] - 1] != '\n')
+        return out_put(o, "\n", 1);
+    return 0;
+}
+
+// Map a group's base range onto one side's lines, given that side's first
+// and last hunk in the group. Only meaningful when the side has hunks there
+static void side_range(const struct Hunk *first, const struct Hunk *last,
+                       uint32_t gs, uint32_t ge, uint32_t *from, uint32_t *to) {
+    if (!first) {
+        *from = gs;
+        *to = ge;
+        return;
+    }
+    *from = first->t - (first->s - gs);
+    *to = last->u + (ge - last->e);
+}
+
+static int same_lines(const struct Lines *x, uint32_t xf, uint32_t xt,
+                      const struct Lines *y, uint32_t yf, uint32_t yt) {
+    if (xt - xf != yt - yf)
+        return 0;
+    for (uint32_t i = 0; i < xt - xf; i++)
+        if (x->id[xf + i] != y->id[yf + i]) return 0;
+    return 1;
+}
+
+// Merge client and server edits against their common ancestor
+// Returns the number of conflicting hunks, or -1 on allocation failure
+int merge3(const uint8_t *base, uint32_t base_len,
+           const uint8_t *client, uint32_t client_len,
+           const uint8_t *server, uint32_t server_len,
+           uint8_t **out, uint32_t *out_len) {
+    struct Intern t = {0};
+    struct Lines lb = {0}, lc = {0}, ls = {0};
+    struct Hunk *hunks = NULL;
+    uint32_t nh = 0, cap = 0;
+    struct Out o = {0};
+    int conflicts = -1;
+
+    uint32_t total = count_lines(base, base_len) + count_lines(client, client_len)
+                   + count_lines(server, server_len);
+
+    if (intern_init(&t, total) != 0 ||
+        split_lines(&lb, &t, base, base_len) != 0 ||
+        split_lines(&lc, &t, client, client_len) != 0 ||
+        split_lines(&ls, &t, server, server_len) != 0 ||
+        collect_hunks(&lb, &lc, 0, &hunks, &nh, &cap) != 0 ||
+        collect_hunks(&lb, &ls, 1, &hunks, &nh, &cap) != 0)
+        goto done;
+
+    if (nh)
+        qsort(hunks, nh, sizeof(*hunks), cmp_hunk);
+
+    uint32_t pos = 0; // Next base line not yet emitted
+    conflicts = 0;
+    for (uint32_t i = 0; i < nh;) {
+        // Group hunks whose base ranges overlap; two insertions at the same
+        // spot also collide, while edits to neighbouring lines don't
+        uint32_t gs = hunks[i].s, ge = hunks[i].e;
+        const struct Hunk *first[2] = {0}, *last[2] = {0};
+        uint32_t j = i;
+        for (; j < nh; j++) {
+            const struct Hunk *h = &hunks[j];
+            int touches = h->s < ge || (h->s == ge && (h->s == h->e || gs == ge));
+            if (j > i && !touches)
+                break;
+            if (h->e > ge) ge = h->e;
+            if (!first[h->side]) first[h->side] = h;
+            last[h->side] = h;
+        }
+        i = j;
+
+        if (out_lines(&o, &lb, pos, gs) != 0)
+            goto fail;
+        pos = ge;
+
+        uint32_t cf, ct, sf, st;
+        side_range(first[0], last[0], gs, ge, &cf, &ct);
+        side_range(first[1], last[1], gs, ge, &sf, &st);
+
+        // A side that didn't touch the group has the base lines there, but
+        // its own line numbers are only known through its hunks
+        if (!first[0]) {
+            if (out_lines(&o, &ls, sf, st) != 0) goto fail;
+        } else if (!first[1] || same_lines(&lc, cf, ct, &ls, sf, st)) {
+            if (out_lines(&o, &lc, cf, ct) != 0) goto fail;
+        } else {
+            conflicts++;
+            if (out_put(&o, MERGE_PRE, strlen(MERGE_PRE)) != 0 ||
+                out_side(&o, &lc, cf, ct) != 0 ||
+                out_put(&o, MERGE_MID, strlen(MERGE_MID)) != 0 ||
+                out_side(&o, &ls, sf, st) != 0 ||
+                out_put(&o, MERGE_POST, strlen(MERGE_POST)) != 0)
+                goto fail;
+        }
+    }
+    if (out_lines(&o, &lb, pos, lb.n) != 0 || o.len > UINT32_MAX)
+        goto fail;
+
+    *out = o.data;
+    *out_len = (uint32_t)o.len;
+    o.data = NULL;
+    goto done;
+
+fail:
+    conflicts = -1;
+done:
+    free(o.data);
+    free(hunks);
+    free_lines(&lb);
+    free_lines(&lc);
+    free_lines(&ls);
+    free(t.slots);
+    return conflicts;
+}
+
+// The line hunks that turn a into b, in order, as byte ranges. *edits_out
+// is NULL when the texts have the same lines
+int merge_diff(const uint8_t *a, uint32_t a_len,
+               const uint8_t *b, uint32_t b_len,
+               struct MergeEdit **edits_out, uint32_t *n_out) {
+    struct Intern t = {0};
+    struct Lines la = {0}, lb = {0};
+    struct Hunk *hunks = NULL;
+    uint32_t nh = 0, cap = 0;
+    int rc = -1;
+    *edits_out = NULL;
+    *n_out = 0;
+
+    if (intern_init(&t, count_lines(a, a_len) + count_lines(b, b_len)) != 0 ||
+        split_lines(&la, &t, a, a_len) != 0 ||
+        split_lines(&lb, &t, b, b_len) != 0 ||
+        collect_hunks(&la, &lb, 0, &hunks, &nh, &cap) != 0)
+        goto done;
+
+    struct MergeEdit *edits = nh ? malloc(nh * sizeof(*edits)) : NULL;
+    if (nh && !edits)
+        goto done;
+    for (uint32_t i = 0; i < nh; i++)
+        edits[i] = (struct MergeEdit){ la.off[hunks[i].s], la.off[hunks[i].e],
+                                       lb.off[hunks[i].t], lb.off[hunks[i].u] };
+    *edits_out = edits;
+    *n_out = nh;
+    rc = 0;
+
+done:
+    free(hunks);
+    free_lines(&la);
+    free_lines(&lb);
+    free(t.slots);
+    return rc;
+}
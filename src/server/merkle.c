@@ -0,0 +1,169 @@
+/*
+ * Merkle tree over a directory of files, shared by server and client so
+ * both hash a tree the same way. Directory hashes are sums rather than
+ * hashes of sorted child lists: order never matters, and a file update
+ * adjusts each ancestor by one subtraction and one addition instead of
+ * rehashing every sibling on the way up.
+ */
+
+#define _GNU_SOURCE
+#include "merkle.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MERKLE_SLOTS_MIN 8
+#define MERKLE_DIR_SALT 0x9E3779B97F4A7C15ull // Keeps a dir and a file apart
+
+// What one child adds to its directory's sum. Name and kind are mixed in
+// too, so renaming or swapping files changes the sum
+uint64_t merkle_entry(const char *name, size_t len, int is_dir, uint64_t hash) {
+    uint64_t mix[2] = { hash64(name, len) ^ (is_dir ? MERKLE_DIR_SALT : 0),
+                        hash };
+    return hash64(mix, sizeof(mix));
+}
+
+static uint32_t slot_of(const char *name, size_t len, uint32_t nslots) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h & (nslots - 1);
+}
+
+struct MerkleNode *merkle_new(void) {
+    struct MerkleNode *root = calloc(1, sizeof(*root));
+    if (root && !(root->name = strdup(""))) {
+        free(root);
+        return NULL;
+    }
+    if (root)
+        root->is_dir = 1;
+    return root;
+}
+
+void merkle_free(struct MerkleNode *n) {
+    if (!n)
+        return;
+    while (n->children) {
+        struct MerkleNode *c = n->children;
+        n->children = c->sibling;
+        merkle_free(c);
+    }
+    free(n->slots);
+    free(n->name);
+    free(n);
+}
+
+struct MerkleNode *merkle_child(const struct MerkleNode *dir,
+                                const char *name, size_t len) {
+    if (!dir->nslots)
+        return NULL;
+    for (struct MerkleNode *c = dir->slots[slot_of(name, len, dir->nslots)];
+         c; c = c->next)
+        if (strlen(c->name) == len && memcmp(c->name, name, len) == 0)
+            return c;
+    return NULL;
+}
+
+// Path components are separated by '/'; "" is the root itself
+struct MerkleNode *merkle_find(struct MerkleNode *root,
+                               const char *path, size_t len) {
+    struct MerkleNode *n = root;
+    size_t start = 0;
+    while (n && start < len) {
+        const char *slash = memchr(path + start, '/', len - start);
+        size_t end = slash ? (size_t)(slash - path) : len;
+        n = n->is_dir ? merkle_child(n, path + start, end - start) : NULL;
+        start = end + 1;
+    }
+    return n;
+}
+
+// Carry n's change from 'old' to n->hash up to the root
+static void propagate(struct MerkleNode *n, uint64_t old) {
+    size_t len = strlen(n->name);
+    for (struct MerkleNode *p = n->parent; p; n = p, p = p->parent) {
+        uint64_t p_old = p->hash;
+        p->hash += merkle_entry(n->name, len, n->is_dir, n->hash) -
+                   merkle_entry(n->name, len, n->is_dir, old);
+        old = p_old;
+        len = strlen(p->name);
+    }
+}
+
+// Double a directory's slots once it averages one child per slot
+static int grow_slots(struct MerkleNode *dir) {
+    uint32_t ns = dir->nslots ? dir->nslots * 2 : MERKLE_SLOTS_MIN;
+    struct MerkleNode **s = calloc(ns, sizeof(*s));
+    if (!s)
+        return -1;
+    for (struct MerkleNode *c = dir->children; c; c = c->sibling) {
+        uint32_t h = slot_of(c->name, strlen(c->name), ns);
+        c->next = s[h];
+        s[h] = c;
+    }
+    free(dir->slots);
+    dir->slots = s;
+    dir->nslots = ns;
+    return 0;
+}
+
+static struct MerkleNode *add_child(struct MerkleNode *dir, const char *name,
+                                    size_t len, int is_dir, uint64_t hash) {
+    if (dir->nchildren >= dir->nslots && grow_slots(dir) != 0)
+        return NULL;
+    struct MerkleNode *c = calloc(1, sizeof(*c));
+    if (!c || !(c->name = strndup(name, len))) {
+        free(c);
+        return NULL;
+    }
+    c->is_dir = is_dir;
+    c->hash = hash;
+    c->parent = dir;
+    c->sibling = dir->children;
+    dir->children = c;
+    uint32_t h = slot_of(name, len, dir->nslots);
+    c->next = dir->slots[h];
+    dir->slots[h] = c;
+    dir->nchildren++;
+
+    uint64_t old = dir->hash;
+    dir->hash += merkle_entry(name, len, is_dir, hash);
+    propagate(dir, old);
+    return c;
+}
+
+// The leaf for path, created along with any missing directories, holding
+// 'hash'. NULL if part of the path is already a file, or out of memory
+struct MerkleNode *merkle_add(struct MerkleNode *root, const char *path,
+                              size_t len, uint64_t hash) {
+    struct MerkleNode *n = root;
+    size_t start = 0;
+    for (;;) {
+        const char *slash = memchr(path + start, '/', len - start);
+        size_t end = slash ? (size_t)(slash - path) : len;
+        struct MerkleNode *c = merkle_child(n, path + start, end - start);
+        if (!c)
+            c = add_child(n, path + start, end - start, slash != NULL,
+                          slash ? 0 : hash);
+        else if (!slash && !c->is_dir)
+            merkle_set(c, hash);
+        if (!c || c->is_dir != (slash != NULL))
+            return NULL;
+        if (!slash)
+            return c;
+        n = c;
+        start = end + 1;
+    }
+}
+
+void merkle_set(struct MerkleNode *leaf, uint64_t hash) {
+    uint64_t old = leaf->hash;
+    if (old == hash)
+        return;
+    leaf->hash = hash;
+    propagate(leaf, old);
+}
@@ -0,0 +1,333 @@
+/*
+ * Event-driven server core: N reactor threads, each with its own epoll set
+ * and non-blocking sockets. Frames are decoded incrementally so a reactor
+ * never blocks on a slow client; replies that don't fit in the socket
+ * buffer are queued on the Conn and flushed on EPOLLOUT. Connections whose
+ * replies wait on something slower, like a journal sync, are parked on
+ * their reactor and retried when reactor_wake says it finished; those that
+ * must not be read meanwhile are paused, and resume once they are sent.
+ */
+
+#define _GNU_SOURCE
+#include "reactor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define MAX_EVENTS 128
+#define READ_CHUNK (64u * 1024u)
+#define READS_PER_EVENT 16 // Bound work per wakeup so one client can't hog a reactor
+
+struct Reactor {
+    pthread_t th;
+    int epfd;
+    int lfd;                 // Listener this reactor accepts on
+    frame_handler on_frame;
+    conn_handler on_drained;
+    int wakefd;              // eventfd written by reactor_wake
+    struct Conn **held;      // Conns on_drained left replies on
+    size_t nheld, held_cap;
+};
+
+// Marks the listener and the wake eventfd in epoll_event.data.ptr; real
+// events carry a Conn
+static char listener_tag, wake_tag;
+
+static struct Reactor *reactors;
+static int nreactors_running;
+
+// Park c until the next wakeup. It stays registered, so a failed
+// allocation only means it waits for its own next event instead
+static void hold(struct Reactor *r, struct Conn *c) {
+    if (c->held)
+        return;
+    if (r->nheld == r->held_cap) {
+        size_t cap = r->held_cap ? r->held_cap * 2 : 16;
+        struct Conn **held = realloc(r->held, cap * sizeof(*held));
+        if (!held)
+            return;
+        r->held = held;
+        r->held_cap = cap;
+    }
+    r->held[r->nheld++] = c;
+    c->held = 1;
+}
+
+static void unhold(struct Reactor *r, struct Conn *c) {
+    if (!c->held)
+        return;
+    for (size_t i = 0; i < r->nheld; i++) {
+        if (r->held[i] == c) {
+            r->held[i] = r->held[--r->nheld]; // order doesn't matter
+            break;
+        }
+    }
+    c->held = 0;
+}
+
+static void reactor_release(struct Reactor *r, struct Conn *c) {
+    unhold(r, c);
+    conn_put(c);
+}
+
+static void reactor_close(struct Reactor *r, struct Conn *c) {
+    r->on_drained(c); // Whatever it held back still goes to everyone else
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    registry_remove(c); // No new broadcast can reach c after this
+    if (!c->ndeferred) {
+        reactor_release(r, c);
+        return;
+    }
+
+    // Replies still wait on the disk: keep c parked until they are out
+    c->closing = 1;
+    shutdown(c->fd, SHUT_RDWR);
+    hold(r, c);
+}
+
+static void reactor_accept(struct Reactor *r) {
+    for (;;) {
+        int cfd = accept4(r->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) // EWOULDBLOCK is the same on Linux
+                perror("accept4");
+            return; // Drained, or another reactor won the race
+        }
+
+        struct Conn *c = conn_new(cfd, r->epfd);
+        if (!c) {
+            close(cfd);
+            continue;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, cfd, &ev) != 0) {
+            conn_put(c);
+            continue;
+        }
+        if (registry_add(c) != 0) {
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, cfd, NULL);
+            conn_put(c);
+        }
+    }
+}
+
+// Run every frame in buf[0..n). When one leaves c paused, the bytes after
+// it wait in c->in until it resumes. Returns -1 when c should be closed
+static int reactor_parse(struct Reactor *r, struct Conn *c,
+                         const uint8_t *buf, size_t n) {
+    size_t off = 0;
+    while (off < n) {
+        if (c->paused) {
+            uint8_t *in = malloc(n - off);
+            if (!in)
+                return -1;
+            memcpy(in, buf + off, n - off);
+            c->in = in;
+            c->in_len = n - off;
+            return 1;
+        }
+
+        size_t used = 0;
+        uint8_t type;
+        uint32_t tag = 0;
+        uint8_t *payload = NULL;
+        uint32_t plen = 0;
+
+        int fr = frame_parser_feed(&c->parser, buf + off, n - off,
+                                   &used, &type, &tag, &payload, &plen);
+        off += used;
+        if (fr < 0)
+            return -1; // Malformed frame
+        if (fr == 0)
+            break;     // Need more bytes
+
+        // Chunks of a large body collect until F_END
+        fr = body_feed(&c->body, &type, &tag, &payload, &plen);
+        if (fr < 0)
+            return -1;
+        if (fr == 0)
+            continue;
+
+        int ok = r->on_frame(c, type, tag, payload, plen);
+        if (ok != 1)
+            return -1;
+    }
+    return 1;
+}
+
+// Read what's available and run every frame it completes
+// Returns -1 when the connection should be closed
+static int reactor_read(struct Reactor *r, struct Conn *c) {
+    uint8_t buf[READ_CHUNK];
+
+    for (int i = 0; i < READS_PER_EVENT && !c->paused; i++) {
+        ssize_t n = read(c->fd, buf, sizeof(buf));
+        if (n == 0)
+            return -1; // EOF
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 1;
+            return -1;
+        }
+        if (reactor_parse(r, c, buf, (size_t)n) != 1)
+            return -1;
+    }
+    return 1; // More may be pending; level-triggered epoll will call again
+}
+
+// on_drained, and once that sent every deferred reply of a paused c, the
+// requests it held back: first those already read, then the socket's
+static int reactor_drain(struct Reactor *r, struct Conn *c) {
+    int ok = r->on_drained(c);
+    while (ok == 1 && c->paused && !c->ndeferred && !c->closing) {
+        uint8_t *in = c->in;
+        size_t n = c->in_len;
+        c->in = NULL;
+        c->in_len = 0;
+        ok = conn_pause(c, 0);
+        if (ok == 1 && in)
+            ok = reactor_parse(r, c, in, n);
+        free(in);
+        if (ok == 1)
+            ok = r->on_drained(c);
+    }
+    return ok;
+}
+
+// Retry every parked connection once whatever it waited on has moved
+static void reactor_woken(struct Reactor *r) {
+    eventfd_t n;
+    eventfd_read(r->wakefd, &n);
+
+    struct Conn **held = r->held;
+    size_t nheld = r->nheld;
+    r->held = NULL;
+    r->nheld = r->held_cap = 0;
+    for (size_t i = 0; i < nheld; i++) {
+        struct Conn *c = held[i];
+        c->held = 0;
+        int ok = reactor_drain(r, c);
+        if (c->closing) {
+            if (c->ndeferred)
+                hold(r, c);
+            else
+                reactor_release(r, c);
+        } else if (ok != 1 || c->dead) {
+            reactor_close(r, c);
+        } else if (c->ndeferred) {
+            hold(r, c);
+        }
+    }
+    free(held);
+}
+
+// Have every reactor retry its parked connections. Safe from any thread
+void reactor_wake(void) {
+    for (int i = 0; i < nreactors_running; i++)
+        eventfd_write(reactors[i].wakefd, 1);
+}
+
+static void *reactor_thread(void *arg) {
+    struct Reactor *r = arg;
+    struct epoll_event evs[MAX_EVENTS];
+    frame_pool_keep(FRAME_POOL_KEEP);
+
+    for (;;) {
+        int n = epoll_wait(r->epfd, evs, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+
+        int woken = 0;
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.ptr == &listener_tag) {
+                reactor_accept(r);
+                continue;
+            }
+            if (evs[i].data.ptr == &wake_tag) {
+                woken = 1; // After the batch, which may still name them
+                continue;
+            }
+
+            struct Conn *c = evs[i].data.ptr;
+            int ok = 1;
+            if (evs[i].events & EPOLLOUT)
+                ok = conn_flush(c);
+            if (ok == 1 && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                ok = c->paused ? -1 : reactor_read(r, c); // Paused: a hangup
+            if (ok == 1)
+                ok = reactor_drain(r, c);
+            if (ok != 1 || c->dead)
+                reactor_close(r, c);
+            else if (c->ndeferred)
+                hold(r, c);
+        }
+        if (woken)
+            reactor_woken(r);
+    }
+}
+
+int reactor_serve(const int *lfds, int nlfds, int nreactors,
+                  frame_handler on_frame, conn_handler on_drained) {
+    if (nreactors < 1 || nlfds < 1)
+        return -1;
+
+    struct Reactor *rs = calloc((size_t)nreactors, sizeof(*rs));
+    if (!rs)
+        return -1;
+
+    for (int i = 0; i < nreactors; i++) {
+        struct Reactor *r = &rs[i];
+        r->on_frame = on_frame;
+        r->on_drained = on_drained;
+        r->lfd = nlfds == nreactors ? lfds[i] : lfds[0];
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        // A shared listener wakes only one reactor per connection
+        struct epoll_event ev = {
+            .events = EPOLLIN | (nlfds == nreactors ? 0 : EPOLLEXCLUSIVE),
+            .data.ptr = &listener_tag,
+        };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->lfd, &ev) != 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event wev = { .events = EPOLLIN, .data.ptr = &wake_tag };
+        if (r->wakefd < 0 ||
+            epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &wev) != 0) {
+            perror("eventfd");
+            return -1;
+        }
+    }
+    reactors = rs;
+    nreactors_running = nreactors;
+
+    for (int i = 0; i < nreactors; i++) {
+        if (pthread_create(&rs[i].th, NULL, reactor_thread, &rs[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    for (int i = 0; i < nreactors; i++)
+        pthread_join(rs[i].th, NULL);
+
+    free(rs);
+    return 0;
+}
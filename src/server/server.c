@@ -4,12 +4,57 @@
  * for remote file sync clients. AKA Google Docs in VSCode.
  * 
  * To run on the raspi:
- * gcc -pthread server.c comm.c -o server && ./server 9000 <file_path>
- * The <file_path> is where the document you're editing is kept.
+ * gcc -pthread server.c chunk_store.c comm.c conn.c crdt.c delta.c doc.c hash.c history.c journal.c lz.c merge.c merkle.c reactor.c stats.c -o server && ./server 9000 <root_dir>
+ * Clients open documents by name; each is kept at <root_dir>/<name> with its
+ * own version, history and lock, so edits to different files don't contend.
+ *
+ * Two server cores share the same request handlers:
+ *   -m threads  one blocking thread per client (default)
+ *   -m epoll    -r N event-driven reactors, add -P for a SO_REUSEPORT
+ *               listener per reactor instead of one shared listener
+ *
+ * By default every accepted PUT rewrites the document. With -j the server
+ * appends versions to <name>.journal instead and recovers the exact
+ * version after a restart; the argument picks when appends hit the disk:
+ *   -j none     whenever the kernel flushes
+ *   -j batch    group commit, PUTs in flight share one fdatasync
+ *   -j always   fdatasync per PUT
+ *
+ * Clients that send C_HELLO with FEATURE_LZ get large payloads compressed
+ * both ways; -Z turns that off for CPU-bound servers on fast links.
+ *
+ * Requests may carry a tag in the frame header, which the reply echoes.
+ * Clients that agreed on FEATURE_TAGS match replies by tag, so the server
+ * may answer them out of order: with -j batch, acks for their PUTs wait
+ * until no more requests are queued on the socket and then share the
+ * journal syncs, while the reads behind them are answered at once.
+ *
+ * Every document under <root_dir> is loaded at startup and hashed into a
+ * Merkle tree. C_TREE walks it one directory at a time, so a reconnecting
+ * client only descends into directories whose hash differs from its own,
+ * and C_SUBSCRIBE_ALL pushes every document's new versions to it.
+ *
+ * Clients may instead edit a document collaboratively: C_CRDT_JOIN hands
+ * them a crdt.h replica and a site of their own, and from then on edits
+ * travel as CRDT ops both ways, which merge without conflicts in any
+ * order. Plain PUTs to the document become ops the server makes.
+ *
+ * Request rates, merges, lock wait and hold times on the documents and
+ * disk write latency are kept in stats.h histograms. C_STATS returns them
+ * as text, and -s N prints them to stderr every N seconds.
  */
 
 #define _GNU_SOURCE
 #include "comm.h"
+#include "conn.h"
+#include "crdt.h"
+#include "delta.h"
+#include "doc.h"
+#include "history.h"
+#include "journal.h"
+#include "merge.h"
+#include "reactor.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,113 +66,74 @@
 #include <limits.h>    
 
 #include <unistd.h>     // POSIX calls
+#include <getopt.h>     // Command line flags
 #include <fcntl.h>      // File control operations and flags 
 #include <pthread.h>    // thread per client POSIX threads and mutexes
+#include <signal.h>     // Ignore SIGPIPE from departed subscribers
+#include <poll.h>       // Whether a client has more requests queued
+#include <stdatomic.h>
 #include <sys/socket.h> 
-#include <sys/stat.h>   // File status 
+#include <sys/resource.h> // Room for sockets plus files kept for sendfile
+#include <sys/time.h>   // Send timeout for subscribers
 
 #include <arpa/inet.h>  // Byte order conversion and address conversion
 #include <netinet/in.h> // Internet address structures and constants 
 
 #define BACKLOG 64
+#define SEND_TIMEOUT_SEC 5 // Drop subscribers that stop reading
+#define DEFER_MAX 64       // Replies a connection may hold for the journal
 
-// Represents the file being synced, global state for the server
-static struct State {
-    char path[PATH_MAX];   // On-disk file path
-    uint8_t *content;      // Heap buffer
-    uint32_t content_len;  // Bytes in content
-    uint32_t version;      // Version starting at 0
-    pthread_mutex_t mu;    // Ensure thread safety
-} g;
-
-// Replace file at 'path' with 'data' of length n atomically
-// Writes to a temp file and renames it into place
-static int atomic_write_file(const char *path, const uint8_t *data, size_t len) {
-    char tmp[PATH_MAX]; // Temporary file path
-    snprintf(tmp, sizeof(tmp), "%s.tmp", path); // e.g., "file.txt.tmp"
-    
-    int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
-    if (fd < 0) 
-        return -1; 
-    
-    if (len && write_full(fd, data, len) != 1) {
-        close(fd);
-        return -1;
-    }
-    if (close(fd) != 0) 
-        return -1;
-    
-    if (rename(tmp, path) != 0) 
-        return -1; 
-    return 0;
-}   
-
-// Load initial state from disk -> See struct above
-// If file does not exist, initialize empty state with version 0
-static int load_initial(void) {
-    int fd = open(g.path, O_RDONLY | O_CLOEXEC); 
-    if (fd < 0) {
-        if (errno == ENOENT) { 
-            g.content = NULL; 
-            g.content_len = 0;
-            g.version = 0; 
-            return 0;
-        }
-        return -1; 
-    }
+// C_SUBSCRIBE_ALL connections, pushed every document's versions
+static struct SubList all_subs;
 
-    struct stat st;
-    if (fstat(fd, &st) != 0) {
-        close(fd);
-        return -1;
-    }
-
-    size_t len = st.st_size; // File size in bytes
-    uint8_t *buf = NULL;
+// CRDT site for the next C_CRDT_JOIN, so no two replicas make the same ids
+static atomic_uint next_site = CRDT_FIRST_SITE;
 
-    if (len) {
-        buf = malloc(len); // Allocate buffer
-        if (!buf) {
-            close(fd);
-            return -1;
-        }
-        if (read_full(fd, buf, len) != 1) { // Read full file
-            free(buf);
-            close(fd);
-            return -1;
-        }
-    }
+// Take d->mu, recording how long that took; returns when it was taken
+static uint64_t lock_doc(struct Doc *d) {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&d->mu);
+    uint64_t locked = stats_now();
+    stats_record(HIST_LOCK_WAIT, locked - start);
+    return locked;
+}
 
-    close(fd);
-    g.content = buf; 
-    g.content_len = len;   
-    g.version = 0; 
-    return 0; 
+static void unlock_doc(struct Doc *d, uint64_t locked) {
+    uint64_t held = stats_now() - locked;
+    pthread_mutex_unlock(&d->mu);
+    stats_record(HIST_LOCK_HOLD, held);
 }
 
-// Combine client changes with server head based on base_version
-static int merge_or_conflict(uint32_t base_version,
+// Combine client changes made against a stale base_version with the
+// server head. Clean PUTs never get here; they publish the client's bytes
+static int merge_or_conflict(const struct Doc *d, uint32_t base_version,
                              const uint8_t *client_data, uint32_t client_len,
                              const uint8_t *server_data, uint32_t server_len,
                              uint8_t **out_data, uint32_t *out_len) {
-    if (base_version == g.version) {
-        // No conflict; accept client changes
-        uint8_t *cpy = NULL;
-        if (client_len) {
-            cpy = malloc(client_len);
-            if (!cpy) 
-                return -1;
-            memcpy(cpy, client_data, client_len);
-        }
-        *out_data = cpy; // merged data is client's data
-        *out_len = client_len;
-        return 0;
+    // Merge line by line against the common ancestor, if the
+    // history still holds it. Only overlapping hunks get markers
+    uint64_t start = stats_now();
+    stats_count(STAT_MERGE, 1);
+    uint8_t *base = NULL;
+    uint32_t base_len = 0;
+    int rc = history_content_at(&d->hist, base_version, &base, &base_len);
+    if (rc < 0)
+        return -1;
+    if (rc == 0) {
+        int conflicts = merge3(base, base_len, client_data, client_len,
+                               server_data, server_len, out_data, out_len);
+        free(base);
+        if (conflicts > 0)
+            stats_count(STAT_CONFLICT, 1);
+        stats_since(HIST_MERGE, start);
+        return conflicts < 0 ? -1 : 0;
     }
+    stats_count(STAT_CONFLICT, 1);
 
-    // Conflict
-    const char *pre = "<-- client\n";
-    const char *mid = "========\n";
-    const char *post = "--> server\n";
+    // Ancestor aged out: keep both whole files between markers
+    const char *pre = MERGE_PRE;
+    const char *mid = MERGE_MID;
+    const char *post = MERGE_POST;
 
     // Calculate total size needed
     size_t total = strlen(pre) + client_len + 1 + 
@@ -146,35 +152,348 @@ static int merge_or_conflict(uint32_t base_version,
 
     *out_data = buf; // merged buffer
     *out_len = (uint32_t)off; // merged length
+    stats_since(HIST_MERGE, start);
     return 0;
 }
 
-// Handle C_GET: send current state to client 
-static int handle_get(int fd) {
-    pthread_mutex_lock(&g.mu); 
+// Answer with a snapshot's S_STATE payload under 'type', chunked if it is
+// large
+static int send_snapshot(struct Conn *c, uint8_t type, struct Snapshot *snap) {
+    struct BodyOwner owner = snapshot_owner(snap);
+    return conn_reply_body(c, type, snap->payload, snap->plen, &owner);
+}
+
+// Tell a client whose content hash matches the head that it is current
+static int send_not_modified(struct Conn *c, struct Doc *d,
+                             const struct Snapshot *snap) {
+    uint32_t reply[2] = { htonl(d->id), htonl(snap->version) };
+    stats_count(STAT_NOT_MODIFIED, 1);
+    return conn_reply(c, S_NOT_MODIFIED, (uint8_t *)reply, sizeof(reply));
+}
+
+// Read the optional u64 content hash of a conditional GET
+static uint64_t read_hash(const uint8_t *p) {
+    uint32_t be[2];
+    memcpy(be, p, 8);
+    return (uint64_t)ntohl(be[0]) << 32 | ntohl(be[1]);
+}
+
+// Handle C_GET: send current state to client straight from the head
+// snapshot, without waiting on writers. A client that sent the hash of
+// the head's content gets S_NOT_MODIFIED instead
+static int handle_get(struct Conn *c, struct Doc *d,
+                      const uint8_t *payload, uint32_t plen) {
+    if (plen != 0 && plen != 8)
+        return -1;
+
+    struct Snapshot *snap = doc_snapshot(d);
+    int ok = plen == 8 && read_hash(payload) == snap->hash
+        ? send_not_modified(c, d, snap)
+        : send_snapshot(c, S_STATE, snap); // send response
+    snapshot_put(snap);
+    return ok;
+}
+
+// Build a one-step S_PUSH_DELTA payload: doc_id, from, to, len, delta
+static uint8_t *pack_delta_step(uint32_t id, uint32_t to, const uint8_t *delta,
+                                uint32_t len, uint32_t *plen_out) {
+    uint8_t *buf = malloc(16 + (size_t)len);
+    if (!buf)
+        return NULL;
+
+    uint32_t be_id = htonl(id);
+    uint32_t be_from = htonl(to - 1), be_to = htonl(to), be_len = htonl(len);
+    memcpy(buf, &be_id, 4);
+    memcpy(buf + 4, &be_from, 4);
+    memcpy(buf + 8, &be_to, 4);
+    memcpy(buf + 12, &be_len, 4);
+    memcpy(buf + 16, delta, len);
+
+    *plen_out = 16 + len;
+    return buf;
+}
+
+// What handle_put tells subscribers about a new version
+struct Push {
+    uint8_t type;          // S_PUSH_DELTA, or S_PUSH if no delta was made
+    uint8_t *payload;      // S_PUSH_DELTA only
+    uint32_t plen;
+    struct Snapshot *snap; // S_PUSH sends the new version's snapshot
+    struct Snapshot *ops;  // S_CRDT_OPS for collaborators, if any
+};
+
+static void push_free(struct Push *push) {
+    free(push->payload);
+    snapshot_put(push->snap);
+    snapshot_put(push->ops);
+}
+
+// Forget the replica once it may no longer match the content. Its
+// collaborators' next ops are refused, and they join again
+static void drop_crdt_locked(struct Doc *d) {
+    crdt_free(d->crdt);
+    free(d->crdt);
+    d->crdt = NULL;
+}
+
+// Make version 'version' (data, or delta from the previous one) survive a
+// restart. In journal mode this only appends a record; journal_wait on
+// *seq_out makes it durable. Otherwise rewrite the whole file as before,
+// and keep large files open in *fd_out so readers can sendfile them
+static int persist_locked(struct Doc *d, uint32_t version,
+                          const uint8_t *data, uint32_t len,
+                          const uint8_t *delta, uint32_t delta_len,
+                          uint64_t *seq_out, int *fd_out) {
+    *seq_out = 0;
+    if (!d->journaled)
+        return atomic_write_file(d->path, data, len,
+                                 len > CHUNK_SIZE ? fd_out : NULL);
+
+    return delta
+        ? journal_append(&d->journal, J_DELTA, version, delta, delta_len, seq_out)
+        : journal_append(&d->journal, J_SNAPSHOT, version, data, len, seq_out);
+}
 
-    uint8_t *buf = malloc(8 + g.content_len);
-    if (!buf) {
-        pthread_mutex_unlock(&g.mu);
+// A journal compaction, holding the version it folds the log into
+struct Compaction {
+    struct Doc *d;
+    struct Snapshot *snap;
+};
+
+// Runs on the journal's flusher thread once the log is folded: refresh
+// the plain copy of the document for anyone reading it directly
+static void compacted(void *arg, int rc) {
+    struct Compaction *cp = arg;
+    if (rc != 0)
+        fprintf(stderr, "%s: journal compaction failed\n", cp->d->path);
+    else if (atomic_write_file(cp->d->path, cp->snap->payload + 12,
+                               cp->snap->len, NULL) != 0)
+        perror(cp->d->path);
+    snapshot_put(cp->snap);
+    free(cp);
+}
+
+// Fold the log into one snapshot of the head now and then. The flusher
+// thread does the writing and syncing, so d->mu is only held to queue it
+static void compact_locked(struct Doc *d) {
+    if (!d->journaled || !journal_should_compact(&d->journal, d->content_len))
+        return;
+    struct Compaction *cp = malloc(sizeof(*cp));
+    if (!cp)
+        return;
+    cp->d = d;
+    cp->snap = doc_snapshot(d);
+    if (journal_compact_later(&d->journal, d->version, d->content,
+                              d->content_len, compacted, cp) != 0) {
+        snapshot_put(cp->snap);
+        free(cp);
+    }
+}
+
+// Install snap, built for version d->version + 1, as the next version and
+// record how it differs from the previous one. Called with d->mu held;
+// takes ownership of snap and of delta (NULL means compute it here). Fills
+// in the push for subscribers and the journal sequence number to wait on
+// before acknowledging
+static int commit_locked(struct Doc *d, struct Snapshot *snap,
+                         uint8_t *delta, uint32_t delta_len,
+                         uint32_t *new_version, struct Push *push,
+                         uint64_t *seq_out) {
+    if (!snap) {
+        free(delta);
+        return -1;
+    }
+    const uint8_t *data = snap->payload + 12;
+    uint32_t len = snap->len;
+    if (!delta &&
+        delta_encode(d->content, d->content_len, data, len, &delta, &delta_len) != 0)
+        delta = NULL;
+
+    if (persist_locked(d, d->version + 1, data, len, delta, delta_len,
+                       seq_out, &snap->fd) != 0) {
+        snapshot_put(snap);
+        free(delta);
         return -1;
     }
 
-    uint32_t be_ver = htonl(g.version);     // version in network order 
-    uint32_t be_len = htonl(g.content_len); // length in network order
+    // Publish the merged content as the next version. Readers holding
+    // the previous snapshot finish with it undisturbed
+    doc_publish_locked(d, snap);
+    *new_version = d->version;
+    compact_locked(d);
 
-    memcpy(buf, &be_ver, 4);       // version 
-    memcpy(buf + 4, &be_len, 4);   // length 
-    if (g.content_len) memcpy(buf + 8, g.content, g.content_len); // content 
+    // Subscribers one version behind only need the delta. Snapshot it now,
+    // the history may fold it away before the broadcast happens
+    push->payload = NULL;
+    push->snap = NULL;
+    if (delta && delta_len <= MAX_MSG - 16) { // else just send the state
+        push->type = S_PUSH_DELTA;
+        push->payload = pack_delta_step(d->id, d->version, delta, delta_len,
+                                        &push->plen);
+    }
+    if (!push->payload) {
+        push->type = S_PUSH;
+        push->snap = doc_snapshot(d);
+    }
 
-    pthread_mutex_unlock(&g.mu);
+    // Keep the history's head in step with d->version; if the delta couldn't
+    // be recorded, restart history at this version, or with nothing at all
+    // if even that fails
+    if (!delta || history_append(&d->hist, delta, delta_len,
+                                     d->content, d->content_len) != 0) {
+        history_free(&d->hist);
+        if (history_init(&d->hist, d->version, d->content, d->content_len) != 0)
+            history_clear(&d->hist, d->version);
+    }
 
-    int ok = send_frame(fd, S_STATE, buf, 8 + g.content_len); // send response 
-    free(buf);
+    // Collaborators only take ops, so bring the replica up to the new
+    // content as the server's own edit. Versions made from ops already
+    // match it and need none
+    push->ops = NULL;
+    if (d->crdt) {
+        uint8_t *ops = NULL;
+        uint32_t ops_len = 0;
+        if (crdt_diff(d->crdt, CRDT_SERVER_SITE, d->content, d->content_len,
+                      &ops, &ops_len) != 0)
+            drop_crdt_locked(d);
+        else if (ops)
+            push->ops = snapshot_new(d->id, d->version, ops, ops_len);
+        free(ops);
+    }
+    return 0;
+}
+
+static void broadcast_ops(struct Conn *c, struct Doc *d, struct Snapshot *ops) {
+    struct BodyOwner owner = snapshot_owner(ops);
+    struct SubList *lists[] = { &d->crdt_subs };
+    sublist_broadcast(lists, 1, c, S_CRDT_OPS, ops->payload, ops->plen, &owner);
+}
+
+// A reply whose version the journal has yet to sync. Its push waits too,
+// so nobody hears of a version that a crash could still lose
+struct Deferred {
+    struct Doc *d;
+    uint32_t tag;
+    uint32_t new_version;
+    struct Snapshot *merged;
+    struct Push push;
+    uint64_t seq;
+};
+
+// Wait for the new version to be durable, answer the writer, then push it
+// to everyone else. Concurrent writers share the journal's fdatasync here
+// A clean PUT only needs the new version; a merged one needs the bytes
+static int finish_reply(struct Conn *c, struct Doc *d, uint32_t new_version,
+                        struct Snapshot *merged, struct Push *push,
+                        uint64_t seq) {
+    int ok;
+    if (d->journaled) {
+        uint64_t start = stats_now();
+        if (journal_wait(&d->journal, seq) != 0) {
+            perror("journal");
+            snapshot_put(merged);
+            push_free(push);
+            return -1;
+        }
+        stats_since(HIST_JOURNAL_WAIT, start);
+    }
+
+    if (merged) {
+        ok = send_snapshot(c, S_STATE, merged);
+        snapshot_put(merged);
+    } else {
+        uint32_t ack[2] = { htonl(d->id), htonl(new_version) };
+        ok = conn_reply(c, S_OK, (uint8_t *)ack, sizeof(ack));
+    }
+
+    struct SubList *lists[] = { &d->subs, &all_subs };
+    if (push->snap) {
+        struct BodyOwner owner = snapshot_owner(push->snap);
+        sublist_broadcast(lists, 2, c, push->type,
+                          push->snap->payload, push->snap->plen, &owner);
+    } else {
+        sublist_broadcast(lists, 2, c, push->type, push->payload, push->plen,
+                          NULL);
+    }
+    if (push->ops)
+        broadcast_ops(c, d, push->ops);
+    push_free(push);
     return ok;
 }
 
-// Handle C_PUT: process client submission 
-static int handle_put(int fd, const uint8_t *payload, uint32_t plen) {
+// Send every reply c held back, in order. Runs when c's socket has no
+// more requests waiting, and before c closes, so the pushes still go out
+// to everyone else
+static int flush_deferred(struct Conn *c) {
+    int ok = 1;
+    for (size_t i = 0; i < c->ndeferred; i++) {
+        struct Deferred *e = &c->deferred[i];
+        c->tag = e->tag;
+        if (finish_reply(c, e->d, e->new_version, e->merged, &e->push,
+                         e->seq) != 1)
+            ok = -1;
+    }
+    c->ndeferred = 0;
+    return ok;
+}
+
+// flush_deferred for reactors, which must not wait on the disk: send the
+// held replies whose versions are durable, in order, and leave the rest
+// to the journal's flusher thread. The reactor calls again once it syncs
+static int flush_synced(struct Conn *c) {
+    int ok = 1;
+    size_t sent = 0;
+    for (size_t i = 0; i < c->ndeferred; i++) {
+        struct Deferred *e = &c->deferred[i];
+        int r = journal_poll(&e->d->journal, e->seq); // Also starts the sync
+        if (i != sent || r == 0)
+            continue;
+        c->tag = e->tag;
+        if (finish_reply(c, e->d, e->new_version, e->merged, &e->push,
+                         e->seq) != 1)
+            ok = -1;
+        sent++;
+    }
+    if (sent) {
+        memmove(c->deferred, c->deferred + sent,
+                (c->ndeferred - sent) * sizeof(*c->deferred));
+        c->ndeferred -= sent;
+    }
+    return ok;
+}
+
+// A group-committed version is acked later, so requests already sent
+// behind it are handled first and their appends join the same fdatasync
+// Tagged replies may go out of order. Untagged ones may not, so a reactor
+// stops reading the client until they are sent, as it does once a client
+// has DEFER_MAX waiting; a client's own thread just waits on the disk
+static int reply_and_broadcast(struct Conn *c, struct Doc *d, uint32_t new_version,
+                               struct Snapshot *merged, struct Push *push,
+                               uint64_t seq) {
+    int reactor = c->epfd >= 0;
+    if (!d->journaled || d->journal.sync != JOURNAL_SYNC_BATCH ||
+        (!c->tag && !reactor))
+        return finish_reply(c, d, new_version, merged, push, seq);
+
+    if (!c->deferred &&
+        !(c->deferred = malloc(DEFER_MAX * sizeof(*c->deferred))))
+        return finish_reply(c, d, new_version, merged, push, seq);
+    c->deferred[c->ndeferred++] = (struct Deferred){
+        .d = d, .tag = c->tag, .new_version = new_version,
+        .merged = merged, .push = *push, .seq = seq,
+    };
+    stats_count(STAT_DEFERRED, 1);
+    if (reactor && (!c->tag || c->ndeferred == DEFER_MAX))
+        return conn_pause(c, 1); // flush_synced sends them as they sync
+    if (c->ndeferred < DEFER_MAX)
+        return 1;
+    return flush_deferred(c);
+}
+
+// Handle C_PUT: process client submission. *frame is the whole received
+// buffer; a clean PUT becomes the new snapshot in place and takes it
+static int handle_put(struct Conn *c, struct Doc *d, uint8_t **frame,
+                      const uint8_t *payload, uint32_t plen) {
     if (plen < 8) 
         return -1; // must at least have version + length 
 
@@ -191,82 +510,464 @@ static int handle_put(int fd, const uint8_t *payload, uint32_t plen) {
 
     const uint8_t *client_data = payload + 8;    
 
-    pthread_mutex_lock(&g.mu);
-    // uint64_t current_version = g.version; // Current server version
-    const uint8_t *server_data = g.content;
-    uint32_t server_len = g.content_len;
+    uint64_t locked = lock_doc(d);
+    int conflict = base_version != d->version;
 
-    uint8_t *merged = NULL;
-    uint32_t merged_len = 0;
+    // The frame is doc_id, base, length, content: the S_STATE layout, so a
+    // clean PUT is published straight from it
+    struct Snapshot *snap;
+    if (!conflict) {
+        snap = snapshot_adopt(d->id, d->version + 1, *frame, client_len);
+        *frame = NULL;
+    } else {
+        // Combine client changes with server head
+        uint8_t *merged = NULL;
+        uint32_t merged_len = 0;
+        if (merge_or_conflict(d, base_version,
+                              client_data, client_len,
+                              d->content, d->content_len,
+                              &merged, &merged_len) != 0) {
+            unlock_doc(d, locked);
+            return -1;
+        }
+        snap = snapshot_new(d->id, d->version + 1, merged, merged_len);
+        free(merged);
+    }
 
-    // Combine client changes with server head 
-    if (merge_or_conflict(base_version, 
-                            client_data, client_len, 
-                            g.content, g.content_len,
-                            &merged, &merged_len) != 0) {
-        pthread_mutex_unlock(&g.mu);
+    uint32_t new_version = 0;
+    uint64_t seq = 0;
+    struct Push push;
+    if (commit_locked(d, snap, NULL, 0, &new_version, &push, &seq) != 0) {
+        unlock_doc(d, locked);
         return -1;
     }
 
-    if (atomic_write_file(g.path, merged, merged_len) != 0) {
-        free(merged);
-        pthread_mutex_unlock(&g.mu);
+    // The writer's base is stale, so it needs the merged bytes in full
+    struct Snapshot *merged_snap = conflict ? doc_snapshot(d) : NULL;
+    unlock_doc(d, locked);
+
+    return reply_and_broadcast(c, d, new_version, merged_snap, &push, seq);
+}
+
+// Handle C_PUT_DELTA: base version + delta against it
+// A delta against an older version still in the history is applied to
+// that version and merged like a stale C_PUT; once the base has aged out
+// it is refused with S_NACK and the client resends a full C_PUT
+static int handle_put_delta(struct Conn *c, struct Doc *d,
+                            const uint8_t *payload, uint32_t plen) {
+    if (plen < 4) 
         return -1;
+
+    uint32_t be_base;
+    memcpy(&be_base, payload, 4);
+    uint32_t base_version = ntohl(be_base);
+
+    const uint8_t *delta = payload + 4;
+    uint32_t delta_len = plen - 4;
+
+    uint64_t locked = lock_doc(d);
+    int stale = base_version != d->version;
+    const uint8_t *base = d->content;
+    uint32_t base_len = d->content_len;
+    uint8_t *old = NULL;
+    if (stale) {
+        int rc = history_content_at(&d->hist, base_version, &old, &base_len);
+        if (rc != 0) {
+            unlock_doc(d, locked);
+            if (rc < 0)
+                return -1;
+            uint32_t be_id = htonl(d->id);
+            stats_count(STAT_NACK, 1);
+            return conn_reply(c, S_NACK, (uint8_t *)&be_id, 4);
+        }
+        base = old;
+    }
+
+    uint8_t *data = NULL;
+    uint32_t len = 0;
+    int bad = delta_apply(base, base_len, delta, delta_len, &data, &len);
+    free(old);
+    if (bad != 0) {
+        unlock_doc(d, locked);
+        return -1; // malformed delta
     }
 
-    // Replace state with merged content and increment version
-    free(g.content);
-    g.content = merged;
-    g.content_len = merged_len;
-    g.version++; // Increment verison
+    // The client's delta is exactly what the history needs, unless it has
+    // to be merged with the versions since its base
+    uint8_t *hist_delta = NULL;
+    if (stale) {
+        uint8_t *merged = NULL;
+        uint32_t merged_len = 0;
+        int rc = merge_or_conflict(d, base_version, data, len,
+                                   d->content, d->content_len,
+                                   &merged, &merged_len);
+        free(data);
+        if (rc != 0) {
+            unlock_doc(d, locked);
+            return -1;
+        }
+        data = merged;
+        len = merged_len;
+    } else {
+        hist_delta = malloc(delta_len);
+        if (hist_delta) memcpy(hist_delta, delta, delta_len);
+    }
 
-    uint32_t new_version = g.version;
+    uint32_t new_version = 0;
+    uint64_t seq = 0;
+    struct Push push;
+    struct Snapshot *snap = snapshot_new(d->id, d->version + 1, data, len);
+    free(data);
+    int rc = commit_locked(d, snap, hist_delta, hist_delta ? delta_len : 0,
+                           &new_version, &push, &seq);
+    if (rc != 0) {
+        unlock_doc(d, locked);
+        return -1;
+    }
 
-    pthread_mutex_unlock(&g.mu);
+    // As with a stale C_PUT, the writer needs the merged bytes in full
+    struct Snapshot *merged_snap = stale ? doc_snapshot(d) : NULL;
+    unlock_doc(d, locked);
 
-    // Send S_OK with new version to client 
-    uint32_t be_lenew = htonl(new_version);
-    return send_frame(fd, S_OK, (uint8_t *)&be_lenew, 8);
+    return reply_and_broadcast(c, d, new_version, merged_snap, &push, seq);
+}
+
+// Handle C_GET_SINCE: the client holds 'from' and wants the head
+// Answer with the chain of deltas from the history, or the full S_STATE
+// when 'from' has aged out or the chain would outweigh the content
+// With a content hash, a match means S_NOT_MODIFIED, and a mismatch at the
+// head version means the client's copy isn't ours, so it gets S_STATE
+static int handle_get_since(struct Conn *c, struct Doc *d,
+                            const uint8_t *payload, uint32_t plen) {
+    if (plen != 4 && plen != 12)
+        return -1;
+
+    uint32_t be_from;
+    memcpy(&be_from, payload, 4);
+    uint32_t from = ntohl(be_from);
+
+    // Most pollers are already current: answer from the snapshot without
+    // touching the writer lock
+    struct Snapshot *snap = doc_snapshot(d);
+    if (plen == 12) {
+        int ok = 0;
+        if (read_hash(payload + 4) == snap->hash)
+            ok = send_not_modified(c, d, snap);
+        else if (snap->version == from)
+            ok = send_snapshot(c, S_STATE, snap);
+        if (ok != 0) {
+            snapshot_put(snap);
+            return ok;
+        }
+    }
+    if (snap->version == from) {
+        snapshot_put(snap);
+        uint32_t empty[3] = { htonl(d->id), be_from, be_from };
+        return conn_reply(c, S_DELTA, (uint8_t *)empty, sizeof(empty));
+    }
+    snapshot_put(snap);
+
+    uint64_t locked = lock_doc(d);
+    uint8_t *buf = NULL;
+    uint32_t len = 0;
+    // Chains go as one frame; past that the (chunked) state is cheaper anyway
+    uint32_t max = d->content_len < MAX_MSG - 17 ? 12 + d->content_len
+                                                 : MAX_MSG - 5; // type + tag
+    int rc = history_chain(&d->hist, from, max, 4, &buf, &len);
+    snap = rc == 1 ? doc_snapshot(d) : NULL;
+    unlock_doc(d, locked);
+    if (rc < 0)
+        return -1;
+
+    int ok;
+    if (snap) {
+        ok = send_snapshot(c, S_STATE, snap);
+        snapshot_put(snap);
+    } else {
+        uint32_t be_id = htonl(d->id); // history left room for it
+        memcpy(buf, &be_id, 4);
+        ok = conn_reply(c, S_DELTA, buf, len);
+        free(buf);
+    }
+    return ok;
+}
+
+// Features this server offers in S_HELLO
+static uint32_t server_features = FEATURE_LZ | FEATURE_TAGS;
+
+// Handle C_HELLO: agree on the features both sides support
+static int handle_hello(struct Conn *c, const uint8_t *payload, uint32_t plen) {
+    uint32_t be_features;
+    if (plen != 4)
+        return -1;
+    memcpy(&be_features, payload, 4);
+    uint32_t features = ntohl(be_features) & server_features;
+
+    // Say yes before the first compressed frame can follow it
+    uint32_t reply = htonl(features);
+    int ok = conn_reply(c, S_HELLO, (uint8_t *)&reply, sizeof(reply));
+    atomic_store(&c->compress, (features & FEATURE_LZ) != 0);
+    return ok;
+}
+
+// Handle C_OPEN: look the document up by name, loading it on first use
+static int handle_open(struct Conn *c, const uint8_t *payload, uint32_t plen) {
+    struct Doc *d = doc_open((const char *)payload, plen);
+    if (!d)
+        return -1; // bad name or unreadable file
+
+    struct Snapshot *snap = doc_snapshot(d);
+    uint32_t opened[2] = { htonl(d->id), htonl(snap->version) };
+    snapshot_put(snap);
+    return conn_reply(c, S_OPENED, (uint8_t *)opened, sizeof(opened));
+}
+
+// Handle C_STATS: everything stats.h has gathered so far, as text
+static int handle_stats(struct Conn *c, uint32_t plen) {
+    if (plen != 0)
+        return -1;
+    uint32_t len = 0;
+    char *text = stats_format(&len);
+    if (!text)
+        return -1;
+    int ok = conn_reply(c, S_STATS, (uint8_t *)text, len);
+    free(text);
+    return ok;
+}
+
+// Handle C_TREE: u64 hash of the client's copy of a directory, then its
+// path. The reply only lists the children when the hashes differ
+static int handle_tree(struct Conn *c, const uint8_t *payload, uint32_t plen) {
+    if (plen < 8)
+        return -1;
+    uint64_t their_hash = read_hash(payload);
+    uint32_t len = 0;
+    uint8_t *list = doc_tree_list((const char *)payload + 8, plen - 8,
+                                  their_hash, &len);
+    if (!list)
+        return -1;
+    int ok = conn_reply(c, S_TREE, list, len);
+    frame_buf_free(list);
+    return ok;
+}
+
+// Handle C_CRDT_JOIN: send the replica, made from the head on the first
+// join, and a new site for the client's ops. Subscribing first means no
+// ops can fall between the two; ops the replica already has are repeats
+static int handle_crdt_join(struct Conn *c, struct Doc *d, uint32_t plen) {
+    if (plen != 0 || sublist_add(&d->crdt_subs, c) != 0)
+        return -1;
+
+    uint64_t locked = lock_doc(d);
+    if (!d->crdt && (d->crdt = malloc(sizeof(*d->crdt))) &&
+        crdt_init(d->crdt, CRDT_SERVER_SITE, d->content, d->content_len) != 0)
+        drop_crdt_locked(d);
+    uint8_t *state = NULL;
+    uint32_t len = 0;
+    uint8_t *body = NULL;
+    if (d->crdt && crdt_encode(d->crdt, &state, &len) == 0 &&
+        len <= MAX_BODY - 16 && (body = malloc(4 + (size_t)len))) {
+        uint32_t be_site = htonl(atomic_fetch_add(&next_site, 1));
+        memcpy(body, &be_site, 4);
+        memcpy(body + 4, state, len);
+    }
+    free(state);
+    struct Snapshot *snap = body ? snapshot_new(d->id, d->version, body, 4 + len)
+                                 : NULL;
+    unlock_doc(d, locked);
+    free(body);
+    if (!snap)
+        return -1;
+
+    int ok = send_snapshot(c, S_CRDT_STATE, snap);
+    snapshot_put(snap);
+    return ok;
+}
+
+// Handle C_CRDT_OPS: apply ops from a collaborator's replica and publish
+// the text as the next version. Everyone gets the ops as they were sent,
+// even when they changed no byte, as ops that follow may name their ids
+static int handle_crdt_ops(struct Conn *c, struct Doc *d,
+                           const uint8_t *payload, uint32_t plen) {
+    uint64_t locked = lock_doc(d);
+    if (!d->crdt) {
+        unlock_doc(d, locked);
+        return -1; // Replica dropped since the client joined
+    }
+    uint8_t *text = NULL;
+    uint32_t len = 0;
+    if (crdt_apply(d->crdt, payload, plen) != 0 ||
+        crdt_text(d->crdt, &text, &len) != 0) {
+        drop_crdt_locked(d);
+        unlock_doc(d, locked);
+        return -1;
+    }
+
+    if (len == d->content_len && memcmp(text, d->content, len) == 0) {
+        free(text);
+        uint32_t ack[2] = { htonl(d->id), htonl(d->version) };
+        struct Snapshot *ops = snapshot_new(d->id, d->version, payload, plen);
+        unlock_doc(d, locked);
+        int ok = conn_reply(c, S_OK, (uint8_t *)ack, sizeof(ack));
+        if (ops)
+            broadcast_ops(c, d, ops);
+        snapshot_put(ops);
+        return ok;
+    }
+
+    uint32_t new_version = 0;
+    uint64_t seq = 0;
+    struct Push push;
+    struct Snapshot *snap = snapshot_new(d->id, d->version + 1, text, len);
+    free(text);
+    if (commit_locked(d, snap, NULL, 0, &new_version, &push, &seq) != 0) {
+        unlock_doc(d, locked);
+        return -1;
+    }
+    push.ops = snapshot_new(d->id, new_version, payload, plen);
+    unlock_doc(d, locked);
+
+    return reply_and_broadcast(c, d, new_version, NULL, &push, seq);
+}
+
+// Run one request from a client
+static int dispatch(struct Conn *c, uint8_t type, uint8_t **frame,
+                    const uint8_t *payload, uint32_t plen) {
+    if (type == C_OPEN)
+        return handle_open(c, payload, plen);
+    if (type == C_HELLO)
+        return handle_hello(c, payload, plen);
+    if (type == C_STATS)
+        return handle_stats(c, plen);
+    if (type == C_TREE)
+        return handle_tree(c, payload, plen);
+    if (type == C_SUBSCRIBE_ALL)
+        return plen == 0 && sublist_add(&all_subs, c) == 0 ? 1 : -1;
+
+    // Everything else names a document the client opened before
+    if (plen < 4)
+        return -1;
+    uint32_t be_id;
+    memcpy(&be_id, payload, 4);
+    struct Doc *d = doc_get(ntohl(be_id));
+    if (!d)
+        return -1;
+    payload += 4;
+    plen -= 4;
+
+    if (type == C_GET)
+        return handle_get(c, d, payload, plen); // handle GET
+    if (type == C_PUT)
+        return handle_put(c, d, frame, payload, plen); // handle PUT
+    if (type == C_PUT_DELTA)
+        return handle_put_delta(c, d, payload, plen);
+    if (type == C_GET_SINCE)
+        return handle_get_since(c, d, payload, plen);
+    if (type == C_SUBSCRIBE)
+        return sublist_add(&d->subs, c) == 0 ? 1 : -1;
+    if (type == C_CRDT_JOIN)
+        return handle_crdt_join(c, d, plen);
+    if (type == C_CRDT_OPS)
+        return handle_crdt_ops(c, d, payload, plen);
+    return -1; // Unknown message type
+}
+
+// Count a finished request and how long it took, reply included
+static void record_request(uint8_t type, uint32_t plen, int ok, uint64_t start) {
+    stats_count(STAT_BYTES_IN, plen);
+    if (ok != 1)
+        stats_count(STAT_ERROR, 1);
+
+    switch (type) {
+    case C_OPEN:
+        stats_count(STAT_OPEN, 1);
+        break;
+    case C_SUBSCRIBE:
+    case C_SUBSCRIBE_ALL:
+    case C_CRDT_JOIN:
+        stats_count(STAT_SUBSCRIBE, 1);
+        break;
+    case C_CRDT_OPS:
+        stats_count(STAT_CRDT_OPS, 1);
+        break;
+    case C_TREE:
+        stats_count(STAT_TREE, 1);
+        break;
+    case C_GET:
+        stats_count(STAT_GET, 1);
+        stats_since(HIST_GET, start);
+        break;
+    case C_GET_SINCE:
+        stats_count(STAT_GET_SINCE, 1);
+        stats_since(HIST_GET_SINCE, start);
+        break;
+    case C_PUT:
+        stats_count(STAT_PUT, 1);
+        stats_since(HIST_PUT, start);
+        break;
+    case C_PUT_DELTA:
+        stats_count(STAT_PUT_DELTA, 1);
+        stats_since(HIST_PUT_DELTA, start);
+        break;
+    default:
+        break;
+    }
+}
+
+// Entry point shared by both server cores. Takes the frame buffer;
+// handlers that keep it clear 'frame'
+static int handle_frame(struct Conn *c, uint8_t type, uint32_t tag,
+                        uint8_t *payload, uint32_t plen) {
+    uint64_t start = stats_now();
+    c->tag = tag;
+    uint8_t *frame = payload;
+    int ok = dispatch(c, type, &frame, payload, plen);
+    frame_buf_free(frame);
+    record_request(type, plen, ok, start);
+    return ok;
 }
 
 static void *client_thread(void *arg) {
-    int fd = (int)(uintptr_t)arg; // Client socket
+    struct Conn *c = arg; // Client connection
+    stats_gauge(STAT_CLIENT_THREADS, 1);
 
     for (;;) {
         uint8_t  type;
+        uint32_t tag = 0;
         uint8_t *payload = NULL;
         uint32_t plen = 0;
 
-        int r = recv_frame(fd, &type, &payload, &plen); // Read next frame 
-        if (r <= 0) { // EOF or error
-            free(payload);
+        // Held-back replies go once the client has nothing more queued
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        if (c->ndeferred && poll(&pfd, 1, 0) <= 0 && flush_deferred(c) != 1)
             break;
-        }
 
-        int ok = 1;
-        if (type == C_GET) {
-            ok = handle_get(fd); // handle GET
-        } else if (type == C_PUT) {
-            ok = handle_put(fd, payload, plen); // handle PUT
-        } else {
-            ok = -1; // Unknown message type
+        int r = recv_message(c->fd, &type, &tag, &payload, &plen); // Read next message 
+        if (r <= 0) { // EOF or error
+            frame_buf_free(payload);
+            break;
         }
 
-        free(payload); // Free payload buffer
+        int ok = handle_frame(c, type, tag, payload, plen); // Frees payload
         if (ok != 1) break; // Handle error by closing connection
     }
 
-    close(fd); // Close client socket
+    flush_deferred(c); // The others still hear of what it committed
+    registry_remove(c); // No new broadcast can reach c after this
+    conn_put(c); // Closes the client socket once no broadcast is sending
+    stats_gauge(STAT_CLIENT_THREADS, -1);
     return NULL;
 }
 
 // Listener setup 
-static int listen_on(uint16_t port) {
+static int listen_on(uint16_t port, int reuseport) {
     int fd = socket(AF_INET6, SOCK_STREAM, 0); // TCP Socket
     if (fd < 0) return -1;
 
     int yes = 1;
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); 
+    if (reuseport) // Let several listeners share the port, kernel balances
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
 
     struct sockaddr_in6 addr6;
     memset(&addr6, 0, sizeof(addr6));
@@ -288,58 +989,139 @@ static int listen_on(uint16_t port) {
     return fd;
 }
 
+// Blocking accept loop spawning one thread per client
+static void serve_threads(int lfd) {
+    for (;;) { 
+        int cfd = accept(lfd, NULL, NULL); // Wait for client
+        if (cfd < 0) {
+            if (errno == EINTR) 
+                continue; 
+            perror("accept");
+            continue;
+        }
+
+        // Don't let one stuck subscriber stall broadcasts forever
+        struct timeval tv = { .tv_sec = SEND_TIMEOUT_SEC };
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        struct Conn *c = conn_new(cfd, -1);
+        if (!c) {
+            close(cfd);
+            continue;
+        }
+
+        if (registry_add(c) != 0) {
+            conn_put(c);
+            continue;
+        }
+
+        pthread_t th;
+        // Spawn thread to handle client 
+        if (pthread_create(&th, NULL, client_thread, c) == 0) {
+            pthread_detach(th);
+        } else {
+            registry_remove(c);
+            conn_put(c);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m threads|epoll] [-r reactors] [-P] "
+                    "[-j none|batch|always] [-Z] [-s seconds] "
+                    "<port> <root_dir>\n", prog);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) { 
-        fprintf(stderr, "Usage: %s <port> <file_path>\n", argv[0]);
+    int use_epoll = 0;
+    long nreactors = sysconf(_SC_NPROCESSORS_ONLN);
+    int reuseport = 0;
+    int journaled = 0;
+    enum JournalSync sync = JOURNAL_SYNC_BATCH;
+    long stats_secs = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:r:Pj:Zs:")) != -1) {
+        if (opt == 'm' && strcmp(optarg, "threads") == 0) {
+            use_epoll = 0;
+        } else if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+            use_epoll = 1;
+        } else if (opt == 'r') {
+            nreactors = atol(optarg);
+        } else if (opt == 'P') {
+            reuseport = 1;
+        } else if (opt == 'j' && strcmp(optarg, "none") == 0) {
+            journaled = 1;
+            sync = JOURNAL_SYNC_NONE;
+        } else if (opt == 'j' && strcmp(optarg, "batch") == 0) {
+            journaled = 1;
+            sync = JOURNAL_SYNC_BATCH;
+        } else if (opt == 'j' && strcmp(optarg, "always") == 0) {
+            journaled = 1;
+            sync = JOURNAL_SYNC_ALWAYS;
+        } else if (opt == 'Z') {
+            server_features &= ~(uint32_t)FEATURE_LZ;
+        } else if (opt == 's') {
+            stats_secs = atol(optarg);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 2 || nreactors < 1 || nreactors > 1024 ||
+        stats_secs < 0) {
+        usage(argv[0]);
         return 2;
     }
 
-    uint16_t port = atoi(argv[1]); 
-    const char *path = argv[2];
+    uint16_t port = (uint16_t)atoi(argv[optind]); 
+    const char *root = argv[optind + 1];
 
-    memset(&g, 0, sizeof(g)); 
-    pthread_mutex_init(&g.mu, NULL); 
+    // A subscriber vanishing mid-broadcast must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-    if (strlen(path) >= sizeof(g.path)) { 
-        fprintf(stderr, "File path too long\n");
-        return 2;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
-    strncpy(g.path, path, sizeof(g.path) - 1); 
-    g.path[sizeof(g.path) - 1] = 0; 
 
-    if (load_initial() != 0) { 
-        perror("load_initial");
+    sublist_init(&all_subs);
+    if (doc_table_init(root, journaled, sync) != 0) {
+        perror(root);
         return 1;
     }
 
-    int lfd = listen_on(port); // Create listening socket
-    if (lfd < 0) {
-        perror("listen");
+    stats_init();
+    if (stats_secs > 0 && stats_dump_every((unsigned)stats_secs) != 0) {
+        perror("stats");
         return 1;
     }
 
-    printf("Serving %s on port %u (version=%" PRIu32 ")\n",
-            g.path, port, g.version);
-
-    for (;;) { 
-        int cfd = accept(lfd, NULL, NULL); // Wait for client
-        if (cfd < 0) {
-            if (errno == EINTR) 
-                continue; 
-            perror("accept");
-            continue;
+    // One listener, or one per reactor when the kernel should spread accepts
+    int nlfds = use_epoll && reuseport ? (int)nreactors : 1;
+    int lfds[1024];
+    for (int i = 0; i < nlfds; i++) {
+        lfds[i] = listen_on(port, reuseport); // Create listening socket
+        if (lfds[i] < 0) {
+            perror("listen");
+            return 1;
         }
+    }
 
-        pthread_t th;
-        // Spawn thread to handle client 
-        if (pthread_create(&th, NULL, 
-                            client_thread, 
-                            (void *)(intptr_t)cfd) == 0) {
-            pthread_detach(th);
-        } else {
-            close(cfd);
-        }
+    printf("Serving %s on port %u (%s)\n",
+            root, port, use_epoll ? "epoll" : "threads");
+
+    if (!use_epoll) {
+        serve_threads(lfds[0]);
+        return 0;
     }
 
+    for (int i = 0; i < nlfds; i++)
+        fcntl(lfds[i], F_SETFL, fcntl(lfds[i], F_GETFL) | O_NONBLOCK);
+    journal_set_wake(reactor_wake);
+    if (reactor_serve(lfds, nlfds, (int)nreactors, handle_frame,
+                      flush_synced) != 0)
+        return 1;
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,307 @@
+/*
+ * Server statistics: counters, gauges and latency histograms.
+ *
+ * Every thread records into its own shard, so the hot path is a plain
+ * load and store with no shared cache lines and no lock. Readers walk the
+ * shard list and merge; a thread that exits folds its shard into a retired
+ * total first, so nothing it counted is lost.
+ *
+ * Histograms are log-linear like HdrHistogram: each power of two is split
+ * into HIST_SUB buckets, which keeps every value within 1/HIST_SUB of its
+ * bucket from 1 ns up to HIST_MAX_EXP (over an hour).
+ */
+
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_EXP 41
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+struct Hist {
+    atomic_uint_fast64_t count[HIST_BUCKETS];
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+};
+
+struct Shard {
+    atomic_uint_fast64_t counters[STAT_NCOUNTERS];
+    struct Hist hist[STAT_NHISTS];
+    struct Shard *next;
+};
+
+static __thread struct Shard *shard;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+// Live shards and what exited threads left behind, both under shards_mu
+static pthread_mutex_t shards_mu = PTHREAD_MUTEX_INITIALIZER;
+static struct Shard *shards;
+static struct Shard retired;
+
+static atomic_long gauges[STAT_NGAUGES];
+static uint64_t started_ns;
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+    [STAT_OPEN] = "open",
+    [STAT_GET] = "get",
+    [STAT_GET_SINCE] = "get_since",
+    [STAT_PUT] = "put",
+    [STAT_PUT_DELTA] = "put_delta",
+    [STAT_SUBSCRIBE] = "subscribe",
+    [STAT_TREE] = "tree",
+    [STAT_CRDT_OPS] = "crdt_ops",
+    [STAT_NOT_MODIFIED] = "not_modified",
+    [STAT_NACK] = "nack",
+    [STAT_DEFERRED] = "deferred",
+    [STAT_MERGE] = "merge",
+    [STAT_CONFLICT] = "conflict",
+    [STAT_ERROR] = "error",
+    [STAT_BYTES_IN] = "bytes_in",
+};
+
+static const char *gauge_names[STAT_NGAUGES] = {
+    [STAT_CONNS] = "conns",
+    [STAT_CLIENT_THREADS] = "client_threads",
+    [STAT_CHUNKS] = "chunks",
+    [STAT_CHUNK_BYTES] = "chunk_bytes",
+};
+
+static const char *hist_names[STAT_NHISTS] = {
+    [HIST_LOCK_WAIT] = "lock_wait",
+    [HIST_LOCK_HOLD] = "lock_hold",
+    [HIST_DISK_WRITE] = "disk_write",
+    [HIST_JOURNAL_WAIT] = "journal_wait",
+    [HIST_MERGE] = "merge",
+    [HIST_GET] = "get",
+    [HIST_GET_SINCE] = "get_since",
+    [HIST_PUT] = "put",
+    [HIST_PUT_DELTA] = "put_delta",
+};
+
+// Only the owning thread writes a shard, so no read-modify-write is needed
+static void bump(atomic_uint_fast64_t *v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static uint64_t load(atomic_uint_fast64_t *v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+// Add src into dst; dst must not be a live shard. Caller holds shards_mu
+static void shard_add(struct Shard *dst, struct Shard *src) {
+    for (int i = 0; i < STAT_NCOUNTERS; i++)
+        bump(&dst->counters[i], load(&src->counters[i]));
+    for (int h = 0; h < STAT_NHISTS; h++) {
+        struct Hist *d = &dst->hist[h], *s = &src->hist[h];
+        for (uint32_t b = 0; b < HIST_BUCKETS; b++)
+            bump(&d->count[b], load(&s->count[b]));
+        bump(&d->sum, load(&s->sum));
+        if (load(&s->max) > load(&d->max))
+            atomic_store_explicit(&d->max, load(&s->max), memory_order_relaxed);
+    }
+}
+
+// Thread exit: keep the counts, drop the shard
+static void shard_retire(void *arg) {
+    struct Shard *s = arg;
+    pthread_mutex_lock(&shards_mu);
+    for (struct Shard **p = &shards; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+    shard_add(&retired, s);
+    pthread_mutex_unlock(&shards_mu);
+    free(s);
+    shard = NULL;
+}
+
+static void shard_key_init(void) {
+    pthread_key_create(&shard_key, shard_retire);
+    started_ns = stats_now();
+}
+
+// Start the uptime clock; recording works without it
+void stats_init(void) {
+    pthread_once(&shard_once, shard_key_init);
+}
+
+static struct Shard *thread_shard(void) {
+    if (!shard) {
+        pthread_once(&shard_once, shard_key_init);
+        struct Shard *s = calloc(1, sizeof(*s));
+        if (!s)
+            return NULL; // Uncounted, but the request still goes through
+        pthread_setspecific(shard_key, s);
+        pthread_mutex_lock(&shards_mu);
+        s->next = shards;
+        shards = s;
+        pthread_mutex_unlock(&shards_mu);
+        shard = s;
+    }
+    return shard;
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_count(enum StatCounter c, uint64_t n) {
+    struct Shard *s = thread_shard();
+    if (s)
+        bump(&s->counters[c], n);
+}
+
+void stats_gauge(enum StatGauge g, int delta) {
+    atomic_fetch_add_explicit(&gauges[g], delta, memory_order_relaxed);
+}
+
+// Values below HIST_SUB get a bucket each; above, the top HIST_SUB_BITS
+// after the leading one pick the bucket within its power of two
+static uint32_t bucket_of(uint64_t v) {
+    if (v < HIST_SUB)
+        return (uint32_t)v;
+    uint32_t e = 63u - (uint32_t)__builtin_clzll(v);
+    if (e > HIST_MAX_EXP)
+        return HIST_BUCKETS - 1;
+    uint32_t sub = (uint32_t)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// Smallest value that lands in bucket b, and the bucket's width
+static uint64_t bucket_low(uint32_t b, uint64_t *width) {
+    if (b < HIST_SUB) {
+        *width = 1;
+        return b;
+    }
+    uint32_t e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    *width = 1ull << (e - HIST_SUB_BITS);
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+void stats_record(enum StatHist h, uint64_t ns) {
+    struct Shard *s = thread_shard();
+    if (!s)
+        return;
+    struct Hist *hist = &s->hist[h];
+    bump(&hist->count[bucket_of(ns)], 1);
+    bump(&hist->sum, ns);
+    if (ns > load(&hist->max))
+        atomic_store_explicit(&hist->max, ns, memory_order_relaxed);
+}
+
+void stats_since(enum StatHist h, uint64_t start) {
+    stats_record(h, stats_now() - start);
+}
+
+// Value at quantile q of a merged histogram, the middle of its bucket
+static uint64_t hist_quantile(struct Hist *h, uint64_t n, double q) {
+    uint64_t rank = (uint64_t)(q * (double)n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += load(&h->count[b]);
+        if (seen >= rank) {
+            uint64_t width;
+            uint64_t v = bucket_low(b, &width) + width / 2;
+            return v < load(&h->max) ? v : load(&h->max);
+        }
+    }
+    return load(&h->max);
+}
+
+// Everything so far as "name value" lines, histograms as
+// "name_ns count=... mean=... p50=... p90=... p99=... p999=... max=..."
+// Returns a malloc'd buffer, not NUL terminated in *len_out
+char *stats_format(uint32_t *len_out) {
+    struct Shard *total = calloc(1, sizeof(*total));
+    if (!total)
+        return NULL;
+
+    stats_init();
+    pthread_mutex_lock(&shards_mu);
+    shard_add(total, &retired);
+    for (struct Shard *s = shards; s; s = s->next)
+        shard_add(total, s);
+    pthread_mutex_unlock(&shards_mu);
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) {
+        free(total);
+        return NULL;
+    }
+
+    fprintf(f, "uptime_s %.1f\n", (double)(stats_now() - started_ns) / 1e9);
+    for (int g = 0; g < STAT_NGAUGES; g++)
+        fprintf(f, "%s %ld\n", gauge_names[g],
+                atomic_load_explicit(&gauges[g], memory_order_relaxed));
+    for (int i = 0; i < STAT_NCOUNTERS; i++)
+        fprintf(f, "%s %" PRIu64 "\n", counter_names[i],
+                load(&total->counters[i]));
+
+    for (int i = 0; i < STAT_NHISTS; i++) {
+        struct Hist *h = &total->hist[i];
+        uint64_t n = 0;
+        for (uint32_t b = 0; b < HIST_BUCKETS; b++)
+            n += load(&h->count[b]);
+        fprintf(f, "%s_ns count=%" PRIu64, hist_names[i], n);
+        if (n) {
+            fprintf(f, " mean=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+                       " p99=%" PRIu64 " p999=%" PRIu64 " max=%" PRIu64,
+                    load(&h->sum) / n, hist_quantile(h, n, 0.5),
+                    hist_quantile(h, n, 0.9), hist_quantile(h, n, 0.99),
+                    hist_quantile(h, n, 0.999), load(&h->max));
+        }
+        fputc('\n', f);
+    }
+    free(total);
+
+    if (fclose(f) != 0 || len > UINT32_MAX) {
+        free(buf);
+        return NULL;
+    }
+    *len_out = (uint32_t)len;
+    return buf;
+}
+
+static void *dump_thread(void *arg) {
+    unsigned secs = (unsigned)(uintptr_t)arg;
+    for (;;) {
+        sleep(secs);
+        uint32_t len;
+        char *text = stats_format(&len);
+        if (!text)
+            continue;
+        fprintf(stderr, "--- stats\n%.*s", (int)len, text);
+        free(text);
+    }
+    return NULL;
+}
+
+// Print the stats to stderr every 'secs' seconds from a background thread
+int stats_dump_every(unsigned secs) {
+    pthread_t th;
+    stats_init();
+    if (pthread_create(&th, NULL, dump_thread, (void *)(uintptr_t)secs) != 0)
+        return -1;
+    pthread_detach(th);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <criterion/criterion.h>
+
+#include "chunk_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LEN (512u * 1024u)
+
+// Pseudo-random bytes, the same every run; each test uses its own seed
+// so they don't share chunks
+static uint8_t* noise(uint32_t len, uint32_t seed) {
+    uint8_t* p = malloc(len + 1);
+    cr_assert_not_null(p);
+    for (uint32_t i = 0; i < len; i++) {
+        seed = seed * 1103515245u + 12345u;
+        p[i] = (uint8_t)(seed >> 16);
+    }
+    return p;
+}
+
+static int holds(const struct ChunkList* l, const uint8_t* data, uint32_t len) {
+    uint8_t* out = NULL;
+    uint32_t out_len = 0;
+    cr_assert_eq(chunk_list_join(l, &out, &out_len), 0);
+    int same = out_len == len && (!len || memcmp(out, data, len) == 0);
+    free(out);
+    return same;
+}
+
+static uint32_t shared(const struct ChunkList* x, const struct ChunkList* y) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < x->n; i++)
+        for (uint32_t j = 0; j < y->n; j++)
+            if (x->chunks[i] == y->chunks[j]) {
+                n++;
+                break;
+            }
+    return n;
+}
+
+Test(chunk_store, cuts_stay_within_bounds) {
+    uint8_t* data = noise(LEN, 1);
+    struct ChunkList l;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(data, LEN, &l, &fresh), 0);
+    cr_assert_eq(l.len, LEN);
+    cr_assert_eq(fresh, LEN);
+    for (uint32_t i = 0; i + 1 < l.n; i++) {
+        cr_assert_geq(l.chunks[i]->len, CDC_MIN);
+        cr_assert_leq(l.chunks[i]->len, CDC_MAX);
+    }
+    cr_assert(holds(&l, data, LEN));
+    chunk_list_free(&l);
+    free(data);
+}
+
+Test(chunk_store, same_content_is_stored_once) {
+    uint8_t* data = noise(LEN, 2);
+    struct ChunkList a, b;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(data, LEN, &a, &fresh), 0);
+    cr_assert_eq(chunk_split(data, LEN, &b, &fresh), 0);
+    cr_assert_eq(fresh, 0);
+    cr_assert_eq(a.n, b.n);
+    for (uint32_t i = 0; i < a.n; i++)
+        cr_assert_eq(a.chunks[i], b.chunks[i]);
+    chunk_list_free(&a);
+    chunk_list_free(&b);
+    free(data);
+}
+
+// One byte inserted only moves the cut next to it: everything else is
+// still the same chunks, and only those around the edit are new
+Test(chunk_store, one_byte_insert_keeps_the_other_chunks) {
+    uint8_t* data = noise(LEN, 3);
+    uint8_t* edited = malloc(LEN + 1);
+    cr_assert_not_null(edited);
+    uint32_t at = LEN / 2 + 12345;
+    memcpy(edited, data, at);
+    edited[at] = 'x';
+    memcpy(edited + at + 1, data + at, LEN - at);
+
+    struct ChunkList a, b;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(data, LEN, &a, &fresh), 0);
+    cr_assert_eq(chunk_split(edited, LEN + 1, &b, &fresh), 0);
+    cr_assert(holds(&b, edited, LEN + 1));
+
+    cr_assert_geq(shared(&a, &b) + 2, a.n);
+    cr_assert_leq(fresh, 2 * CDC_MAX);
+    chunk_list_free(&a);
+    chunk_list_free(&b);
+    free(data);
+    free(edited);
+}
+
+Test(chunk_store, insert_at_the_start_keeps_the_other_chunks) {
+    uint8_t* data = noise(LEN, 4);
+    uint8_t* edited = malloc(LEN + 1);
+    cr_assert_not_null(edited);
+    edited[0] = '#';
+    memcpy(edited + 1, data, LEN);
+
+    struct ChunkList a, b;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(data, LEN, &a, &fresh), 0);
+    cr_assert_eq(chunk_split(edited, LEN + 1, &b, &fresh), 0);
+    cr_assert_geq(shared(&a, &b) + 2, a.n);
+    chunk_list_free(&a);
+    chunk_list_free(&b);
+    free(data);
+    free(edited);
+}
+
+// Re-cutting around an edit gives exactly the chunks a full split does,
+// told the true unchanged ends or less than them
+static void same_as_split(const uint8_t* old, uint32_t old_len,
+                          const uint8_t* now, uint32_t len) {
+    uint32_t head = 0, tail = 0;
+    while (head < old_len && head < len && old[head] == now[head])
+        head++;
+    while (tail < old_len - head && tail < len - head &&
+           old[old_len - 1 - tail] == now[len - 1 - tail])
+        tail++;
+
+    struct ChunkList prev, want, got;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(old, old_len, &prev, &fresh), 0);
+    cr_assert_eq(chunk_split(now, len, &want, &fresh), 0);
+    for (uint32_t less = 0; less < 2; less++) {
+        cr_assert_eq(chunk_resplit(&prev, head / (1 + less), tail / (1 + less),
+                                   now, len, &got, &fresh), 0);
+        cr_assert_eq(fresh, 0);
+        cr_assert_eq(got.len, len);
+        cr_assert_eq(got.n, want.n);
+        for (uint32_t i = 0; i < got.n; i++)
+            cr_assert_eq(got.chunks[i], want.chunks[i]);
+        chunk_list_free(&got);
+    }
+    chunk_list_free(&prev);
+    chunk_list_free(&want);
+}
+
+Test(chunk_store, resplit_matches_split) {
+    uint8_t* data = noise(LEN, 6);
+    uint8_t* edited = malloc(LEN + 100);
+    cr_assert_not_null(edited);
+    uint32_t spots[] = { 0, 1, 5000, LEN / 2 + 777, LEN - 3000, LEN - 1, LEN };
+    for (uint32_t i = 0; i < sizeof(spots) / sizeof(*spots); i++) {
+        uint32_t at = spots[i];
+        // Insert
+        memcpy(edited, data, at);
+        memset(edited + at, 'x', 100);
+        memcpy(edited + at + 100, data + at, LEN - at);
+        same_as_split(data, LEN, edited, LEN + 100);
+        // Delete
+        uint32_t n = LEN - at < 100 ? LEN - at : 100;
+        memcpy(edited, data, at);
+        memcpy(edited + at, data + at + n, LEN - at - n);
+        same_as_split(data, LEN, edited, LEN - n);
+        // Overwrite
+        memcpy(edited, data, LEN);
+        memset(edited + at, 'y', n);
+        same_as_split(data, LEN, edited, LEN);
+    }
+    same_as_split(data, LEN, data, LEN);
+    same_as_split(data, LEN, data, CDC_MIN / 2);
+    same_as_split(data, CDC_MIN / 2, data, LEN);
+    same_as_split(NULL, 0, data, LEN);
+    same_as_split(data, LEN, NULL, 0);
+    free(data);
+    free(edited);
+}
+
+// Chunks go once the last list holding them does
+Test(chunk_store, freed_chunks_are_stored_again) {
+    uint8_t* data = noise(LEN, 5);
+    struct ChunkList a, b;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(data, LEN, &a, &fresh), 0);
+    cr_assert_eq(chunk_split(data, LEN, &b, &fresh), 0);
+    chunk_list_free(&a);
+    cr_assert(holds(&b, data, LEN));
+    chunk_list_free(&b);
+
+    cr_assert_eq(chunk_split(data, LEN, &a, &fresh), 0);
+    cr_assert_eq(fresh, LEN);
+    chunk_list_free(&a);
+    free(data);
+}
+
+Test(chunk_store, empty_content) {
+    struct ChunkList l;
+    uint32_t fresh;
+    cr_assert_eq(chunk_split(NULL, 0, &l, &fresh), 0);
+    cr_assert_eq(l.n, 0);
+    cr_assert(holds(&l, NULL, 0));
+    chunk_list_free(&l);
+}
@@ -0,0 +1,137 @@
+#include <criterion/criterion.h>
+
+#include "comm.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#define TOTAL (CHUNK_SIZE + CHUNK_SIZE / 2)
+
+static uint8_t body[TOTAL];
+static uint8_t* out;
+static uint32_t out_len;
+
+// Run one frame through b as the reactor would: the payload is a frame
+// buffer that body_feed takes over
+static int feed(struct BodyAssembler* b, uint8_t type, uint32_t tag,
+                const uint8_t* payload, uint32_t plen) {
+    if (!body[1])
+        for (uint32_t i = 0; i < TOTAL; i++)
+            body[i] = (uint8_t)(i * 31 + i / 4096);
+    uint8_t* p = frame_buf_alloc(plen);
+    cr_assert_not_null(p);
+    if (plen) memcpy(p, payload, plen);
+    out = p;
+    out_len = plen;
+    int r = body_feed(b, &type, &tag, &out, &out_len);
+    if (r == 1) {
+        cr_assert_eq(type, C_PUT);
+        cr_assert_eq(tag, 7);
+    }
+    return r;
+}
+
+static int begin(struct BodyAssembler* b, uint32_t total) {
+    uint8_t p[5] = { C_PUT };
+    uint32_t be = htonl(total);
+    memcpy(p + 1, &be, 4);
+    return feed(b, F_BEGIN, 7, p, sizeof(p));
+}
+
+static int chunk(struct BodyAssembler* b, uint32_t off, uint32_t n) {
+    return feed(b, F_CHUNK, 0, body + off, n);
+}
+
+static int end(struct BodyAssembler* b) {
+    return feed(b, F_END, 0, NULL, 0);
+}
+
+Test(body, chunks_come_out_as_one_message) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(chunk(&b, 0, CHUNK_SIZE), 0);
+    cr_assert_eq(chunk(&b, CHUNK_SIZE, TOTAL - CHUNK_SIZE), 0);
+    cr_assert_eq(end(&b), 1);
+    cr_assert_eq(out_len, TOTAL);
+    cr_assert_arr_eq(out, body, TOTAL);
+    frame_buf_free(out);
+
+    // The assembler is ready for the next one
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    body_free(&b);
+}
+
+Test(body, other_frames_pass_through) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(feed(&b, C_PUT, 7, body, 100), 1);
+    cr_assert_eq(out_len, 100);
+    cr_assert_arr_eq(out, body, 100);
+    frame_buf_free(out);
+}
+
+Test(body, chunk_or_end_without_begin_is_rejected) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(chunk(&b, 0, 100), -1);
+    cr_assert_eq(end(&b), -1);
+}
+
+Test(body, nothing_may_interrupt_a_body) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(chunk(&b, 0, 100), 0);
+    cr_assert_eq(feed(&b, C_GET, 0, body, 4), -1);
+
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(begin(&b, TOTAL), -1);
+}
+
+Test(body, bad_totals_are_rejected) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(begin(&b, CHUNK_SIZE), -1); // Would have gone unchunked
+    cr_assert_eq(begin(&b, MAX_BODY + 1), -1);
+    cr_assert_eq(feed(&b, F_BEGIN, 0, body, 4), -1);
+}
+
+Test(body, oversized_chunks_are_rejected) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(chunk(&b, 0, CHUNK_SIZE + 1), -1);
+
+    // Past the announced total
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(chunk(&b, 0, CHUNK_SIZE), 0);
+    cr_assert_eq(chunk(&b, 0, TOTAL - CHUNK_SIZE + 1), -1);
+}
+
+Test(body, early_end_is_rejected) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(chunk(&b, 0, CHUNK_SIZE), 0);
+    cr_assert_eq(end(&b), -1);
+
+    // F_END carries nothing
+    cr_assert_eq(begin(&b, TOTAL), 0);
+    cr_assert_eq(chunk(&b, 0, CHUNK_SIZE), 0);
+    cr_assert_eq(chunk(&b, CHUNK_SIZE, TOTAL - CHUNK_SIZE), 0);
+    cr_assert_eq(feed(&b, F_END, 0, body, 1), -1);
+}
+
+// Announcing a huge body costs nothing until its bytes arrive
+Test(body, memory_follows_the_chunks) {
+    struct BodyAssembler b;
+    body_init(&b);
+    cr_assert_eq(begin(&b, MAX_BODY), 0);
+    cr_assert_null(b.buf);
+    cr_assert_eq(chunk(&b, 0, CHUNK_SIZE), 0);
+    cr_assert_eq(b.cap, CHUNK_SIZE);
+    cr_assert_eq(chunk(&b, 0, 100), 0);
+    cr_assert_eq(b.cap, 2 * CHUNK_SIZE);
+    body_free(&b);
+}
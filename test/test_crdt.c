@@ -0,0 +1,204 @@
+#include <criterion/criterion.h>
+
+#include "crdt.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char BASE[] = "alpha\nbeta\ngamma\ndelta\n";
+
+#define SITE_A CRDT_FIRST_SITE
+#define SITE_B (CRDT_FIRST_SITE + 1)
+
+// Every replica starts from the same content with the same ids
+static void start(struct Crdt* c) {
+    cr_assert_eq(crdt_init(c, CRDT_SERVER_SITE, (const uint8_t*)BASE,
+                           (uint32_t)strlen(BASE)), 0);
+}
+
+struct Ops {
+    uint8_t* p;
+    uint32_t len;
+};
+
+// Change c's text to 'to' as site's local edit; the ops for the others
+static struct Ops edit(struct Crdt* c, uint32_t site, const char* to) {
+    struct Ops o = { NULL, 0 };
+    cr_assert_eq(crdt_diff(c, site, (const uint8_t*)to, (uint32_t)strlen(to),
+                           &o.p, &o.len), 0);
+    cr_assert_not_null(o.p);
+    return o;
+}
+
+static void apply(struct Crdt* c, struct Ops o) {
+    cr_assert_eq(crdt_apply(c, o.p, o.len), 0);
+}
+
+static int holds(const struct Crdt* c, const char* want) {
+    uint8_t* t = NULL;
+    uint32_t len = 0;
+    cr_assert_eq(crdt_text(c, &t, &len), 0);
+    int same = len == strlen(want) && memcmp(t, want, len) == 0;
+    free(t);
+    return same;
+}
+
+static int same_text(const struct Crdt* x, const struct Crdt* y) {
+    uint8_t *a = NULL, *b = NULL;
+    uint32_t alen = 0, blen = 0;
+    cr_assert_eq(crdt_text(x, &a, &alen), 0);
+    cr_assert_eq(crdt_text(y, &b, &blen), 0);
+    int same = alen == blen && memcmp(a, b, alen) == 0;
+    free(a);
+    free(b);
+    return same;
+}
+
+Test(crdt, concurrent_edits_converge) {
+    struct Crdt s, a, b;
+    start(&s);
+    start(&a);
+    start(&b);
+
+    struct Ops oa = edit(&a, SITE_A, "ALPHA\nbeta\ngamma\ndelta\n");
+    struct Ops ob = edit(&b, SITE_B, "alpha\nbeta\ngamma\ndelta\nepsilon\n");
+    apply(&s, oa);
+    apply(&s, ob);
+    apply(&a, ob);
+    apply(&b, oa);
+
+    cr_assert(holds(&s, "ALPHA\nbeta\ngamma\ndelta\nepsilon\n"));
+    cr_assert(same_text(&s, &a));
+    cr_assert(same_text(&s, &b));
+    free(oa.p);
+    free(ob.p);
+    crdt_free(&s);
+    crdt_free(&a);
+    crdt_free(&b);
+}
+
+// Two sites typing at the same spot: both texts stay, in one order
+// everywhere
+Test(crdt, inserts_at_the_same_spot_converge) {
+    struct Crdt a, b;
+    start(&a);
+    start(&b);
+
+    struct Ops oa = edit(&a, SITE_A, "alpha\nbeta\nfrom a\ngamma\ndelta\n");
+    struct Ops ob = edit(&b, SITE_B, "alpha\nbeta\nfrom b\ngamma\ndelta\n");
+    apply(&a, ob);
+    apply(&b, oa);
+
+    cr_assert(same_text(&a, &b));
+    cr_assert(holds(&a, "alpha\nbeta\nfrom a\nfrom b\ngamma\ndelta\n") ||
+              holds(&a, "alpha\nbeta\nfrom b\nfrom a\ngamma\ndelta\n"));
+    free(oa.p);
+    free(ob.p);
+    crdt_free(&a);
+    crdt_free(&b);
+}
+
+// A later op that names bytes from an earlier one waits until that one
+// arrives, then both apply
+Test(crdt, reordered_delivery_converges) {
+    struct Crdt a, c;
+    start(&a);
+    start(&c);
+
+    struct Ops o1 = edit(&a, SITE_A, "alpha\nbeta\nnew line\ngamma\ndelta\n");
+    struct Ops o2 = edit(&a, SITE_A, "alpha\nbeta\nnew line, edited\ngamma\n");
+    struct Ops o3 = edit(&a, SITE_A, "beta\nnew line, edited\ngamma\n");
+
+    apply(&c, o3);
+    apply(&c, o2);
+    cr_assert(!same_text(&a, &c)); // o2's insert still waits for o1
+    apply(&c, o1);
+
+    cr_assert(holds(&c, "beta\nnew line, edited\ngamma\n"));
+    cr_assert(same_text(&a, &c));
+    free(o1.p);
+    free(o2.p);
+    free(o3.p);
+    crdt_free(&a);
+    crdt_free(&c);
+}
+
+Test(crdt, concurrent_and_reordered_converge) {
+    struct Crdt a, b, s, t;
+    start(&a);
+    start(&b);
+    start(&s);
+    start(&t);
+
+    struct Ops a1 = edit(&a, SITE_A, "alpha\nbeta!\ngamma\ndelta\n");
+    struct Ops a2 = edit(&a, SITE_A, "alpha\nbeta!!\ngamma\ndelta\n");
+    struct Ops b1 = edit(&b, SITE_B, "alpha\nbeta\ngamma\nDELTA\n");
+    struct Ops b2 = edit(&b, SITE_B, "alpha\nbeta\nDELTA\n");
+
+    // Each replica sees a different interleaving
+    apply(&s, a1);
+    apply(&s, b1);
+    apply(&s, a2);
+    apply(&s, b2);
+    apply(&t, b2);
+    apply(&t, a2);
+    apply(&t, b1);
+    apply(&t, a1);
+    apply(&a, b2);
+    apply(&a, b1);
+    apply(&b, a2);
+    apply(&b, a1);
+
+    cr_assert(holds(&s, "alpha\nbeta!!\nDELTA\n"));
+    cr_assert(same_text(&s, &t));
+    cr_assert(same_text(&s, &a));
+    cr_assert(same_text(&s, &b));
+    free(a1.p);
+    free(a2.p);
+    free(b1.p);
+    free(b2.p);
+    crdt_free(&a);
+    crdt_free(&b);
+    crdt_free(&s);
+    crdt_free(&t);
+}
+
+Test(crdt, repeated_ops_change_nothing) {
+    struct Crdt a, c;
+    start(&a);
+    start(&c);
+    struct Ops o = edit(&a, SITE_A, "alpha\ngamma\ndelta\nomega\n");
+    apply(&c, o);
+    apply(&c, o);
+    cr_assert(same_text(&a, &c));
+    free(o.p);
+    crdt_free(&a);
+    crdt_free(&c);
+}
+
+// A joining replica decoded from another's state takes later ops alike
+Test(crdt, decoded_replica_follows) {
+    struct Crdt a, b, j;
+    start(&a);
+    start(&b);
+    struct Ops o1 = edit(&a, SITE_A, "alpha\nbeta\ngamma\ndelta\nmore\n");
+    apply(&b, o1);
+
+    uint8_t* state = NULL;
+    uint32_t len = 0;
+    cr_assert_eq(crdt_encode(&a, &state, &len), 0);
+    cr_assert_eq(crdt_decode(&j, state, len), 0);
+    cr_assert(same_text(&a, &j));
+
+    struct Ops o2 = edit(&b, SITE_B, "beta\ngamma\ndelta\nmore\n");
+    apply(&a, o2);
+    apply(&j, o2);
+    cr_assert(holds(&j, "beta\ngamma\ndelta\nmore\n"));
+    cr_assert(same_text(&a, &j));
+    free(state);
+    free(o1.p);
+    free(o2.p);
+    crdt_free(&a);
+    crdt_free(&b);
+    crdt_free(&j);
+}
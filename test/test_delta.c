@@ -0,0 +1,149 @@
+#include <criterion/criterion.h>
+
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Pseudo-random bytes, the same every run
+static uint8_t* noise(uint32_t len, uint32_t seed) {
+    uint8_t* p = malloc(len ? len : 1);
+    cr_assert_not_null(p);
+    for (uint32_t i = 0; i < len; i++) {
+        seed = seed * 1103515245u + 12345u;
+        p[i] = (uint8_t)(seed >> 16);
+    }
+    return p;
+}
+
+static void round_trip(const uint8_t* base, uint32_t base_len,
+                       const uint8_t* target, uint32_t target_len) {
+    uint8_t *delta = NULL, *out = NULL;
+    uint32_t delta_len = 0, out_len = 0;
+    cr_assert_eq(delta_encode(base, base_len, target, target_len,
+                              &delta, &delta_len), 0);
+    cr_assert_eq(delta_apply(base, base_len, delta, delta_len,
+                             &out, &out_len), 0);
+    cr_assert_eq(out_len, target_len);
+    if (target_len)
+        cr_assert_arr_eq(out, target, target_len);
+    free(delta);
+    free(out);
+}
+
+Test(delta, unchanged_content) {
+    uint8_t* base = noise(100000, 1);
+    round_trip(base, 100000, base, 100000);
+    free(base);
+}
+
+// Inserted, deleted and appended bytes come back, and the unchanged
+// blocks around them travel as copies
+Test(delta, edits_round_trip_small) {
+    uint32_t len = 200000;
+    uint8_t* base = noise(len, 2);
+    uint8_t* target = malloc(len + 64);
+    cr_assert_not_null(target);
+
+    memcpy(target, base, 50000);
+    memcpy(target + 50000, "inserted", 8);
+    memcpy(target + 50008, base + 50000, 90000);  // base 140000..149999 dropped
+    memcpy(target + 140008, base + 150000, len - 150000);
+    memcpy(target + len - 9992, "tail", 4);
+    uint32_t target_len = len - 9988;
+
+    round_trip(base, len, target, target_len);
+
+    uint8_t* delta = NULL;
+    uint32_t delta_len = 0;
+    cr_assert_eq(delta_encode(base, len, target, target_len,
+                              &delta, &delta_len), 0);
+    cr_assert_lt(delta_len, target_len / 10);
+    free(delta);
+    free(base);
+    free(target);
+}
+
+Test(delta, unrelated_content) {
+    uint8_t* base = noise(30000, 3);
+    uint8_t* target = noise(20000, 4);
+    round_trip(base, 30000, target, 20000);
+    free(base);
+    free(target);
+}
+
+Test(delta, empty_sides) {
+    uint8_t* data = noise(5000, 5);
+    round_trip(NULL, 0, data, 5000);
+    round_trip(data, 5000, NULL, 0);
+    round_trip(NULL, 0, NULL, 0);
+    free(data);
+}
+
+// A copy reaching past the end of the base is refused, not read
+Test(delta, copy_outside_base_is_rejected) {
+    uint8_t base[16] = "0123456789abcdef";
+    uint8_t delta[] = {
+        0, 0, 0, 8,
+        DELTA_COPY, 0, 0, 0, 12, 0, 0, 0, 8,
+    };
+    uint8_t* out = NULL;
+    uint32_t out_len = 0;
+    cr_assert_eq(delta_apply(base, sizeof(base), delta, sizeof(delta),
+                             &out, &out_len), -1);
+}
+
+Test(delta, truncated_delta_is_rejected) {
+    uint8_t* base = noise(10000, 6);
+    uint8_t* target = noise(10000, 7);
+    memcpy(target, base, 5000);
+    uint8_t *delta = NULL, *out = NULL;
+    uint32_t delta_len = 0, out_len = 0;
+    cr_assert_eq(delta_encode(base, 10000, target, 10000, &delta, &delta_len), 0);
+    for (uint32_t cut = 0; cut < delta_len; cut += delta_len / 7 + 1)
+        cr_assert_eq(delta_apply(base, 10000, delta, cut, &out, &out_len), -1);
+    free(delta);
+    free(base);
+    free(target);
+}
+
+Test(delta, unchanged_ends) {
+    uint8_t delta[] = {
+        0, 0, 0, 14,
+        DELTA_COPY, 0, 0, 0, 0, 0, 0, 0, 4,
+        DELTA_INSERT, 0, 0, 0, 2, 'x', 'y',
+        DELTA_COPY, 0, 0, 0, 8, 0, 0, 0, 4,
+        DELTA_COPY, 0, 0, 0, 12, 0, 0, 0, 4,
+    };
+    uint32_t head, tail;
+    delta_unchanged(delta, sizeof(delta), 16, &head, &tail);
+    cr_assert_eq(head, 4);
+    cr_assert_eq(tail, 8);
+
+    // A copy from elsewhere in the base isn't the tail
+    delta_unchanged(delta, sizeof(delta), 17, &head, &tail);
+    cr_assert_eq(head, 4);
+    cr_assert_eq(tail, 0);
+}
+
+// What an encoded edit reports is never more than was left alone, and
+// the ends come within a block of the edit
+Test(delta, unchanged_ends_of_an_edit) {
+    uint8_t* base = noise(100000, 8);
+    uint8_t* target = malloc(100010);
+    cr_assert_not_null(target);
+    memcpy(target, base, 40000);
+    memset(target + 40000, 'z', 10);
+    memcpy(target + 40010, base + 40000, 60000);
+
+    uint8_t* delta = NULL;
+    uint32_t delta_len = 0, head, tail;
+    cr_assert_eq(delta_encode(base, 100000, target, 100010, &delta, &delta_len), 0);
+    delta_unchanged(delta, delta_len, 100000, &head, &tail);
+    cr_assert_leq(head, 40000);
+    cr_assert_leq(tail, 60000);
+    cr_assert_geq(head + tail, 100000 - 2000);
+    free(delta);
+    free(base);
+    free(target);
+}
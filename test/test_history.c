@@ -0,0 +1,153 @@
+#include <criterion/criterion.h>
+
+#include "delta.h"
+#include "history.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char texts[HIST_MAX_VERSIONS + 10][64];
+
+// Version v of a document that gains a line per version
+static const char* text(uint32_t v) {
+    char* t = texts[v];
+    if (!t[0]) {
+        strcpy(t, "start\n");
+        for (uint32_t i = 1; i <= v && strlen(t) < 48; i++)
+            sprintf(t + strlen(t), "%u\n", i);
+        sprintf(t + strlen(t), "v%u\n", v);
+    }
+    return t;
+}
+
+static uint32_t len_of(uint32_t v) {
+    return (uint32_t)strlen(text(v));
+}
+
+// Versions 0 to head, one delta each
+static void build(struct History* h, uint32_t head) {
+    cr_assert_eq(history_init(h, 0, (const uint8_t*)text(0), len_of(0)), 0);
+    for (uint32_t v = 1; v <= head; v++) {
+        uint8_t* d = NULL;
+        uint32_t dlen = 0;
+        cr_assert_eq(delta_encode((const uint8_t*)text(v - 1), len_of(v - 1),
+                                  (const uint8_t*)text(v), len_of(v),
+                                  &d, &dlen), 0);
+        cr_assert_eq(history_append(h, d, dlen, (const uint8_t*)text(v),
+                                    len_of(v)), 0);
+    }
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    uint32_t be;
+    memcpy(&be, p, 4);
+    return ntohl(be);
+}
+
+// Apply a history_chain payload to version from; 1 if it gives version to
+static int chain_gives(const uint8_t* chain, uint32_t len, uint32_t from,
+                       uint32_t to) {
+    cr_assert_eq(get_u32(chain), from);
+    cr_assert_eq(get_u32(chain + 4), to);
+    uint8_t* cur = malloc(len_of(from));
+    cr_assert_not_null(cur);
+    memcpy(cur, text(from), len_of(from));
+    uint32_t cur_len = len_of(from), off = 8;
+    for (uint32_t v = from; v < to; v++) {
+        uint32_t dlen = get_u32(chain + off);
+        uint8_t* next = NULL;
+        uint32_t next_len = 0;
+        cr_assert_eq(delta_apply(cur, cur_len, chain + off + 4, dlen,
+                                 &next, &next_len), 0);
+        free(cur);
+        cur = next;
+        cur_len = next_len;
+        off += 4 + dlen;
+    }
+    int same = off == len && cur_len == len_of(to) &&
+               memcmp(cur, text(to), cur_len) == 0;
+    free(cur);
+    return same;
+}
+
+Test(history, chain_reaches_the_head) {
+    struct History h;
+    build(&h, 10);
+    for (uint32_t from = 0; from <= 10; from++) {
+        uint8_t* out = NULL;
+        uint32_t len = 0;
+        cr_assert_eq(history_chain(&h, from, UINT32_MAX, 0, &out, &len), 0);
+        cr_assert(chain_gives(out, len, from, 10), "from %u", from);
+        free(out);
+    }
+    history_free(&h);
+}
+
+Test(history, headroom_is_left_free) {
+    struct History h;
+    build(&h, 3);
+    uint8_t *plain = NULL, *roomy = NULL;
+    uint32_t plain_len = 0, roomy_len = 0;
+    cr_assert_eq(history_chain(&h, 1, UINT32_MAX, 0, &plain, &plain_len), 0);
+    cr_assert_eq(history_chain(&h, 1, UINT32_MAX, 5, &roomy, &roomy_len), 0);
+    cr_assert_eq(roomy_len, plain_len + 5);
+    cr_assert_arr_eq(roomy + 5, plain, plain_len);
+    free(plain);
+    free(roomy);
+    history_free(&h);
+}
+
+Test(history, long_or_unknown_chains_are_refused) {
+    struct History h;
+    build(&h, 10);
+    uint8_t* out = NULL;
+    uint32_t len = 0;
+    cr_assert_eq(history_chain(&h, 11, UINT32_MAX, 0, &out, &len), 1);
+    cr_assert_eq(history_chain(&h, 0, UINT32_MAX, 0, &out, &len), 0);
+    uint32_t whole = len;
+    free(out);
+    cr_assert_eq(history_chain(&h, 0, whole - 1, 0, &out, &len), 1);
+    history_free(&h);
+}
+
+// A full ring drops its oldest quarter; what is left still chains and
+// rebuilds, the rest is refused
+Test(history, oldest_versions_age_out) {
+    struct History h;
+    uint32_t head = HIST_MAX_VERSIONS + 5;
+    build(&h, head);
+    cr_assert_gt(h.oldest, 0);
+    cr_assert_eq(h.oldest + h.count, head);
+
+    uint8_t* out = NULL;
+    uint32_t len = 0;
+    cr_assert_eq(history_chain(&h, h.oldest - 1, UINT32_MAX, 0, &out, &len), 1);
+    cr_assert_eq(history_content_at(&h, h.oldest - 1, &out, &len), 1);
+    for (uint32_t v = h.oldest; v <= head; v++) {
+        cr_assert_eq(history_content_at(&h, v, &out, &len), 0);
+        cr_assert_eq(len, len_of(v));
+        cr_assert_arr_eq(out, text(v), len);
+        free(out);
+    }
+    cr_assert_eq(history_chain(&h, h.oldest, UINT32_MAX, 0, &out, &len), 0);
+    cr_assert(chain_gives(out, len, h.oldest, head));
+    free(out);
+    history_free(&h);
+}
+
+// history_clear keeps the head but nothing before it
+Test(history, cleared_history_serves_nothing_old) {
+    struct History h;
+    history_clear(&h, 7);
+    uint8_t* out = NULL;
+    uint32_t len = 0;
+    cr_assert_eq(history_content_at(&h, 7, &out, &len), 1);
+    cr_assert_eq(history_chain(&h, 7, UINT32_MAX, 0, &out, &len), 0);
+    cr_assert_eq(len, 8);
+    cr_assert_eq(get_u32(out), 7);
+    cr_assert_eq(get_u32(out + 4), 7);
+    free(out);
+    history_free(&h);
+}
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+
+#include "delta.h"
+#include "journal.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char dir[32];
+static char doc[64];
+static char jpath[80];
+
+// A fresh journal for doc.txt in a new directory, seeded with version 0
+static void start(struct Journal* j, enum JournalSync sync, const char* text) {
+    strcpy(dir, "/tmp/journal_XXXXXX");
+    cr_assert_not_null(mkdtemp(dir));
+    snprintf(doc, sizeof(doc), "%s/doc.txt", dir);
+    snprintf(jpath, sizeof(jpath), "%s.journal", doc);
+
+    uint32_t version = 99, len = 0;
+    uint8_t* content = NULL;
+    cr_assert_eq(journal_open(j, doc, sync, &version, &content, &len), 1);
+    cr_assert_eq(journal_compact(j, 0, (const uint8_t*)text,
+                                 (uint32_t)strlen(text)), 0);
+}
+
+static void finish(struct Journal* j) {
+    journal_close(j);
+    unlink(jpath);
+    rmdir(dir);
+}
+
+// Append version as a delta from the previous text
+static uint64_t append_delta(struct Journal* j, uint32_t version,
+                             const char* from, const char* to) {
+    uint8_t* d = NULL;
+    uint32_t dlen = 0;
+    cr_assert_eq(delta_encode((const uint8_t*)from, (uint32_t)strlen(from),
+                              (const uint8_t*)to, (uint32_t)strlen(to),
+                              &d, &dlen), 0);
+    uint64_t seq = 0;
+    cr_assert_eq(journal_append(j, J_DELTA, version, d, dlen, &seq), 0);
+    free(d);
+    return seq;
+}
+
+// Reopen the journal as a restart would; 1 if it holds version and text
+static int recovers(uint32_t want_version, const char* want) {
+    struct Journal j;
+    uint32_t version = 0, len = 0;
+    uint8_t* content = NULL;
+    cr_assert_eq(journal_open(&j, doc, JOURNAL_SYNC_NONE, &version, &content,
+                              &len), 0);
+    int same = version == want_version && len == strlen(want) &&
+               (!len || memcmp(content, want, len) == 0);
+    free(content);
+    journal_close(&j);
+    return same;
+}
+
+static off_t size_of(const char* path) {
+    struct stat st;
+    cr_assert_eq(stat(path, &st), 0);
+    return st.st_size;
+}
+
+static const char* const TEXTS[] = {
+    "one\ntwo\nthree\n",
+    "one\ntwo\nthree\nfour\n",
+    "zero\none\ntwo\nthree\nfour\n",
+    "zero\none\nTWO\nthree\nfour\n",
+};
+
+Test(journal, replays_to_the_last_version) {
+    struct Journal j;
+    start(&j, JOURNAL_SYNC_NONE, TEXTS[0]);
+    for (uint32_t v = 1; v < 4; v++)
+        append_delta(&j, v, TEXTS[v - 1], TEXTS[v]);
+    journal_close(&j);
+    cr_assert(recovers(3, TEXTS[3]));
+    finish(&j);
+}
+
+Test(journal, snapshot_records_replace_the_content) {
+    struct Journal j;
+    start(&j, JOURNAL_SYNC_NONE, TEXTS[0]);
+    append_delta(&j, 1, TEXTS[0], TEXTS[1]);
+    uint64_t seq;
+    cr_assert_eq(journal_append(&j, J_SNAPSHOT, 2, (const uint8_t*)"fresh\n",
+                                6, &seq), 0);
+    append_delta(&j, 3, "fresh\n", "fresh\nstart\n");
+    journal_close(&j);
+    cr_assert(recovers(3, "fresh\nstart\n"));
+    finish(&j);
+}
+
+// A crash mid-append leaves part of a record: it is dropped, and the
+// next append goes where it started
+Test(journal, torn_tail_is_truncated) {
+    struct Journal j;
+    start(&j, JOURNAL_SYNC_NONE, TEXTS[0]);
+    append_delta(&j, 1, TEXTS[0], TEXTS[1]);
+    off_t good = size_of(jpath);
+    append_delta(&j, 2, TEXTS[1], TEXTS[2]);
+    journal_close(&j);
+    cr_assert_eq(truncate(jpath, size_of(jpath) - 3), 0);
+
+    uint32_t version = 0, len = 0;
+    uint8_t* content = NULL;
+    cr_assert_eq(journal_open(&j, doc, JOURNAL_SYNC_NONE, &version, &content,
+                              &len), 0);
+    cr_assert_eq(version, 1);
+    cr_assert_eq(size_of(jpath), good);
+    append_delta(&j, 2, TEXTS[1], TEXTS[3]);
+    free(content);
+    journal_close(&j);
+    cr_assert(recovers(2, TEXTS[3]));
+    finish(&j);
+}
+
+Test(journal, corrupt_record_ends_the_replay) {
+    struct Journal j;
+    start(&j, JOURNAL_SYNC_NONE, TEXTS[0]);
+    append_delta(&j, 1, TEXTS[0], TEXTS[1]);
+    off_t good = size_of(jpath);
+    append_delta(&j, 2, TEXTS[1], TEXTS[2]);
+    append_delta(&j, 3, TEXTS[2], TEXTS[3]);
+    journal_close(&j);
+
+    // Flip a body byte of version 2; version 3 can't apply without it
+    int fd = open(jpath, O_RDWR);
+    cr_assert_geq(fd, 0);
+    uint8_t b;
+    cr_assert_eq(pread(fd, &b, 1, good + 14), 1);
+    b ^= 0xFF;
+    cr_assert_eq(pwrite(fd, &b, 1, good + 14), 1);
+    close(fd);
+
+    cr_assert(recovers(1, TEXTS[1]));
+    cr_assert_eq(size_of(jpath), good);
+    finish(&j);
+}
+
+Test(journal, group_commit_makes_appends_durable) {
+    struct Journal j;
+    start(&j, JOURNAL_SYNC_BATCH, TEXTS[0]);
+    uint64_t s1 = append_delta(&j, 1, TEXTS[0], TEXTS[1]);
+    uint64_t s2 = append_delta(&j, 2, TEXTS[1], TEXTS[2]);
+    cr_assert_lt(s1, s2);
+    cr_assert_eq(journal_wait(&j, s2), 0);
+    cr_assert_eq(journal_poll(&j, s1), 1);
+
+    // Polling hands the sync to the flusher thread
+    uint64_t s3 = append_delta(&j, 3, TEXTS[2], TEXTS[3]);
+    int r;
+    while ((r = journal_poll(&j, s3)) == 0)
+        sched_yield();
+    cr_assert_eq(r, 1);
+    journal_close(&j);
+    cr_assert(recovers(3, TEXTS[3]));
+    finish(&j);
+}
+
+static atomic_int compacted;
+
+// Runs on the flusher thread
+static void done(void* arg, int rc) {
+    atomic_store((atomic_int*)arg, rc == 0 ? 1 : -1);
+}
+
+// The flusher folds the log into one snapshot while appends carry on;
+// those made meanwhile survive in the new file
+Test(journal, compaction_keeps_later_appends) {
+    struct Journal j;
+    start(&j, JOURNAL_SYNC_BATCH, TEXTS[0]);
+    char from[64], to[64];
+    strcpy(from, TEXTS[0]);
+    for (uint32_t v = 1; v <= 200; v++) {
+        snprintf(to, sizeof(to), "%sline %u\n", TEXTS[0], v);
+        append_delta(&j, v, from, to);
+        strcpy(from, to);
+    }
+    off_t before = size_of(jpath);
+
+    atomic_store(&compacted, 0);
+    cr_assert_eq(journal_compact_later(&j, 200, (const uint8_t*)from,
+                                       (uint32_t)strlen(from), done,
+                                       &compacted), 0);
+    cr_assert_eq(journal_compact_later(&j, 200, (const uint8_t*)from,
+                                       (uint32_t)strlen(from), done,
+                                       &compacted), -1); // One at a time
+    uint64_t seq = append_delta(&j, 201, from, TEXTS[3]);
+    while (!atomic_load(&compacted))
+        sched_yield();
+    cr_assert_eq(atomic_load(&compacted), 1);
+    cr_assert_eq(journal_wait(&j, seq), 0);
+    append_delta(&j, 202, TEXTS[3], TEXTS[2]);
+
+    journal_close(&j);
+    cr_assert_lt(size_of(jpath), before);
+    cr_assert(recovers(202, TEXTS[2]));
+    finish(&j);
+}
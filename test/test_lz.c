@@ -0,0 +1,109 @@
+#include <criterion/criterion.h>
+
+#include "lz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Source-like text that compresses well
+static uint8_t* text(uint32_t* len_out) {
+    uint32_t cap = 64 * 1024, len = 0;
+    uint8_t* p = malloc(cap);
+    cr_assert_not_null(p);
+    for (int i = 0; len + 64 < cap; i++)
+        len += (uint32_t)snprintf((char*)p + len, cap - len,
+                                  "    total += item[%d] * weight;\n", i % 97);
+    *len_out = len;
+    return p;
+}
+
+static uint8_t* packed(uint32_t* packed_len, uint32_t* raw_len) {
+    uint8_t* raw = text(raw_len);
+    uint8_t* z = NULL;
+    cr_assert_eq(lz_pack(raw, *raw_len, &z, packed_len), 0);
+    free(raw);
+    return z;
+}
+
+Test(lz, round_trip) {
+    uint32_t len, zlen, raw_len;
+    uint8_t* raw = text(&len);
+    uint8_t* z = NULL;
+    cr_assert_eq(lz_pack(raw, len, &z, &zlen), 0);
+    cr_assert_lt(zlen, len / 2);
+
+    cr_assert_eq(lz_packed_len(z, zlen, len, &raw_len), 0);
+    cr_assert_eq(raw_len, len);
+    uint8_t* out = malloc(raw_len);
+    cr_assert_not_null(out);
+    cr_assert_eq(lz_unpack(z, zlen, out, raw_len), 0);
+    cr_assert_arr_eq(out, raw, len);
+    free(out);
+    free(z);
+    free(raw);
+}
+
+// Not worth packing: the caller sends the raw bytes
+Test(lz, small_or_random_input_stays_raw) {
+    uint8_t buf[8192];
+    uint32_t seed = 7;
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        seed = seed * 1103515245u + 12345u;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+    uint8_t* z = NULL;
+    uint32_t zlen;
+    cr_assert_eq(lz_pack(buf, LZ_MIN_INPUT - 1, &z, &zlen), 1);
+    cr_assert_eq(lz_pack(buf, sizeof(buf), &z, &zlen), 1);
+}
+
+Test(lz, every_truncation_is_rejected) {
+    uint32_t zlen, raw_len;
+    uint8_t* z = packed(&zlen, &raw_len);
+    uint8_t* out = malloc(raw_len);
+    cr_assert_not_null(out);
+    for (uint32_t cut = 0; cut < zlen; cut++)
+        cr_assert_eq(lz_unpack(z, cut, out, raw_len), -1, "cut at %u", cut);
+    free(out);
+    free(z);
+}
+
+// The claimed size is checked before anyone allocates for it
+Test(lz, oversized_claims_are_rejected) {
+    uint32_t zlen, raw_len, got;
+    uint8_t* z = packed(&zlen, &raw_len);
+    cr_assert_eq(lz_packed_len(z, zlen, raw_len - 1, &got), -1);
+    cr_assert_eq(lz_packed_len(z, 3, raw_len, &got), -1);
+
+    uint8_t bomb[8] = { 0x7F, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00 };
+    cr_assert_eq(lz_packed_len(bomb, sizeof(bomb), UINT32_MAX, &got), -1);
+    free(z);
+}
+
+// Output buffers of the wrong size are never overrun or left short
+Test(lz, wrong_raw_len_is_rejected) {
+    uint32_t zlen, raw_len;
+    uint8_t* z = packed(&zlen, &raw_len);
+    uint8_t* out = malloc(raw_len + 1);
+    cr_assert_not_null(out);
+    cr_assert_eq(lz_unpack(z, zlen, out, raw_len - 1), -1);
+    cr_assert_eq(lz_unpack(z, zlen, out, raw_len + 1), -1);
+    free(out);
+    free(z);
+}
+
+Test(lz, match_before_the_output_is_rejected) {
+    // One literal 'a', then a match 5 bytes back when only 1 exists
+    uint8_t block[] = { 0, 0, 0, 8, 0x10, 'a', 5, 0 };
+    uint8_t out[8];
+    cr_assert_eq(lz_unpack(block, sizeof(block), out, sizeof(out)), -1);
+
+    block[6] = 0; // Offset 0 is never valid either
+    cr_assert_eq(lz_unpack(block, sizeof(block), out, sizeof(out)), -1);
+
+    // 'a' then four copies of it, then an empty last literal
+    uint8_t ok[] = { 0, 0, 0, 5, 0x10, 'a', 1, 0, 0x00 };
+    cr_assert_eq(lz_unpack(ok, sizeof(ok), out, 5), 0);
+    cr_assert_arr_eq(out, "aaaaa", 5);
+}
@@ -0,0 +1,94 @@
+#include <criterion/criterion.h>
+
+#include "merge.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char BASE[] = "one\ntwo\nthree\nfour\nfive\nsix\n";
+
+// merge3 of three texts: the conflict count, and the result in *out
+static int merge(const char* base, const char* client, const char* server,
+                 char** out) {
+    uint8_t* merged = NULL;
+    uint32_t len = 0;
+    int conflicts = merge3((const uint8_t*)base, (uint32_t)strlen(base),
+                           (const uint8_t*)client, (uint32_t)strlen(client),
+                           (const uint8_t*)server, (uint32_t)strlen(server),
+                           &merged, &len);
+    cr_assert_geq(conflicts, 0);
+    *out = malloc(len + 1);
+    cr_assert_not_null(*out);
+    memcpy(*out, merged, len);
+    (*out)[len] = '\0';
+    free(merged);
+    return conflicts;
+}
+
+Test(merge3, edits_to_different_lines_both_land) {
+    char* out;
+    cr_assert_eq(merge(BASE, "ONE\ntwo\nthree\nfour\nfive\nsix\n",
+                       "one\ntwo\nthree\nfour\nfive\nSIX\n", &out), 0);
+    cr_assert_str_eq(out, "ONE\ntwo\nthree\nfour\nfive\nSIX\n");
+    free(out);
+}
+
+Test(merge3, insert_and_delete_both_land) {
+    char* out;
+    cr_assert_eq(merge(BASE, "one\ntwo\nnew\nthree\nfour\nfive\nsix\n",
+                       "one\ntwo\nthree\nfour\nsix\n", &out), 0);
+    cr_assert_str_eq(out, "one\ntwo\nnew\nthree\nfour\nsix\n");
+    free(out);
+}
+
+Test(merge3, one_side_unchanged_takes_the_other) {
+    char* out;
+    const char* edited = "zero\none\nthree\nfour\nfive\nsix\nseven\n";
+    cr_assert_eq(merge(BASE, BASE, edited, &out), 0);
+    cr_assert_str_eq(out, edited);
+    free(out);
+    cr_assert_eq(merge(BASE, edited, BASE, &out), 0);
+    cr_assert_str_eq(out, edited);
+    free(out);
+}
+
+Test(merge3, same_edit_on_both_sides_is_clean) {
+    char* out;
+    const char* edited = "one\ntwo\nTHREE\nfour\nfive\nsix\n";
+    cr_assert_eq(merge(BASE, edited, edited, &out), 0);
+    cr_assert_str_eq(out, edited);
+    free(out);
+}
+
+// Both changed the same line: each version is kept, client first
+Test(merge3, same_line_conflicts) {
+    char* out;
+    cr_assert_eq(merge(BASE, "one\ntwo\nmine\nfour\nfive\nsix\n",
+                       "one\ntwo\ntheirs\nfour\nfive\nsix\n", &out), 1);
+    cr_assert_str_eq(out, "one\ntwo\n" MERGE_PRE "mine\n" MERGE_MID
+                          "theirs\n" MERGE_POST "four\nfive\nsix\n");
+    free(out);
+}
+
+Test(merge3, clean_and_conflicting_hunks_together) {
+    char* out;
+    cr_assert_eq(merge(BASE, "ONE\ntwo\nthree\nmine\nfive\nsix\n",
+                       "one\ntwo\nthree\ntheirs\nfive\nSIX\n", &out), 1);
+    cr_assert_str_eq(out, "ONE\ntwo\nthree\n" MERGE_PRE "mine\n" MERGE_MID
+                          "theirs\n" MERGE_POST "five\nSIX\n");
+    free(out);
+}
+
+Test(merge3, two_conflicts_are_counted) {
+    char* out;
+    cr_assert_eq(merge(BASE, "a\ntwo\nthree\nfour\nfive\nb\n",
+                       "c\ntwo\nthree\nfour\nfive\nd\n", &out), 2);
+    free(out);
+}
+
+Test(merge3, empty_base) {
+    char* out;
+    cr_assert_eq(merge("", "", "server\n", &out), 0);
+    cr_assert_str_eq(out, "server\n");
+    free(out);
+}
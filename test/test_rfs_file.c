@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+
+#include "merge.h"
+#include "rfs_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char dir[32];
+static char path[64];
+
+static void make_file(const char* text) {
+    strcpy(dir, "/tmp/rfs_file_XXXXXX");
+    cr_assert_not_null(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/doc.txt", dir);
+    if (text)
+        cr_assert_eq(atomic_write_local(path, (const uint8_t*)text,
+                                        (uint32_t)strlen(text)), 0);
+}
+
+static void remove_file(void) {
+    unlink(path);
+    rmdir(dir);
+}
+
+static int holds(const char* text) {
+    uint8_t* data = NULL;
+    uint32_t len = 0;
+    int same = read_file_into_buf(path, &data, &len) == 0 &&
+               len == strlen(text) && memcmp(data, text, len) == 0;
+    free(data);
+    return same;
+}
+
+static int merge_into(const char* base, const char* remote) {
+    return merge_local(path, (const uint8_t*)base, (uint32_t)strlen(base),
+                       (const uint8_t*)remote, (uint32_t)strlen(remote), NULL);
+}
+
+static const char BASE[] = "a\nb\nc\nd\ne\n";
+
+// Saved while offline, changed on the server meanwhile, then reconnected:
+// the pull must not overwrite the save
+Test(merge_local, offline_edit_survives_remote_edit) {
+    make_file("a\nB\nc\nd\ne\n");
+    cr_assert_eq(merge_into(BASE, "a\nb\nc\nd\nE\n"), 1);
+    cr_assert(holds("a\nB\nc\nd\nE\n"));
+    remove_file();
+}
+
+Test(merge_local, unchanged_file_takes_remote) {
+    make_file(BASE);
+    cr_assert_eq(merge_into(BASE, "a\nb\nX\nd\ne\n"), 0);
+    cr_assert(holds("a\nb\nX\nd\ne\n"));
+    remove_file();
+}
+
+Test(merge_local, file_already_at_remote) {
+    make_file("a\nb\nX\nd\ne\n");
+    cr_assert_eq(merge_into(BASE, "a\nb\nX\nd\ne\n"), 0);
+    cr_assert(holds("a\nb\nX\nd\ne\n"));
+    remove_file();
+}
+
+Test(merge_local, gone_file_takes_remote) {
+    make_file(NULL);
+    cr_assert_eq(merge_into(BASE, "a\nb\nX\nd\ne\n"), 0);
+    cr_assert(holds("a\nb\nX\nd\ne\n"));
+    remove_file();
+}
+
+Test(merge_local, same_line_keeps_both_between_markers) {
+    make_file("a\nb\nmine\nd\ne\n");
+    cr_assert_eq(merge_into(BASE, "a\nb\ntheirs\nd\ne\n"), 1);
+    cr_assert(holds("a\nb\n" MERGE_PRE "mine\n" MERGE_MID "theirs\n"
+                    MERGE_POST "d\ne\n"));
+    remove_file();
+}
+
+Test(patch_local, small_edit_keeps_inode) {
+    char big[64 * 1024];
+    for (size_t i = 0; i < sizeof(big) - 1; i++)
+        big[i] = (char)('a' + i % 26);
+    big[sizeof(big) - 1] = '\0';
+    make_file(big);
+    struct stat before, after;
+    cr_assert_eq(stat(path, &before), 0);
+
+    big[30000] = '#';
+    cr_assert_eq(patch_local(path, (const uint8_t*)big, (uint32_t)strlen(big),
+                             NULL), 0);
+    cr_assert_eq(stat(path, &after), 0);
+    cr_assert_eq(before.st_ino, after.st_ino);
+    cr_assert(holds(big));
+
+    big[40000] = '\0'; // Shrinks: the tail goes
+    cr_assert_eq(patch_local(path, (const uint8_t*)big, 40000, NULL), 0);
+    cr_assert(holds(big));
+    remove_file();
+}
+
+// The mark names the file only while the patch is under way
+Test(patch_local, mark_is_cleared_when_done) {
+    char big[16 * 1024];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    make_file(big);
+    char mark[64];
+    snprintf(mark, sizeof(mark), "%s/mark", dir);
+
+    big[100] = 'y';
+    cr_assert_eq(patch_local(path, (const uint8_t*)big, (uint32_t)strlen(big),
+                             mark), 0);
+    cr_assert(holds(big));
+    cr_assert_neq(access(mark, F_OK), 0);
+    remove_file();
+}
+
+// Whether the mark is new, left over, or in a directory not made yet, the
+// patch goes through and takes the mark with it
+Test(patch_local, mark_is_made_where_needed) {
+    char big[16 * 1024];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    make_file(big);
+    char sub[64], mark[80];
+    snprintf(sub, sizeof(sub), "%s/state", dir);
+    snprintf(mark, sizeof(mark), "%s/mark", sub);
+
+    big[100] = 'y';
+    cr_assert_eq(patch_local(path, (const uint8_t*)big, (uint32_t)strlen(big),
+                             mark), 0);
+    cr_assert(holds(big));
+    cr_assert_neq(access(mark, F_OK), 0);
+
+    FILE* f = fopen(mark, "w");
+    cr_assert_not_null(f);
+    fputs("/some/other/file", f);
+    fclose(f);
+    big[200] = 'z';
+    cr_assert_eq(patch_local(path, (const uint8_t*)big, (uint32_t)strlen(big),
+                             mark), 0);
+    cr_assert(holds(big));
+    cr_assert_neq(access(mark, F_OK), 0);
+    rmdir(sub);
+    remove_file();
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <criterion/criterion.h>
+
+#include "hash.h"
+#include "rfs_file.h"
+#include "sync_state.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A client root with one synced file whose base is saved at version 3
+static char root[32];
+
+static const char BASE[] = "one\ntwo\nthree\nfour\n";
+
+static void write_text(const char* path, const char* text) {
+    cr_assert_eq(atomic_write_local(path, (const uint8_t*)text,
+                                    (uint32_t)strlen(text)), 0);
+}
+
+static int holds(const char* path, const char* text) {
+    uint8_t* data = NULL;
+    uint32_t len = 0;
+    int same = read_file_into_buf(path, &data, &len) == 0 &&
+               len == strlen(text) && memcmp(data, text, len) == 0;
+    free(data);
+    return same;
+}
+
+static void save_base(const char* name) {
+    struct SyncTable t;
+    cr_assert_eq(sync_table_init(&t, root), 0);
+    struct SyncFile* f = sync_file_get(&t, name);
+    cr_assert_not_null(f);
+    f->base = (uint8_t*)strdup(BASE);
+    f->base_len = (uint32_t)strlen(BASE);
+    f->base_hash = hash64(f->base, f->base_len);
+    f->has_base = 1;
+    f->last_version = 3;
+    cr_assert_eq(sync_state_save(&t), 0);
+    sync_table_free(&t);
+}
+
+static void make_root(void) {
+    strcpy(root, "/tmp/rfs_state_XXXXXX");
+    cr_assert_not_null(mkdtemp(root));
+}
+
+static void remove_root(const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, SYNC_PATCH_MARK);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s/%s", root, SYNC_STATE_DIR, name);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", root, SYNC_STATE_DIR);
+    rmdir(path);
+    rmdir(root);
+}
+
+Test(sync_state, restores_base_and_version) {
+    make_root();
+    save_base("doc.txt");
+
+    struct SyncTable t;
+    cr_assert_eq(sync_table_init(&t, root), 0);
+    cr_assert_eq(sync_state_load(&t), 1);
+    struct SyncFile* f = sync_file_get(&t, "doc.txt");
+    cr_assert(f->has_base);
+    cr_assert_eq(f->last_version, 3);
+    cr_assert_eq(f->base_len, strlen(BASE));
+    cr_assert_arr_eq(f->base, BASE, f->base_len);
+    sync_table_free(&t);
+    remove_root("doc.txt");
+}
+
+Test(sync_state, damaged_record_is_ignored) {
+    make_root();
+    save_base("doc.txt");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/doc.txt", root, SYNC_STATE_DIR);
+    FILE* fp = fopen(path, "r+b");
+    cr_assert_not_null(fp);
+    fseek(fp, 20, SEEK_SET);
+    fputc('X', fp);
+    fclose(fp);
+
+    struct SyncTable t;
+    cr_assert_eq(sync_table_init(&t, root), 0);
+    cr_assert_eq(sync_state_load(&t), 0);
+    sync_table_free(&t);
+    remove_root("doc.txt");
+}
+
+// Edited while the client was off, and on the server by someone else:
+// the restored base is the ancestor that keeps both edits
+Test(sync_state, warm_start_merges_against_saved_base) {
+    make_root();
+    save_base("doc.txt");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/doc.txt", root);
+    write_text(path, "one\nTWO\nthree\nfour\n");
+
+    struct SyncTable t;
+    cr_assert_eq(sync_table_init(&t, root), 0);
+    cr_assert_eq(sync_state_load(&t), 1);
+    struct SyncFile* f = sync_file_get(&t, "doc.txt");
+
+    const char* remote = "one\ntwo\nthree\nFOUR\n";
+    cr_assert_eq(merge_local(f->path, f->base, f->base_len,
+                             (const uint8_t*)remote, (uint32_t)strlen(remote),
+                             NULL), 1);
+    cr_assert(holds(path, "one\nTWO\nthree\nFOUR\n"));
+    sync_table_free(&t);
+    remove_root("doc.txt");
+}
+
+// The last run died patching the file in place: the next start puts it
+// back to its base instead of taking the torn bytes for an edit
+Test(sync_state, torn_patch_is_restored_from_base) {
+    make_root();
+    save_base("doc.txt");
+    char path[PATH_MAX], mark[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/doc.txt", root);
+    snprintf(mark, sizeof(mark), "%s/%s", root, SYNC_PATCH_MARK);
+    write_text(path, "one\ntwo\nthr");
+    write_text(mark, path);
+
+    struct SyncTable t;
+    cr_assert_eq(sync_table_init(&t, root), 0);
+    cr_assert_eq(sync_state_load(&t), 1);
+    cr_assert(holds(path, BASE));
+    cr_assert_neq(access(mark, F_OK), 0);
+    sync_table_free(&t);
+    remove_root("doc.txt");
+}